@@ -0,0 +1,70 @@
+#pragma once
+
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+/// Bookkeeping of the batch files that have been applied to a table, so that
+/// a retried request can skip them. The files of a batch are recorded in the
+/// transaction that applies them: either the whole batch and its records are
+/// committed, or neither. A retry after a failed batch therefore re-applies
+/// every file, while a retry after a batch whose response got lost (e.g. a
+/// timeout after the commit) skips all of them. Only in chunked mode (see
+/// ChunkedApply and the apply_chunk_rows setting) are files and chunks
+/// committed with their records one by one, so that a retry after a failure
+/// skips those committed before it.
+class AppliedFiles {
+public:
+	static constexpr const char* TABLE_NAME = "__fivetran_applied_files";
+
+	/// Creates the bookkeeping table in the main schema of the current database
+	/// and removes records older than `max_age`. Errors are logged, not thrown;
+	/// without the table, batches are applied without bookkeeping.
+	static void Initialize(duckdb::Connection& con, mdlog::Logger& logger, std::chrono::seconds max_age);
+
+	AppliedFiles(duckdb::Connection& con_, mdlog::Logger& logger_, table_def table_);
+
+	/// Looks up which of `fingerprints` have been applied to the table. Has to
+	/// run before the batch transaction begins: a failing query would abort it.
+	void Load(const std::vector<std::string>& fingerprints);
+
+	bool Contains(const std::string& fingerprint) const {
+		return applied.contains(fingerprint);
+	}
+
+	/// Remembers a file of this batch, written by Record
+	void Add(const std::string& fingerprint, const std::string& operation);
+
+	/// Records the files passed to Add. Call inside the batch transaction,
+	/// after the last file has been applied.
+	void Record();
+
+	/// The number of records whose fingerprint starts with `chunk_prefix`,
+	/// i.e. the number of chunks of a file that have been committed, see
+	/// ChunkedApply
+	std::int64_t CommittedChunks(const std::string& chunk_prefix);
+
+	/// Records a chunk or file right away instead of with the batch. Call
+	/// inside the transaction that applies it.
+	void RecordImmediately(const std::string& fingerprint, const std::string& operation);
+
+private:
+	struct pending_file {
+		std::string fingerprint;
+		std::string operation;
+	};
+
+	duckdb::Connection& con;
+	mdlog::Logger& logger;
+	const table_def table;
+	// False if the bookkeeping table could not be read
+	bool enabled = false;
+	std::set<std::string> applied;
+	std::vector<pending_file> pending;
+};
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "duckdb.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Stops the queries of requests that nobody waits for anymore. A request
+/// registers the connections it runs queries on, a check whether it has been
+/// cancelled (e.g. grpc::ServerContextBase::IsCancelled) and its deadline. One
+/// thread polls all requests and interrupts the connections of those that were
+/// cancelled or ran past their deadline.
+///
+/// An interrupted query fails like any other, and the request unwinds: its
+/// transaction is rolled back, which also discards the staging tables created
+/// in it.
+class CancellationWatchdog {
+public:
+	using clock = std::chrono::system_clock;
+	using cancelled_fn = std::function<bool()>;
+
+	struct options {
+		/// How often requests are checked, i.e. for how long a query runs on
+		/// after its request was cancelled
+		std::chrono::milliseconds interval {200};
+
+		/// Defaults, overridden by the environment variable
+		/// MD_CANCELLATION_POLL_INTERVAL_MS
+		static options FromEnvironment();
+	};
+
+	explicit CancellationWatchdog(options opts_);
+	/// Joins the polling thread. Watches must not outlive the watchdog.
+	~CancellationWatchdog();
+
+	CancellationWatchdog(const CancellationWatchdog&) = delete;
+	CancellationWatchdog& operator=(const CancellationWatchdog&) = delete;
+
+private:
+	struct watched_request {
+		std::string name;
+		cancelled_fn is_cancelled;
+		clock::time_point deadline;
+		std::vector<duckdb::Connection*> connections;
+		bool stopped = false;
+		/// Set once cancelled
+		std::string reason;
+	};
+
+public:
+	/// Watches a request for its lifetime
+	class Watch {
+	public:
+		/// `deadline` is clock::time_point::max() if there is none
+		Watch(CancellationWatchdog& watchdog_, std::string name, cancelled_fn is_cancelled,
+		      clock::time_point deadline);
+		~Watch();
+
+		Watch(const Watch&) = delete;
+		Watch& operator=(const Watch&) = delete;
+
+		/// Interrupt `con` when the request is cancelled. Remove it before it
+		/// is closed or returned to its pool.
+		void AddConnection(duckdb::Connection& con);
+		void RemoveConnection(duckdb::Connection& con);
+
+		/// Stops interrupting, so that the request can clean up after an
+		/// interruption. Cancelled() does not change.
+		void Stop();
+
+		/// True once the request has been cancelled or exceeded its deadline
+		bool Cancelled() const;
+		/// Why the request was cancelled, empty if it was not
+		std::string Reason() const;
+
+	private:
+		CancellationWatchdog& watchdog;
+		std::unique_ptr<watched_request> request;
+	};
+
+private:
+	void work();
+
+	const options opts;
+	mutable std::mutex mutex;
+	std::condition_variable changed;
+	bool stopping = false;
+	std::set<watched_request*> requests;
+	std::thread worker;
+};
+
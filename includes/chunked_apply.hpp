@@ -0,0 +1,45 @@
+#pragma once
+
+#include "applied_files.hpp"
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+#include "retry_policy.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+/// Applies a staged file in chunks of a fixed number of rows, each in its own
+/// transaction, instead of in one statement over the whole file. The memory
+/// and transaction size of a chunk do not grow with the file, and a failure
+/// only loses the chunk that was being applied.
+///
+/// Every chunk is recorded in AppliedFiles in its transaction. A retried
+/// request stages the file again and continues after the last committed
+/// chunk. Chunks are rowid ranges of the staging table, read through a
+/// temporary view without copying them. Staging a file fills the table in the
+/// order of the file (insertion order is preserved), so every attempt gets the
+/// same chunks. The apply function has to be harmless to repeat, as upserts
+/// and deletes are. With a retry policy, a failed chunk is retried on its own;
+/// its record tells whether a failed commit went through.
+class ChunkedApply {
+public:
+	/// Called with the name of a view of the chunk
+	using apply_function = std::function<void(const std::string& chunk_table_name)>;
+
+	ChunkedApply(duckdb::Connection& con_, mdlog::Logger& logger_, AppliedFiles& applied_files_,
+	             std::int64_t chunk_rows_, RetryPolicy* retry_policy_ = nullptr);
+
+	/// Calls `apply` with a view of the next chunk of `staging_table_name`
+	/// until all chunks have been applied. Throws if a transaction is active on
+	/// the connection, and leaves none behind, also when a chunk fails.
+	void Run(const std::string& staging_table_name, const std::string& fingerprint, const std::string& operation,
+	         const apply_function& apply);
+
+private:
+	duckdb::Connection& con;
+	mdlog::Logger& logger;
+	AppliedFiles& applied_files;
+	const std::int64_t chunk_rows;
+	RetryPolicy* retry_policy;
+};
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+
+#include <string>
+#include <vector>
+
+/// The value of the cluster_by option that stands for the primary key columns
+inline constexpr const char* CLUSTER_BY_PRIMARY_KEY = "primary_key";
+
+/// The columns that rows written to `table_name` are sorted by, according to
+/// the "cluster_by" configuration. It is a comma-separated list of
+/// `<table>=<column>` entries, plus optionally a `<column>` entry that applies
+/// to all other tables. `<column>` is a column name such as `_fivetran_synced`,
+/// or `primary_key` for the primary key columns of the table, unless the table
+/// has a column of that name.
+///
+/// Empty if rows are written in file order. Columns that the table does not
+/// have are logged and ignored, so that a stale configuration does not fail
+/// the sync.
+std::vector<const column_def*> find_cluster_columns(const std::string& cluster_by, const std::string& table_name,
+                                                    const std::vector<column_def>& columns, mdlog::Logger& logger);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <optional>
 #include <stdexcept>
 #include <string>
@@ -9,6 +10,9 @@ inline constexpr const char* PROP_DATABASE = "motherduck_database";
 inline constexpr const char* PROP_TOKEN = "motherduck_token";
 inline constexpr const char* PROP_MAX_RECORD_SIZE = "max_record_size";
 inline constexpr const char* PROP_STRICT_PRIMARY_KEYS = "strict_primary_keys";
+inline constexpr const char* PROP_ACTIVE_RECORDS_TABLE = "active_records_table";
+inline constexpr const char* PROP_CLUSTER_BY = "cluster_by";
+inline constexpr const char* PROP_APPLY_CHUNK_ROWS = "apply_chunk_rows";
 
 /// Reads the property with name `property_name` from the config and throws if it is not found.
 template <typename MapLike>
@@ -41,4 +45,15 @@ bool find_bool_property(const MapLike& config, const std::string& property_name,
 	}
 	return it->second == "true";
 }
+
+/// Reads the environment variable `name`, or returns std::nullopt if it is not set. A variable that is set but empty
+/// is returned as the empty string.
+std::optional<std::string> env_string(const char* name);
+
+/// Reads an integer-valued environment variable. A missing, empty or unparsable value resolves to `default_value`.
+std::int64_t env_int(const char* name, std::int64_t default_value);
+
+/// Reads a boolean-valued environment variable. "true" and "1" are true, "false" and "0" are false, in any case. Any
+/// other value, and a missing or empty one, resolves to `default_value`.
+bool env_bool(const char* name, bool default_value);
 } // namespace config
@@ -1,33 +1,157 @@
 #pragma once
 
+#include "connection_pool.hpp"
 #include "duckdb.hpp"
 #include "md_logging.hpp"
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <set>
 #include <string>
+#include <vector>
 
-/// Used to create a new DuckDB connection to the specified MotherDuck database.
-/// In practice, only one db_name is always passed for the entire lifetime of
-/// the process. If no duckdb::DuckDB has been instantiated yet, it will create
-/// one on the first call to GetConnection. One ConnectionFactory is used per
-/// gRPC request.
+/// Creates DuckDB connections to MotherDuck databases. Keeps one DuckDB
+/// instance per token and database, so that a single process can serve several
+/// destinations. An instance is created on the first request for its token and
+/// database. Once there are more than `max_instances`, the least recently used
+/// instances without checked out connections are closed, as are instances that
+/// have not been used for `max_idle_time`.
+///
+/// A rotated token therefore gets an instance of its own, while requests with
+/// the old token finish on the old instance, which is closed once it has been
+/// idle for long enough. One ConnectionFactory is shared by all gRPC requests.
 class ConnectionFactory {
 public:
-	explicit ConnectionFactory() : stdout_logger(mdlog::Logger::CreateStdoutLogger()) {
-	}
+	struct instance_settings {
+		/// memory_limit of the instance, DuckDB's default if empty
+		std::string memory_limit;
+		/// threads of the instance, DuckDB's default if 0
+		std::size_t threads = 0;
+		/// temp_directory of the instance, for spilling. Not shared with other
+		/// instances, whose temporary files would have the same names.
+		/// DuckDB's default if empty.
+		std::string temp_directory;
+		/// False if an earlier instance of the token and database has already
+		/// cleaned up after crashed processes, i.e. before it was evicted. Other
+		/// tokens may belong to other accounts, so they clean up on their own.
+		bool clean_up = true;
+	};
 
+	/// Creates and sets up the DuckDB instance for a token and database
+	using create_instance_fn = std::function<std::shared_ptr<duckdb::DuckDB>(
+	    const std::string& md_auth_token, const std::string& db_name, const instance_settings& settings)>;
+
+	struct options {
+		/// Instances that are kept open, unless more are in use at once
+		std::size_t max_instances = 4;
+		/// Unused instances are closed after this long, even if there are fewer
+		std::chrono::seconds max_idle_time {600};
+		/// memory_limit of each instance, DuckDB's default if empty
+		std::string instance_memory_limit;
+		/// threads of each instance, DuckDB's default if 0
+		std::size_t instance_threads = 0;
+		/// Each instance spills to a directory of its own below this one,
+		/// DuckDB's default if empty
+		std::string temp_directory;
+		ConnectionPool::options pool;
+
+		/// Defaults, overridden by the environment variables MD_MAX_INSTANCES,
+		/// MD_INSTANCE_MAX_IDLE_SECONDS, and those of ConnectionPool::options.
+		/// Memory limit and threads of the instances are derived from the
+		/// cgroup limits of the container (see resource_governor), overridden
+		/// by MD_INSTANCE_MEMORY_LIMIT and MD_INSTANCE_THREADS. The memory is
+		/// only divided between `max_instances` instances if MD_MAX_INSTANCES
+		/// is set, otherwise each instance may use all of it. The temporary
+		/// directory is below the system's, overridden by MD_TEMP_DIRECTORY.
+		/// Logs the chosen values.
+		static options FromEnvironment();
+	};
+
+	explicit ConnectionFactory(options opts_ = options::FromEnvironment(),
+	                           create_instance_fn create_instance_ = CreateMotherDuckInstance);
+	/// Waits until evicted instances have been closed
+	~ConnectionFactory();
+
+	ConnectionFactory(const ConnectionFactory&) = delete;
+	ConnectionFactory& operator=(const ConnectionFactory&) = delete;
+
+	/// A new connection that is not pooled, e.g. for long-running background
+	/// work
 	duckdb::Connection CreateConnection(const std::string& md_auth_token, const std::string& db_name);
 
+	/// A connection from the pool of the instance, see ConnectionPool
+	ConnectionPool::Lease AcquireConnection(const std::string& md_auth_token, const std::string& db_name);
+	/// Like AcquireConnection, but returns no connection if the pool has none
+	/// to spare instead of waiting for one
+	std::optional<ConnectionPool::Lease> TryAcquireConnection(const std::string& md_auth_token,
+	                                                          const std::string& db_name);
+
+	/// Creates the instance for `md_auth_token` and `db_name` and opens
+	/// `connections` idle connections in its pool (at most the pool's
+	/// `max_idle`), so that the first requests find everything set up
+	void WarmUp(const std::string& md_auth_token, const std::string& db_name, std::size_t connections);
+
+	/// The number of open instances
+	std::size_t InstanceCount();
+
+	/// Statistics of the connection pool of the instance for `md_auth_token`
+	/// and `db_name`, which is created if needed
+	ConnectionPool::stats PoolStats(const std::string& md_auth_token, const std::string& db_name);
+
+	/// Identifies the instance of `md_auth_token` and `db_name`. Server-wide
+	/// caches and locks are keyed by it, as databases of different accounts
+	/// can have the same name. Holds a hash of the token, not the token.
+	static std::string InstanceKey(const std::string& md_auth_token, const std::string& db_name);
+
+	/// The default create_instance_fn: opens the MotherDuck database, fetches
+	/// the welcome pack and cleans up after crashed processes
+	static std::shared_ptr<duckdb::DuckDB> CreateMotherDuckInstance(const std::string& md_auth_token,
+	                                                                const std::string& db_name,
+	                                                                const instance_settings& settings);
+
 private:
-	duckdb::DuckDB& get_duckdb(const std::string& md_auth_token, const std::string& db_name);
+	struct instance {
+		std::string db_name;
+		std::once_flag init_flag;
+		std::shared_ptr<ConnectionPool> pool;
+		// For LRU eviction
+		std::uint64_t last_used = 0;
+		std::chrono::steady_clock::time_point last_used_at;
+	};
+
+	/// The instance for `md_auth_token` and `db_name`, created if needed
+	std::shared_ptr<ConnectionPool> get_pool(const std::string& md_auth_token, const std::string& db_name);
+	/// Removes unused instances that have been idle for `max_idle_time`, then
+	/// the least recently used ones until there are at most `max_instances`.
+	/// Returns them so that they are closed outside of the lock.
+	std::vector<std::shared_ptr<instance>> evict_instances();
+	/// Closes `evicted` in the background, closing an instance can take a while
+	void close_instances(std::vector<std::shared_ptr<instance>> evicted);
 
 	// Only logs to stdout because there is no duckdb::Connection yet for
 	// SQL-based logging
 	mdlog::Logger stdout_logger;
-	std::once_flag db_init_flag;
-	duckdb::DuckDB db;
-	// Used to check that the same parameters are used on subsequent calls to
-	// GetConnection
-	std::string initial_md_token;
-	std::string initial_db_name;
+	const options opts;
+	const create_instance_fn create_instance;
+
+	std::mutex mutex;
+	// By token fingerprint and database name
+	std::map<std::string, std::shared_ptr<instance>> instances;
+	std::uint64_t use_count = 0;
+	// Numbers the temporary directories of the instances
+	std::uint64_t created_instances = 0;
+	// Keys of the instances that have cleaned up, kept across evictions
+	std::set<std::string> cleaned_up_instances;
+	// Time to the first connection, i.e. the cold start the first request sees
+	const std::chrono::steady_clock::time_point created_at = std::chrono::steady_clock::now();
+	std::once_flag first_connection_flag;
+	std::mutex closing_mutex;
+	std::vector<std::future<void>> closing;
 };
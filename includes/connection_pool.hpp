@@ -0,0 +1,141 @@
+#pragma once
+
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+/// Keeps the connections of a DuckDB instance open between requests. A
+/// request checks out a connection whose client ids are already known, so
+/// that setting up a request takes no round trip to MotherDuck. On return, an
+/// open transaction is rolled back and the settings the request changed are
+/// reset.
+///
+/// The number of open connections is bounded: once `max_open` are checked
+/// out, Acquire waits for one to be returned and TryAcquire returns none.
+///
+/// Pools are shared: checked out connections keep their pool, and the pool
+/// its DuckDB instance, alive.
+class ConnectionPool : public std::enable_shared_from_this<ConnectionPool> {
+public:
+	struct options {
+		/// Connections that are kept open while not checked out
+		std::size_t max_idle = 8;
+		/// Connections that are open at once, checked out or idle
+		std::size_t max_open = 32;
+		/// Query the client ids of new connections, for their loggers
+		bool fetch_client_ids = true;
+
+		/// Defaults, overridden by the environment variables
+		/// MD_CONNECTION_POOL_SIZE (max_idle) and MD_CONNECTION_POOL_MAX_OPEN
+		static options FromEnvironment();
+	};
+
+	struct stats {
+		std::size_t idle;
+		std::size_t open;
+		std::size_t created;
+		std::size_t reused;
+		std::size_t waits;
+		std::chrono::steady_clock::duration wait_time;
+	};
+
+private:
+	struct pooled_connection {
+		std::unique_ptr<duckdb::Connection> con;
+		mdlog::ClientIds ids;
+	};
+
+public:
+	/// A checked out connection, returned to the pool on destruction
+	class Lease {
+	public:
+		Lease(Lease&& other) noexcept;
+		Lease& operator=(Lease&&) = delete;
+		Lease(const Lease&) = delete;
+		Lease& operator=(const Lease&) = delete;
+		~Lease();
+
+		duckdb::Connection& Connection() {
+			return *entry->con;
+		}
+		const mdlog::ClientIds& Ids() const {
+			return entry->ids;
+		}
+		/// How long Acquire waited for the connection
+		std::chrono::steady_clock::duration WaitTime() const {
+			return wait_time;
+		}
+		/// Statistics of the pool the connection belongs to
+		stats PoolStats() const {
+			return pool->Stats();
+		}
+
+		/// Resets `setting` to its default when the connection is returned
+		void ResetOnReturn(const std::string& setting);
+		/// Closes the connection instead of returning it, e.g. after it has been
+		/// interrupted
+		void Discard() {
+			discard = true;
+		}
+
+	private:
+		friend class ConnectionPool;
+		Lease(std::shared_ptr<ConnectionPool> pool_, pooled_connection entry_,
+		      std::chrono::steady_clock::duration wait_time_);
+
+		std::shared_ptr<ConnectionPool> pool;
+		std::unique_ptr<pooled_connection> entry;
+		std::chrono::steady_clock::duration wait_time;
+		std::vector<std::string> reset_settings;
+		bool discard = false;
+	};
+
+	static std::shared_ptr<ConnectionPool> Create(std::shared_ptr<duckdb::DuckDB> db, options opts);
+
+	ConnectionPool(const ConnectionPool&) = delete;
+	ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+	/// Checks out an idle connection, or opens a new one
+	Lease Acquire();
+	/// Like Acquire, but returns no connection instead of waiting for one
+	std::optional<Lease> TryAcquire();
+
+	/// Opens idle connections until there are `count`, at most `max_idle`
+	void Prefill(std::size_t count);
+
+	stats Stats();
+
+	/// The instance whose connections are pooled
+	duckdb::DuckDB& Database() {
+		return *db;
+	}
+
+private:
+	ConnectionPool(std::shared_ptr<duckdb::DuckDB> db_, options opts_);
+
+	pooled_connection open_connection();
+	// Checks out a connection while `lock` is held, once one is available
+	Lease check_out(std::unique_lock<std::mutex>& lock, std::chrono::steady_clock::duration waited);
+	void release(pooled_connection entry, const std::vector<std::string>& reset_settings, bool discard);
+
+	const std::shared_ptr<duckdb::DuckDB> db;
+	const options opts;
+
+	std::mutex mutex;
+	std::condition_variable returned;
+	std::vector<pooled_connection> idle;
+	// Checked out and idle connections, and those being opened
+	std::size_t open = 0;
+	std::size_t created = 0;
+	std::size_t reused = 0;
+	std::size_t waits = 0;
+	std::chrono::steady_clock::duration wait_time {0};
+};
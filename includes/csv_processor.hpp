@@ -3,6 +3,9 @@
 #include "duckdb.hpp"
 #include "ingest_properties.hpp"
 #include "md_logging.hpp"
+#include "memory_backed_file.hpp"
+#include "retry_policy.hpp"
+#include "staging_tables.hpp"
 
 #include <functional>
 #include <memory>
@@ -12,8 +15,41 @@ namespace csv_processor {
 /// Creates a table that contains the contents of the CSV file located at
 /// `props.filename`, then calls `process_staging_table` with the
 /// fully-qualified name of the created table. Lastly, the table is dropped
-/// again.
+/// again, or, with `staging_tables`, handed back for reuse by later files.
+///
+/// If `con` has no active transaction, the file is processed in one of its
+/// own, and with a `retry_policy`, failures are retried from the decrypted
+/// file instead of failing the request.
 void ProcessFile(duckdb::Connection& con, const IngestProperties& props, mdlog::Logger& logger,
-                 const std::function<void(const std::string& staging_table_name)>& process_staging_table);
+                 const std::function<void(const std::string& staging_table_name)>& process_staging_table,
+                 StagingTables* staging_tables = nullptr, RetryPolicy* retry_policy = nullptr);
+
+/// A Parquet copy of a CSV file, written by ConvertFile. Like the decrypted CSV
+/// data, it is kept in memory-backed storage and never written to disk. It is
+/// freed when this object is destroyed.
+class ConvertedFile {
+public:
+	explicit ConvertedFile(MemoryBackedFile file_);
+
+	const std::string& Path() const {
+		return file.path;
+	}
+
+private:
+	MemoryBackedFile file;
+};
+
+/// Decrypts and parses the CSV file located at `props.filename` and writes its
+/// contents to an in-memory Parquet file. This is the local half of
+/// ProcessFile, so it can run on a separate connection while another file is
+/// being applied.
+ConvertedFile ConvertFile(duckdb::Connection& con, const IngestProperties& props, mdlog::Logger& logger);
+
+/// Same as ProcessFile, but creates the staging table from a file written by
+/// ConvertFile
+void ProcessConvertedFile(duckdb::Connection& con, const ConvertedFile& file, const IngestProperties& props,
+                          mdlog::Logger& logger,
+                          const std::function<void(const std::string& staging_table_name)>& process_staging_table,
+                          StagingTables* staging_tables = nullptr, RetryPolicy* retry_policy = nullptr);
 
 } // namespace csv_processor
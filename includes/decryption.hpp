@@ -4,3 +4,10 @@
 std::vector<unsigned char> decrypt_stream(std::istream& input, const std::string& input_name,
                                           const unsigned char* decryption_key);
 std::vector<unsigned char> decrypt_file(const std::string& filename, const unsigned char* decryption_key);
+
+/// Identifies the contents of a batch file, as a hex-encoded SHA-256 digest.
+/// Encrypted files are identified by their key, IV and size: Fivetran
+/// encrypts every file with a random key and IV, so these only need the first
+/// 16 bytes of the file instead of a pass over all of it. Unencrypted files are
+/// hashed in full.
+std::string file_fingerprint(const std::string& filename, const std::string& decryption_key);
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "destination_sdk.grpc.pb.h"
+#include "motherduck_destination_server.hpp"
+#include "request_executor.hpp"
+
+#include <cstddef>
+#include <google/protobuf/arena.h>
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/support/message_allocator.h>
+#include <map>
+#include <string>
+
+/// Allocates the request and response of a call on a protobuf arena, which is
+/// freed in one go when the call completes
+template <typename Request, typename Response>
+class ArenaMessageAllocator final : public ::grpc::MessageAllocator<Request, Response> {
+public:
+	::grpc::MessageHolder<Request, Response>* AllocateMessages() override {
+		return new holder();
+	}
+
+private:
+	class holder final : public ::grpc::MessageHolder<Request, Response> {
+	public:
+		holder() {
+			this->set_request(google::protobuf::Arena::Create<Request>(&arena));
+			this->set_response(google::protobuf::Arena::Create<Response>(&arena));
+		}
+
+		void Release() override {
+			delete this;
+		}
+
+	private:
+		google::protobuf::Arena arena;
+	};
+};
+
+/// Serves DestinationSdkImpl with the callback API. gRPC threads only hand
+/// calls over to one of two executors: cheap metadata calls (ConfigurationForm,
+/// Capabilities, Test, DescribeTable) have a lane of their own, so that they
+/// never queue behind writes.
+class DestinationCallbackService final : public fivetran_sdk::v2::DestinationConnector::CallbackService {
+public:
+	struct options {
+		std::size_t metadata_threads = 4;
+		std::size_t write_threads = 8;
+		/// Calls of a method that run at once, by method name
+		std::map<std::string, std::size_t> method_limits;
+
+		/// Defaults, overridden by the environment variables MD_METADATA_THREADS,
+		/// MD_WRITE_THREADS and MD_METHOD_CONCURRENCY, a comma-separated list of
+		/// <method>=<limit> entries, e.g. "WriteBatch=4, Migrate=1"
+		static options FromEnvironment();
+	};
+
+	DestinationCallbackService(DestinationSdkImpl& impl_, const options& opts);
+
+	::grpc::ServerUnaryReactor* ConfigurationForm(::grpc::CallbackServerContext* context,
+	                                              const ::fivetran_sdk::v2::ConfigurationFormRequest* request,
+	                                              ::fivetran_sdk::v2::ConfigurationFormResponse* response) override;
+	::grpc::ServerUnaryReactor* Test(::grpc::CallbackServerContext* context,
+	                                 const ::fivetran_sdk::v2::TestRequest* request,
+	                                 ::fivetran_sdk::v2::TestResponse* response) override;
+	::grpc::ServerUnaryReactor* Capabilities(::grpc::CallbackServerContext* context,
+	                                         const ::fivetran_sdk::v2::CapabilitiesRequest* request,
+	                                         ::fivetran_sdk::v2::CapabilitiesResponse* response) override;
+	::grpc::ServerUnaryReactor* DescribeTable(::grpc::CallbackServerContext* context,
+	                                          const ::fivetran_sdk::v2::DescribeTableRequest* request,
+	                                          ::fivetran_sdk::v2::DescribeTableResponse* response) override;
+	::grpc::ServerUnaryReactor* CreateTable(::grpc::CallbackServerContext* context,
+	                                        const ::fivetran_sdk::v2::CreateTableRequest* request,
+	                                        ::fivetran_sdk::v2::CreateTableResponse* response) override;
+	::grpc::ServerUnaryReactor* AlterTable(::grpc::CallbackServerContext* context,
+	                                       const ::fivetran_sdk::v2::AlterTableRequest* request,
+	                                       ::fivetran_sdk::v2::AlterTableResponse* response) override;
+	::grpc::ServerUnaryReactor* Truncate(::grpc::CallbackServerContext* context,
+	                                     const ::fivetran_sdk::v2::TruncateRequest* request,
+	                                     ::fivetran_sdk::v2::TruncateResponse* response) override;
+	::grpc::ServerUnaryReactor* WriteBatch(::grpc::CallbackServerContext* context,
+	                                       const ::fivetran_sdk::v2::WriteBatchRequest* request,
+	                                       ::fivetran_sdk::v2::WriteBatchResponse* response) override;
+	::grpc::ServerUnaryReactor* WriteHistoryBatch(::grpc::CallbackServerContext* context,
+	                                              const ::fivetran_sdk::v2::WriteHistoryBatchRequest* request,
+	                                              ::fivetran_sdk::v2::WriteBatchResponse* response) override;
+	::grpc::ServerUnaryReactor* Migrate(::grpc::CallbackServerContext* context,
+	                                    const ::fivetran_sdk::v2::MigrateRequest* request,
+	                                    ::fivetran_sdk::v2::MigrateResponse* response) override;
+
+private:
+	template <typename Request, typename Response>
+	using impl_method = ::grpc::Status (DestinationSdkImpl::*)(::grpc::ServerContextBase*, const Request*,
+	                                                          Response*);
+
+	/// Runs `method` of the implementation on `lane` and finishes the call with
+	/// its status
+	template <typename Request, typename Response>
+	::grpc::ServerUnaryReactor* dispatch(::grpc::CallbackServerContext* context, RequestExecutor& lane,
+	                                     const char* method_name, impl_method<Request, Response> method,
+	                                     const Request* request, Response* response);
+
+	DestinationSdkImpl& impl;
+	RequestExecutor metadata_lane;
+	RequestExecutor write_lane;
+
+	ArenaMessageAllocator<fivetran_sdk::v2::ConfigurationFormRequest, fivetran_sdk::v2::ConfigurationFormResponse>
+	    configuration_form_allocator;
+	ArenaMessageAllocator<fivetran_sdk::v2::TestRequest, fivetran_sdk::v2::TestResponse> test_allocator;
+	ArenaMessageAllocator<fivetran_sdk::v2::CapabilitiesRequest, fivetran_sdk::v2::CapabilitiesResponse>
+	    capabilities_allocator;
+	ArenaMessageAllocator<fivetran_sdk::v2::DescribeTableRequest, fivetran_sdk::v2::DescribeTableResponse>
+	    describe_table_allocator;
+	ArenaMessageAllocator<fivetran_sdk::v2::CreateTableRequest, fivetran_sdk::v2::CreateTableResponse>
+	    create_table_allocator;
+	ArenaMessageAllocator<fivetran_sdk::v2::AlterTableRequest, fivetran_sdk::v2::AlterTableResponse>
+	    alter_table_allocator;
+	ArenaMessageAllocator<fivetran_sdk::v2::TruncateRequest, fivetran_sdk::v2::TruncateResponse> truncate_allocator;
+	ArenaMessageAllocator<fivetran_sdk::v2::WriteBatchRequest, fivetran_sdk::v2::WriteBatchResponse>
+	    write_batch_allocator;
+	ArenaMessageAllocator<fivetran_sdk::v2::WriteHistoryBatchRequest, fivetran_sdk::v2::WriteBatchResponse>
+	    write_history_batch_allocator;
+	ArenaMessageAllocator<fivetran_sdk::v2::MigrateRequest, fivetran_sdk::v2::MigrateResponse> migrate_allocator;
+};
@@ -5,11 +5,22 @@
 #include <cstdint>
 #include <mutex>
 #include <string>
+#include <utility>
 
 namespace mdlog {
 
 enum class LogLevel : std::uint8_t { DEBUG, INFO, WARNING, SEVERE };
 
+/// Identifies a connection in the MotherDuck logs
+struct ClientIds {
+	std::string duckdb_id = "none";
+	std::string connection_id = "none";
+
+	/// Queries the ids of `con`. Returns "none" ids, and logs to stdout, if
+	/// they are not available.
+	static ClientIds Fetch(duckdb::Connection& con);
+};
+
 class Logger {
 public:
 	enum class SinkType : std::uint8_t { NONE = 0, STDOUT = 1 << 0, DUCKDB = 1 << 1 };
@@ -26,9 +37,22 @@ public:
 
 	// Creates a logger that logs to both stdout and DuckDB
 	static Logger CreateMultiSinkLogger(duckdb::Connection* connection) {
-		return Logger(connection);
+		return Logger(connection, ClientIds::Fetch(*connection), false);
 	}
 
+	/// Same, for a connection whose ids are known and whose DuckDB instance
+	/// already has logging enabled (see EnableDuckDBLogging). Runs no queries
+	/// until the first message.
+	static Logger CreateMultiSinkLogger(duckdb::Connection* connection, ClientIds ids) {
+		return Logger(connection, std::move(ids), true);
+	}
+
+	/// Whether DuckDB logging is enabled, i.e. MD_DISABLE_DUCKDB_LOGGING is not set
+	static bool DuckDBLoggingEnabled();
+	/// Enables the DuckDB sink of the instance of `con`. It is a global setting,
+	/// so this is only needed once per DuckDB instance.
+	static void EnableDuckDBLogging(duckdb::Connection& con);
+
 	void log(LogLevel level, const std::string& message) const;
 	void debug(const std::string& message) const;
 	void info(const std::string& message) const;
@@ -40,15 +64,14 @@ private:
 	explicit Logger(SinkType sinks);
 
 	// Logs to both stdout and DuckDB
-	explicit Logger(duckdb::Connection* con_);
+	Logger(duckdb::Connection* con_, ClientIds ids_, bool duckdb_logging_enabled);
 
 	SinkType enabled_sinks = SinkType::NONE;
 	// This is a raw pointer because it can be optional. The Logger is created as
 	// part of the RequestContext which ensures that the duckdb::Connection
 	// outlives the Logger.
 	duckdb::Connection* con;
-	std::string duckdb_id = "none";
-	std::string connection_id = "none";
+	ClientIds ids;
 	mutable std::once_flag initialize_duckdb_logging_flag;
 
 	void log_to_stdout(LogLevel level, const std::string& message) const;
@@ -1,38 +1,68 @@
 #pragma once
 
+#include "cancellation_watchdog.hpp"
 #include "connection_factory.hpp"
 #include "destination_sdk.grpc.pb.h"
+#include "schema_cache.hpp"
+#include "table_maintenance.hpp"
+#include "write_locks.hpp"
 
-class DestinationSdkImpl final : public fivetran_sdk::v2::DestinationConnector::Service {
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+/// The endpoints of the destination connector, served by
+/// DestinationCallbackService. The queries of an endpoint are interrupted when
+/// its call is cancelled or exceeds its deadline; tests call the endpoints
+/// with a null context.
+class DestinationSdkImpl final {
 public:
-	explicit DestinationSdkImpl() = default;
-	~DestinationSdkImpl() override = default;
+	explicit DestinationSdkImpl();
 
-	::grpc::Status ConfigurationForm(::grpc::ServerContext* context,
+	::grpc::Status ConfigurationForm(::grpc::ServerContextBase* context,
 	                                 const ::fivetran_sdk::v2::ConfigurationFormRequest* request,
-	                                 ::fivetran_sdk::v2::ConfigurationFormResponse* response) override;
-	::grpc::Status Test(::grpc::ServerContext* context, const ::fivetran_sdk::v2::TestRequest* request,
-	                    ::fivetran_sdk::v2::TestResponse* response) override;
+	                                 ::fivetran_sdk::v2::ConfigurationFormResponse* response);
+	::grpc::Status Test(::grpc::ServerContextBase* context, const ::fivetran_sdk::v2::TestRequest* request,
+	                    ::fivetran_sdk::v2::TestResponse* response);
 
-	::grpc::Status Capabilities(::grpc::ServerContext* context, const ::fivetran_sdk::v2::CapabilitiesRequest* request,
-	                            ::fivetran_sdk::v2::CapabilitiesResponse* response) override;
-	::grpc::Status DescribeTable(::grpc::ServerContext* context,
+	::grpc::Status Capabilities(::grpc::ServerContextBase* context,
+	                            const ::fivetran_sdk::v2::CapabilitiesRequest* request,
+	                            ::fivetran_sdk::v2::CapabilitiesResponse* response);
+	::grpc::Status DescribeTable(::grpc::ServerContextBase* context,
 	                             const ::fivetran_sdk::v2::DescribeTableRequest* request,
-	                             ::fivetran_sdk::v2::DescribeTableResponse* response) override;
-	::grpc::Status CreateTable(::grpc::ServerContext* context, const ::fivetran_sdk::v2::CreateTableRequest* request,
-	                           ::fivetran_sdk::v2::CreateTableResponse* response) override;
-	::grpc::Status AlterTable(::grpc::ServerContext* context, const ::fivetran_sdk::v2::AlterTableRequest* request,
-	                          ::fivetran_sdk::v2::AlterTableResponse* response) override;
-	::grpc::Status Truncate(::grpc::ServerContext* context, const ::fivetran_sdk::v2::TruncateRequest* request,
-	                        ::fivetran_sdk::v2::TruncateResponse* response) override;
-	::grpc::Status WriteBatch(::grpc::ServerContext* context, const ::fivetran_sdk::v2::WriteBatchRequest* request,
-	                          ::fivetran_sdk::v2::WriteBatchResponse* response) override;
-	::grpc::Status WriteHistoryBatch(::grpc::ServerContext* context,
+	                             ::fivetran_sdk::v2::DescribeTableResponse* response);
+	::grpc::Status CreateTable(::grpc::ServerContextBase* context,
+	                           const ::fivetran_sdk::v2::CreateTableRequest* request,
+	                           ::fivetran_sdk::v2::CreateTableResponse* response);
+	::grpc::Status AlterTable(::grpc::ServerContextBase* context, const ::fivetran_sdk::v2::AlterTableRequest* request,
+	                          ::fivetran_sdk::v2::AlterTableResponse* response);
+	::grpc::Status Truncate(::grpc::ServerContextBase* context, const ::fivetran_sdk::v2::TruncateRequest* request,
+	                        ::fivetran_sdk::v2::TruncateResponse* response);
+	::grpc::Status WriteBatch(::grpc::ServerContextBase* context,
+	                          const ::fivetran_sdk::v2::WriteBatchRequest* request,
+	                          ::fivetran_sdk::v2::WriteBatchResponse* response);
+	::grpc::Status WriteHistoryBatch(::grpc::ServerContextBase* context,
 	                                 const ::fivetran_sdk::v2::WriteHistoryBatchRequest* request,
-	                                 ::fivetran_sdk::v2::WriteBatchResponse* response) override;
-	::grpc::Status Migrate(::grpc::ServerContext* context, const ::fivetran_sdk::v2::MigrateRequest* request,
-	                       ::fivetran_sdk::v2::MigrateResponse* response) override;
+	                                 ::fivetran_sdk::v2::WriteBatchResponse* response);
+	::grpc::Status Migrate(::grpc::ServerContextBase* context, const ::fivetran_sdk::v2::MigrateRequest* request,
+	                       ::fivetran_sdk::v2::MigrateResponse* response);
+
+	/// Sets up the database instance and connections that requests with
+	/// `md_token` and `db_name` will use, ahead of the first request
+	void WarmUp(const std::string& md_token, const std::string& db_name, std::size_t connections);
+
+	/// Statistics of the connection pool that requests with `md_token` and
+	/// `db_name` use
+	ConnectionPool::stats PoolStats(const std::string& md_token, const std::string& db_name);
 
 private:
 	ConnectionFactory connection_factory;
+	CancellationWatchdog cancellation_watchdog {CancellationWatchdog::options::FromEnvironment()};
+	// Long enough to cover the DescribeTable calls at the start of a sync. Bounds
+	// how long changes made outside of the connector go unnoticed.
+	SchemaCache schema_cache {std::chrono::seconds(60)};
+	WriteLocks write_locks;
+	// Declared after connection_factory, which its workers use until they are
+	// joined
+	TableMaintenance table_maintenance;
 };
@@ -9,6 +9,12 @@
 namespace openssl_helper {
 void raise_openssl_error(const std::string& message_prefix);
 
+/// Lowercase hex encoding of `length` bytes at `data`
+std::string to_hex(const unsigned char* data, unsigned int length);
+
+/// Hex-encoded SHA-256 digest of `data`
+std::string sha256_hex(const std::string& data);
+
 /// RAII helper to free EVP_CIPHER and EVP_CIPHER_CTX
 struct CipherCtxDeleter {
 	EVP_CIPHER_CTX* cipher_ctx = nullptr;
@@ -22,4 +28,18 @@ struct CipherCtxDeleter {
 		}
 	}
 };
+
+/// RAII helper to free EVP_MD_CTX
+struct MdCtxDeleter {
+	EVP_MD_CTX* md_ctx = nullptr;
+
+	explicit MdCtxDeleter(EVP_MD_CTX* _md_ctx) : md_ctx(_md_ctx) {
+	}
+
+	~MdCtxDeleter() {
+		if (md_ctx) {
+			EVP_MD_CTX_free(md_ctx);
+		}
+	}
+};
 } // namespace openssl_helper
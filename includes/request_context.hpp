@@ -1,18 +1,32 @@
 #pragma once
 
+#include "cancellation_watchdog.hpp"
 #include "connection_factory.hpp"
+#include "connection_pool.hpp"
 #include "duckdb.hpp"
 #include "google/protobuf/map.h"
 #include "md_logging.hpp"
+#include "retry_policy.hpp"
 
+#include <chrono>
+#include <cstddef>
+#include <optional>
 #include <string>
 
+namespace grpc {
+class ServerContextBase;
+}
+
 /// Context for a single request to the MotherDuck destination server.
 /// Contains the DuckDB connection and logger for the request.
 class RequestContext {
 public:
-	explicit RequestContext(const std::string& endpoint_name_, ConnectionFactory& connection_factory,
-	                        const google::protobuf::Map<std::string, std::string>& request_config);
+	/// With a `watchdog` and `server_context`, the queries of the request are
+	/// interrupted once the call is cancelled or exceeds its deadline
+	explicit RequestContext(const std::string& endpoint_name_, ConnectionFactory& connection_factory_,
+	                        const google::protobuf::Map<std::string, std::string>& request_config,
+	                        CancellationWatchdog* watchdog = nullptr,
+	                        ::grpc::ServerContextBase* server_context = nullptr);
 	~RequestContext();
 
 	/// Get the DuckDB connection for the current request
@@ -27,12 +41,73 @@ public:
 	const std::string& GetDBName() const {
 		return db_name;
 	}
+	/// Get the key of the instance of the current request, see
+	/// ConnectionFactory::InstanceKey
+	const std::string& GetInstanceKey() const {
+		return instance_key;
+	}
+	/// Get the retry policy for the steps of the current request, which share
+	/// its retry budget
+	RetryPolicy& GetRetryPolicy() {
+		return retry_policy;
+	}
+
+	/// Begin a transaction that spans the rest of the request. Nested helpers
+	/// (e.g. csv_processor::ProcessFile) see the active transaction and do not
+	/// commit on their own.
+	void BeginTransaction();
+	/// Commit the request transaction. Every commit is a round trip to
+	/// MotherDuck, so the number of commits and the time spent in them are
+	/// logged when the request completes. Throws instead if the request has
+	/// been cancelled.
+	void Commit();
+	/// Roll back the request transaction, if there is one. After a
+	/// cancellation, this also stops interrupting the queries of the request,
+	/// so that it can clean up.
+	void Rollback();
+
+	/// True once the call has been cancelled or exceeded its deadline
+	bool Cancelled() const {
+		return watch && watch->Cancelled();
+	}
+
+	/// Check out an additional connection to the same database, e.g. for work
+	/// that runs concurrently with the request connection. Returns none rather
+	/// than waiting if the pool has none to spare: waiting while holding the
+	/// request connection would deadlock once every request does so.
+	std::optional<ConnectionPool::Lease> TryAcquireConnection();
+	/// Create a logger for a connection obtained from TryAcquireConnection
+	static mdlog::Logger CreateLogger(ConnectionPool::Lease& lease);
+
+	/// Interrupts a connection obtained from TryAcquireConnection along with the
+	/// request connection while it is in scope. The connection is closed
+	/// rather than returned to the pool if the request was cancelled.
+	class WatchedConnection {
+	public:
+		WatchedConnection(RequestContext& ctx_, ConnectionPool::Lease& lease_);
+		~WatchedConnection();
+
+		WatchedConnection(const WatchedConnection&) = delete;
+		WatchedConnection& operator=(const WatchedConnection&) = delete;
+
+	private:
+		RequestContext& ctx;
+		ConnectionPool::Lease& lease;
+	};
 
 private:
+	ConnectionFactory& connection_factory;
 	std::string endpoint_name;
 	std::string db_name;
 	std::string md_token;
-	duckdb::Connection con;
+	std::string instance_key;
+	// Returns the connection to the pool after the logger is gone
+	ConnectionPool::Lease lease;
+	duckdb::Connection& con;
 	// Logger has to have a shorter lifetime than the connection
 	mdlog::Logger logger;
+	RetryPolicy retry_policy;
+	std::optional<CancellationWatchdog::Watch> watch;
+	std::size_t commit_count = 0;
+	std::chrono::steady_clock::duration commit_time {0};
 };
\ No newline at end of file
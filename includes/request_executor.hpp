@@ -0,0 +1,57 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Runs submitted tasks on a fixed number of threads, in the order they were
+/// submitted. Every task has a key, e.g. the gRPC method it serves, and keys
+/// can have a limit on how many of their tasks run at once. A task whose key
+/// is at its limit stays queued without holding up the tasks behind it.
+class RequestExecutor {
+public:
+	/// Keys without a limit are only limited by the number of threads
+	RequestExecutor(std::string name_, std::size_t threads, std::map<std::string, std::size_t> limits_ = {});
+	/// Runs the queued tasks, then joins the threads
+	~RequestExecutor();
+
+	RequestExecutor(const RequestExecutor&) = delete;
+	RequestExecutor& operator=(const RequestExecutor&) = delete;
+
+	void Submit(const std::string& key, std::function<void()> task);
+
+	struct stats {
+		std::size_t queued;
+		std::size_t running;
+	};
+	stats Stats();
+
+private:
+	struct queued_task {
+		std::string key;
+		std::function<void()> run;
+		std::chrono::steady_clock::time_point queued_at;
+	};
+
+	void work();
+	/// The first queued task whose key is below its limit, end() if there is none
+	std::deque<queued_task>::iterator find_runnable();
+
+	const std::string name;
+	const std::map<std::string, std::size_t> limits;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool stopping = false;
+	std::deque<queued_task> queue;
+	// By key
+	std::map<std::string, std::size_t> running;
+	std::vector<std::thread> threads;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+/// Sizes DuckDB instances to the container instead of the host. DuckDB assumes
+/// it may use every core and 80% of the memory of the host, which in a
+/// container with a cgroup limit of 1 or 2 GiB gets the process killed by the
+/// OOM killer instead of spilling to disk.
+namespace resource_governor {
+/// Limits of the cgroup of the process, empty if there is none
+struct cgroup_limits {
+	/// The CPU quota, rounded up to whole CPUs
+	std::optional<std::size_t> cpus;
+	std::optional<std::int64_t> memory_bytes;
+};
+
+/// Reads cpu.max and memory.max of cgroup v2 below `cgroup_root`, or
+/// cpu.cfs_quota_us and memory.limit_in_bytes of cgroup v1. Unreadable files
+/// count as no limit.
+cgroup_limits ReadCgroupLimits(const std::string& cgroup_root = "/sys/fs/cgroup");
+
+struct instance_budget {
+	/// threads of each instance, DuckDB's default if 0
+	std::size_t threads = 0;
+	/// memory_limit of each instance, DuckDB's default if empty
+	std::string memory_limit;
+};
+
+/// Splits `limits` across `instances` DuckDB instances. Memory is divided
+/// between them, as each instance has a buffer pool of its own, after leaving
+/// a share for the rest of the process (gRPC messages, decrypted files).
+/// Threads are not divided: idle instances do not use theirs, and too many
+/// threads only cost context switches, not memory.
+instance_budget Budget(const cgroup_limits& limits, std::size_t instances);
+
+/// `bytes` in a format that memory_limit accepts
+std::string FormatMemoryLimit(std::int64_t bytes);
+} // namespace resource_governor
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <random>
+#include <string>
+
+/// Retries the steps of a request that failed with a transient error, instead
+/// of failing the request and having Fivetran send all of it again.
+///
+/// A step can only be retried on its own if it runs its own transactions: a
+/// failed statement aborts the transaction it runs in, and with it everything
+/// else that transaction did. Steps that run inside a transaction of their
+/// caller are therefore never retried, their error goes to the caller.
+///
+/// Errors are classified by their message. Transaction conflicts mean the
+/// transaction was rolled back, so any step can be retried after them.
+/// Connection errors leave it unknown whether the step took effect, so only
+/// idempotent steps are retried after them.
+///
+/// Delays grow exponentially with decorrelated jitter, and all steps of a
+/// request share a budget of retries. A policy belongs to one request and is
+/// not thread-safe.
+class RetryPolicy {
+public:
+	struct options {
+		/// Attempts of a single step, including the first one
+		std::size_t max_attempts = 5;
+		/// Retries of all steps of a request together
+		std::size_t budget = 20;
+		std::chrono::milliseconds base_delay {50};
+		std::chrono::milliseconds max_delay {5000};
+
+		/// Defaults, overridden by the environment variables
+		/// MD_RETRY_MAX_ATTEMPTS, MD_RETRY_BUDGET and MD_RETRY_MAX_DELAY_MS
+		static options FromEnvironment();
+	};
+
+	enum class error_kind {
+		/// Retrying will not help, e.g. a constraint violation or an interrupt
+		permanent,
+		/// A transaction conflict, the transaction was rolled back
+		conflict,
+		/// A connection problem, the step may or may not have taken effect
+		transient,
+	};
+
+	/// Whether a step can run again although its failed attempt may have taken
+	/// effect, e.g. because it checks an idempotency marker first
+	enum class idempotency { idempotent, not_idempotent };
+
+	RetryPolicy(options opts_, mdlog::Logger& logger_);
+
+	static error_kind Classify(const std::string& error_message);
+
+	/// Runs `step` until it succeeds, throws an error that is not worth
+	/// retrying, or runs out of attempts or budget. A transaction that a
+	/// failed attempt left open is rolled back before the next attempt.
+	void Run(duckdb::Connection& con, const std::string& step_name, idempotency step_idempotency,
+	         const std::function<void()>& step);
+
+	/// Retries so far, of all steps
+	std::size_t Retries() const {
+		return retries;
+	}
+	/// Time spent waiting between attempts so far
+	std::chrono::milliseconds Delay() const {
+		return total_delay;
+	}
+
+private:
+	/// The decorrelated jitter backoff: a random delay between the base delay
+	/// and three times the previous one, capped at the max delay
+	std::chrono::milliseconds next_delay();
+
+	const options opts;
+	mdlog::Logger& logger;
+	std::size_t retries = 0;
+	std::chrono::milliseconds previous_delay;
+	std::chrono::milliseconds total_delay {0};
+	std::mt19937 gen;
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "schema_types.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+/// Process-wide cache of the tables and columns of whole schemas. Fivetran
+/// calls DescribeTable for every table at the start of a sync, so the first
+/// call loads the schema with one query and the others are answered from
+/// memory.
+///
+/// Schemas are cached per instance (see ConnectionFactory::InstanceKey), as
+/// databases of different accounts can have the same name.
+///
+/// MdSqlGenerator invalidates the schema of every table it changes. Changes
+/// made by anything else (e.g. a user altering a table in the MotherDuck UI)
+/// are picked up once the entry is older than the TTL.
+class SchemaCache {
+public:
+	struct cached_table {
+		/// False for views, which describe_table lists but table_exists does not
+		bool is_table = false;
+		/// Whether the table has a PRIMARY KEY constraint, see
+		/// MdSqlGenerator::add_deferred_primary_key
+		bool primary_key = false;
+		std::vector<column_def> columns;
+	};
+	using schema_tables = std::map<std::string, cached_table>;
+
+	explicit SchemaCache(std::chrono::steady_clock::duration ttl_) : ttl(ttl_) {
+	}
+
+	/// The tables of a schema, or nullptr if the schema is not cached or its
+	/// entry has expired
+	std::shared_ptr<const schema_tables> Get(const std::string& instance_key, const std::string& db_name,
+	                                         const std::string& schema_name);
+
+	/// Has to be read before loading a schema and passed to Put, so that a load
+	/// that raced with an invalidation is not stored
+	std::uint64_t Generation();
+
+	void Put(const std::string& instance_key, const std::string& db_name, const std::string& schema_name,
+	         std::shared_ptr<const schema_tables> tables, std::uint64_t generation_before_load);
+
+	void Invalidate(const std::string& instance_key, const std::string& db_name, const std::string& schema_name);
+
+private:
+	struct entry {
+		std::shared_ptr<const schema_tables> tables;
+		std::chrono::steady_clock::time_point loaded_at;
+	};
+
+	const std::chrono::steady_clock::duration ttl;
+	std::mutex mutex;
+	// By instance key, database and schema name
+	std::map<std::tuple<std::string, std::string, std::string>, entry> schemas;
+	// Incremented by every invalidation
+	std::uint64_t generation = 0;
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "schema_types.hpp"
+
+#include <concepts>
+#include <cstddef>
+#include <fmt/format.h>
+#include <iterator>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/// A column together with its quoted identifier. The quoting is done once when
+/// the list is built, so statements that mention a column several times (e.g.
+/// `update_values`) do not escape its name over and over again.
+struct quoted_column {
+	const column_def* def;
+	std::string name;
+};
+
+std::vector<quoted_column> quote_columns(const std::vector<const column_def*>& columns);
+
+/// Appends `text` surrounded by `quote` to `out`, doubling any `quote`
+/// characters inside `text`. Produces the same output as
+/// duckdb::KeywordHelper::WriteQuoted, but without a temporary string.
+void append_quoted(fmt::memory_buffer& out, std::string_view text, char quote);
+
+/// Builds a SQL statement in a single growable buffer. All generator methods
+/// render into one of these instead of chaining std::ostringstreams:
+///
+///  SqlBuilder sql;
+///  sql << "SELECT ";
+///  sql.join(columns, ", ", [](SqlBuilder& out, const quoted_column& col) { out << col.name; });
+///  sql << " FROM " << table;                     // table is a table_def
+///  sql << " WHERE " << ident("my col") << " = " << literal("it's");
+///
+class SqlBuilder {
+public:
+	/// A double-quoted identifier, written with append_quoted
+	struct identifier {
+		std::string_view text;
+	};
+	/// A single-quoted string literal, written with append_quoted
+	struct string_literal {
+		std::string_view text;
+	};
+
+	SqlBuilder& operator<<(const std::string_view text) {
+		buffer.append(text);
+		return *this;
+	}
+
+	SqlBuilder& operator<<(const char c) {
+		buffer.push_back(c);
+		return *this;
+	}
+
+	// Numbers have to go through format(), they would otherwise be written as a char
+	template <std::integral T>
+	    requires(!std::same_as<T, char>)
+	SqlBuilder& operator<<(T) = delete;
+
+	SqlBuilder& operator<<(const identifier& id) {
+		append_quoted(buffer, id.text, '"');
+		return *this;
+	}
+
+	SqlBuilder& operator<<(const string_literal& lit) {
+		append_quoted(buffer, lit.text, '\'');
+		return *this;
+	}
+
+	/// Writes the fully qualified, quoted name of `table`
+	SqlBuilder& operator<<(const table_def& table);
+
+	/// Formats `args` into the statement, e.g. sql.format("LIMIT {}", n)
+	template <typename... Args>
+	SqlBuilder& format(fmt::format_string<Args...> fmt_string, Args&&... args) {
+		fmt::format_to(std::back_inserter(buffer), fmt_string, std::forward<Args>(args)...);
+		return *this;
+	}
+
+	/// Writes every element of `items`, separated by `sep`, using `write(*this, item)`
+	template <std::ranges::input_range R, typename F>
+	SqlBuilder& join(const R& items, const std::string_view sep, const F& write) {
+		bool first = true;
+		for (const auto& item : items) {
+			if (!first) {
+				buffer.append(sep);
+			}
+			first = false;
+			write(*this, item);
+		}
+		return *this;
+	}
+
+	/// Writes the quoted names of `columns`, separated by `sep`
+	SqlBuilder& join_names(const std::vector<quoted_column>& columns, std::string_view sep = ", ");
+
+	[[nodiscard]] std::string str() const {
+		return fmt::to_string(buffer);
+	}
+
+	[[nodiscard]] std::size_t size() const {
+		return buffer.size();
+	}
+
+private:
+	fmt::memory_buffer buffer;
+};
+
+inline SqlBuilder::identifier ident(const std::string_view text) {
+	return SqlBuilder::identifier {text};
+}
+
+inline SqlBuilder::string_literal literal(const std::string_view text) {
+	return SqlBuilder::string_literal {text};
+}
@@ -2,11 +2,16 @@
 
 #include "duckdb.hpp"
 #include "md_logging.hpp"
+#include "retry_policy.hpp"
+#include "schema_cache.hpp"
 #include "schema_types.hpp"
 
+#include <chrono>
+#include <cstdint>
 #include <functional>
 #include <map>
 #include <memory>
+#include <optional>
 #include <set>
 #include <string>
 #include <vector>
@@ -78,18 +83,48 @@ std::string join(const std::vector<T>& vec, const F& map = {}) {
 class MdSqlGenerator {
 
 public:
-	explicit MdSqlGenerator(mdlog::Logger& logger_);
-
-	/// Generates a randomized table name which is not used yet in the database
+	/// With a `schema_cache_`, table_exists and describe_table are answered from
+	/// the cache outside of transactions, and DDL methods invalidate it. With a
+	/// `retry_policy_`, statements that run outside of a transaction are retried
+	/// after transaction conflicts. The cache entries of the generator are
+	/// those of `instance_key_`, see ConnectionFactory::InstanceKey.
+	explicit MdSqlGenerator(mdlog::Logger& logger_, SchemaCache* schema_cache_ = nullptr,
+	                        RetryPolicy* retry_policy_ = nullptr, std::string instance_key_ = "");
+
+	/// Generates a randomized table name in the main schema of the current
+	/// database. The name embeds its creation time so that
+	/// drop_leaked_temp_tables can tell leaked tables from ones that are still
+	/// in use.
 	std::string generate_temp_table_name(duckdb::Connection& con, const std::string& prefix) const;
+	/// Same, for callers that already know the current database
+	static std::string generate_temp_table_name(const std::string& db_name, const std::string& prefix);
+
+	/// Drops the staging and bookkeeping tables that crashed or killed
+	/// processes left behind in the current database, in a single round trip.
+	/// Only tables older than `max_age` are dropped, because other processes
+	/// may be using newer ones. Errors are logged, not thrown.
+	void drop_leaked_temp_tables(duckdb::Connection& con, std::chrono::seconds max_age) const;
 
 	void create_schema_if_not_exists_with_retries(duckdb::Connection& con, const std::string& db_name,
 	                                              const std::string& schema_name) const;
 
 	bool table_exists(duckdb::Connection& con, const table_def& table) const;
 
+	/// Without `primary_key_constraint`, the primary key columns are only
+	/// declared NOT NULL, see add_deferred_primary_key
 	void create_table(duckdb::Connection& con, const table_def& table, const std::vector<column_def>& all_columns,
-	                  const std::set<std::string>& columns_with_default_value);
+	                  const std::set<std::string>& columns_with_default_value, bool primary_key_constraint = true);
+
+	/// Answered from the schema cache once the constraint exists, outside of
+	/// a transaction
+	bool has_primary_key_constraint(duckdb::Connection& con, const table_def& table) const;
+	bool table_is_empty(duckdb::Connection& con, const table_def& table) const;
+
+	/// Adds the PRIMARY KEY constraint to a table that was created without it
+	/// and loaded without maintaining its index. Duplicate keys are found with
+	/// a single aggregation and reported as a RecoverableError.
+	void add_deferred_primary_key(duckdb::Connection& con, const table_def& table,
+	                              const std::vector<const column_def*>& columns_pk) const;
 
 	std::vector<column_def> describe_table(duckdb::Connection& con, const table_def& table);
 	void add_column(duckdb::Connection& con, const table_def& table, const column_def& column,
@@ -101,21 +136,61 @@ public:
 	void alter_table(duckdb::Connection& con, const table_def& table, const std::vector<column_def>& requested_columns,
 	                 bool drop_columns);
 
+	// Per-file DML statements. These only render the SQL and do not touch the
+	// database; upsert(), insert(), update_values() and delete_rows() run them.
+	// `order_by` are the columns that the staged rows are sorted by before they
+	// are written, see find_cluster_columns.
+	static std::string upsert_query(const table_def& table, const std::string& staging_table_name,
+	                                const std::vector<const column_def*>& columns_pk,
+	                                const std::vector<const column_def*>& columns_regular,
+	                                const std::vector<const column_def*>& order_by = {});
+	static std::string insert_query(const table_def& table, const std::string& staging_table_name,
+	                                const std::vector<const column_def*>& columns_pk,
+	                                const std::vector<const column_def*>& columns_regular,
+	                                const std::vector<const column_def*>& order_by = {});
+	// `key_filter` is an optional predicate on the target table from staged_key_filter().
+	static std::string update_values_query(const table_def& table, const std::string& staging_table_name,
+	                                       const std::vector<const column_def*>& columns_pk,
+	                                       const std::vector<const column_def*>& columns_regular,
+	                                       const std::string& unmodified_string, const std::string& key_filter = "");
+	static std::string delete_rows_query(const table_def& table, const std::string& staging_table_name,
+	                                     const std::vector<const column_def*>& columns_pk,
+	                                     const std::string& key_filter = "");
+
+	/// Builds a constant predicate on the primary key columns of `target` (the
+	/// qualifier used for the target table in the statement) that matches every
+	/// key in the staging table: an IN list for small batches, a BETWEEN range
+	/// otherwise. Joins against the target table add it so that DuckDB can skip
+	/// row groups based on their min/max statistics. Returns an empty string if
+	/// no filter could be computed.
+	std::string staged_key_filter(duckdb::Connection& con, const std::string& staging_table_name,
+	                              const std::vector<const column_def*>& columns_pk, const std::string& target) const;
+
+	/// With `order_by`, the rows are written in that order, which keeps the
+	/// min/max statistics of the row groups on those columns narrow
 	void upsert(duckdb::Connection& con, const table_def& table, const std::string& staging_table_name,
 	            const std::vector<const column_def*>& columns_pk,
-	            const std::vector<const column_def*>& columns_regular);
+	            const std::vector<const column_def*>& columns_regular,
+	            const std::vector<const column_def*>& order_by = {});
 
 	void insert(duckdb::Connection& con, const table_def& table, const std::string& staging_table_name,
 	            const std::vector<const column_def*>& columns_pk,
-	            const std::vector<const column_def*>& columns_regular);
+	            const std::vector<const column_def*>& columns_regular,
+	            const std::vector<const column_def*>& order_by = {});
+
+	/// Rewrites all rows of `table` sorted by `order_by`. Rows that later
+	/// updates and deletes scattered across row groups end up clustered again.
+	void recluster_table(duckdb::Connection& con, const table_def& table,
+	                     const std::vector<const column_def*>& order_by) const;
 
 	void update_values(duckdb::Connection& con, const table_def& table, const std::string& staging_table_name,
 	                   std::vector<const column_def*>& columns_pk, std::vector<const column_def*>& columns_regular,
 	                   const std::string& unmodified_string);
 
-	/// This creates the latest_active_records (LAR) table, a table with a
-	/// randomized name. The caller is responsible for cleaning it up. The LAR
-	/// table is used in history mode (see DestinationSdkImpl::WriteHistoryBatch).
+	/// This creates the latest_active_records (LAR) table, a TEMP table with a
+	/// randomized name. It is local to `con` and goes away with the connection,
+	/// but the caller should still clean it up once it is no longer needed. The
+	/// LAR table is used in history mode (see DestinationSdkImpl::WriteHistoryBatch).
 	std::string create_latest_active_records_table(duckdb::Connection& con, const table_def& source_table) const;
 
 	void drop_latest_active_records_table(duckdb::Connection& con, const std::string& lar_table_name) const;
@@ -134,11 +209,36 @@ public:
 
 	void deactivate_historical_records(duckdb::Connection& con, const table_def& table,
 	                                   const std::string& staging_table_name, const std::string& lar_table_name,
-	                                   std::vector<const column_def*>& columns_pk) const;
+	                                   std::vector<const column_def*>& columns_pk);
 
 	void delete_historical_rows(duckdb::Connection& con, const table_def& table, const std::string& staging_table_name,
 	                            std::vector<const column_def*>& columns_pk);
 
+	/// The number of rows that update_values, delete_rows and the history mode
+	/// deactivations and deletions of this generator have changed. Each of
+	/// them leaves old row versions behind, see TableMaintenance.
+	std::int64_t changed_row_count() const {
+		return changed_rows;
+	}
+
+	/// The optional side table of a history mode table. It holds the primary
+	/// key and _fivetran_start of the active version of every key, i.e. it is
+	/// the current state of the table in the shape of its keys.
+	static table_def active_records_table(const table_def& table);
+
+	/// Creates the active records table of `table` from the history table if it
+	/// does not exist yet. From then on, the history mode operations of this
+	/// generator keep it in sync, and use it to limit their scans of the history
+	/// table to the row groups that can contain active versions.
+	void maintain_active_records_table(duckdb::Connection& con, const table_def& table,
+	                                   const std::vector<const column_def*>& columns_pk);
+
+	/// Drops the active records table of `table`. Operations that change a
+	/// history table outside of WriteHistoryBatch (alter_table, truncate_table
+	/// and the migrations) do not maintain it, so they drop it, and the next
+	/// batch rebuilds it.
+	void drop_active_records_table(duckdb::Connection& con, const table_def& table) const;
+
 	// Migration operations
 
 	// Drop the destination table
@@ -245,9 +345,35 @@ public:
 
 private:
 	mdlog::Logger& logger;
+	SchemaCache* schema_cache;
+	RetryPolicy* retry_policy;
+	const std::string instance_key;
+	/// Set by maintain_active_records_table
+	std::optional<table_def> active_records;
+	std::int64_t changed_rows = 0;
+
+	/// The smallest _fivetran_start of the active versions of the staged keys,
+	/// NULL if none of them has an active version. With `before_staged_start`,
+	/// NULL unless every staged key has an active version that starts before
+	/// its staged _fivetran_start.
+	duckdb::Value active_start_bound(duckdb::Connection& con, const std::string& staging_table_name,
+	                                 const std::vector<const column_def*>& columns_pk, bool before_staged_start) const;
+	/// Replaces the active records of the staged keys that have an active
+	/// version in the staging table
+	void add_active_records(duckdb::Connection& con, const std::string& staging_table_name,
+	                        const std::vector<const column_def*>& columns_pk,
+	                        const std::vector<const column_def*>& columns_regular) const;
+	/// Removes the active records of all staged keys
+	void remove_active_records(duckdb::Connection& con, const std::string& staging_table_name,
+	                           const std::vector<const column_def*>& columns_pk) const;
 
 	void run_query(duckdb::Connection& con, const std::string& log_prefix, const std::string& query,
 	               const std::string& error_message) const;
+	/// The tables of the schema of `table` from the schema cache, loading the
+	/// whole schema with one query on a miss. nullptr if there is no cache or a
+	/// transaction is active.
+	std::shared_ptr<const SchemaCache::schema_tables> cached_schema(duckdb::Connection& con,
+	                                                                const table_def& table) const;
 	void alter_table_recreate(duckdb::Connection& con, const table_def& table,
 	                          const std::vector<column_def>& all_columns_in_new_table,
 	                          const std::set<std::string>& existing_columns_in_new_table);
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "csv_processor.hpp"
+#include "duckdb.hpp"
+#include "ingest_properties.hpp"
+#include "md_logging.hpp"
+#include "request_context.hpp"
+#include "retry_policy.hpp"
+#include "staging_tables.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+/// Applies the files of a batch in order, while the next file is already being
+/// decrypted and parsed on a second connection (see csv_processor::ConvertFile).
+///
+/// The staging tables themselves are created on the applying connection: it
+/// holds the transaction of the whole batch and would not see tables that
+/// another connection committed after that transaction started. Files with the
+/// same columns share a staging table (see StagingTables), which is dropped
+/// at the end of Run.
+class StagingPipeline {
+public:
+	using apply_function = std::function<void(const std::string& staging_table_name)>;
+
+	/// With a `retry_policy_`, files that are applied in their own transaction
+	/// are retried, see csv_processor::ProcessFile
+	StagingPipeline(duckdb::Connection& con_, mdlog::Logger& logger_, RetryPolicy* retry_policy_ = nullptr);
+
+	/// Queue a file. `apply` is called with the name of its staging table.
+	void Add(IngestProperties props, apply_function apply);
+
+	/// Process all queued files in the order they were added, converting on a
+	/// pooled connection of `ctx`. A single file is processed directly, as are
+	/// all of them if the pool has no connection to spare.
+	void Run(RequestContext& ctx);
+
+	/// Process all queued files in the order they were added, converting on
+	/// `staging_con`
+	void Run(duckdb::Connection& staging_con, mdlog::Logger& staging_logger);
+
+	std::size_t Size() const {
+		return files.size();
+	}
+
+private:
+	struct queued_file {
+		IngestProperties props;
+		apply_function apply;
+	};
+
+	duckdb::Connection& con;
+	mdlog::Logger& logger;
+	RetryPolicy* retry_policy;
+	StagingTables staging_tables;
+	std::vector<queued_file> files;
+};
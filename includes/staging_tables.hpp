@@ -0,0 +1,63 @@
+#pragma once
+
+#include "duckdb.hpp"
+#include "ingest_properties.hpp"
+#include "md_logging.hpp"
+
+#include <cstddef>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+/// Hands out the staging tables for the files of a batch. A staging table is
+/// created for the first file with a given set of columns. Later files with
+/// the same columns are loaded into it with TRUNCATE + INSERT instead of
+/// another CREATE and DROP, so that in the steady state, a file needs no
+/// catalog changes at all.
+///
+/// The tables are dropped with DropAll. Call it before committing the
+/// transaction they were created in, so that they never reach the catalog.
+class StagingTables {
+public:
+	struct staging_table {
+		std::string name;
+		/// The table exists already and has to be truncated before it is filled
+		bool reused = false;
+		/// Columns of the table, see Acquire. Not set for tables that cannot be reused.
+		std::optional<std::string> schema_key;
+	};
+
+	StagingTables(duckdb::Connection& con_, mdlog::Logger& logger_);
+	/// Drops the remaining tables, unless a transaction is still active: then
+	/// the tables disappear when it is rolled back
+	~StagingTables();
+
+	StagingTables(const StagingTables&) = delete;
+	StagingTables& operator=(const StagingTables&) = delete;
+
+	/// A staging table for the file described by `props`. It is reused if an
+	/// earlier file with the same columns and types has been released.
+	staging_table Acquire(const IngestProperties& props);
+
+	/// Makes `table` available to later files with the same columns
+	void Release(staging_table table);
+
+	/// Drops all tables in one round trip. Errors are logged, not thrown.
+	void DropAll();
+
+	std::size_t ReuseCount() const {
+		return reuse_count;
+	}
+
+private:
+	const std::string& current_database();
+
+	duckdb::Connection& con;
+	mdlog::Logger& logger;
+	std::optional<std::string> db_name;
+	std::vector<std::string> created;
+	// Released tables by schema key
+	std::map<std::string, std::string> idle;
+	std::size_t reuse_count = 0;
+};
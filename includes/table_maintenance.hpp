@@ -0,0 +1,123 @@
+#pragma once
+
+#include "duckdb.hpp"
+#include "schema_types.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Rewrites tables that updates and deletes have left full of old row
+/// versions. Requests report how many rows they changed per table, and
+/// background workers rebuild a table once enough rows changed since its last
+/// rebuild, while no request writes to it.
+///
+/// Maintenance never holds up a sync: a request that starts writing to a
+/// table interrupts the maintenance of that table, which then rolls back and
+/// is retried later.
+class TableMaintenance {
+public:
+	struct options {
+		/// No maintenance at all if false
+		bool enabled = true;
+		/// Tables with fewer changed rows are not considered
+		std::int64_t min_changed_rows = 1000000;
+		/// Nor are tables where the changed rows are a smaller share of the table
+		double min_changed_ratio = 0.2;
+		/// Number of worker threads, i.e. tables that are maintained at once
+		std::size_t max_concurrent = 1;
+		/// How often idle workers look for tables to maintain
+		std::chrono::seconds interval {60};
+
+		/// Defaults, overridden by the environment variables
+		/// MD_TABLE_MAINTENANCE (0 disables it), MD_TABLE_MAINTENANCE_MIN_CHANGED_ROWS
+		/// and MD_TABLE_MAINTENANCE_CONCURRENCY
+		static options FromEnvironment();
+	};
+
+	struct maintenance_job {
+		table_def table;
+		std::string md_token;
+		/// The table is rewritten in this order, its primary key if empty
+		std::vector<column_def> order_by;
+		std::int64_t changed_rows;
+	};
+
+	struct maintenance_result {
+		bool maintained;
+		/// If not maintained, the number of changed rows that make it worthwhile
+		std::int64_t changed_rows_needed = 0;
+	};
+
+	using connect_fn = std::function<duckdb::Connection(const maintenance_job&)>;
+	using run_fn = std::function<maintenance_result(duckdb::Connection&, const maintenance_job&, const options&)>;
+
+	TableMaintenance(options opts_, connect_fn connect_, run_fn run_ = Rebuild);
+	/// Interrupts running maintenance and joins the workers
+	~TableMaintenance();
+
+	TableMaintenance(const TableMaintenance&) = delete;
+	TableMaintenance& operator=(const TableMaintenance&) = delete;
+
+	/// Marks a table as written to for its lifetime. Waits until maintenance
+	/// of the table that was running has been interrupted.
+	class Write {
+	public:
+		Write(TableMaintenance& maintenance_, const std::string& instance_key, const table_def& table);
+		~Write();
+
+		Write(const Write&) = delete;
+		Write& operator=(const Write&) = delete;
+
+	private:
+		TableMaintenance& maintenance;
+		const std::string key;
+	};
+
+	/// Adds `changed_rows` committed changes to the count of `table` of the
+	/// instance `instance_key` (see ConnectionFactory::InstanceKey). The latest
+	/// `md_token` and `order_by` are used for its maintenance.
+	void RecordChanges(const std::string& instance_key, const table_def& table, const std::string& md_token,
+	                   const std::vector<const column_def*>& order_by, std::int64_t changed_rows);
+
+	/// The default run_fn: rebuilds the table with MdSqlGenerator::recluster_table
+	/// if the changed rows are at least `min_changed_ratio` of its estimated size
+	static maintenance_result Rebuild(duckdb::Connection& con, const maintenance_job& job, const options& opts);
+
+private:
+	struct table_state {
+		table_def table;
+		std::string md_token;
+		std::vector<column_def> order_by;
+		std::int64_t changed_rows = 0;
+		std::int64_t changed_rows_needed = 0;
+		std::size_t writes = 0;
+		bool running = false;
+		/// Set while maintenance runs a query that a write has to interrupt
+		duckdb::Connection* connection = nullptr;
+	};
+
+	static std::string state_key(const std::string& instance_key, const table_def& table);
+
+	void work();
+	/// The due table with the most changed rows, nullptr if there is none
+	table_state* find_due();
+
+	const options opts;
+	const connect_fn connect;
+	const run_fn run;
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool stopping = false;
+	// By instance key and escaped table name, see state_key
+	std::map<std::string, table_state> tables;
+	std::vector<std::thread> workers;
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Serializes the requests of this process that would otherwise abort each
+/// other with a write-write conflict, e.g. a Truncate racing a WriteBatch of the
+/// same table, or a Migrate while a table of its schema is being written to.
+/// Such a conflict costs a retry of the whole request by Fivetran, a lock wait
+/// here only the time until the other request completes.
+///
+/// Locks are per instance (see ConnectionFactory::InstanceKey): the same table
+/// name in databases of different accounts is a different table.
+///
+/// Locks are granted in the order they were requested, and held until the guard
+/// that requested them is destroyed. Locks of a guard are acquired in a fixed
+/// order (schema before table), so guards do not deadlock each other as long as
+/// a request holds at most one of them at a time.
+class WriteLocks {
+public:
+	struct stats {
+		/// Number of guards, and how many of them had to wait
+		std::size_t acquired = 0;
+		std::size_t waited = 0;
+		std::chrono::steady_clock::duration wait_time {0};
+		std::chrono::steady_clock::duration max_wait_time {0};
+	};
+
+	WriteLocks() = default;
+	WriteLocks(const WriteLocks&) = delete;
+	WriteLocks& operator=(const WriteLocks&) = delete;
+
+	stats Stats() const;
+
+private:
+	struct lock_request {
+		bool exclusive;
+	};
+
+public:
+	class Guard {
+	public:
+		~Guard();
+
+		Guard(const Guard&) = delete;
+		Guard& operator=(const Guard&) = delete;
+
+		/// How long the guard waited for its locks
+		std::chrono::steady_clock::duration WaitTime() const {
+			return wait_time;
+		}
+
+	protected:
+		/// Acquires `locks`, (key, exclusive) pairs, in order. Logs the wait
+		/// with `description` if there was one.
+		Guard(WriteLocks& write_locks_, const std::vector<std::pair<std::string, bool>>& locks,
+		      const std::string& description, mdlog::Logger& logger);
+
+	private:
+		WriteLocks& write_locks;
+		std::vector<std::pair<std::string, std::list<lock_request>::iterator>> held;
+		std::chrono::steady_clock::duration wait_time {0};
+	};
+
+	/// For writes to one table: locks the table, and its schema in shared mode
+	class Table : public Guard {
+	public:
+		Table(WriteLocks& write_locks_, const std::string& instance_key, const table_def& table,
+		      mdlog::Logger& logger);
+	};
+
+	/// For changes that involve several tables of a schema, e.g. migrations:
+	/// locks the schema, and with it all of its tables
+	class Schema : public Guard {
+	public:
+		Schema(WriteLocks& write_locks_, const std::string& instance_key, const std::string& db_name,
+		       const std::string& schema_name, mdlog::Logger& logger);
+	};
+
+	/// For CREATE SCHEMA IF NOT EXISTS, which only conflicts with itself. Does
+	/// not wait for writes to the tables of the schema.
+	class SchemaCreation : public Guard {
+	public:
+		SchemaCreation(WriteLocks& write_locks_, const std::string& instance_key, const std::string& db_name,
+		               const std::string& schema_name, mdlog::Logger& logger);
+	};
+
+private:
+	/// Whether `request`, queued for a lock, may hold it: exclusive requests
+	/// at the front of the queue, shared ones behind shared ones only
+	static bool can_hold(const std::list<lock_request>& queue, const lock_request& request);
+
+	mutable std::mutex mutex;
+	std::condition_variable released;
+	// The requests for a lock in the order they were made, holders first
+	std::map<std::string, std::list<lock_request>> queues;
+	stats totals;
+};
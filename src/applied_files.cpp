@@ -0,0 +1,132 @@
+#include "applied_files.hpp"
+
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+#include "sql_builder.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+std::int64_t unix_seconds() {
+	return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch())
+	    .count();
+}
+} // namespace
+
+void AppliedFiles::Initialize(duckdb::Connection& con, mdlog::Logger& logger, const std::chrono::seconds max_age) {
+	// applied_at holds unix seconds: TIMESTAMPTZ arithmetic would need ICU
+	SqlBuilder sql;
+	sql << "CREATE TABLE IF NOT EXISTS main." << ident(TABLE_NAME)
+	    << " (schema_name VARCHAR, table_name VARCHAR, fingerprint VARCHAR, operation VARCHAR, batch_id VARCHAR, "
+	       "applied_at BIGINT); DELETE FROM main."
+	    << ident(TABLE_NAME);
+	sql.format(" WHERE applied_at < {}", unix_seconds() - max_age.count());
+
+	const auto query = sql.str();
+	logger.info("AppliedFiles: " + query);
+	const auto result = con.Query(query);
+	if (result->HasError()) {
+		logger.warning("AppliedFiles: could not prepare bookkeeping table: " + result->GetError());
+	}
+}
+
+AppliedFiles::AppliedFiles(duckdb::Connection& con_, mdlog::Logger& logger_, table_def table_)
+    : con(con_), logger(logger_), table(std::move(table_)) {
+}
+
+void AppliedFiles::Load(const std::vector<std::string>& fingerprints) {
+	if (fingerprints.empty()) {
+		return;
+	}
+
+	SqlBuilder sql;
+	sql << "SELECT fingerprint FROM " << table_def {table.db_name, "main", TABLE_NAME}
+	    << " WHERE schema_name = " << literal(table.schema_name) << " AND table_name = " << literal(table.table_name)
+	    << " AND fingerprint IN (";
+	sql.join(fingerprints, ", ", [](SqlBuilder& out, const std::string& fingerprint) { out << literal(fingerprint); });
+	sql << ')';
+
+	const auto result = con.Query(sql.str());
+	if (result->HasError()) {
+		logger.warning("AppliedFiles: could not read bookkeeping table, applying all files: " + result->GetError());
+		return;
+	}
+	enabled = true;
+	for (idx_t row = 0; row < result->RowCount(); row++) {
+		applied.insert(result->GetValue(0, row).ToString());
+	}
+	if (!applied.empty()) {
+		logger.info("AppliedFiles: " + std::to_string(applied.size()) + " of " + std::to_string(fingerprints.size()) +
+		            " files have been applied before");
+	}
+}
+
+void AppliedFiles::Add(const std::string& fingerprint, const std::string& operation) {
+	pending.push_back(pending_file {fingerprint, operation});
+}
+
+void AppliedFiles::Record() {
+	if (!enabled || pending.empty()) {
+		return;
+	}
+
+	// The batch is identified by its first file, which no other batch contains
+	const auto& batch_id = pending.front().fingerprint;
+	const auto applied_at = unix_seconds();
+
+	SqlBuilder sql;
+	sql << "INSERT INTO " << table_def {table.db_name, "main", TABLE_NAME} << " VALUES ";
+	sql.join(pending, ", ", [&](SqlBuilder& out, const pending_file& file) {
+		out << '(' << literal(table.schema_name) << ", " << literal(table.table_name) << ", "
+		    << literal(file.fingerprint) << ", " << literal(file.operation) << ", " << literal(batch_id);
+		out.format(", {})", applied_at);
+	});
+
+	const auto result = con.Query(sql.str());
+	if (result->HasError()) {
+		throw std::runtime_error("Could not record applied files for table <" + table.to_escaped_string() +
+		                         ">: " + result->GetError());
+	}
+	pending.clear();
+}
+
+std::int64_t AppliedFiles::CommittedChunks(const std::string& chunk_prefix) {
+	if (!enabled) {
+		return 0;
+	}
+
+	SqlBuilder sql;
+	sql << "SELECT COUNT(*) FROM " << table_def {table.db_name, "main", TABLE_NAME}
+	    << " WHERE schema_name = " << literal(table.schema_name) << " AND table_name = " << literal(table.table_name)
+	    << " AND starts_with(fingerprint, " << literal(chunk_prefix) << ')';
+	const auto result = con.Query(sql.str());
+	if (result->HasError()) {
+		throw std::runtime_error("Could not read committed chunks for table <" + table.to_escaped_string() +
+		                         ">: " + result->GetError());
+	}
+	return result->GetValue(0, 0).GetValue<int64_t>();
+}
+
+void AppliedFiles::RecordImmediately(const std::string& fingerprint, const std::string& operation) {
+	if (!enabled) {
+		return;
+	}
+
+	SqlBuilder sql;
+	sql << "INSERT INTO " << table_def {table.db_name, "main", TABLE_NAME} << " VALUES (" << literal(table.schema_name)
+	    << ", " << literal(table.table_name) << ", " << literal(fingerprint) << ", " << literal(operation) << ", "
+	    << literal(fingerprint);
+	sql.format(", {})", unix_seconds());
+
+	const auto result = con.Query(sql.str());
+	if (result->HasError()) {
+		throw std::runtime_error("Could not record applied chunk or file for table <" + table.to_escaped_string() +
+		                         ">: " + result->GetError());
+	}
+}
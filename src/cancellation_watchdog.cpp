@@ -0,0 +1,112 @@
+#include "cancellation_watchdog.hpp"
+
+#include "config.hpp"
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+CancellationWatchdog::options CancellationWatchdog::options::FromEnvironment() {
+	options opts;
+	const auto interval = config::env_int("MD_CANCELLATION_POLL_INTERVAL_MS", opts.interval.count());
+	opts.interval = std::chrono::milliseconds(std::max<std::int64_t>(10, interval));
+	return opts;
+}
+
+CancellationWatchdog::CancellationWatchdog(options opts_) : opts(std::move(opts_)) {
+	worker = std::thread([this]() { work(); });
+}
+
+CancellationWatchdog::~CancellationWatchdog() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	changed.notify_all();
+	worker.join();
+}
+
+CancellationWatchdog::Watch::Watch(CancellationWatchdog& watchdog_, std::string name, cancelled_fn is_cancelled,
+                                   const clock::time_point deadline)
+    : watchdog(watchdog_), request(std::make_unique<watched_request>()) {
+	request->name = std::move(name);
+	request->is_cancelled = std::move(is_cancelled);
+	request->deadline = deadline;
+	{
+		std::lock_guard<std::mutex> lock(watchdog.mutex);
+		watchdog.requests.insert(request.get());
+	}
+	watchdog.changed.notify_all();
+}
+
+CancellationWatchdog::Watch::~Watch() {
+	std::lock_guard<std::mutex> lock(watchdog.mutex);
+	watchdog.requests.erase(request.get());
+}
+
+void CancellationWatchdog::Watch::AddConnection(duckdb::Connection& con) {
+	std::lock_guard<std::mutex> lock(watchdog.mutex);
+	request->connections.push_back(&con);
+}
+
+void CancellationWatchdog::Watch::RemoveConnection(duckdb::Connection& con) {
+	std::lock_guard<std::mutex> lock(watchdog.mutex);
+	std::erase(request->connections, &con);
+}
+
+void CancellationWatchdog::Watch::Stop() {
+	std::lock_guard<std::mutex> lock(watchdog.mutex);
+	request->stopped = true;
+}
+
+bool CancellationWatchdog::Watch::Cancelled() const {
+	std::lock_guard<std::mutex> lock(watchdog.mutex);
+	return !request->reason.empty();
+}
+
+std::string CancellationWatchdog::Watch::Reason() const {
+	std::lock_guard<std::mutex> lock(watchdog.mutex);
+	return request->reason;
+}
+
+void CancellationWatchdog::work() {
+	auto logger = mdlog::Logger::CreateStdoutLogger();
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!stopping) {
+		if (requests.empty()) {
+			changed.wait(lock, [this]() { return stopping || !requests.empty(); });
+			continue;
+		}
+		changed.wait_for(lock, opts.interval);
+
+		const auto now = clock::now();
+		for (auto* request : requests) {
+			if (request->stopped) {
+				continue;
+			}
+			if (request->reason.empty()) {
+				if (request->is_cancelled && request->is_cancelled()) {
+					request->reason = "cancelled by the client";
+				} else if (now >= request->deadline) {
+					request->reason = "past its deadline";
+				} else {
+					continue;
+				}
+				logger.warning("CancellationWatchdog: request <" + request->name + "> is " + request->reason +
+				               ", interrupting its queries on " + std::to_string(request->connections.size()) +
+				               " connection(s)");
+			}
+			// Again on every poll until the request stops: an interrupt that
+			// arrives between two queries does not stop the next one
+			for (auto* con : request->connections) {
+				con->Interrupt();
+			}
+		}
+	}
+}
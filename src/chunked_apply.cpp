@@ -0,0 +1,116 @@
+#include "chunked_apply.hpp"
+
+#include "applied_files.hpp"
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+#include "retry_policy.hpp"
+#include "sql_builder.hpp"
+
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
+#include <string>
+
+namespace {
+/// Selects the rows of the current chunk, see ChunkedApply::Run. Temporary
+/// objects live on the client, so replacing it takes no round trip.
+constexpr const char* CHUNK_VIEW = "temp.main.\"__fivetran_ingest_chunk\"";
+
+/// Drops the chunk view however a run ends. A failed chunk has left its
+/// transaction open, which is rolled back first.
+class ChunkView {
+public:
+	ChunkView(duckdb::Connection& con_, mdlog::Logger& logger_) : con(con_), logger(logger_) {
+	}
+	ChunkView(const ChunkView&) = delete;
+	ChunkView& operator=(const ChunkView&) = delete;
+
+	~ChunkView() {
+		try {
+			if (con.HasActiveTransaction()) {
+				con.Rollback();
+			}
+		} catch (const std::exception& ex) {
+			logger.severe("ChunkedApply: could not roll back the failed chunk: " + std::string(ex.what()));
+			return;
+		}
+		const auto result = con.Query(std::string("DROP VIEW IF EXISTS ") + CHUNK_VIEW);
+		if (result->HasError()) {
+			// The next run replaces it
+			logger.severe("ChunkedApply: could not drop chunk view: " + result->GetError());
+		}
+	}
+
+private:
+	duckdb::Connection& con;
+	mdlog::Logger& logger;
+};
+} // namespace
+
+ChunkedApply::ChunkedApply(duckdb::Connection& con_, mdlog::Logger& logger_, AppliedFiles& applied_files_,
+                           const std::int64_t chunk_rows_, RetryPolicy* retry_policy_)
+    : con(con_), logger(logger_), applied_files(applied_files_), chunk_rows(chunk_rows_),
+      retry_policy(retry_policy_) {
+}
+
+void ChunkedApply::Run(const std::string& staging_table_name, const std::string& fingerprint,
+                       const std::string& operation, const apply_function& apply) {
+	if (con.HasActiveTransaction()) {
+		// Committing the caller's transaction, and what it holds, is up to the caller
+		throw std::runtime_error("ChunkedApply cannot run in a transaction, every chunk commits on its own");
+	}
+
+	const auto rows_result = con.Query("SELECT COUNT(*), MIN(rowid), MAX(rowid) FROM " + staging_table_name);
+	if (rows_result->HasError()) {
+		rows_result->ThrowError("Could not count the rows of staging table <" + staging_table_name + ">: ");
+	}
+	const auto rows = rows_result->GetValue(0, 0).GetValue<int64_t>();
+	// A reused staging table has been emptied, so its rowids start where those
+	// of the previous file ended
+	const auto first_rowid = rows > 0 ? rows_result->GetValue(1, 0).GetValue<int64_t>() : 0;
+	const auto rowids = rows > 0 ? rows_result->GetValue(2, 0).GetValue<int64_t>() - first_rowid + 1 : 0;
+	const auto chunks = (rowids + chunk_rows - 1) / chunk_rows;
+
+	// Chunks with a different size are not the same chunks
+	const auto chunk_prefix = fingerprint + "#" + std::to_string(chunk_rows) + "#";
+	const auto first_chunk = applied_files.CommittedChunks(chunk_prefix);
+	logger.info("ChunkedApply: " + std::to_string(rows) + " rows in " + std::to_string(chunks) + " chunks, " +
+	            std::to_string(first_chunk) + " of them committed before");
+
+	const ChunkView chunk_view(con, logger);
+	for (auto chunk = first_chunk; chunk < chunks; chunk++) {
+		bool attempted = false;
+		const auto apply_chunk = [&]() {
+			// The record of the chunk is its idempotency marker: a failed commit
+			// may have gone through after all
+			if (attempted && applied_files.CommittedChunks(chunk_prefix) > chunk) {
+				logger.info("ChunkedApply: chunk " + std::to_string(chunk + 1) + " was committed before");
+				return;
+			}
+			attempted = true;
+
+			con.BeginTransaction();
+			// The view is the apply function's staging table: the chunk is read
+			// where it was staged, without a copy
+			SqlBuilder view;
+			view << "CREATE OR REPLACE VIEW " << CHUNK_VIEW << " AS SELECT * FROM " << staging_table_name;
+			view.format(" WHERE rowid >= {} AND rowid < {}", first_rowid + chunk * chunk_rows,
+			            first_rowid + (chunk + 1) * chunk_rows);
+			const auto view_result = con.Query(view.str());
+			if (view_result->HasError()) {
+				view_result->ThrowError("Could not create chunk view: ");
+			}
+
+			apply(CHUNK_VIEW);
+			applied_files.RecordImmediately(chunk_prefix + std::to_string(chunk), operation + " chunk");
+			con.Commit();
+		};
+		if (retry_policy) {
+			retry_policy->Run(con, "chunk " + std::to_string(chunk + 1) + " of " + fingerprint,
+			                  RetryPolicy::idempotency::idempotent, apply_chunk);
+		} else {
+			apply_chunk();
+		}
+		logger.info("ChunkedApply: committed chunk " + std::to_string(chunk + 1) + " of " + std::to_string(chunks));
+	}
+}
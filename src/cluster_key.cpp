@@ -0,0 +1,52 @@
+#include "cluster_key.hpp"
+
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+std::vector<const column_def*> find_cluster_columns(const std::string& cluster_by, const std::string& table_name,
+                                                    const std::vector<column_def>& columns, mdlog::Logger& logger) {
+	std::optional<std::string> table_column;
+	std::optional<std::string> default_column;
+	for (auto entry : duckdb::StringUtil::Split(cluster_by, ',')) {
+		duckdb::StringUtil::Trim(entry);
+		const auto separator = entry.find('=');
+		if (separator == std::string::npos) {
+			default_column = entry;
+			continue;
+		}
+		auto entry_table = entry.substr(0, separator);
+		auto entry_column = entry.substr(separator + 1);
+		duckdb::StringUtil::Trim(entry_table);
+		duckdb::StringUtil::Trim(entry_column);
+		if (entry_table == table_name) {
+			table_column = entry_column;
+		}
+	}
+
+	const auto& column_name = table_column ? table_column : default_column;
+	if (!column_name || column_name->empty()) {
+		return {};
+	}
+
+	std::vector<const column_def*> cluster_columns;
+	for (const auto& col : columns) {
+		if (col.name == *column_name) {
+			return {&col};
+		}
+		if (col.primary_key) {
+			cluster_columns.push_back(&col);
+		}
+	}
+	if (*column_name == CLUSTER_BY_PRIMARY_KEY) {
+		return cluster_columns;
+	}
+
+	logger.warning("Table " + table_name + " has no column \"" + *column_name +
+	               "\" to cluster by, writing rows in file order");
+	return {};
+}
@@ -0,0 +1,44 @@
+#include "config.hpp"
+
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <optional>
+#include <string>
+
+namespace config {
+std::optional<std::string> env_string(const char* name) {
+	const char* value = std::getenv(name);
+	if (value == nullptr) {
+		return std::nullopt;
+	}
+	return std::string(value);
+}
+
+std::int64_t env_int(const char* name, const std::int64_t default_value) {
+	const auto value = env_string(name);
+	if (!value || value->empty()) {
+		return default_value;
+	}
+	try {
+		return std::stoll(*value);
+	} catch (const std::exception&) {
+		return default_value;
+	}
+}
+
+bool env_bool(const char* name, const bool default_value) {
+	auto value = env_string(name).value_or("");
+	for (auto& c : value) {
+		c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+	}
+	if (value == "true" || value == "1") {
+		return true;
+	}
+	if (value == "false" || value == "0") {
+		return false;
+	}
+	return default_value;
+}
+} // namespace config
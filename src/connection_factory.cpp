@@ -1,15 +1,39 @@
 #include "connection_factory.hpp"
 
+#include "applied_files.hpp"
 #include "config.hpp"
+#include "connection_pool.hpp"
 #include "duckdb.hpp"
 #include "md_error.hpp"
+#include "md_logging.hpp"
+#include "openssl_helper.hpp"
+#include "resource_governor.hpp"
+#include "sql_generator.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <exception>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
-#include <stdexcept>
+#include <optional>
 #include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
 
 namespace {
+/// Staging and bookkeeping tables older than this are considered leaked. No
+/// batch runs anywhere near this long.
+constexpr std::chrono::hours LEAKED_TABLE_MAX_AGE {24};
+/// Fivetran retries a failed request within minutes, records of applied files
+/// are not needed for longer than this
+constexpr std::chrono::hours APPLIED_FILES_MAX_AGE {7 * 24};
+
 void maybe_rewrite_error(const std::exception& ex, const std::string& db_name) {
 	const duckdb::ErrorData error(ex);
 	const auto& msg = error.Message();
@@ -31,60 +55,261 @@ void maybe_rewrite_error(const std::exception& ex, const std::string& db_name) {
 }
 } // namespace
 
-duckdb::DuckDB& ConnectionFactory::get_duckdb(const std::string& md_auth_token, const std::string& db_name) {
-	auto initialize_db = [this, &md_auth_token, &db_name]() {
-		duckdb::DBConfig config;
-		config.SetOptionByName(config::PROP_TOKEN, md_auth_token);
-		config.SetOptionByName("custom_user_agent", std::string("fivetran/") + GIT_COMMIT_SHA);
-		config.SetOptionByName("old_implicit_casting", true);
-		config.SetOptionByName("motherduck_attach_mode", "single");
-
-		try {
-			stdout_logger.info("get_duckdb: creating database instance");
-			db = duckdb::DuckDB("md:" + db_name, &config);
-		} catch (std::exception& ex) {
-			maybe_rewrite_error(ex, db_name);
-			throw;
+ConnectionFactory::options ConnectionFactory::options::FromEnvironment() {
+	options opts;
+	// A container usually serves a single destination, whose instance gets all
+	// of the memory unless more instances are configured
+	const bool multiple_instances = config::env_string("MD_MAX_INSTANCES").has_value();
+	const auto max_instances = config::env_int("MD_MAX_INSTANCES", static_cast<std::int64_t>(opts.max_instances));
+	opts.max_instances = static_cast<std::size_t>(std::max<std::int64_t>(1, max_instances));
+	const auto max_idle_seconds = config::env_int("MD_INSTANCE_MAX_IDLE_SECONDS", opts.max_idle_time.count());
+	opts.max_idle_time = std::chrono::seconds(std::max<std::int64_t>(0, max_idle_seconds));
+
+	const auto limits = resource_governor::ReadCgroupLimits();
+	const auto budget = resource_governor::Budget(limits, multiple_instances ? opts.max_instances : 1);
+	opts.instance_memory_limit = budget.memory_limit;
+	opts.instance_threads = budget.threads;
+	// Set but empty restores DuckDB's default
+	if (auto memory_limit = config::env_string("MD_INSTANCE_MEMORY_LIMIT")) {
+		opts.instance_memory_limit = std::move(*memory_limit);
+	}
+	const auto threads = config::env_int("MD_INSTANCE_THREADS", static_cast<std::int64_t>(opts.instance_threads));
+	opts.instance_threads = static_cast<std::size_t>(std::max<std::int64_t>(0, threads));
+	if (auto temp_directory = config::env_string("MD_TEMP_DIRECTORY")) {
+		opts.temp_directory = std::move(*temp_directory);
+	} else {
+		std::error_code ec;
+		const auto system_temp = std::filesystem::temp_directory_path(ec);
+		if (!ec) {
+			opts.temp_directory = (system_temp / "motherduck_destination").string();
 		}
+	}
+	opts.pool = ConnectionPool::options::FromEnvironment();
 
-		duckdb::Connection con(db);
-		// Trigger welcome pack fetch, but do not raise errors
-		const auto welcome_pack_res = con.Query("FROM md_welcome_messages()");
-		if (welcome_pack_res->HasError()) {
-			stdout_logger.severe("get_duckdb: Could not fetch welcome pack: " + welcome_pack_res->GetError());
-		} else {
-			stdout_logger.info("get_duckdb: fetched welcome pack");
+	mdlog::Logger::CreateStdoutLogger().info(
+	    "resources: cgroup limits " + (limits.cpus ? std::to_string(*limits.cpus) : "no") + " CPUs and " +
+	    (limits.memory_bytes ? resource_governor::FormatMemoryLimit(*limits.memory_bytes) : "no memory limit") +
+	    ", each of up to " + std::to_string(opts.max_instances) + " instances gets threads=" +
+	    (opts.instance_threads ? std::to_string(opts.instance_threads) : "default") + ", memory_limit=" +
+	    (opts.instance_memory_limit.empty() ? "default" : opts.instance_memory_limit) + ", temp_directory=" +
+	    (opts.temp_directory.empty() ? "default" : opts.temp_directory));
+	return opts;
+}
+
+ConnectionFactory::ConnectionFactory(options opts_, create_instance_fn create_instance_)
+    : stdout_logger(mdlog::Logger::CreateStdoutLogger()), opts(std::move(opts_)),
+      create_instance(std::move(create_instance_)) {
+}
+
+ConnectionFactory::~ConnectionFactory() {
+	std::lock_guard<std::mutex> lock(closing_mutex);
+	for (auto& future : closing) {
+		future.wait();
+	}
+}
+
+std::shared_ptr<duckdb::DuckDB> ConnectionFactory::CreateMotherDuckInstance(const std::string& md_auth_token,
+                                                                            const std::string& db_name,
+                                                                            const instance_settings& settings) {
+	auto stdout_logger = mdlog::Logger::CreateStdoutLogger();
+	duckdb::DBConfig config;
+	config.SetOptionByName(config::PROP_TOKEN, md_auth_token);
+	config.SetOptionByName("custom_user_agent", std::string("fivetran/") + GIT_COMMIT_SHA);
+	config.SetOptionByName("old_implicit_casting", true);
+	config.SetOptionByName("motherduck_attach_mode", "single");
+	if (!settings.memory_limit.empty()) {
+		config.SetOptionByName("memory_limit", settings.memory_limit);
+	}
+	if (settings.threads > 0) {
+		config.SetOptionByName("threads", static_cast<std::int64_t>(settings.threads));
+	}
+	if (!settings.temp_directory.empty()) {
+		config.SetOptionByName("temp_directory", settings.temp_directory);
+	}
+
+	std::shared_ptr<duckdb::DuckDB> db;
+	try {
+		stdout_logger.info("get_duckdb: creating database instance");
+		// The motherduck extension has been installed by preload_extensions, so
+		// every instance loads the same binary
+		db = std::make_shared<duckdb::DuckDB>("md:" + db_name, &config);
+	} catch (std::exception& ex) {
+		maybe_rewrite_error(ex, db_name);
+		throw;
+	}
+
+	duckdb::Connection con(*db);
+	// Trigger welcome pack fetch, but do not raise errors
+	const auto welcome_pack_res = con.Query("FROM md_welcome_messages()");
+	if (welcome_pack_res->HasError()) {
+		stdout_logger.severe("get_duckdb: Could not fetch welcome pack: " + welcome_pack_res->GetError());
+	} else {
+		stdout_logger.info("get_duckdb: fetched welcome pack");
+	}
+
+	// Set default_collation to a connection-specific default value which
+	// overwrites any global setting and ensures that client-side planning and
+	// server-side execution use the same collation.
+	const auto set_collation_res = con.Query("SET GLOBAL default_collation=''");
+	if (set_collation_res->HasError()) {
+		stdout_logger.severe("get_duckdb: Could not SET default_collation: " + set_collation_res->GetError());
+	}
+
+	// Pooled connections create their loggers without enabling logging
+	if (mdlog::Logger::DuckDBLoggingEnabled()) {
+		mdlog::Logger::EnableDuckDBLogging(con);
+	}
+
+	// Clean up after processes that crashed or were killed in the middle of a
+	// batch. Two round trips that an instance re-created after eviction does
+	// not need to repeat.
+	if (settings.clean_up) {
+		MdSqlGenerator(stdout_logger).drop_leaked_temp_tables(con, LEAKED_TABLE_MAX_AGE);
+		AppliedFiles::Initialize(con, stdout_logger, APPLIED_FILES_MAX_AGE);
+	}
+	return db;
+}
+
+std::string ConnectionFactory::InstanceKey(const std::string& md_auth_token, const std::string& db_name) {
+	// Tokens are not kept as keys, a leaked key identifies no token
+	return openssl_helper::sha256_hex(md_auth_token) + '\0' + db_name;
+}
+
+std::shared_ptr<ConnectionPool> ConnectionFactory::get_pool(const std::string& md_auth_token,
+                                                            const std::string& db_name) {
+	const auto key = InstanceKey(md_auth_token, db_name);
+
+	std::shared_ptr<instance> entry;
+	std::vector<std::shared_ptr<instance>> evicted;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto& slot = instances[key];
+		if (!slot) {
+			slot = std::make_shared<instance>();
+			slot->db_name = db_name;
 		}
+		slot->last_used = ++use_count;
+		slot->last_used_at = std::chrono::steady_clock::now();
+		entry = slot;
+		evicted = evict_instances();
+	}
+	close_instances(std::move(evicted));
 
-		// Set default_collation to a connection-specific default value which
-		// overwrites any global setting and ensures that client-side planning and
-		// server-side execution use the same collation.
-		const auto set_collation_res = con.Query("SET GLOBAL default_collation=''");
-		if (set_collation_res->HasError()) {
-			stdout_logger.severe("get_duckdb: Could not SET default_collation: " + set_collation_res->GetError());
+	// Instances of other tokens and databases are not held up while this one
+	// is created. If creating it fails, the next request tries again.
+	std::call_once(entry->init_flag, [&]() {
+		instance_settings settings {opts.instance_memory_limit, opts.instance_threads, "", true};
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			settings.clean_up = !cleaned_up_instances.contains(key);
+			if (!opts.temp_directory.empty()) {
+				settings.temp_directory = opts.temp_directory + "/instance_" + std::to_string(++created_instances);
+			}
 		}
+		auto db = create_instance(md_auth_token, db_name, settings);
+		auto pool = ConnectionPool::Create(std::move(db), opts.pool);
+		std::lock_guard<std::mutex> lock(mutex);
+		entry->pool = std::move(pool);
+		cleaned_up_instances.insert(key);
+	});
 
-		initial_md_token = md_auth_token;
-		initial_db_name = db_name;
-	};
+	std::lock_guard<std::mutex> lock(mutex);
+	return entry->pool;
+}
 
-	std::call_once(db_init_flag, initialize_db);
+std::vector<std::shared_ptr<ConnectionFactory::instance>> ConnectionFactory::evict_instances() {
+	// Only instances that nobody uses: no connection is checked out and no
+	// request is creating or about to use them
+	const auto unused = [](const std::shared_ptr<instance>& entry) {
+		return entry.use_count() == 1 && (!entry->pool || entry->pool.use_count() == 1);
+	};
 
-	if (md_auth_token != initial_md_token) {
-		throw std::runtime_error("Trying to connect to MotherDuck with a different "
-		                         "token than initially provided");
+	std::vector<std::shared_ptr<instance>> evicted;
+	const auto idle_since = std::chrono::steady_clock::now() - opts.max_idle_time;
+	for (auto it = instances.begin(); it != instances.end();) {
+		if (unused(it->second) && it->second->last_used_at < idle_since) {
+			evicted.push_back(std::move(it->second));
+			it = instances.erase(it);
+		} else {
+			++it;
+		}
 	}
 
-	if (db_name != initial_db_name) {
-		throw std::runtime_error("Trying to connect to a different MotherDuck database (" + db_name +
-		                         ") than on the initial connection (" + initial_db_name + ")");
+	while (instances.size() > opts.max_instances) {
+		auto lru = instances.end();
+		for (auto it = instances.begin(); it != instances.end(); ++it) {
+			const auto& entry = it->second;
+			if (!unused(entry)) {
+				continue;
+			}
+			if (lru == instances.end() || entry->last_used < lru->second->last_used) {
+				lru = it;
+			}
+		}
+		if (lru == instances.end()) {
+			break;
+		}
+		evicted.push_back(std::move(lru->second));
+		instances.erase(lru);
 	}
+	return evicted;
+}
 
-	return db;
+void ConnectionFactory::close_instances(std::vector<std::shared_ptr<instance>> evicted) {
+	std::lock_guard<std::mutex> lock(closing_mutex);
+	std::erase_if(closing, [](const std::future<void>& future) {
+		return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	});
+	if (evicted.empty()) {
+		return;
+	}
+	stdout_logger.info("get_duckdb: closing " + std::to_string(evicted.size()) + " unused instance(s)");
+	// The last reference to each instance, so that the requests that triggered
+	// this do not wait for it
+	closing.push_back(std::async(std::launch::async, [evicted = std::move(evicted)]() mutable { evicted.clear(); }));
 }
 
 duckdb::Connection ConnectionFactory::CreateConnection(const std::string& md_auth_token, const std::string& db_name) {
 	stdout_logger.info("create_connection: start");
-	duckdb::DuckDB& db = get_duckdb(md_auth_token, db_name);
-	return duckdb::Connection(db);
+	const auto pool = get_pool(md_auth_token, db_name);
+	return duckdb::Connection(pool->Database());
+}
+
+ConnectionPool::Lease ConnectionFactory::AcquireConnection(const std::string& md_auth_token,
+                                                           const std::string& db_name) {
+	const auto start = std::chrono::steady_clock::now();
+	auto lease = get_pool(md_auth_token, db_name)->Acquire();
+	std::call_once(first_connection_flag, [&]() {
+		const auto now = std::chrono::steady_clock::now();
+		stdout_logger.info(
+		    "create_connection: first request connection after " +
+		    std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(now - created_at).count()) +
+		    " ms since start, of which the request waited " +
+		    std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count()) + " ms");
+	});
+	return lease;
+}
+
+std::optional<ConnectionPool::Lease> ConnectionFactory::TryAcquireConnection(const std::string& md_auth_token,
+                                                                            const std::string& db_name) {
+	return get_pool(md_auth_token, db_name)->TryAcquire();
+}
+
+void ConnectionFactory::WarmUp(const std::string& md_auth_token, const std::string& db_name,
+                               const std::size_t connections) {
+	const auto start = std::chrono::steady_clock::now();
+	get_pool(md_auth_token, db_name)->Prefill(connections);
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+	stdout_logger.info(
+	    "warm_up: database instance and up to " + std::to_string(connections) + " connection(s) ready after " +
+	    std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()) + " ms");
+}
+
+std::size_t ConnectionFactory::InstanceCount() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return instances.size();
+}
+
+ConnectionPool::stats ConnectionFactory::PoolStats(const std::string& md_auth_token, const std::string& db_name) {
+	return get_pool(md_auth_token, db_name)->Stats();
 }
@@ -0,0 +1,167 @@
+#include "connection_pool.hpp"
+
+#include "config.hpp"
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+ConnectionPool::options ConnectionPool::options::FromEnvironment() {
+	options opts;
+	const auto max_idle = config::env_int("MD_CONNECTION_POOL_SIZE", static_cast<std::int64_t>(opts.max_idle));
+	opts.max_idle = static_cast<std::size_t>(std::max<std::int64_t>(0, max_idle));
+	const auto max_open = config::env_int("MD_CONNECTION_POOL_MAX_OPEN", static_cast<std::int64_t>(opts.max_open));
+	// A request needs one connection. It only takes a second one if it is free,
+	// see StagingPipeline.
+	opts.max_open = static_cast<std::size_t>(std::max<std::int64_t>(1, max_open));
+	return opts;
+}
+
+ConnectionPool::Lease::Lease(std::shared_ptr<ConnectionPool> pool_, pooled_connection entry_,
+                             const std::chrono::steady_clock::duration wait_time_)
+    : pool(std::move(pool_)), entry(std::make_unique<pooled_connection>(std::move(entry_))), wait_time(wait_time_) {
+}
+
+ConnectionPool::Lease::Lease(Lease&& other) noexcept
+    : pool(std::move(other.pool)), entry(std::move(other.entry)), wait_time(other.wait_time),
+      reset_settings(std::move(other.reset_settings)), discard(other.discard) {
+}
+
+ConnectionPool::Lease::~Lease() {
+	if (pool && entry) {
+		pool->release(std::move(*entry), reset_settings, discard);
+	}
+}
+
+void ConnectionPool::Lease::ResetOnReturn(const std::string& setting) {
+	if (std::find(reset_settings.begin(), reset_settings.end(), setting) == reset_settings.end()) {
+		reset_settings.push_back(setting);
+	}
+}
+
+std::shared_ptr<ConnectionPool> ConnectionPool::Create(std::shared_ptr<duckdb::DuckDB> db, options opts) {
+	return std::shared_ptr<ConnectionPool>(new ConnectionPool(std::move(db), std::move(opts)));
+}
+
+ConnectionPool::ConnectionPool(std::shared_ptr<duckdb::DuckDB> db_, options opts_)
+    : db(std::move(db_)), opts(std::move(opts_)) {
+}
+
+ConnectionPool::pooled_connection ConnectionPool::open_connection() {
+	pooled_connection entry {std::make_unique<duckdb::Connection>(*db), {}};
+	if (opts.fetch_client_ids) {
+		entry.ids = mdlog::ClientIds::Fetch(*entry.con);
+	}
+	return entry;
+}
+
+ConnectionPool::Lease ConnectionPool::Acquire() {
+	const auto start = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(mutex);
+	if (idle.empty() && open >= opts.max_open) {
+		waits++;
+		returned.wait(lock, [this]() { return !idle.empty() || open < opts.max_open; });
+	}
+	const auto waited = std::chrono::steady_clock::now() - start;
+	wait_time += waited;
+	return check_out(lock, waited);
+}
+
+std::optional<ConnectionPool::Lease> ConnectionPool::TryAcquire() {
+	std::unique_lock<std::mutex> lock(mutex);
+	if (idle.empty() && open >= opts.max_open) {
+		return std::nullopt;
+	}
+	return check_out(lock, std::chrono::steady_clock::duration {0});
+}
+
+ConnectionPool::Lease ConnectionPool::check_out(std::unique_lock<std::mutex>& lock,
+                                                const std::chrono::steady_clock::duration waited) {
+	if (!idle.empty()) {
+		auto entry = std::move(idle.back());
+		idle.pop_back();
+		reused++;
+		return Lease(shared_from_this(), std::move(entry), waited);
+	}
+
+	open++;
+	created++;
+	lock.unlock();
+	try {
+		return Lease(shared_from_this(), open_connection(), waited);
+	} catch (...) {
+		lock.lock();
+		open--;
+		returned.notify_one();
+		throw;
+	}
+}
+
+void ConnectionPool::Prefill(const std::size_t count) {
+	const auto target = std::min(count, opts.max_idle);
+	while (true) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (idle.size() >= target || open >= opts.max_open) {
+				return;
+			}
+			open++;
+			created++;
+		}
+		pooled_connection entry;
+		try {
+			entry = open_connection();
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(mutex);
+			open--;
+			throw;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		idle.push_back(std::move(entry));
+		returned.notify_one();
+	}
+}
+
+void ConnectionPool::release(pooled_connection entry, const std::vector<std::string>& reset_settings,
+                             bool discard) {
+	auto& con = *entry.con;
+	try {
+		if (!discard && con.HasActiveTransaction() && !con.IsAutoCommit()) {
+			con.Rollback();
+		}
+		for (const auto& setting : reset_settings) {
+			if (discard) {
+				break;
+			}
+			discard = con.Query("RESET " + setting)->HasError();
+		}
+	} catch (const std::exception&) {
+		discard = true;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	if (discard || idle.size() >= opts.max_idle) {
+		open--;
+		lock.unlock();
+		// Closed outside of the lock
+		entry.con.reset();
+	} else {
+		idle.push_back(std::move(entry));
+	}
+	returned.notify_one();
+}
+
+ConnectionPool::stats ConnectionPool::Stats() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return stats {idle.size(), open, created, reused, waits, wait_time};
+}
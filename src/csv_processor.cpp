@@ -6,8 +6,10 @@
 #include "md_error.hpp"
 #include "md_logging.hpp"
 #include "memory_backed_file.hpp"
+#include "retry_policy.hpp"
 #include "schema_types.hpp"
 #include "sql_generator.hpp"
+#include "staging_tables.hpp"
 
 #include <fstream>
 #include <functional>
@@ -16,7 +18,9 @@
 #include <optional>
 #include <stdexcept>
 #include <string>
+#include <system_error>
 #include <unistd.h>
+#include <utility>
 
 #ifdef __linux__
 #include <fcntl.h>
@@ -255,83 +259,171 @@ std::string generate_read_csv_query(const std::string& filepath, const IngestPro
 
 	return query.str();
 }
-} // namespace
+/// A CSV file that is ready to be read by DuckDB: decrypted into memory if
+/// necessary, with its compression detected
+struct csv_source {
+	// Only set if the file is encrypted, keeps the decrypted data alive
+	std::optional<MemoryBackedFile> temp_file;
+	std::string path;
+	CompressionType compression;
+};
 
-namespace csv_processor {
-void ProcessFile(duckdb::Connection& con, const IngestProperties& props, mdlog::Logger& logger,
-                 const std::function<void(const std::string&)>& process_staging_table) {
+csv_source open_csv_source(const IngestProperties& props, const mdlog::Logger& logger) {
 	validate_file(props.filename);
 	logger.info("    validated file " + props.filename);
 
+	csv_source source;
 	const auto is_file_encrypted = !props.decryption_key.empty();
-	std::string decrypted_file_path;
-	// Only used if file is encrypted to ensure MemoryBackedFile lives long enough
-	std::optional<MemoryBackedFile> temp_file;
 	if (is_file_encrypted) {
-		temp_file = decrypt_file_into_memory(props.filename, props.decryption_key);
-		decrypted_file_path = temp_file.value().path;
-		logger.info("    wrote decrypted data to ephemeral memory-backed storage " + decrypted_file_path);
+		source.temp_file = decrypt_file_into_memory(props.filename, props.decryption_key);
+		source.path = source.temp_file.value().path;
+		logger.info("    wrote decrypted data to ephemeral memory-backed storage " + source.path);
 	} else {
-		decrypted_file_path = props.filename;
+		source.path = props.filename;
 		logger.info("    file is not encrypted");
 	}
 
-	if (temp_file.has_value()) {
-		reset_file_cursor(temp_file.value().fd);
+	if (source.temp_file.has_value()) {
+		reset_file_cursor(source.temp_file.value().fd);
 	}
 
-	const auto compression = determine_compression_type(decrypted_file_path);
+	source.compression = determine_compression_type(source.path);
 
 	// The last function call read four bytes. Reset to the beginning again.
-	if (temp_file.has_value()) {
-		reset_file_cursor(temp_file.value().fd);
+	if (source.temp_file.has_value()) {
+		reset_file_cursor(source.temp_file.value().fd);
 	}
 
-	bool should_commit = false;
-	if (!con.HasActiveTransaction()) {
-		con.BeginTransaction();
-		should_commit = true;
+	return source;
+}
+
+/// Throws the error of a query that read the CSV file of `props`
+[[noreturn]] void throw_read_csv_error(duckdb::QueryResult& result, const IngestProperties& props,
+                                       const std::string& prefix) {
+	const auto& error_msg = result.GetError();
+	if (error_msg.find("Change the maximum length size, e.g., max_line_size=") != std::string::npos) {
+		throw md_error::RecoverableError("A data record was too large to be processed. To fix this, increase the "
+		                                 "\"Max Record Size (MiB)\" in the "
+		                                 "connector configuration. Original error:" +
+		                                 error_msg);
 	}
+	result.ThrowError(prefix + " <" + props.filename + ">: ");
+}
 
-	MdSqlGenerator sql_generator(logger);
-	const std::string staging_table_name = sql_generator.generate_temp_table_name(con, "__fivetran_ingest_staging");
-
-	// Create staging table in remote database. We upload all data anyway, and
-	// this way we make sure that all processing happens remotely.
-	const auto final_query = "CREATE TABLE " + staging_table_name + " AS " +
-	                         generate_read_csv_query(decrypted_file_path, props, compression, logger);
-	logger.info("    creating staging table: " + final_query);
-	const auto create_staging_table_res = con.Query(final_query);
-	if (create_staging_table_res->HasError()) {
-		const auto& error_msg = create_staging_table_res->GetError();
-		if (error_msg.find("Change the maximum length size, e.g., max_line_size=") != std::string::npos) {
-			throw md_error::RecoverableError("A data record was too large to be processed. To fix this, increase the "
-			                                 "\"Max Record Size (MiB)\" in the "
-			                                 "connector configuration. Original error:" +
-			                                 error_msg);
+/// Fills a staging table with `source_query` and calls `process_staging_table`
+/// with it. Without `staging_tables`, the table is created for this file and
+/// dropped again. Runs in its own transaction unless `con` already has one.
+void process_staging_query(duckdb::Connection& con, const std::string& source_query, const IngestProperties& props,
+                           mdlog::Logger& logger,
+                           const std::function<void(const std::string&)>& process_staging_table,
+                           StagingTables* staging_tables, RetryPolicy* retry_policy) {
+	const bool should_commit = !con.HasActiveTransaction();
+
+	StagingTables::staging_table staging;
+	const auto fill = [&]() {
+		if (should_commit) {
+			con.BeginTransaction();
+		}
+		// A retry fills the same table again: a reused one still exists, and
+		// so does a new one if the failed attempt committed it (see
+		// ChunkedApply)
+		if (staging.name.empty()) {
+			if (staging_tables) {
+				staging = staging_tables->Acquire(props);
+			} else {
+				staging.name = MdSqlGenerator(logger).generate_temp_table_name(con, "__fivetran_ingest_staging");
+			}
 		}
-		create_staging_table_res->ThrowError("Failed to create staging table for CSV file <" + props.filename + ">: ");
-	}
-	logger.info("    staging table created for file " + props.filename);
 
-	// `read_csv` opened and read the file for binding. Reset the file cursor
-	// again for execution.
-	if (temp_file.has_value()) {
-		reset_file_cursor(temp_file.value().fd);
-	}
+		// Fill the staging table in the remote database. We upload all data
+		// anyway, and this way we make sure that all processing happens remotely.
+		const auto final_query = staging.reused
+		                             ? "TRUNCATE " + staging.name + "; INSERT INTO " + staging.name + " " + source_query
+		                             : "CREATE OR REPLACE TABLE " + staging.name + " AS " + source_query;
+		logger.info("    filling staging table: " + final_query);
+		const auto create_staging_table_res = con.Query(final_query);
+		if (create_staging_table_res->HasError()) {
+			throw_read_csv_error(*create_staging_table_res, props, "Failed to create staging table for CSV file");
+		}
+		logger.info("    staging table filled for file " + props.filename);
+	};
+
+	const auto process = [&]() {
+		// Only the fill is retried on its own: the staging table is not visible
+		// to anyone else, so it is safe to fill it again
+		if (retry_policy && should_commit) {
+			retry_policy->Run(con, "filling staging table for " + props.filename,
+			                  RetryPolicy::idempotency::idempotent, fill);
+		} else {
+			fill();
+		}
 
-	process_staging_table(staging_table_name);
-	logger.info("    CSV file " + props.filename + " processed successfully");
+		process_staging_table(staging.name);
+		logger.info("    CSV file " + props.filename + " processed successfully");
 
-	const auto drop_staging_table_res = con.Query("DROP TABLE " + staging_table_name);
-	if (drop_staging_table_res->HasError()) {
-		logger.severe("Failed to drop temporary table <" + staging_table_name + "> after processing CSV file <" +
-		              props.filename + ">: " + drop_staging_table_res->GetError());
+		if (!staging_tables) {
+			const auto drop_staging_table_res = con.Query("DROP TABLE " + staging.name);
+			if (drop_staging_table_res->HasError()) {
+				logger.severe("Failed to drop temporary table <" + staging.name + "> after processing CSV file <" +
+				              props.filename + ">: " + drop_staging_table_res->GetError());
+			}
+		}
+
+		if (should_commit) {
+			// This throws any errors during commit
+			con.Commit();
+		}
+		// Only released once committed, a new table does not exist otherwise
+		if (staging_tables) {
+			staging_tables->Release(std::move(staging));
+		}
+	};
+
+	if (retry_policy && should_commit) {
+		// After a conflict, the file is staged again from its decrypted source
+		// and applied in a new transaction. Other errors may leave it unknown
+		// whether the commit went through, so they are not retried here.
+		retry_policy->Run(con, "applying " + props.filename, RetryPolicy::idempotency::not_idempotent, process);
+	} else {
+		process();
 	}
+}
+} // namespace
 
-	if (should_commit) {
-		// This throws any errors during commit
-		con.Commit();
+namespace csv_processor {
+void ProcessFile(duckdb::Connection& con, const IngestProperties& props, mdlog::Logger& logger,
+                 const std::function<void(const std::string&)>& process_staging_table,
+                 StagingTables* staging_tables, RetryPolicy* retry_policy) {
+	const auto source = open_csv_source(props, logger);
+	process_staging_query(con, generate_read_csv_query(source.path, props, source.compression, logger), props, logger,
+	                      process_staging_table, staging_tables, retry_policy);
+}
+
+ConvertedFile::ConvertedFile(MemoryBackedFile file_) : file(std::move(file_)) {
+}
+
+ConvertedFile ConvertFile(duckdb::Connection& con, const IngestProperties& props, mdlog::Logger& logger) {
+	const auto source = open_csv_source(props, logger);
+
+	ConvertedFile converted(MemoryBackedFile::Create(0));
+	// COPY would write to a temporary file next to /dev/fd/<n> and rename it
+	const auto query = "COPY (" + generate_read_csv_query(source.path, props, source.compression, logger) + ") TO " +
+	                   duckdb::KeywordHelper::WriteQuoted(converted.Path(), '\'') +
+	                   " (FORMAT parquet, USE_TMP_FILE false)";
+	logger.info("    converting file: " + query);
+	const auto result = con.Query(query);
+	if (result->HasError()) {
+		throw_read_csv_error(*result, props, "Failed to convert CSV file");
 	}
+	logger.info("    converted file " + props.filename + " to ephemeral memory-backed storage " + converted.Path());
+	return converted;
+}
+
+void ProcessConvertedFile(duckdb::Connection& con, const ConvertedFile& file, const IngestProperties& props,
+                          mdlog::Logger& logger,
+                          const std::function<void(const std::string&)>& process_staging_table,
+                          StagingTables* staging_tables, RetryPolicy* retry_policy) {
+	process_staging_query(con, "FROM read_parquet(" + duckdb::KeywordHelper::WriteQuoted(file.Path(), '\'') + ")",
+	                      props, logger, process_staging_table, staging_tables, retry_policy);
 }
-} // namespace csv_processor
\ No newline at end of file
+} // namespace csv_processor
@@ -3,10 +3,15 @@
 #include "openssl_helper.hpp"
 
 #include <cassert>
+#include <cerrno>
+#include <filesystem>
 #include <fstream>
 #include <limits>
 #include <openssl/evp.h>
 #include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wsign-conversion"
@@ -70,4 +75,49 @@ std::vector<unsigned char> decrypt_file(const std::string& filename, const unsig
 	return decrypt_stream(file, filename, decryption_key);
 }
 
+std::string file_fingerprint(const std::string& filename, const std::string& decryption_key) {
+	std::ifstream file(filename, std::ios::binary);
+	if (file.fail()) {
+		throw std::system_error(errno, std::generic_category(), "Failed to open file <" + filename + ">");
+	}
+
+	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+	if (!ctx) {
+		openssl_helper::raise_openssl_error("Failed to create digest context");
+	}
+	openssl_helper::MdCtxDeleter ctx_deleter(ctx);
+	if (1 != EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr)) {
+		openssl_helper::raise_openssl_error("Failed to initialize digest of file " + filename);
+	}
+
+	const auto update = [ctx, &filename](const void* data, const size_t size) {
+		if (1 != EVP_DigestUpdate(ctx, data, size)) {
+			openssl_helper::raise_openssl_error("Failed to compute digest of file " + filename);
+		}
+	};
+
+	if (!decryption_key.empty()) {
+		constexpr int iv_length = 16;
+		char iv[iv_length] = {};
+		file.read(iv, iv_length);
+		const auto file_size = std::filesystem::file_size(filename);
+		update(decryption_key.data(), decryption_key.size());
+		update(iv, static_cast<size_t>(file.gcount()));
+		update(&file_size, sizeof(file_size));
+	} else {
+		std::vector<char> buffer(1 << 20);
+		while (file.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) || file.gcount() > 0) {
+			update(buffer.data(), static_cast<size_t>(file.gcount()));
+		}
+	}
+
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_length = 0;
+	if (1 != EVP_DigestFinal_ex(ctx, digest, &digest_length)) {
+		openssl_helper::raise_openssl_error("Failed to finalize digest of file " + filename);
+	}
+
+	return openssl_helper::to_hex(digest, digest_length);
+}
+
 #pragma GCC diagnostic pop
\ No newline at end of file
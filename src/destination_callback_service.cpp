@@ -0,0 +1,159 @@
+#include "destination_callback_service.hpp"
+
+#include "config.hpp"
+#include "destination_sdk.grpc.pb.h"
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+#include "motherduck_destination_server.hpp"
+#include "request_executor.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <grpcpp/grpcpp.h>
+#include <map>
+#include <string>
+
+namespace {
+/// Parses "WriteBatch=4, Migrate=1". Entries that do not parse are logged and
+/// ignored.
+std::map<std::string, std::size_t> parse_method_limits(const std::string& value) {
+	std::map<std::string, std::size_t> limits;
+	for (auto entry : duckdb::StringUtil::Split(value, ',')) {
+		duckdb::StringUtil::Trim(entry);
+		const auto separator = entry.find('=');
+		if (separator == std::string::npos) {
+			mdlog::Logger::CreateStdoutLogger().warning("Ignoring method limit without a value: " + entry);
+			continue;
+		}
+		auto method = entry.substr(0, separator);
+		auto limit = entry.substr(separator + 1);
+		duckdb::StringUtil::Trim(method);
+		duckdb::StringUtil::Trim(limit);
+		try {
+			limits[method] = std::max<std::size_t>(1, std::stoul(limit));
+		} catch (const std::exception&) {
+			mdlog::Logger::CreateStdoutLogger().warning("Ignoring method limit that is not a number: " + entry);
+		}
+	}
+	return limits;
+}
+} // namespace
+
+DestinationCallbackService::options DestinationCallbackService::options::FromEnvironment() {
+	options opts;
+	const auto metadata_threads =
+	    config::env_int("MD_METADATA_THREADS", static_cast<std::int64_t>(opts.metadata_threads));
+	opts.metadata_threads = static_cast<std::size_t>(std::max<std::int64_t>(1, metadata_threads));
+	const auto write_threads = config::env_int("MD_WRITE_THREADS", static_cast<std::int64_t>(opts.write_threads));
+	opts.write_threads = static_cast<std::size_t>(std::max<std::int64_t>(1, write_threads));
+	if (const auto method_limits = config::env_string("MD_METHOD_CONCURRENCY")) {
+		opts.method_limits = parse_method_limits(*method_limits);
+	}
+	return opts;
+}
+
+DestinationCallbackService::DestinationCallbackService(DestinationSdkImpl& impl_, const options& opts)
+    : impl(impl_), metadata_lane("metadata", opts.metadata_threads, opts.method_limits),
+      write_lane("write", opts.write_threads, opts.method_limits) {
+	SetMessageAllocatorFor_ConfigurationForm(&configuration_form_allocator);
+	SetMessageAllocatorFor_Test(&test_allocator);
+	SetMessageAllocatorFor_Capabilities(&capabilities_allocator);
+	SetMessageAllocatorFor_DescribeTable(&describe_table_allocator);
+	SetMessageAllocatorFor_CreateTable(&create_table_allocator);
+	SetMessageAllocatorFor_AlterTable(&alter_table_allocator);
+	SetMessageAllocatorFor_Truncate(&truncate_allocator);
+	SetMessageAllocatorFor_WriteBatch(&write_batch_allocator);
+	SetMessageAllocatorFor_WriteHistoryBatch(&write_history_batch_allocator);
+	SetMessageAllocatorFor_Migrate(&migrate_allocator);
+}
+
+template <typename Request, typename Response>
+::grpc::ServerUnaryReactor*
+DestinationCallbackService::dispatch(::grpc::CallbackServerContext* context, RequestExecutor& lane,
+                                     const char* method_name, impl_method<Request, Response> method,
+                                     const Request* request, Response* response) {
+	auto* reactor = context->DefaultReactor();
+	// The context, request and response live until Finish
+	const auto run = [this, context, reactor, method, request, response]() {
+		::grpc::Status status;
+		try {
+			status = (impl.*method)(context, request, response);
+		} catch (const std::exception& ex) {
+			status = ::grpc::Status(::grpc::StatusCode::INTERNAL, ex.what());
+		}
+		reactor->Finish(status);
+	};
+	lane.Submit(method_name, run);
+	return reactor;
+}
+
+::grpc::ServerUnaryReactor*
+DestinationCallbackService::ConfigurationForm(::grpc::CallbackServerContext* context,
+                                              const ::fivetran_sdk::v2::ConfigurationFormRequest* request,
+                                              ::fivetran_sdk::v2::ConfigurationFormResponse* response) {
+	return dispatch(context, metadata_lane, "ConfigurationForm", &DestinationSdkImpl::ConfigurationForm, request,
+	                response);
+}
+
+::grpc::ServerUnaryReactor* DestinationCallbackService::Test(::grpc::CallbackServerContext* context,
+                                                             const ::fivetran_sdk::v2::TestRequest* request,
+                                                             ::fivetran_sdk::v2::TestResponse* response) {
+	return dispatch(context, metadata_lane, "Test", &DestinationSdkImpl::Test, request, response);
+}
+
+::grpc::ServerUnaryReactor*
+DestinationCallbackService::Capabilities(::grpc::CallbackServerContext* context,
+                                         const ::fivetran_sdk::v2::CapabilitiesRequest* request,
+                                         ::fivetran_sdk::v2::CapabilitiesResponse* response) {
+	return dispatch(context, metadata_lane, "Capabilities", &DestinationSdkImpl::Capabilities, request, response);
+}
+
+::grpc::ServerUnaryReactor*
+DestinationCallbackService::DescribeTable(::grpc::CallbackServerContext* context,
+                                          const ::fivetran_sdk::v2::DescribeTableRequest* request,
+                                          ::fivetran_sdk::v2::DescribeTableResponse* response) {
+	return dispatch(context, metadata_lane, "DescribeTable", &DestinationSdkImpl::DescribeTable, request, response);
+}
+
+::grpc::ServerUnaryReactor*
+DestinationCallbackService::CreateTable(::grpc::CallbackServerContext* context,
+                                        const ::fivetran_sdk::v2::CreateTableRequest* request,
+                                        ::fivetran_sdk::v2::CreateTableResponse* response) {
+	return dispatch(context, write_lane, "CreateTable", &DestinationSdkImpl::CreateTable, request, response);
+}
+
+::grpc::ServerUnaryReactor*
+DestinationCallbackService::AlterTable(::grpc::CallbackServerContext* context,
+                                       const ::fivetran_sdk::v2::AlterTableRequest* request,
+                                       ::fivetran_sdk::v2::AlterTableResponse* response) {
+	return dispatch(context, write_lane, "AlterTable", &DestinationSdkImpl::AlterTable, request, response);
+}
+
+::grpc::ServerUnaryReactor* DestinationCallbackService::Truncate(::grpc::CallbackServerContext* context,
+                                                                 const ::fivetran_sdk::v2::TruncateRequest* request,
+                                                                 ::fivetran_sdk::v2::TruncateResponse* response) {
+	return dispatch(context, write_lane, "Truncate", &DestinationSdkImpl::Truncate, request, response);
+}
+
+::grpc::ServerUnaryReactor*
+DestinationCallbackService::WriteBatch(::grpc::CallbackServerContext* context,
+                                       const ::fivetran_sdk::v2::WriteBatchRequest* request,
+                                       ::fivetran_sdk::v2::WriteBatchResponse* response) {
+	return dispatch(context, write_lane, "WriteBatch", &DestinationSdkImpl::WriteBatch, request, response);
+}
+
+::grpc::ServerUnaryReactor*
+DestinationCallbackService::WriteHistoryBatch(::grpc::CallbackServerContext* context,
+                                              const ::fivetran_sdk::v2::WriteHistoryBatchRequest* request,
+                                              ::fivetran_sdk::v2::WriteBatchResponse* response) {
+	return dispatch(context, write_lane, "WriteHistoryBatch", &DestinationSdkImpl::WriteHistoryBatch, request,
+	                response);
+}
+
+::grpc::ServerUnaryReactor* DestinationCallbackService::Migrate(::grpc::CallbackServerContext* context,
+                                                                const ::fivetran_sdk::v2::MigrateRequest* request,
+                                                                ::fivetran_sdk::v2::MigrateResponse* response) {
+	return dispatch(context, write_lane, "Migrate", &DestinationSdkImpl::Migrate, request, response);
+}
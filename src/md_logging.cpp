@@ -2,9 +2,12 @@
 
 #include "duckdb.hpp"
 
+#include <cstdlib>
 #include <iostream>
 #include <mutex>
 #include <string>
+#include <string_view>
+#include <utility>
 
 namespace mdlog {
 
@@ -37,25 +40,44 @@ Logger::Logger(const SinkType sinks) : enabled_sinks(sinks), con(nullptr) {
 	assert(!HasFlag(enabled_sinks, SinkType::DUCKDB));
 }
 
-Logger::Logger(duckdb::Connection* con_) : enabled_sinks(SinkType::STDOUT | SinkType::DUCKDB), con(con_) {
+Logger::Logger(duckdb::Connection* con_, ClientIds ids_, const bool duckdb_logging_enabled)
+    : enabled_sinks(SinkType::STDOUT | SinkType::DUCKDB), con(con_), ids(std::move(ids_)) {
 	assert(con != nullptr);
-	const auto client_ids_res = con->Query("SELECT md_current_client_duckdb_id(), "
-	                                       "md_current_client_connection_id()");
+	if (duckdb_logging_enabled) {
+		std::call_once(initialize_duckdb_logging_flag, []() {});
+	}
+}
+
+ClientIds ClientIds::Fetch(duckdb::Connection& con) {
+	ClientIds ids;
+	const auto client_ids_res = con.Query("SELECT md_current_client_duckdb_id(), "
+	                                      "md_current_client_connection_id()");
 	if (client_ids_res->HasError()) {
-		log_to_stdout(LogLevel::WARNING,
-		              "Could not retrieve the current DuckDB and connection ID: " + client_ids_res->GetError());
+		Logger::CreateStdoutLogger().warning("Could not retrieve the current DuckDB and connection ID: " +
+		                                     client_ids_res->GetError());
 	} else {
-		duckdb_id = client_ids_res->GetValue(0, 0).ToString();
-		connection_id = client_ids_res->GetValue(1, 0).ToString();
+		ids.duckdb_id = client_ids_res->GetValue(0, 0).ToString();
+		ids.connection_id = client_ids_res->GetValue(1, 0).ToString();
 	}
+	return ids;
+}
+
+bool Logger::DuckDBLoggingEnabled() {
+	const char* env_var = std::getenv("MD_DISABLE_DUCKDB_LOGGING");
+	return !env_var || std::string_view(env_var) == "0";
+}
+
+void Logger::EnableDuckDBLogging(duckdb::Connection& con) {
+	con.Query("CALL enable_logging('Fivetran', storage='motherduck_log_storage', level='INFO')");
 }
 
 void Logger::log_to_stdout(const LogLevel level, const std::string& message) const {
 	// Fivetran does not support DEBUG level on stdout, emit as INFO instead.
 	const LogLevel stdout_level = level == LogLevel::DEBUG ? LogLevel::INFO : level;
 	std::cout << "{\"level\":\"" << level_to_string(stdout_level) << "\",\"message\":\""
-	          << duckdb::KeywordHelper::EscapeQuotes(message, '"') << ", duckdb_id=<" << duckdb_id
-	          << ">, connection_id=<" << connection_id << ">\",\"message-origin\":\"sdk_destination\"}" << std::endl;
+	          << duckdb::KeywordHelper::EscapeQuotes(message, '"') << ", duckdb_id=<" << ids.duckdb_id
+	          << ">, connection_id=<" << ids.connection_id << ">\",\"message-origin\":\"sdk_destination\"}"
+	          << std::endl;
 }
 
 void Logger::log_to_duckdb(const LogLevel level, const std::string& message) const {
@@ -94,13 +116,9 @@ void Logger::log(const LogLevel level, const std::string& message) const {
 
 	if (HasFlag(enabled_sinks, SinkType::DUCKDB)) {
 		// enable_logging is a global setting, so it only needs to be called once
-		// per DuckDB instance. And the DuckDB instance is a singleton.
-		std::call_once(
-		    initialize_duckdb_logging_flag,
-		    [](duckdb::Connection& con) {
-			    con.Query("CALL enable_logging('Fivetran', storage='motherduck_log_storage', level='INFO')");
-		    },
-		    *con);
+		// per DuckDB instance. Pooled connections skip it, ConnectionFactory
+		// calls it when it creates the instance.
+		std::call_once(initialize_duckdb_logging_flag, EnableDuckDBLogging, *con);
 		log_to_duckdb(level, message);
 	}
 }
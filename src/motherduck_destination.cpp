@@ -1,15 +1,49 @@
+#include "config.hpp"
+#include "destination_callback_service.hpp"
 #include "extension_helper.hpp"
+#include "md_logging.hpp"
 #include "motherduck_destination_server.hpp"
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
 #include <execinfo.h>
 #include <grpcpp/grpcpp.h>
+#include <optional>
 #include <signal.h>
 #include <string>
+#include <thread>
 #include <unistd.h>
 
-void RunServer(const std::string& port) {
+/// What to set up in the background while the server already accepts requests
+struct WarmUpOptions {
+	std::string md_token;
+	std::string db_name;
+	std::size_t connections;
+};
+
+/// Warm-up is enabled by MD_WARMUP_TOKEN and MD_WARMUP_DATABASE (or
+/// --warmup-database). The token is only read from the environment, command
+/// lines are visible to other processes.
+std::optional<WarmUpOptions> get_warm_up_options(const std::string& warmup_database) {
+	const auto token = config::env_string("MD_WARMUP_TOKEN").value_or("");
+	const auto db_name =
+	    !warmup_database.empty() ? warmup_database : config::env_string("MD_WARMUP_DATABASE").value_or("");
+	if (token.empty() || db_name.empty()) {
+		return std::nullopt;
+	}
+
+	// One for each of the up to 8 requests that Fivetran sends at once. The
+	// pool keeps at most MD_CONNECTION_POOL_SIZE of them.
+	const auto connections = config::env_int("MD_WARMUP_CONNECTIONS", 8);
+	return WarmUpOptions {token, db_name, static_cast<std::size_t>(std::max<std::int64_t>(0, connections))};
+}
+
+void RunServer(const std::string& port, const std::optional<WarmUpOptions>& warm_up) {
 	std::string server_address = "0.0.0.0:" + port;
-	DestinationSdkImpl service;
+	DestinationSdkImpl impl;
+	DestinationCallbackService service(impl, DestinationCallbackService::options::FromEnvironment());
 
 	grpc::EnableDefaultHealthCheckService(true);
 
@@ -20,7 +54,24 @@ void RunServer(const std::string& port) {
 	std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
 	std::cout << "Server listening on " << server_address << std::endl;
 
+	// Requests that arrive during warm-up wait for the instance it is creating
+	// instead of creating their own
+	std::thread warm_up_thread;
+	if (warm_up) {
+		warm_up_thread = std::thread([&impl, &warm_up]() {
+			try {
+				impl.WarmUp(warm_up->md_token, warm_up->db_name, warm_up->connections);
+			} catch (const std::exception& ex) {
+				// The first request tries again, and reports the error
+				mdlog::Logger::CreateStdoutLogger().warning(std::string("Warm-up failed: ") + ex.what());
+			}
+		});
+	}
+
 	server->Wait();
+	if (warm_up_thread.joinable()) {
+		warm_up_thread.join();
+	}
 }
 
 void log_crash(const int sig) {
@@ -50,18 +101,26 @@ int main(const int argc, char** argv) {
 	sigaction(SIGABRT, &sa, nullptr);
 
 	std::string port = "50052";
+	std::string warmup_database;
 	for (auto i = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--port") == 0) {
 			if (i + 1 >= argc) {
 				throw std::runtime_error("Please provide a port number.\nUsage: "
-				                         "motherduck_destination [--port <PORT>]");
+				                         "motherduck_destination [--port <PORT>] [--warmup-database <DATABASE>]");
 			}
 			port = argv[i + 1];
 		}
+		if (strcmp(argv[i], "--warmup-database") == 0) {
+			if (i + 1 >= argc) {
+				throw std::runtime_error("Please provide a database name.\nUsage: "
+				                         "motherduck_destination [--port <PORT>] [--warmup-database <DATABASE>]");
+			}
+			warmup_database = argv[i + 1];
+		}
 		std::cout << "argument: " << argv[i] << std::endl;
 	}
 
 	preload_extensions();
-	RunServer(port);
+	RunServer(port, get_warm_up_options(warmup_database));
 	return 0;
 }
@@ -1,5 +1,8 @@
 #include "motherduck_destination_server.hpp"
 
+#include "applied_files.hpp"
+#include "chunked_apply.hpp"
+#include "cluster_key.hpp"
 #include "config.hpp"
 #include "config_tester.hpp"
 #include "csv_processor.hpp"
@@ -12,13 +15,22 @@
 #include "md_logging.hpp"
 #include "request_context.hpp"
 #include "sql_generator.hpp"
-
+#include "staging_pipeline.hpp"
+#include "staging_tables.hpp"
+#include "table_maintenance.hpp"
+#include "write_locks.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <exception>
 #include <filesystem>
 #include <grpcpp/grpcpp.h>
+#include <map>
 #include <memory>
 #include <optional>
 #include <string>
+#include <vector>
 
 namespace {
 ::grpc::Status create_grpc_status_from_exception(const std::exception& ex, const std::string& prefix = "") {
@@ -144,9 +156,50 @@ std::uint32_t get_max_record_size(const google::protobuf::Map<std::string, std::
 
 	return max_record_size;
 }
+
+std::vector<const column_def*> get_cluster_columns(const google::protobuf::Map<std::string, std::string>& configuration,
+                                                   const table_def& table, const std::vector<column_def>& cols,
+                                                   mdlog::Logger& logger) {
+	const auto cluster_by = config::find_optional_property(configuration, config::PROP_CLUSTER_BY);
+	if (!cluster_by.has_value()) {
+		return {};
+	}
+	return find_cluster_columns(cluster_by.value(), table.table_name, cols, logger);
+}
+
+/// The number of rows per chunk for ChunkedApply, 0 if files are applied whole
+std::int64_t get_apply_chunk_rows(const google::protobuf::Map<std::string, std::string>& configuration) {
+	const auto value = config::find_optional_property(configuration, config::PROP_APPLY_CHUNK_ROWS);
+	if (!value.has_value() || value.value().empty()) {
+		return 0;
+	}
+	try {
+		return std::max<std::int64_t>(0, std::stoll(value.value()));
+	} catch (const std::exception&) {
+		throw md_error::RecoverableError("Value \"" + value.value() +
+		                                 "\" could not be converted into an integer for \"Apply Chunk Rows\". "
+		                                 "Make sure to set the \"Apply Chunk Rows\" to a valid positive integer.");
+	}
+}
 } // namespace
 
-grpc::Status DestinationSdkImpl::ConfigurationForm(::grpc::ServerContext*,
+DestinationSdkImpl::DestinationSdkImpl()
+    : table_maintenance(TableMaintenance::options::FromEnvironment(),
+                        [this](const TableMaintenance::maintenance_job& job) {
+	                        return connection_factory.CreateConnection(job.md_token, job.table.db_name);
+                        }) {
+}
+
+void DestinationSdkImpl::WarmUp(const std::string& md_token, const std::string& db_name,
+                                const std::size_t connections) {
+	connection_factory.WarmUp(md_token, db_name, connections);
+}
+
+ConnectionPool::stats DestinationSdkImpl::PoolStats(const std::string& md_token, const std::string& db_name) {
+	return connection_factory.PoolStats(md_token, db_name);
+}
+
+grpc::Status DestinationSdkImpl::ConfigurationForm(::grpc::ServerContextBase*,
                                                    const ::fivetran_sdk::v2::ConfigurationFormRequest*,
                                                    ::fivetran_sdk::v2::ConfigurationFormResponse* response) {
 
@@ -197,6 +250,44 @@ grpc::Status DestinationSdkImpl::ConfigurationForm(::grpc::ServerContext*,
 	strict_primary_keys_field.set_default_value("false");
 	response->add_fields()->CopyFrom(strict_primary_keys_field);
 
+	fivetran_sdk::v2::FormField active_records_table_field;
+	active_records_table_field.set_name(config::PROP_ACTIVE_RECORDS_TABLE);
+	active_records_table_field.set_label("Active Records Table");
+	active_records_table_field.set_description(
+	    "When enabled, every history mode table gets a companion table named __fivetran_active_<table> that holds the "
+	    "primary keys and _fivetran_start of the active versions. It is kept up to date in the same transaction as "
+	    "the table, and lets history mode syncs skip the inactive versions. It can also be queried as the current "
+	    "state of the table. Leave this OFF (the default) to not create it.");
+	active_records_table_field.mutable_toggle_field();
+	active_records_table_field.set_required(false);
+	active_records_table_field.set_default_value("false");
+	response->add_fields()->CopyFrom(active_records_table_field);
+
+	fivetran_sdk::v2::FormField cluster_by_field;
+	cluster_by_field.set_name(config::PROP_CLUSTER_BY);
+	cluster_by_field.set_label("Cluster By");
+	cluster_by_field.set_description(
+	    "Sorts the rows of every batch by a column before they are written, so that queries filtering on that column "
+	    "can skip most of the table. Use a comma-separated list of <table>=<column> entries, and optionally a "
+	    "<column> entry for all other tables, e.g. \"orders=order_date, _fivetran_synced\". Use primary_key for the "
+	    "primary key columns. Leave empty (the default) to write rows in the order they arrive.");
+	cluster_by_field.set_text_field(fivetran_sdk::v2::PlainText);
+	cluster_by_field.set_required(false);
+	response->add_fields()->CopyFrom(cluster_by_field);
+
+	fivetran_sdk::v2::FormField apply_chunk_rows_field;
+	apply_chunk_rows_field.set_name(config::PROP_APPLY_CHUNK_ROWS);
+	apply_chunk_rows_field.set_label("Apply Chunk Rows");
+	apply_chunk_rows_field.set_description(
+	    "Applies large upsert and delete files in chunks of this many rows, each committed on its own, so that memory "
+	    "use does not grow with the file size and a retried batch continues after the last committed chunk. Batches "
+	    "are then no longer applied all or nothing. Leave empty (the default) to apply every batch in one "
+	    "transaction: a batch that fails is rolled back as a whole and its retry applies every file again, only the "
+	    "retry of a batch that committed is skipped.");
+	apply_chunk_rows_field.set_text_field(fivetran_sdk::v2::PlainText);
+	apply_chunk_rows_field.set_required(false);
+	response->add_fields()->CopyFrom(apply_chunk_rows_field);
+
 	for (const auto& test_case : config_tester::get_test_cases()) {
 		auto connection_test = response->add_tests();
 		connection_test->set_name(test_case.name);
@@ -206,18 +297,19 @@ grpc::Status DestinationSdkImpl::ConfigurationForm(::grpc::ServerContext*,
 	return ::grpc::Status::OK;
 }
 
-grpc::Status DestinationSdkImpl::Capabilities(::grpc::ServerContext*, const ::fivetran_sdk::v2::CapabilitiesRequest*,
+grpc::Status DestinationSdkImpl::Capabilities(::grpc::ServerContextBase*,
+                                              const ::fivetran_sdk::v2::CapabilitiesRequest*,
                                               ::fivetran_sdk::v2::CapabilitiesResponse* response) {
 	response->set_batch_file_format(::fivetran_sdk::v2::CSV);
 	return ::grpc::Status::OK;
 }
 
-grpc::Status DestinationSdkImpl::DescribeTable(::grpc::ServerContext*,
+grpc::Status DestinationSdkImpl::DescribeTable(::grpc::ServerContextBase* context,
                                                const ::fivetran_sdk::v2::DescribeTableRequest* request,
                                                ::fivetran_sdk::v2::DescribeTableResponse* response) {
 	std::optional<RequestContext> ctx;
 	try {
-		ctx.emplace("DescribeTable", connection_factory, request->configuration());
+		ctx.emplace("DescribeTable", connection_factory, request->configuration(), &cancellation_watchdog, context);
 	} catch (const std::exception& ex) {
 		return create_grpc_status_from_exception(ex);
 	}
@@ -225,7 +317,8 @@ grpc::Status DestinationSdkImpl::DescribeTable(::grpc::ServerContext*,
 	auto& logger = ctx->GetLogger();
 
 	try {
-		auto sql_generator = std::make_unique<MdSqlGenerator>(logger);
+		auto sql_generator =
+		    std::make_unique<MdSqlGenerator>(logger, &schema_cache, &ctx->GetRetryPolicy(), ctx->GetInstanceKey());
 		table_def table_name {ctx->GetDBName(), get_schema_name(request), get_table_name(request)};
 		logger.info("Endpoint <DescribeTable>: schema name <" + table_name.schema_name + ">");
 		logger.info("Endpoint <DescribeTable>: table name <" + table_name.table_name + ">");
@@ -271,12 +364,12 @@ grpc::Status DestinationSdkImpl::DescribeTable(::grpc::ServerContext*,
 	return ::grpc::Status::OK;
 }
 
-grpc::Status DestinationSdkImpl::CreateTable(::grpc::ServerContext*,
+grpc::Status DestinationSdkImpl::CreateTable(::grpc::ServerContextBase* context,
                                              const ::fivetran_sdk::v2::CreateTableRequest* request,
                                              ::fivetran_sdk::v2::CreateTableResponse* response) {
 	std::optional<RequestContext> ctx;
 	try {
-		ctx.emplace("CreateTable", connection_factory, request->configuration());
+		ctx.emplace("CreateTable", connection_factory, request->configuration(), &cancellation_watchdog, context);
 	} catch (const std::exception& ex) {
 		return create_grpc_status_from_exception(ex);
 	}
@@ -284,14 +377,22 @@ grpc::Status DestinationSdkImpl::CreateTable(::grpc::ServerContext*,
 	auto& logger = ctx->GetLogger();
 
 	try {
-		auto sql_generator = std::make_unique<MdSqlGenerator>(logger);
+		auto sql_generator =
+		    std::make_unique<MdSqlGenerator>(logger, &schema_cache, &ctx->GetRetryPolicy(), ctx->GetInstanceKey());
 
 		auto schema_name = get_schema_name(request);
-		sql_generator->create_schema_if_not_exists_with_retries(con, ctx->GetDBName(), schema_name);
+		{
+			const WriteLocks::SchemaCreation schema_lock(write_locks, ctx->GetInstanceKey(), ctx->GetDBName(),
+			                                             schema_name, logger);
+			sql_generator->create_schema_if_not_exists_with_retries(con, ctx->GetDBName(), schema_name);
+		}
 
 		const table_def table {ctx->GetDBName(), schema_name, request->table().name()};
 		const auto cols = get_duckdb_columns(request->table().columns());
-		sql_generator->create_table(con, table, cols, {});
+		const WriteLocks::Table table_lock(write_locks, ctx->GetInstanceKey(), table, logger);
+		// The first batch loads the table without maintaining a primary key
+		// index and adds the constraint at its end, see WriteBatch
+		sql_generator->create_table(con, table, cols, {}, false);
 		response->set_success(true);
 	} catch (const md_error::RecoverableError& mde) {
 		logger.warning("CreateTable endpoint failed for schema <" + request->schema_name() + ">, table <" +
@@ -308,12 +409,12 @@ grpc::Status DestinationSdkImpl::CreateTable(::grpc::ServerContext*,
 	return ::grpc::Status::OK;
 }
 
-grpc::Status DestinationSdkImpl::AlterTable(::grpc::ServerContext*,
+grpc::Status DestinationSdkImpl::AlterTable(::grpc::ServerContextBase* context,
                                             const ::fivetran_sdk::v2::AlterTableRequest* request,
                                             ::fivetran_sdk::v2::AlterTableResponse* response) {
 	std::optional<RequestContext> ctx;
 	try {
-		ctx.emplace("AlterTable", connection_factory, request->configuration());
+		ctx.emplace("AlterTable", connection_factory, request->configuration(), &cancellation_watchdog, context);
 	} catch (const std::exception& ex) {
 		return create_grpc_status_from_exception(ex);
 	}
@@ -322,8 +423,11 @@ grpc::Status DestinationSdkImpl::AlterTable(::grpc::ServerContext*,
 
 	try {
 		table_def table_name {ctx->GetDBName(), get_schema_name(request), request->table().name()};
+		const WriteLocks::Table table_lock(write_locks, ctx->GetInstanceKey(), table_name, logger);
+		const TableMaintenance::Write maintenance_write(table_maintenance, ctx->GetInstanceKey(), table_name);
 
-		auto sql_generator = std::make_unique<MdSqlGenerator>(logger);
+		auto sql_generator =
+		    std::make_unique<MdSqlGenerator>(logger, &schema_cache, &ctx->GetRetryPolicy(), ctx->GetInstanceKey());
 		sql_generator->alter_table(con, table_name, get_duckdb_columns(request->table().columns()),
 		                           request->drop_columns());
 		response->set_success(true);
@@ -342,11 +446,12 @@ grpc::Status DestinationSdkImpl::AlterTable(::grpc::ServerContext*,
 	return ::grpc::Status::OK;
 }
 
-grpc::Status DestinationSdkImpl::Truncate(::grpc::ServerContext*, const ::fivetran_sdk::v2::TruncateRequest* request,
+grpc::Status DestinationSdkImpl::Truncate(::grpc::ServerContextBase* context,
+                                          const ::fivetran_sdk::v2::TruncateRequest* request,
                                           ::fivetran_sdk::v2::TruncateResponse* response) {
 	std::optional<RequestContext> ctx;
 	try {
-		ctx.emplace("Truncate", connection_factory, request->configuration());
+		ctx.emplace("Truncate", connection_factory, request->configuration(), &cancellation_watchdog, context);
 	} catch (const std::exception& ex) {
 		return create_grpc_status_from_exception(ex);
 	}
@@ -358,8 +463,11 @@ grpc::Status DestinationSdkImpl::Truncate(::grpc::ServerContext*, const ::fivetr
 		if (request->synced_column().empty()) {
 			throw std::invalid_argument("Synced column is required");
 		}
+		const WriteLocks::Table table_lock(write_locks, ctx->GetInstanceKey(), table_name, logger);
+		const TableMaintenance::Write maintenance_write(table_maintenance, ctx->GetInstanceKey(), table_name);
 
-		auto sql_generator = std::make_unique<MdSqlGenerator>(logger);
+		auto sql_generator =
+		    std::make_unique<MdSqlGenerator>(logger, &schema_cache, &ctx->GetRetryPolicy(), ctx->GetInstanceKey());
 
 		if (sql_generator->table_exists(con, table_name)) {
 			std::chrono::nanoseconds delete_before_ts = std::chrono::seconds(request->utc_delete_before().seconds()) +
@@ -386,12 +494,12 @@ grpc::Status DestinationSdkImpl::Truncate(::grpc::ServerContext*, const ::fivetr
 	return ::grpc::Status::OK;
 }
 
-grpc::Status DestinationSdkImpl::WriteBatch(::grpc::ServerContext*,
+grpc::Status DestinationSdkImpl::WriteBatch(::grpc::ServerContextBase* context,
                                             const ::fivetran_sdk::v2::WriteBatchRequest* request,
                                             ::fivetran_sdk::v2::WriteBatchResponse* response) {
 	std::optional<RequestContext> ctx;
 	try {
-		ctx.emplace("WriteBatch", connection_factory, request->configuration());
+		ctx.emplace("WriteBatch", connection_factory, request->configuration(), &cancellation_watchdog, context);
 	} catch (const std::exception& ex) {
 		return create_grpc_status_from_exception(ex);
 	}
@@ -404,7 +512,8 @@ grpc::Status DestinationSdkImpl::WriteBatch(::grpc::ServerContext*,
 		const auto max_record_size = get_max_record_size(request->configuration(), logger);
 
 		table_def table_name {ctx->GetDBName(), get_schema_name(request), request->table().name()};
-		auto sql_generator = std::make_unique<MdSqlGenerator>(logger);
+		auto sql_generator =
+		    std::make_unique<MdSqlGenerator>(logger, &schema_cache, &ctx->GetRetryPolicy(), ctx->GetInstanceKey());
 
 		const auto cols = get_duckdb_columns(request->table().columns());
 		std::vector<const column_def*> columns_pk;
@@ -414,8 +523,110 @@ grpc::Status DestinationSdkImpl::WriteBatch(::grpc::ServerContext*,
 		if (columns_pk.empty()) {
 			throw std::invalid_argument("No primary keys found");
 		}
+		const auto cluster_columns = get_cluster_columns(request->configuration(), table_name, cols, logger);
+
+		// Files that an earlier attempt of this request already committed are
+		// skipped, see AppliedFiles
+		std::map<std::string, std::string> fingerprints;
+		for (const auto* files : {&request->replace_files(), &request->update_files(), &request->delete_files()}) {
+			for (const auto& filename : *files) {
+				fingerprints[filename] = file_fingerprint(
+				    filename, get_decryption_key(filename, request->keys(), request->file_params().encryption()));
+			}
+		}
+		// Held until the batch has committed. Also keeps a retry of this request
+		// from loading the applied files before the original attempt is done.
+		const WriteLocks::Table table_lock(write_locks, ctx->GetInstanceKey(), table_name, logger);
+		AppliedFiles applied_files(con, logger, table_name);
+		std::vector<std::string> fingerprint_values;
+		fingerprint_values.reserve(fingerprints.size());
+		for (const auto& [filename, fingerprint] : fingerprints) {
+			fingerprint_values.push_back(fingerprint);
+		}
+		applied_files.Load(fingerprint_values);
+
+		// In chunked mode, every file commits on its own and is recorded with
+		// it, replace and delete files even chunk by chunk (see ChunkedApply),
+		// so a retry after a failure skips what was committed. Otherwise the
+		// records commit with the batch, and only the retry of a batch whose
+		// response got lost skips anything.
+		const auto apply_chunk_rows = get_apply_chunk_rows(request->configuration());
+		const bool chunked = apply_chunk_rows > 0;
+		ChunkedApply chunked_apply(con, logger, applied_files, std::max<std::int64_t>(1, apply_chunk_rows),
+		                           &ctx->GetRetryPolicy());
+
+		const auto skip_applied = [&](const std::string& filename, const std::string& operation) {
+			const auto& fingerprint = fingerprints.at(filename);
+			if (applied_files.Contains(fingerprint)) {
+				logger.info("Skipping " + operation + " file " + filename + ", it has been applied before");
+				return true;
+			}
+			if (!chunked) {
+				applied_files.Add(fingerprint, operation);
+			}
+			return false;
+		};
+		// Wraps the apply function of a file for chunked mode. `apply` is
+		// copied: the pipeline calls the wrapper after this scope has ended.
+		const auto apply_file = [&](const std::string& filename, const std::string& operation,
+		                            StagingPipeline::apply_function apply, const bool in_chunks) {
+			if (!chunked) {
+				return apply;
+			}
+			const auto& fingerprint = fingerprints.at(filename);
+			return StagingPipeline::apply_function(
+			    [&, fingerprint, operation, apply, in_chunks](const std::string& staging_table_name) {
+				    if (in_chunks) {
+					    // The chunks commit on their own, after the staging table.
+					    // The staging transaction is reopened for the rest of
+					    // csv_processor::ProcessFile.
+					    con.Commit();
+					    chunked_apply.Run(staging_table_name, fingerprint, operation, apply);
+					    con.BeginTransaction();
+				    } else {
+					    apply(staging_table_name);
+				    }
+				    applied_files.RecordImmediately(fingerprint, operation);
+			    });
+		};
+
+		// Interrupts the maintenance of the table, if it is running
+		const TableMaintenance::Write maintenance_write(table_maintenance, ctx->GetInstanceKey(), table_name);
+
+		// Tables are created empty and without their PRIMARY KEY constraint
+		// (see CreateTable). The first batch appends its replace files
+		// instead of upserting them and adds the constraint at its end.
+		// Checked before the transaction begins, where the schema cache
+		// answers it once the constraint exists.
+		bool deferred_primary_key = !sql_generator->has_primary_key_constraint(con, table_name);
+		if (deferred_primary_key && !sql_generator->table_is_empty(con, table_name)) {
+			// An earlier batch committed files in chunked mode but failed
+			// before adding the constraint: only an empty table takes the
+			// fast path
+			sql_generator->add_deferred_primary_key(con, table_name, columns_pk);
+			deferred_primary_key = false;
+		}
+		if (deferred_primary_key) {
+			logger.info("Loading empty table without primary key index");
+		}
+		// The first replace file needs no DELETE to stand in for ON CONFLICT
+		bool table_empty = deferred_primary_key;
+
+		// Otherwise, all files of the batch are applied in one transaction: a
+		// single commit for the whole request, and nothing is applied if any
+		// file fails.
+		if (!chunked) {
+			ctx->BeginTransaction();
+		}
+
+		// Files are applied in the order they are added here, while the
+		// pipeline already reads the next file on a second connection
+		StagingPipeline pipeline(con, logger, &ctx->GetRetryPolicy());
 
 		for (auto& filename : request->replace_files()) {
+			if (skip_applied(filename, "replace")) {
+				continue;
+			}
 			logger.info("Processing replace file " + filename);
 			const auto decryption_key =
 			    get_decryption_key(filename, request->keys(), request->file_params().encryption());
@@ -426,12 +637,26 @@ grpc::Status DestinationSdkImpl::WriteBatch(::grpc::ServerContext*,
 			                        .allow_unmodified_string = false,
 			                        .max_record_size = max_record_size};
 
-			csv_processor::ProcessFile(con, props, logger, [&](const std::string& staging_table_name) {
-				sql_generator->upsert(con, table_name, staging_table_name, columns_pk, columns_regular);
-			});
+			const auto apply = [&](const std::string& staging_table_name) {
+				if (!deferred_primary_key) {
+					sql_generator->upsert(con, table_name, staging_table_name, columns_pk, columns_regular,
+					                      cluster_columns);
+					return;
+				}
+				if (!table_empty) {
+					sql_generator->delete_rows(con, table_name, staging_table_name, columns_pk);
+				}
+				sql_generator->insert(con, table_name, staging_table_name, columns_pk, columns_regular,
+				                      cluster_columns.empty() ? columns_pk : cluster_columns);
+				table_empty = false;
+			};
+			pipeline.Add(props, apply_file(filename, "replace", apply, true));
 		}
 
 		for (auto& filename : request->update_files()) {
+			if (skip_applied(filename, "update")) {
+				continue;
+			}
 			logger.info("Processing update file " + filename);
 			auto decryption_key = get_decryption_key(filename, request->keys(), request->file_params().encryption());
 			IngestProperties props {.filename = filename,
@@ -441,13 +666,18 @@ grpc::Status DestinationSdkImpl::WriteBatch(::grpc::ServerContext*,
 			                        .allow_unmodified_string = true,
 			                        .max_record_size = max_record_size};
 
-			csv_processor::ProcessFile(con, props, logger, [&](const std::string& staging_table_name) {
+			const auto apply = [&](const std::string& staging_table_name) {
 				sql_generator->update_values(con, table_name, staging_table_name, columns_pk, columns_regular,
 				                             request->file_params().unmodified_string());
-			});
+			};
+			// Applying an update file twice is not harmless, so it is not chunked
+			pipeline.Add(props, apply_file(filename, "update", apply, false));
 		}
 
 		for (auto& filename : request->delete_files()) {
+			if (skip_applied(filename, "delete")) {
+				continue;
+			}
 			logger.info("Processing delete file " + filename);
 			std::vector<column_def> cols_to_read;
 			for (const auto& col : columns_pk) {
@@ -461,11 +691,24 @@ grpc::Status DestinationSdkImpl::WriteBatch(::grpc::ServerContext*,
 			                        .allow_unmodified_string = false,
 			                        .max_record_size = max_record_size};
 
-			csv_processor::ProcessFile(con, props, logger, [&](const std::string& staging_table_name) {
+			const auto apply = [&](const std::string& staging_table_name) {
 				sql_generator->delete_rows(con, table_name, staging_table_name, columns_pk);
-			});
+			};
+			pipeline.Add(props, apply_file(filename, "delete", apply, true));
 		}
 
+		pipeline.Run(*ctx);
+		if (chunked) {
+			ctx->BeginTransaction();
+		}
+		if (deferred_primary_key) {
+			sql_generator->add_deferred_primary_key(con, table_name, columns_pk);
+		}
+		applied_files.Record();
+		ctx->Commit();
+		table_maintenance.RecordChanges(ctx->GetInstanceKey(), table_name,
+		                                config::find_property(request->configuration(), config::PROP_TOKEN),
+		                                cluster_columns, sql_generator->changed_row_count());
 	} catch (const md_error::RecoverableError& mde) {
 		auto const msg = "WriteBatch endpoint failed for schema <" + request->schema_name() + ">, table <" +
 		                 request->table().name() + ">: " + std::string(mde.what());
@@ -484,18 +727,19 @@ grpc::Status DestinationSdkImpl::WriteBatch(::grpc::ServerContext*,
 	return ::grpc::Status::OK;
 }
 
-::grpc::Status DestinationSdkImpl::WriteHistoryBatch(::grpc::ServerContext*,
+::grpc::Status DestinationSdkImpl::WriteHistoryBatch(::grpc::ServerContextBase* context,
                                                      const ::fivetran_sdk::v2::WriteHistoryBatchRequest* request,
                                                      ::fivetran_sdk::v2::WriteBatchResponse* response) {
 	std::optional<RequestContext> ctx;
 	try {
-		ctx.emplace("WriteHistoryBatch", connection_factory, request->configuration());
+		ctx.emplace("WriteHistoryBatch", connection_factory, request->configuration(), &cancellation_watchdog, context);
 	} catch (const std::exception& ex) {
 		return create_grpc_status_from_exception(ex);
 	}
 	auto& con = ctx->GetConnection();
 	auto& logger = ctx->GetLogger();
-	auto sql_generator = std::make_unique<MdSqlGenerator>(logger);
+	auto sql_generator =
+	    std::make_unique<MdSqlGenerator>(logger, &schema_cache, &ctx->GetRetryPolicy(), ctx->GetInstanceKey());
 	// We keep the table name in the outer scope to be able to drop the LAR table
 	// in the catch block
 	std::string lar_table_name;
@@ -514,6 +758,24 @@ grpc::Status DestinationSdkImpl::WriteBatch(::grpc::ServerContext*,
 		if (columns_pk.empty()) {
 			throw std::invalid_argument("No primary keys found");
 		}
+		const auto cluster_columns = get_cluster_columns(request->configuration(), table_name, cols, logger);
+
+		// See WriteBatch: one transaction and one commit for all files
+		const WriteLocks::Table table_lock(write_locks, ctx->GetInstanceKey(), table_name, logger);
+		const TableMaintenance::Write maintenance_write(table_maintenance, ctx->GetInstanceKey(), table_name);
+		// See WriteBatch: history batches only insert, so the table does not
+		// have to be empty to be loaded without the constraint
+		const bool deferred_primary_key = !sql_generator->has_primary_key_constraint(con, table_name);
+		ctx->BeginTransaction();
+		// Files of the same kind share a staging table
+		StagingTables staging_tables(con, logger);
+
+		// Dropped when disabled, it would be stale if it was enabled again later
+		if (config::find_bool_property(request->configuration(), config::PROP_ACTIVE_RECORDS_TABLE, false)) {
+			sql_generator->maintain_active_records_table(con, table_name, columns_pk);
+		} else {
+			sql_generator->drop_active_records_table(con, table_name);
+		}
 
 		/*
 		The latest_active_records (lar) table is used to process the update file
@@ -547,10 +809,11 @@ grpc::Status DestinationSdkImpl::WriteBatch(::grpc::ServerContext*,
 			                        .allow_unmodified_string = false,
 			                        .max_record_size = max_record_size};
 
-			csv_processor::ProcessFile(con, props, logger, [&](const std::string& staging_table_name) {
+			const auto apply = [&](const std::string& staging_table_name) {
 				sql_generator->deactivate_historical_records(con, table_name, staging_table_name, lar_table_name,
 				                                             columns_pk);
-			});
+			};
+			csv_processor::ProcessFile(con, props, logger, apply, &staging_tables);
 		}
 
 		for (auto& filename : request->update_files()) {
@@ -564,11 +827,12 @@ grpc::Status DestinationSdkImpl::WriteBatch(::grpc::ServerContext*,
 			                        .allow_unmodified_string = true,
 			                        .max_record_size = max_record_size};
 
-			csv_processor::ProcessFile(con, props, logger, [&](const std::string& staging_table_name) {
+			const auto apply = [&](const std::string& staging_table_name) {
 				sql_generator->add_partial_historical_values(con, table_name, staging_table_name, lar_table_name,
 				                                             columns_pk, columns_regular,
 				                                             request->file_params().unmodified_string());
-			});
+			};
+			csv_processor::ProcessFile(con, props, logger, apply, &staging_tables);
 		}
 
 		// The following functions do not need the LAR table
@@ -586,9 +850,11 @@ grpc::Status DestinationSdkImpl::WriteBatch(::grpc::ServerContext*,
 			                        .allow_unmodified_string = false,
 			                        .max_record_size = max_record_size};
 
-			csv_processor::ProcessFile(con, props, logger, [&](const std::string& staging_table_name) {
-				sql_generator->insert(con, table_name, staging_table_name, columns_pk, columns_regular);
-			});
+			const auto apply = [&](const std::string& staging_table_name) {
+				sql_generator->insert(con, table_name, staging_table_name, columns_pk, columns_regular,
+				                      cluster_columns);
+			};
+			csv_processor::ProcessFile(con, props, logger, apply, &staging_tables);
 		}
 
 		for (auto& filename : request->delete_files()) {
@@ -614,14 +880,28 @@ grpc::Status DestinationSdkImpl::WriteBatch(::grpc::ServerContext*,
 			                        .allow_unmodified_string = false,
 			                        .max_record_size = max_record_size};
 
-			csv_processor::ProcessFile(con, props, logger, [&](const std::string& staging_table_name) {
+			const auto apply = [&](const std::string& staging_table_name) {
 				sql_generator->delete_historical_rows(con, table_name, staging_table_name, columns_pk);
-			});
+			};
+			csv_processor::ProcessFile(con, props, logger, apply, &staging_tables);
+		}
+
+		if (deferred_primary_key) {
+			std::vector<const column_def*> history_pk;
+			find_primary_keys(cols, history_pk);
+			sql_generator->add_deferred_primary_key(con, table_name, history_pk);
 		}
 
+		staging_tables.DropAll();
+		ctx->Commit();
+		table_maintenance.RecordChanges(ctx->GetInstanceKey(), table_name,
+		                                config::find_property(request->configuration(), config::PROP_TOKEN),
+		                                cluster_columns, sql_generator->changed_row_count());
 	} catch (const md_error::RecoverableError& mde) {
-		// Clean up bookkeeping table. The function uses IF EXISTS. Ignore any
-		// errors here.
+		// Rolling back the batch also discards the bookkeeping table. The drop
+		// uses IF EXISTS and ignores errors, it only matters if the failure
+		// happened outside of the transaction.
+		ctx->Rollback();
 		sql_generator->drop_latest_active_records_table(con, lar_table_name);
 
 		auto const msg = "WriteHistoryBatch endpoint failed for schema <" + request->schema_name() + ">, table <" +
@@ -634,8 +914,10 @@ grpc::Status DestinationSdkImpl::WriteBatch(::grpc::ServerContext*,
 		const auto msg = error_prefix + ex.what();
 		logger.severe(msg);
 
-		// Clean up bookkeeping table. The function uses IF EXISTS. Ignore any
-		// errors here.
+		// Rolling back the batch also discards the bookkeeping table. The drop
+		// uses IF EXISTS and ignores errors, it only matters if the failure
+		// happened outside of the transaction.
+		ctx->Rollback();
 		sql_generator->drop_latest_active_records_table(con, lar_table_name);
 
 		response->mutable_task()->set_message(msg);
@@ -685,11 +967,12 @@ std::string get_migration_schema_name(const fivetran_sdk::v2::MigrationDetails&
 	return schema_name;
 }
 
-grpc::Status DestinationSdkImpl::Migrate(::grpc::ServerContext*, const ::fivetran_sdk::v2::MigrateRequest* request,
+grpc::Status DestinationSdkImpl::Migrate(::grpc::ServerContextBase* context,
+                                         const ::fivetran_sdk::v2::MigrateRequest* request,
                                          ::fivetran_sdk::v2::MigrateResponse* response) {
 	std::optional<RequestContext> ctx;
 	try {
-		ctx.emplace("Migrate", connection_factory, request->configuration());
+		ctx.emplace("Migrate", connection_factory, request->configuration(), &cancellation_watchdog, context);
 	} catch (const std::exception& e) {
 		return ::grpc::Status(::grpc::StatusCode::INTERNAL, e.what());
 	}
@@ -706,10 +989,13 @@ grpc::Status DestinationSdkImpl::Migrate(::grpc::ServerContext*, const ::fivetra
 		}
 
 		const std::string& db_name = ctx->GetDBName();
-		auto sql_generator = std::make_unique<MdSqlGenerator>(logger);
+		auto sql_generator =
+		    std::make_unique<MdSqlGenerator>(logger, &schema_cache, &ctx->GetRetryPolicy(), ctx->GetInstanceKey());
 
 		table_def table {db_name, schema_name, table_name};
 		logger.info("Endpoint <Migrate>: schema <" + schema_name + ">, table <" + table_name + ">");
+		// Copies and renames involve other tables of the schema
+		const WriteLocks::Schema schema_lock(write_locks, ctx->GetInstanceKey(), db_name, schema_name, logger);
 
 		switch (details.operation_case()) {
 		case fivetran_sdk::v2::MigrationDetails::kDrop: {
@@ -925,7 +1211,8 @@ grpc::Status DestinationSdkImpl::Migrate(::grpc::ServerContext*, const ::fivetra
 	return ::grpc::Status(::grpc::StatusCode::OK, "");
 }
 
-grpc::Status DestinationSdkImpl::Test(::grpc::ServerContext*, const ::fivetran_sdk::v2::TestRequest* request,
+grpc::Status DestinationSdkImpl::Test(::grpc::ServerContextBase* context,
+                                      const ::fivetran_sdk::v2::TestRequest* request,
                                       ::fivetran_sdk::v2::TestResponse* response) {
 	const std::string test_name = request->name();
 	const std::string error_prefix = "Test <" + test_name + "> failed: ";
@@ -935,7 +1222,7 @@ grpc::Status DestinationSdkImpl::Test(::grpc::ServerContext*, const ::fivetran_s
 		// This constructor already loads the extension and connects to MotherDuck.
 		// If this fails, we catch the exception and rewrite it a bit to make
 		// it more actionable.
-		RequestContext ctx("Test", connection_factory, request->configuration());
+		RequestContext ctx("Test", connection_factory, request->configuration(), &cancellation_watchdog, context);
 
 		auto test_result = config_tester::run_test(test_name, ctx.GetConnection(), request->configuration());
 		if (test_result.success) {
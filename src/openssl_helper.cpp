@@ -1,6 +1,7 @@
 #include "openssl_helper.hpp"
 
 #include <openssl/err.h>
+#include <openssl/evp.h>
 #include <sstream>
 #include <string>
 
@@ -30,3 +31,23 @@ void openssl_helper::raise_openssl_error(const std::string& message_prefix) {
 
 	throw std::runtime_error(final_error_stream.str());
 }
+
+std::string openssl_helper::to_hex(const unsigned char* data, const unsigned int length) {
+	constexpr char hex_digits[] = "0123456789abcdef";
+	std::string hex;
+	hex.reserve(2 * length);
+	for (unsigned int i = 0; i < length; i++) {
+		hex += hex_digits[data[i] >> 4];
+		hex += hex_digits[data[i] & 0xf];
+	}
+	return hex;
+}
+
+std::string openssl_helper::sha256_hex(const std::string& data) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_length = 0;
+	if (1 != EVP_Digest(data.data(), data.size(), digest, &digest_length, EVP_sha256(), nullptr)) {
+		raise_openssl_error("Failed to compute SHA-256 digest");
+	}
+	return to_hex(digest, digest_length);
+}
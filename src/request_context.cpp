@@ -1,36 +1,134 @@
 #include "request_context.hpp"
 
+#include "cancellation_watchdog.hpp"
 #include "config.hpp"
 #include "connection_factory.hpp"
+#include "connection_pool.hpp"
 #include "google/protobuf/map.h"
+#include "md_logging.hpp"
+#include "retry_policy.hpp"
 
-#include <cstdlib>
+#include <chrono>
+#include <cstdint>
+#include <grpcpp/grpcpp.h>
+#include <optional>
+#include <stdexcept>
 #include <string>
-#include <string_view>
 
 namespace {
-mdlog::Logger get_logger_for_env(duckdb::Connection& con) {
-	const char* env_var = std::getenv("MD_DISABLE_DUCKDB_LOGGING");
-	if (env_var && std::string_view(env_var) != "0") {
+mdlog::Logger get_logger_for_env(ConnectionPool::Lease& lease) {
+	if (!mdlog::Logger::DuckDBLoggingEnabled()) {
 		return mdlog::Logger::CreateStdoutLogger();
 	}
-	return mdlog::Logger::CreateMultiSinkLogger(&con);
+	return mdlog::Logger::CreateMultiSinkLogger(&lease.Connection(), lease.Ids());
+}
+
+std::int64_t to_ms(const std::chrono::steady_clock::duration duration) {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+}
+
+const RetryPolicy::options& retry_options() {
+	static const auto options = RetryPolicy::options::FromEnvironment();
+	return options;
 }
 } // namespace
 
-RequestContext::RequestContext(const std::string& endpoint_name_, ConnectionFactory& connection_factory,
-                               const google::protobuf::Map<std::string, std::string>& request_config)
-    : endpoint_name(endpoint_name_),
+RequestContext::RequestContext(const std::string& endpoint_name_, ConnectionFactory& connection_factory_,
+                               const google::protobuf::Map<std::string, std::string>& request_config,
+                               CancellationWatchdog* watchdog, ::grpc::ServerContextBase* server_context)
+    : connection_factory(connection_factory_), endpoint_name(endpoint_name_),
       db_name(config::find_property(request_config, config::PROP_DATABASE)),
       md_token(config::find_property(request_config, config::PROP_TOKEN)),
-      con(connection_factory.CreateConnection(md_token, db_name)),
-      logger(get_logger_for_env(con)) {
-	logger.debug("Endpoint <" + endpoint_name + "> started");
+      instance_key(ConnectionFactory::InstanceKey(md_token, db_name)),
+      lease(connection_factory.AcquireConnection(md_token, db_name)), con(lease.Connection()),
+      logger(get_logger_for_env(lease)), retry_policy(retry_options(), logger) {
+	const auto pool = lease.PoolStats();
+	logger.debug("Endpoint <" + endpoint_name + "> started, waited " + std::to_string(to_ms(lease.WaitTime())) +
+	             " ms for a connection, pool has " + std::to_string(pool.open) + " open and " +
+	             std::to_string(pool.idle) + " idle connections, " + std::to_string(pool.reused) + " reused, " +
+	             std::to_string(pool.created) + " created, waited " + std::to_string(pool.waits) + " times for " +
+	             std::to_string(to_ms(pool.wait_time)) + " ms in total");
+
+	if (watchdog && server_context) {
+		watch.emplace(*watchdog, endpoint_name, [server_context]() { return server_context->IsCancelled(); },
+		              server_context->deadline());
+		watch->AddConnection(con);
+	}
 }
 
 RequestContext::~RequestContext() {
-	if (con.HasActiveTransaction() && !con.IsAutoCommit()) {
+	// Nothing interrupts the connection once the watch has stopped
+	std::string cancelled_reason;
+	if (watch) {
+		watch->Stop();
+		cancelled_reason = watch->Reason();
+		watch.reset();
+	}
+	if (!cancelled_reason.empty()) {
+		// The connection may still see an interrupt meant for the request. Closing
+		// it rolls back its transaction, which drops the staging and LAR tables
+		// created in it, and frees its memory right away.
+		logger.warning("Endpoint <" + endpoint_name + "> was " + cancelled_reason + ", closing its connection");
+		lease.Discard();
+	} else if (con.HasActiveTransaction() && !con.IsAutoCommit()) {
 		con.Rollback();
 	}
+	if (commit_count > 0) {
+		logger.info("Endpoint <" + endpoint_name + "> committed " + std::to_string(commit_count) +
+		            " transaction(s) in " + std::to_string(to_ms(commit_time)) + " ms");
+	}
+	if (retry_policy.Retries() > 0) {
+		logger.info("Endpoint <" + endpoint_name + "> retried " + std::to_string(retry_policy.Retries()) +
+		            " step(s), waited " + std::to_string(retry_policy.Delay().count()) + " ms between attempts");
+	}
 	logger.debug("Endpoint <" + endpoint_name + "> completed");
-}
\ No newline at end of file
+}
+
+void RequestContext::BeginTransaction() {
+	con.BeginTransaction();
+}
+
+void RequestContext::Commit() {
+	if (Cancelled()) {
+		throw std::runtime_error("Endpoint <" + endpoint_name + "> was " + watch->Reason() +
+		                         ", not committing its changes");
+	}
+	const auto start = std::chrono::steady_clock::now();
+	// This throws any errors during commit
+	con.Commit();
+	commit_time += std::chrono::steady_clock::now() - start;
+	commit_count++;
+}
+
+std::optional<ConnectionPool::Lease> RequestContext::TryAcquireConnection() {
+	return connection_factory.TryAcquireConnection(md_token, db_name);
+}
+
+mdlog::Logger RequestContext::CreateLogger(ConnectionPool::Lease& lease) {
+	return get_logger_for_env(lease);
+}
+
+void RequestContext::Rollback() {
+	if (watch) {
+		watch->Stop();
+	}
+	if (con.HasActiveTransaction() && !con.IsAutoCommit()) {
+		con.Rollback();
+	}
+}
+
+RequestContext::WatchedConnection::WatchedConnection(RequestContext& ctx_, ConnectionPool::Lease& lease_)
+    : ctx(ctx_), lease(lease_) {
+	if (ctx.watch) {
+		ctx.watch->AddConnection(lease.Connection());
+	}
+}
+
+RequestContext::WatchedConnection::~WatchedConnection() {
+	if (ctx.watch) {
+		ctx.watch->RemoveConnection(lease.Connection());
+	}
+	if (ctx.Cancelled()) {
+		lease.Discard();
+	}
+}
@@ -0,0 +1,98 @@
+#include "request_executor.hpp"
+
+#include "md_logging.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace {
+/// Tasks that waited longer than this in the queue are logged
+constexpr std::chrono::milliseconds LOGGED_QUEUE_TIME {1000};
+} // namespace
+
+RequestExecutor::RequestExecutor(std::string name_, const std::size_t threads_count,
+                                 std::map<std::string, std::size_t> limits_)
+    : name(std::move(name_)), limits(std::move(limits_)) {
+	for (std::size_t i = 0; i < std::max<std::size_t>(1, threads_count); i++) {
+		threads.emplace_back([this]() { work(); });
+	}
+}
+
+RequestExecutor::~RequestExecutor() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	changed.notify_all();
+	for (auto& thread : threads) {
+		thread.join();
+	}
+}
+
+void RequestExecutor::Submit(const std::string& key, std::function<void()> task) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back(queued_task {key, std::move(task), std::chrono::steady_clock::now()});
+	}
+	changed.notify_one();
+}
+
+RequestExecutor::stats RequestExecutor::Stats() {
+	std::lock_guard<std::mutex> lock(mutex);
+	std::size_t running_count = 0;
+	for (const auto& [key, count] : running) {
+		running_count += count;
+	}
+	return stats {queue.size(), running_count};
+}
+
+std::deque<RequestExecutor::queued_task>::iterator RequestExecutor::find_runnable() {
+	return std::find_if(queue.begin(), queue.end(), [this](const queued_task& task) {
+		const auto limit = limits.find(task.key);
+		return limit == limits.end() || running[task.key] < limit->second;
+	});
+}
+
+void RequestExecutor::work() {
+	auto logger = mdlog::Logger::CreateStdoutLogger();
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		auto next = queue.end();
+		changed.wait(lock, [&]() {
+			next = find_runnable();
+			return next != queue.end() || (stopping && queue.empty());
+		});
+		if (next == queue.end()) {
+			return;
+		}
+
+		auto task = std::move(*next);
+		queue.erase(next);
+		running[task.key]++;
+		lock.unlock();
+
+		const auto queue_time = std::chrono::steady_clock::now() - task.queued_at;
+		if (queue_time > LOGGED_QUEUE_TIME) {
+			logger.info("RequestExecutor " + name + ": " + task.key + " waited " +
+			            std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(queue_time).count()) +
+			            " ms to run");
+		}
+		try {
+			task.run();
+		} catch (const std::exception& ex) {
+			// Tasks report their own errors, this is a last resort
+			logger.severe("RequestExecutor " + name + ": " + task.key + " failed: " + ex.what());
+		}
+
+		lock.lock();
+		running[task.key]--;
+		changed.notify_all();
+	}
+}
@@ -0,0 +1,110 @@
+#include "resource_governor.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+constexpr std::int64_t MIB = 1024 * 1024;
+/// Share of the container memory that the DuckDB instances get together
+constexpr std::int64_t INSTANCE_MEMORY_PERCENT = 75;
+/// Below this, queries fail rather than spill
+constexpr std::int64_t MIN_INSTANCE_MEMORY = 64 * MIB;
+/// cgroup v1 reports no limit as a page-aligned INT64_MAX
+constexpr std::int64_t V1_UNLIMITED = std::int64_t(1) << 62;
+
+/// The whitespace-separated fields of the first line of `path`, empty if it
+/// cannot be read
+std::vector<std::string> read_fields(const std::string& path) {
+	std::ifstream file(path);
+	std::string line;
+	if (!file || !std::getline(file, line)) {
+		return {};
+	}
+	std::istringstream stream(line);
+	std::vector<std::string> fields;
+	std::string field;
+	while (stream >> field) {
+		fields.push_back(field);
+	}
+	return fields;
+}
+
+std::optional<std::int64_t> parse_int(const std::string& value) {
+	try {
+		return std::stoll(value);
+	} catch (const std::exception&) {
+		return std::nullopt;
+	}
+}
+
+std::optional<std::size_t> cpus_of_quota(const std::optional<std::int64_t> quota,
+                                         const std::optional<std::int64_t> period) {
+	if (!quota || !period || *quota <= 0 || *period <= 0) {
+		return std::nullopt;
+	}
+	return static_cast<std::size_t>(std::max<std::int64_t>(1, (*quota + *period - 1) / *period));
+}
+
+std::optional<std::size_t> read_cpus(const std::string& cgroup_root) {
+	// v2: "<quota> <period>", or "max <period>" without a limit
+	const auto v2 = read_fields(cgroup_root + "/cpu.max");
+	if (v2.size() == 2) {
+		return v2[0] == "max" ? std::nullopt : cpus_of_quota(parse_int(v2[0]), parse_int(v2[1]));
+	}
+	// v1: a quota of -1 means no limit
+	const auto quota = read_fields(cgroup_root + "/cpu/cpu.cfs_quota_us");
+	const auto period = read_fields(cgroup_root + "/cpu/cpu.cfs_period_us");
+	if (quota.size() == 1 && period.size() == 1) {
+		return cpus_of_quota(parse_int(quota[0]), parse_int(period[0]));
+	}
+	return std::nullopt;
+}
+
+std::optional<std::int64_t> read_memory(const std::string& cgroup_root) {
+	const auto v2 = read_fields(cgroup_root + "/memory.max");
+	if (v2.size() == 1) {
+		return v2[0] == "max" ? std::nullopt : parse_int(v2[0]);
+	}
+	const auto v1 = read_fields(cgroup_root + "/memory/memory.limit_in_bytes");
+	if (v1.size() == 1) {
+		const auto bytes = parse_int(v1[0]);
+		if (bytes && *bytes < V1_UNLIMITED) {
+			return bytes;
+		}
+	}
+	return std::nullopt;
+}
+} // namespace
+
+namespace resource_governor {
+cgroup_limits ReadCgroupLimits(const std::string& cgroup_root) {
+	return cgroup_limits {read_cpus(cgroup_root), read_memory(cgroup_root)};
+}
+
+instance_budget Budget(const cgroup_limits& limits, const std::size_t instances) {
+	instance_budget budget;
+	if (limits.cpus) {
+		// A cpuset may allow fewer cores than the quota
+		const auto cores = static_cast<std::size_t>(std::thread::hardware_concurrency());
+		budget.threads = cores == 0 ? *limits.cpus : std::min(*limits.cpus, cores);
+	}
+	if (limits.memory_bytes) {
+		const auto shares = static_cast<std::int64_t>(std::max<std::size_t>(1, instances));
+		const auto per_instance = *limits.memory_bytes * INSTANCE_MEMORY_PERCENT / 100 / shares;
+		budget.memory_limit = FormatMemoryLimit(std::max(MIN_INSTANCE_MEMORY, per_instance));
+	}
+	return budget;
+}
+
+std::string FormatMemoryLimit(const std::int64_t bytes) {
+	return std::to_string(bytes / MIB) + "MiB";
+}
+} // namespace resource_governor
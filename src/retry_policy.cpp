@@ -0,0 +1,103 @@
+#include "retry_policy.hpp"
+
+#include "config.hpp"
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace {
+bool contains(const std::string& haystack, const char* needle) {
+	return haystack.find(needle) != std::string::npos;
+}
+} // namespace
+
+RetryPolicy::options RetryPolicy::options::FromEnvironment() {
+	options opts;
+	const auto max_attempts = config::env_int("MD_RETRY_MAX_ATTEMPTS", static_cast<std::int64_t>(opts.max_attempts));
+	opts.max_attempts = static_cast<std::size_t>(std::max<std::int64_t>(1, max_attempts));
+	const auto budget = config::env_int("MD_RETRY_BUDGET", static_cast<std::int64_t>(opts.budget));
+	opts.budget = static_cast<std::size_t>(std::max<std::int64_t>(0, budget));
+	const auto max_delay = config::env_int("MD_RETRY_MAX_DELAY_MS", opts.max_delay.count());
+	opts.max_delay = std::chrono::milliseconds(std::max<std::int64_t>(opts.base_delay.count(), max_delay));
+	return opts;
+}
+
+RetryPolicy::RetryPolicy(options opts_, mdlog::Logger& logger_)
+    : opts(std::move(opts_)), logger(logger_), previous_delay(opts.base_delay), gen(std::random_device {}()) {
+}
+
+RetryPolicy::error_kind RetryPolicy::Classify(const std::string& error_message) {
+	const auto message = duckdb::StringUtil::Lower(error_message);
+	// A cancelled request must not start over
+	if (contains(message, "interrupt")) {
+		return error_kind::permanent;
+	}
+	if (contains(message, "conflict") && contains(message, "transaction")) {
+		return error_kind::conflict;
+	}
+	if (contains(message, "connection error") || contains(message, "http error") ||
+	    contains(message, "network error") || contains(message, "connection reset") ||
+	    contains(message, "timed out")) {
+		return error_kind::transient;
+	}
+	return error_kind::permanent;
+}
+
+std::chrono::milliseconds RetryPolicy::next_delay() {
+	std::uniform_int_distribution<std::int64_t> dis(opts.base_delay.count(),
+	                                                std::max(opts.base_delay.count(), previous_delay.count() * 3));
+	previous_delay = std::min(opts.max_delay, std::chrono::milliseconds(dis(gen)));
+	return previous_delay;
+}
+
+void RetryPolicy::Run(duckdb::Connection& con, const std::string& step_name, const idempotency step_idempotency,
+                      const std::function<void()>& step) {
+	const auto in_transaction = [&con]() {
+		return con.HasActiveTransaction() && !con.IsAutoCommit();
+	};
+	// The error would have aborted the caller's transaction
+	const bool caller_transaction = in_transaction();
+
+	for (std::size_t attempt = 1;; attempt++) {
+		try {
+			step();
+			return;
+		} catch (const std::exception& ex) {
+			if (caller_transaction || attempt >= opts.max_attempts || retries >= opts.budget) {
+				throw;
+			}
+			const auto kind = Classify(ex.what());
+			if (kind == error_kind::permanent ||
+			    (kind == error_kind::transient && step_idempotency != idempotency::idempotent)) {
+				throw;
+			}
+			if (in_transaction()) {
+				const auto original = std::current_exception();
+				try {
+					con.Rollback();
+				} catch (const std::exception&) {
+					// The connection is unusable, the original error tells why
+					std::rethrow_exception(original);
+				}
+			}
+
+			const auto delay = next_delay();
+			retries++;
+			total_delay += delay;
+			logger.warning("RetryPolicy: " + step_name + " failed (attempt " + std::to_string(attempt) + " of " +
+			               std::to_string(opts.max_attempts) + "), retrying in " + std::to_string(delay.count()) +
+			               " ms, " + std::to_string(opts.budget - retries) +
+			               " retries left for the request: " + ex.what());
+			std::this_thread::sleep_for(delay);
+		}
+	}
+}
@@ -0,0 +1,45 @@
+#include "schema_cache.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
+
+std::shared_ptr<const SchemaCache::schema_tables>
+SchemaCache::Get(const std::string& instance_key, const std::string& db_name, const std::string& schema_name) {
+	std::lock_guard<std::mutex> lock(mutex);
+	const auto it = schemas.find({instance_key, db_name, schema_name});
+	if (it == schemas.end()) {
+		return nullptr;
+	}
+	if (std::chrono::steady_clock::now() - it->second.loaded_at > ttl) {
+		schemas.erase(it);
+		return nullptr;
+	}
+	return it->second.tables;
+}
+
+std::uint64_t SchemaCache::Generation() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return generation;
+}
+
+void SchemaCache::Put(const std::string& instance_key, const std::string& db_name, const std::string& schema_name,
+                      std::shared_ptr<const schema_tables> tables, const std::uint64_t generation_before_load) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (generation != generation_before_load) {
+		// Some schema changed while this one was loaded; it may have been this one
+		return;
+	}
+	schemas[{instance_key, db_name, schema_name}] = entry {std::move(tables), std::chrono::steady_clock::now()};
+}
+
+void SchemaCache::Invalidate(const std::string& instance_key, const std::string& db_name,
+                             const std::string& schema_name) {
+	std::lock_guard<std::mutex> lock(mutex);
+	schemas.erase({instance_key, db_name, schema_name});
+	generation++;
+}
@@ -0,0 +1,45 @@
+#include "sql_builder.hpp"
+
+#include "schema_types.hpp"
+
+#include <fmt/format.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+void append_quoted(fmt::memory_buffer& out, const std::string_view text, const char quote) {
+	out.push_back(quote);
+	std::size_t start = 0;
+	for (auto pos = text.find(quote); pos != std::string_view::npos; pos = text.find(quote, start)) {
+		// Copy everything up to and including the quote, then double it
+		out.append(text.substr(start, pos - start + 1));
+		out.push_back(quote);
+		start = pos + 1;
+	}
+	out.append(text.substr(start));
+	out.push_back(quote);
+}
+
+std::vector<quoted_column> quote_columns(const std::vector<const column_def*>& columns) {
+	std::vector<quoted_column> quoted;
+	quoted.reserve(columns.size());
+	for (const auto* col : columns) {
+		fmt::memory_buffer name;
+		append_quoted(name, col->name, '"');
+		quoted.push_back(quoted_column {col, fmt::to_string(name)});
+	}
+	return quoted;
+}
+
+SqlBuilder& SqlBuilder::operator<<(const table_def& table) {
+	append_quoted(buffer, table.db_name, '"');
+	buffer.push_back('.');
+	append_quoted(buffer, table.schema_name, '"');
+	buffer.push_back('.');
+	append_quoted(buffer, table.table_name, '"');
+	return *this;
+}
+
+SqlBuilder& SqlBuilder::join_names(const std::vector<quoted_column>& columns, const std::string_view sep) {
+	return join(columns, sep, [](SqlBuilder& out, const quoted_column& col) { out << col.name; });
+}
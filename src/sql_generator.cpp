@@ -4,22 +4,23 @@
 #include "fivetran_duckdb_interop.hpp"
 #include "md_error.hpp"
 #include "md_logging.hpp"
+#include "retry_policy.hpp"
+#include "schema_cache.hpp"
 #include "schema_types.hpp"
+#include "sql_builder.hpp"
 
+#include <array>
 #include <chrono>
 #include <cstdint>
 #include <fmt/format.h>
-#include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
-#include <random>
 #include <ranges>
 #include <set>
-#include <sstream>
 #include <stdexcept>
 #include <string>
-#include <thread>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -69,38 +70,144 @@ private:
 	bool has_begun;
 };
 
-namespace {
-// Utility
+/// Invalidates the cached schema of a table when a DDL method starts and again
+/// when it returns or throws. The second invalidation discards what other
+/// requests may have loaded while the change was in progress.
+class SchemaChange {
+public:
+	SchemaChange(SchemaCache* cache_, const std::string& instance_key_, const table_def& table_)
+	    : cache(cache_), instance_key(instance_key_), db_name(table_.db_name), schema_name(table_.schema_name) {
+		invalidate();
+	}
+
+	~SchemaChange() {
+		invalidate();
+	}
 
-const auto to_name = [](std::ostream& out, const column_def* column) {
-	out << column->quoted();
+	SchemaChange(const SchemaChange&) = delete;
+	SchemaChange& operator=(const SchemaChange&) = delete;
+
+private:
+	void invalidate() const {
+		if (cache) {
+			cache->Invalidate(instance_key, db_name, schema_name);
+		}
+	}
+
+	SchemaCache* cache;
+	std::string instance_key;
+	std::string db_name;
+	std::string schema_name;
 };
 
-std::string make_full_column_list(const std::vector<const column_def*>& columns_pk,
-                                  const std::vector<const column_def*>& columns_regular) {
-	std::ostringstream full_column_list;
+namespace {
+// Utility
 
+void write_full_column_list(SqlBuilder& sql, const std::vector<quoted_column>& columns_pk,
+                            const std::vector<quoted_column>& columns_regular) {
 	if (!columns_pk.empty()) {
-		join(full_column_list, columns_pk, to_name);
+		sql.join_names(columns_pk);
 		// tiny troubleshooting assist; primary columns are separated from regular columns by 2 spaces
-		full_column_list << ",  ";
+		sql << ",  ";
 	}
 
-	join(full_column_list, columns_regular, to_name);
+	sql.join_names(columns_regular);
+}
+
+/// The number of rows that an INSERT, UPDATE, DELETE or MERGE statement changed
+std::int64_t affected_rows(duckdb::MaterializedQueryResult& result) {
+	return result.RowCount() == 0 ? 0 : result.GetValue(0, 0).GetValue<int64_t>();
+}
 
-	return full_column_list.str();
+/// Appends an ORDER BY clause, so that the inserted rows land in the table
+/// clustered by `order_by`. Nothing if it is empty.
+void write_order_by(SqlBuilder& sql, const std::vector<const column_def*>& order_by) {
+	if (!order_by.empty()) {
+		sql << " ORDER BY ";
+		sql.join_names(quote_columns(order_by));
+	}
 }
 
-std::string primary_key_join(std::vector<const column_def*>& columns_pk, const std::string tbl1,
-                             const std::string tbl2) {
-	return join(columns_pk, " AND ", [&tbl1, &tbl2](std::ostream& out, const column_def* col) {
-		const auto quoted = col->quoted();
-		out << tbl1 << "." << quoted << " = " << tbl2 << "." << quoted;
+void write_primary_key_join(SqlBuilder& sql, const std::vector<quoted_column>& columns_pk, const std::string_view tbl1,
+                            const std::string_view tbl2) {
+	sql.join(columns_pk, " AND ", [&tbl1, &tbl2](SqlBuilder& out, const quoted_column& col) {
+		out << tbl1 << '.' << col.name << " = " << tbl2 << '.' << col.name;
 	});
 }
+
+/// Tables created by generate_temp_table_name that drop_leaked_temp_tables
+/// cleans up. The latest_active_records tables are TEMP tables nowadays, but
+/// older versions created them in the target database.
+constexpr std::array<std::string_view, 3> LEAKABLE_TABLE_PREFIXES = {
+    "__fivetran_ingest_staging", "__fivetran_latest_active_records", "__fivetran_history_matches"};
+
+/// Staged batches with at most this many rows get an exact IN list of their
+/// keys instead of a min/max range
+constexpr std::int64_t MAX_KEY_FILTER_IN_LIST = 1000;
+
+/// Whether a constant filter on a column of this type can be used for row
+/// group pruning. BOOLEAN is pointless, BLOBs do not keep min/max statistics.
+bool supports_key_filter(const duckdb::LogicalTypeId type) {
+	switch (type) {
+	case duckdb::LogicalTypeId::INVALID:
+	case duckdb::LogicalTypeId::BOOLEAN:
+	case duckdb::LogicalTypeId::BLOB:
+		return false;
+	default:
+		return true;
+	}
+}
+
+/// Reads a column_def from the duckdb_columns() values column_name,
+/// data_type_id, column_default, NOT is_nullable, numeric_precision and
+/// numeric_scale, starting at index `first`.
+// TBD is_identity is never set, used is_nullable=no temporarily but really
+// should use duckdb_constraints table.
+column_def read_column_def(const duckdb::ColumnDataRow& row, const idx_t first) {
+	const auto column_type = static_cast<duckdb::LogicalTypeId>(row.GetValue(first + 1).GetValue<int8_t>());
+	column_def col {row.GetValue(first).GetValue<duckdb::string>(),
+	                column_type,
+	                row.GetValue(first + 2).GetValue<duckdb::string>(),
+	                row.GetValue(first + 3).GetValue<bool>(),
+	                0,
+	                0};
+	if (column_type == duckdb::LogicalTypeId::DECIMAL) {
+		col.width = row.GetValue(first + 4).GetValue<uint8_t>();
+		col.scale = row.GetValue(first + 5).GetValue<uint8_t>();
+	}
+	return col;
+}
+
+/// Writes `table.col` cast to the type of `col`. Update files are staged with
+/// all_varchar=true, so their columns do not compare with typed columns.
+void write_typed_column(SqlBuilder& sql, const quoted_column& col, const std::string_view table) {
+	sql << "CAST(" << table << '.' << col.name << " AS " << format_type(*col.def) << ')';
+}
+
+const column_def& find_history_column(const std::vector<const column_def*>& columns, const std::string_view name) {
+	for (const auto* col : columns) {
+		if (col->name == name) {
+			return *col;
+		}
+	}
+	throw std::runtime_error("History mode table is missing column <" + std::string(name) + ">");
+}
+
+/// The value a column gets from the staging table in an update, i.e. a
+/// base64-decoded BLOB or the plain value
+void write_staging_value(SqlBuilder& sql, const quoted_column& col, const std::string_view staging_table_name) {
+	if (col.def->type == duckdb::LogicalTypeId::BLOB) {
+		sql << "from_base64(" << staging_table_name << '.' << col.name << ')';
+	} else {
+		sql << staging_table_name << '.' << col.name;
+	}
+}
 } // namespace
 
-MdSqlGenerator::MdSqlGenerator(mdlog::Logger& logger_) : logger(logger_) {
+MdSqlGenerator::MdSqlGenerator(mdlog::Logger& logger_, SchemaCache* schema_cache_, RetryPolicy* retry_policy_,
+                               std::string instance_key_)
+    : logger(logger_), schema_cache(schema_cache_), retry_policy(retry_policy_),
+      instance_key(std::move(instance_key_)) {
 }
 
 std::string MdSqlGenerator::generate_temp_table_name(duckdb::Connection& con, const std::string& prefix) const {
@@ -110,43 +217,133 @@ std::string MdSqlGenerator::generate_temp_table_name(duckdb::Connection& con, co
 	}
 	assert(current_db_res->RowCount() == 1);
 	assert(current_db_res->ColumnCount() == 1);
-	const std::string current_db = current_db_res->GetValue(0, 0).ToString();
-	const std::string current_path = KeywordHelper::WriteQuoted(current_db, '"') + ".\"main\"";
-
-	constexpr uint_fast8_t MAX_ATTEMPTS = 10; // This should be more than enough
-	for (uint_fast8_t i = 0; i < MAX_ATTEMPTS; i++) {
-		const std::string table_name = prefix + duckdb::StringUtil::GenerateRandomName(16);
-		const std::string fqn_name = current_path + "." + KeywordHelper::WriteQuoted(table_name, '"');
-		const std::string check_query =
-		    "FROM (SHOW TABLES FROM " + current_path + ") WHERE name = " + KeywordHelper::WriteQuoted(table_name, '\'');
-		const auto check_res = con.Query(check_query);
-		if (check_res->HasError()) {
-			logger.severe("Could not check for existence of temporary table <" + table_name +
-			              ">: " + check_res->GetError());
-			// Optimistically use this name in case there was an error during checking
-			return fqn_name;
-		}
+	return generate_temp_table_name(current_db_res->GetValue(0, 0).ToString(), prefix);
+}
 
-		// If there is no such table, we can use this name
-		if (check_res->RowCount() == 0) {
-			return fqn_name;
-		}
+std::string MdSqlGenerator::generate_temp_table_name(const std::string& db_name, const std::string& prefix) {
+	const auto created_at =
+	    std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+	// <prefix>_<unix seconds>_<random>, see drop_leaked_temp_tables. 32 random
+	// hex digits make collisions practically impossible, so there is no need to
+	// check the catalog for an existing table.
+	const std::string table_name =
+	    prefix + "_" + std::to_string(created_at) + "_" + duckdb::StringUtil::GenerateRandomName(32);
+	SqlBuilder fqn;
+	fqn << ident(db_name) << ".\"main\"." << ident(table_name);
+	return fqn.str();
+}
+
+void MdSqlGenerator::drop_leaked_temp_tables(duckdb::Connection& con, const std::chrono::seconds max_age) const {
+	const auto now =
+	    std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch());
+	const auto cutoff = (now - max_age).count();
+
+	// Names without a creation time were generated by older versions of the
+	// connector. They are always considered leaked.
+	SqlBuilder find;
+	find << "SELECT schema_name, table_name FROM duckdb_tables() WHERE database_name = current_database()"
+	     << " AND NOT temporary AND (";
+	find.join(LEAKABLE_TABLE_PREFIXES, " OR ", [](SqlBuilder& out, const std::string_view prefix) {
+		out << "starts_with(table_name, " << literal(prefix) << ')';
+	});
+	find.format(") AND coalesce(TRY_CAST(regexp_extract(table_name, '_([0-9]+)_[^_]+$', 1) AS BIGINT) < {}, true)",
+	            cutoff);
+	const auto leaked = con.Query(find.str());
+	if (leaked->HasError()) {
+		logger.warning("drop_leaked_temp_tables: could not list leaked tables: " + leaked->GetError());
+		return;
+	}
+	if (leaked->RowCount() == 0) {
+		logger.info("drop_leaked_temp_tables: no leaked tables found");
+		return;
 	}
 
-	throw std::runtime_error("Could not generate a unique temporary table name after " + std::to_string(MAX_ATTEMPTS) +
-	                         " attempts");
+	// All DROPs go to the server in one request
+	SqlBuilder drop;
+	for (idx_t row = 0; row < leaked->RowCount(); row++) {
+		drop << "DROP TABLE IF EXISTS " << ident(leaked->GetValue(0, row).ToString()) << '.'
+		     << ident(leaked->GetValue(1, row).ToString()) << ";\n";
+	}
+	const auto query = drop.str();
+	logger.info("drop_leaked_temp_tables: dropping " + std::to_string(leaked->RowCount()) + " tables: " + query);
+	const auto result = con.Query(query);
+	if (result->HasError()) {
+		logger.warning("drop_leaked_temp_tables: could not drop leaked tables: " + result->GetError());
+	}
 }
 
 void MdSqlGenerator::run_query(duckdb::Connection& con, const std::string& log_prefix, const std::string& query,
                                const std::string& error_message) const {
-	logger.info(log_prefix + ": " + query);
-	const auto result = con.Query(query);
+	const auto run = [&]() {
+		logger.info(log_prefix + ": " + query);
+		const auto result = con.Query(query);
+		if (result->HasError()) {
+			throw std::runtime_error(error_message + ": " + result->GetError());
+		}
+	};
+	if (!retry_policy) {
+		run();
+		return;
+	}
+	// Outside of a transaction, the statement is a transaction of its own
+	retry_policy->Run(con, log_prefix, RetryPolicy::idempotency::not_idempotent, run);
+}
+
+std::shared_ptr<const SchemaCache::schema_tables> MdSqlGenerator::cached_schema(duckdb::Connection& con,
+                                                                                const table_def& table) const {
+	// Inside a transaction, the catalog may contain uncommitted changes of this
+	// connection that must neither be cached nor hidden by the cache
+	if (!schema_cache || con.HasActiveTransaction()) {
+		return nullptr;
+	}
+	if (auto tables = schema_cache->Get(instance_key, table.db_name, table.schema_name)) {
+		return tables;
+	}
+
+	const auto generation = schema_cache->Generation();
+	const std::string query = "SELECT c.table_name, t.table_oid IS NOT NULL, k.table_oid IS NOT NULL, "
+	                          "c.column_name, c.data_type_id, c.column_default, NOT c.is_nullable, "
+	                          "c.numeric_precision, c.numeric_scale "
+	                          "FROM duckdb_columns() c LEFT JOIN duckdb_tables() t "
+	                          "ON c.database_oid = t.database_oid AND c.table_oid = t.table_oid "
+	                          "LEFT JOIN (SELECT DISTINCT database_oid, table_oid FROM duckdb_constraints() "
+	                          "WHERE database_name=? AND schema_name=? AND constraint_type='PRIMARY KEY') k "
+	                          "ON c.database_oid = k.database_oid AND c.table_oid = k.table_oid "
+	                          "WHERE c.database_name=? AND c.schema_name=? "
+	                          "ORDER BY c.table_name, c.column_index";
+	const std::string err = "Could not describe schema <" + table.db_name + "." + table.schema_name + ">";
+	logger.info("describe_schema: " + query);
+	auto statement = con.Prepare(query);
+	if (statement->HasError()) {
+		throw std::runtime_error(err + " (at bind step): " + statement->GetError());
+	}
+	duckdb::vector<duckdb::Value> params = {duckdb::Value(table.db_name), duckdb::Value(table.schema_name),
+	                                        duckdb::Value(table.db_name), duckdb::Value(table.schema_name)};
+	auto result = statement->Execute(params, false);
 	if (result->HasError()) {
-		throw std::runtime_error(error_message + ": " + result->GetError());
+		throw std::runtime_error(err + ": " + result->GetError());
 	}
+
+	auto loaded = std::make_shared<SchemaCache::schema_tables>();
+	for (const auto& row : result->Cast<duckdb::MaterializedQueryResult>().Collection().GetRows()) {
+		auto& cached = (*loaded)[row.GetValue(0).GetValue<duckdb::string>()];
+		cached.is_table = row.GetValue(1).GetValue<bool>();
+		cached.primary_key = row.GetValue(2).GetValue<bool>();
+		cached.columns.push_back(read_column_def(row, 3));
+	}
+	logger.info("describe_schema: loaded " + std::to_string(loaded->size()) + " tables");
+
+	schema_cache->Put(instance_key, table.db_name, table.schema_name, loaded, generation);
+	return loaded;
 }
 
 bool MdSqlGenerator::table_exists(duckdb::Connection& con, const table_def& table) const {
+	if (const auto tables = cached_schema(con, table)) {
+		const auto it = tables->find(table.table_name);
+		return it != tables->end() && it->second.is_table;
+	}
+
 	const std::string query = "SELECT table_name FROM duckdb_tables() WHERE "
 	                          "database_name=? AND schema_name=? AND table_name=?";
 	const std::string err_prefix = "Could not find whether table <" + table.to_escaped_string() + "> exists";
@@ -172,60 +369,37 @@ duckdb::unique_ptr<duckdb::MaterializedQueryResult> create_schema_if_not_exists(
                                                                                 const std::string& db_name,
                                                                                 const std::string& schema_name,
                                                                                 mdlog::Logger& logger) {
-	std::ostringstream ddl;
-	ddl << "CREATE SCHEMA IF NOT EXISTS " << KeywordHelper::WriteQuoted(db_name, '"') << "."
-	    << KeywordHelper::WriteQuoted(schema_name, '"');
+	SqlBuilder ddl;
+	ddl << "CREATE SCHEMA IF NOT EXISTS " << ident(db_name) << '.' << ident(schema_name);
 	const std::string query = ddl.str();
 	logger.info("create_schema_if_not_exists: " + query);
 	return con.Query(query);
 }
 
-/// Retries the given idempotent operation after a short delay if it fails due to a transaction write-write conflict.
-/// @param operation An idempotent operation to execute and potentially retry if it fails due to a write-write conflict.
-/// @param max_retries The maximum number of retries before giving up and returning the last error result.
-duckdb::unique_ptr<duckdb::MaterializedQueryResult>
-retry_transaction_errors(const std::function<duckdb::unique_ptr<duckdb::MaterializedQueryResult>()>& operation,
-                         const uint_fast8_t max_retries = 8) {
-	uint_fast8_t attempt = 0;
-	duckdb::unique_ptr<duckdb::MaterializedQueryResult> result = operation();
-
-	while (result->HasError() && attempt < max_retries) {
-		const auto& error_data = result->GetErrorObject();
-		// We only retry transaction conflicts
-		if (error_data.Type() != duckdb::ExceptionType::TRANSACTION ||
-		    error_data.RawMessage().find("Catalog write-write conflict") == std::string::npos) {
-			break;
-		}
-
-		// Since function has been built with `CREATE SCHEMA IF NOT EXISTS` queries in mind.
-		// The assumption here is that we have a short queue of connections doing short-lived transactions on the same
-		// catalog object, and that this queue is not growing. We expect at least one transaction to be successful
-		// per round/attempt, hence we retry maximum 8 times (number of parallel threads in Fivetran). We add a bit of
-		// jitter to reduce the chance of conflicts and therefore retries.
-		thread_local std::mt19937 gen(std::random_device {}());
-		// It is fine to retry immediately (i.e. 0 ms delay), but in the common case, we wait for a short amount of
-		// time.
-		std::uniform_int_distribution<std::uint_fast8_t> dis(0, 100);
-		const auto delay_ms = dis(gen);
-		std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
-
-		result = operation();
-		attempt++;
-	}
-
-	return result;
-}
-
 } // namespace
 
 void MdSqlGenerator::create_schema_if_not_exists_with_retries(duckdb::Connection& con, const std::string& db_name,
                                                               const std::string& schema_name) const {
-	const auto create_result =
-	    retry_transaction_errors([&]() { return create_schema_if_not_exists(con, db_name, schema_name, logger); });
+	const auto create = [&]() {
+		const auto create_result = create_schema_if_not_exists(con, db_name, schema_name, logger);
+		if (create_result->HasError()) {
+			throw std::runtime_error("Could not create schema <" + schema_name + "> in database <" + db_name +
+			                         ">: " + create_result->GetError());
+		}
+	};
 
-	if (create_result->HasError()) {
-		throw std::runtime_error("Could not create schema <" + schema_name + "> in database <" + db_name +
-		                         ">: " + create_result->GetError());
+	// Concurrent connections that create the same schema conflict with each
+	// other. Within this process, WriteLocks serializes them; conflicts come
+	// from other processes writing to the same database. At least one of them
+	// succeeds per round, so the default attempts cover Fivetran's 8 parallel
+	// threads.
+	if (retry_policy) {
+		retry_policy->Run(con, "create_schema_if_not_exists", RetryPolicy::idempotency::idempotent, create);
+	} else {
+		RetryPolicy::options opts;
+		opts.max_attempts = 9;
+		RetryPolicy(opts, logger).Run(con, "create_schema_if_not_exists", RetryPolicy::idempotency::idempotent,
+		                              create);
 	}
 }
 
@@ -244,31 +418,37 @@ std::string get_default_value(duckdb::LogicalTypeId type) {
 
 void MdSqlGenerator::create_table(duckdb::Connection& con, const table_def& table,
                                   const std::vector<column_def>& all_columns,
-                                  const std::set<std::string>& columns_with_default_value) {
+                                  const std::set<std::string>& columns_with_default_value,
+                                  const bool primary_key_constraint) {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
 	const std::string absolute_table_name = table.to_escaped_string();
 
 	std::vector<const column_def*> columns_pk;
 	find_primary_keys(all_columns, columns_pk);
 
-	std::ostringstream ddl;
-	ddl << "CREATE TABLE " << absolute_table_name << " (";
+	SqlBuilder ddl;
+	ddl << "CREATE TABLE " << table << " (";
 
 	for (const auto& col : all_columns) {
-		ddl << KeywordHelper::WriteQuoted(col.name, '"') << " " << format_type(col);
+		ddl << ident(col.name) << ' ' << format_type(col);
 		if (columns_with_default_value.find(col.name) != columns_with_default_value.end()) {
-			ddl << " DEFAULT " + get_default_value(col.type);
+			ddl << " DEFAULT " << get_default_value(col.type);
+		}
+		if (col.primary_key && !primary_key_constraint) {
+			// describe_table reports NOT NULL columns as primary key columns
+			ddl << " NOT NULL";
 		}
 
 		ddl << ", "; // DuckDB allows trailing commas
 	}
 
-	if (!columns_pk.empty()) {
+	if (!columns_pk.empty() && primary_key_constraint) {
 		ddl << "PRIMARY KEY (";
-		join(ddl, columns_pk, to_name);
-		ddl << ")";
+		ddl.join_names(quote_columns(columns_pk));
+		ddl << ')';
 	}
 
-	ddl << ")";
+	ddl << ')';
 
 	const auto query = ddl.str();
 	logger.info("create_table: " + query);
@@ -287,9 +467,75 @@ void MdSqlGenerator::create_table(duckdb::Connection& con, const table_def& tabl
 	}
 }
 
+bool MdSqlGenerator::has_primary_key_constraint(duckdb::Connection& con, const table_def& table) const {
+	// Only a cached constraint is trusted: tables without one are about to get
+	// it, possibly by another process
+	if (const auto tables = cached_schema(con, table)) {
+		const auto it = tables->find(table.table_name);
+		if (it != tables->end() && it->second.primary_key) {
+			return true;
+		}
+	}
+
+	SqlBuilder sql;
+	sql << "SELECT 1 FROM duckdb_constraints() WHERE database_name = " << literal(table.db_name)
+	    << " AND schema_name = " << literal(table.schema_name) << " AND table_name = " << literal(table.table_name)
+	    << " AND constraint_type = 'PRIMARY KEY'";
+	const auto query = sql.str();
+	logger.info("has_primary_key_constraint: " + query);
+	const auto result = con.Query(query);
+	if (result->HasError()) {
+		throw std::runtime_error("Could not find the primary key of table <" + table.to_escaped_string() +
+		                         ">: " + result->GetError());
+	}
+	return result->RowCount() > 0;
+}
+
+bool MdSqlGenerator::table_is_empty(duckdb::Connection& con, const table_def& table) const {
+	SqlBuilder sql;
+	sql << "SELECT 1 FROM " << table << " LIMIT 1";
+	const auto result = con.Query(sql.str());
+	if (result->HasError()) {
+		throw std::runtime_error("Could not check whether table <" + table.to_escaped_string() +
+		                         "> is empty: " + result->GetError());
+	}
+	return result->RowCount() == 0;
+}
+
+void MdSqlGenerator::add_deferred_primary_key(duckdb::Connection& con, const table_def& table,
+                                              const std::vector<const column_def*>& columns_pk) const {
+	// One aggregation over the loaded rows instead of a failing index build,
+	// which would not tell which key is duplicated
+	SqlBuilder sql;
+	sql << "SELECT ";
+	sql.join_names(quote_columns(columns_pk));
+	sql << " FROM " << table << " GROUP BY ALL HAVING COUNT(*) > 1 LIMIT 1";
+	const auto query = sql.str();
+	logger.info("add_deferred_primary_key: " + query);
+	const auto result = con.Query(query);
+	if (result->HasError()) {
+		throw std::runtime_error("Could not check for duplicate primary keys in table <" + table.to_escaped_string() +
+		                         ">: " + result->GetError());
+	}
+	if (result->RowCount() > 0) {
+		std::string key;
+		for (idx_t i = 0; i < result->ColumnCount(); i++) {
+			key += (i == 0 ? "" : ", ") + result->GetValue(i, 0).ToString();
+		}
+		throw md_error::RecoverableError("Table " + table.schema_name + "." + table.table_name +
+		                                 " received more than one row with the primary key (" + key +
+		                                 "). Please check the primary key of the source table and trigger a "
+		                                 "historical re-sync.");
+	}
+
+	add_pks(con, columns_pk, table, "add_deferred_primary_key");
+}
+
 std::vector<column_def> MdSqlGenerator::describe_table(duckdb::Connection& con, const table_def& table) {
-	// TBD is_identity is never set, used is_nullable=no temporarily but really
-	// should use duckdb_constraints table.
+	if (const auto tables = cached_schema(con, table)) {
+		const auto it = tables->find(table.table_name);
+		return it == tables->end() ? std::vector<column_def> {} : it->second.columns;
+	}
 
 	std::vector<column_def> columns;
 
@@ -303,7 +549,9 @@ std::vector<column_def> MdSqlGenerator::describe_table(duckdb::Connection& con,
 	             "FROM duckdb_columns() "
 	             "WHERE database_name=? "
 	             "AND schema_name=? "
-	             "AND table_name=?";
+	             "AND table_name=? "
+	             // The order of the table
+	             "ORDER BY column_index";
 	const std::string err = "Could not describe table <" + table.to_escaped_string() + ">";
 	logger.info("describe_table: " + std::string(query));
 	auto statement = con.Prepare(query);
@@ -321,30 +569,23 @@ std::vector<column_def> MdSqlGenerator::describe_table(duckdb::Connection& con,
 	auto& materialized_result = result->Cast<duckdb::MaterializedQueryResult>();
 
 	for (const auto& row : materialized_result.Collection().GetRows()) {
-		duckdb::LogicalTypeId column_type = static_cast<duckdb::LogicalTypeId>(row.GetValue(1).GetValue<int8_t>());
-		column_def col {
-		    row.GetValue(0).GetValue<duckdb::string>(), column_type, row.GetValue(2).GetValue<duckdb::string>(),
-		    row.GetValue(3).GetValue<bool>(),           0,           0};
-		if (column_type == duckdb::LogicalTypeId::DECIMAL) {
-			col.width = row.GetValue(4).GetValue<uint8_t>();
-			col.scale = row.GetValue(5).GetValue<uint8_t>();
-		}
-		columns.push_back(col);
+		columns.push_back(read_column_def(row, 0));
 	}
 	return columns;
 }
 
 void MdSqlGenerator::add_column(duckdb::Connection& con, const table_def& table, const column_def& column,
                                 const std::string& log_prefix, const bool ignore_if_exists) const {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
 	// Add `column` to `table` and add a default value if present in the struct.
-	std::ostringstream sql;
-	sql << "ALTER TABLE " << table.to_escaped_string() << " ADD COLUMN ";
+	SqlBuilder sql;
+	sql << "ALTER TABLE " << table << " ADD COLUMN ";
 
 	if (ignore_if_exists) {
 		sql << " IF NOT EXISTS ";
 	}
 
-	sql << KeywordHelper::WriteQuoted(column.name, '"') << " " << format_type(column);
+	sql << ident(column.name) << ' ' << format_type(column);
 
 	if (column.column_default.has_value()) {
 		if (column.column_default.value() == "NULL") {
@@ -352,8 +593,7 @@ void MdSqlGenerator::add_column(duckdb::Connection& con, const table_def& table,
 		}
 		// We should not expect NULLs here according to fivetran, so we also cast
 		// the string "NULL" to the string "NULL" for varchar columns, not NULLs.
-		sql << " DEFAULT CAST(" << KeywordHelper::WriteQuoted(column.column_default.value(), '\'') << " AS "
-		    << format_type(column) << ")";
+		sql << " DEFAULT CAST(" << literal(column.column_default.value()) << " AS " << format_type(column) << ')';
 	}
 
 	return run_query(con, log_prefix, sql.str(),
@@ -362,13 +602,14 @@ void MdSqlGenerator::add_column(duckdb::Connection& con, const table_def& table,
 
 void MdSqlGenerator::drop_column(duckdb::Connection& con, const table_def& table, const std::string& column_name,
                                  const std::string& log_prefix, const bool not_exists_ok) const {
-	std::ostringstream sql;
-	sql << "ALTER TABLE " << table.to_escaped_string() << " DROP COLUMN ";
+	const SchemaChange schema_change(schema_cache, instance_key, table);
+	SqlBuilder sql;
+	sql << "ALTER TABLE " << table << " DROP COLUMN ";
 
 	if (not_exists_ok) {
 		sql << " IF EXISTS ";
 	}
-	sql << KeywordHelper::WriteQuoted(column_name, '"');
+	sql << ident(column_name);
 
 	return run_query(con, log_prefix, sql.str(),
 	                 "Could not drop column <" + column_name + "> of table <" + table.to_escaped_string() + ">");
@@ -398,10 +639,10 @@ void MdSqlGenerator::check_no_duplicate_primary_keys(duckdb::Connection& con, co
 	bool has_duplicates;
 
 	if (!existing_pk_columns_in_new_table.empty()) {
-		std::ostringstream sql;
+		SqlBuilder sql;
 		sql << "SELECT 1 FROM " << absolute_table_name << " GROUP BY ";
-		join(sql, existing_pk_columns_in_new_table,
-		     [](std::ostream& out, const std::string& col) { out << KeywordHelper::WriteQuoted(col, '"'); });
+		sql.join(existing_pk_columns_in_new_table, ", ",
+		         [](SqlBuilder& out, const std::string& col) { out << ident(col); });
 		sql << " HAVING COUNT(*) > 1 LIMIT 1";
 
 		const auto query = sql.str();
@@ -460,19 +701,19 @@ void MdSqlGenerator::alter_table_recreate(duckdb::Connection& con, const table_d
 	create_table(con, table, all_columns_in_new_table, new_primary_key_cols);
 
 	// reinsert the data from the old table
-	std::ostringstream out_column_list;
+	SqlBuilder out_column_list;
 	bool first = true;
 	for (auto& col : existing_columns_in_new_table) {
 		if (first) {
 			first = false;
 		} else {
-			out_column_list << ",";
+			out_column_list << ',';
 		}
-		out_column_list << KeywordHelper::WriteQuoted(col, '"');
+		out_column_list << ident(col);
 	}
 	std::string common_column_list = out_column_list.str();
 
-	std::ostringstream out;
+	SqlBuilder out;
 	out << "INSERT INTO " << absolute_table_name << " (" << common_column_list << ") SELECT " << common_column_list
 	    << " FROM " << absolute_temp_table_name;
 
@@ -493,11 +734,11 @@ void MdSqlGenerator::alter_table_in_place(duckdb::Connection& con, const table_d
 	auto absolute_table_name = table.to_escaped_string();
 
 	for (const auto& col_name : alter_types) {
-		std::ostringstream out;
+		SqlBuilder out;
 		out << "ALTER TABLE " << absolute_table_name << " ALTER ";
 		const auto& col = new_column_map.at(col_name);
 
-		out << KeywordHelper::WriteQuoted(col_name, '"') << " TYPE " << format_type(col);
+		out << ident(col_name) << " TYPE " << format_type(col);
 
 		run_query(con, "alter table change type", out.str(),
 		          "Could not alter type for column <" + col_name + "> in table <" + absolute_table_name + ">");
@@ -510,6 +751,9 @@ void MdSqlGenerator::alter_table_in_place(duckdb::Connection& con, const table_d
 
 void MdSqlGenerator::alter_table(duckdb::Connection& con, const table_def& table,
                                  const std::vector<column_def>& requested_columns, const bool drop_columns) {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
+	// The next WriteHistoryBatch rebuilds it with the new primary key
+	drop_active_records_table(con, table);
 	bool recreate_table = false;
 
 	auto absolute_table_name = table.to_escaped_string();
@@ -631,99 +875,164 @@ void MdSqlGenerator::alter_table(duckdb::Connection& con, const table_def& table
 	transaction_context.Commit();
 }
 
-void MdSqlGenerator::upsert(duckdb::Connection& con, const table_def& table, const std::string& staging_table_name,
-                            const std::vector<const column_def*>& columns_pk,
-                            const std::vector<const column_def*>& columns_regular) {
-
-	auto full_column_list = make_full_column_list(columns_pk, columns_regular);
-	const std::string absolute_table_name = table.to_escaped_string();
-	std::ostringstream sql;
-	sql << "INSERT INTO " << absolute_table_name << "(" << full_column_list << ") SELECT " << full_column_list
-	    << " FROM " << staging_table_name;
+std::string MdSqlGenerator::upsert_query(const table_def& table, const std::string& staging_table_name,
+                                         const std::vector<const column_def*>& columns_pk,
+                                         const std::vector<const column_def*>& columns_regular,
+                                         const std::vector<const column_def*>& order_by) {
+	const auto quoted_pk = quote_columns(columns_pk);
+	const auto quoted_regular = quote_columns(columns_regular);
+
+	SqlBuilder sql;
+	sql << "INSERT INTO " << table << '(';
+	write_full_column_list(sql, quoted_pk, quoted_regular);
+	sql << ") SELECT ";
+	write_full_column_list(sql, quoted_pk, quoted_regular);
+	sql << " FROM " << staging_table_name;
+	write_order_by(sql, order_by);
 
-	if (!columns_pk.empty()) {
+	if (!quoted_pk.empty()) {
 		sql << " ON CONFLICT (";
-		join(sql, columns_pk, to_name);
+		sql.join_names(quoted_pk);
 		sql << " ) DO UPDATE SET ";
 
-		join(sql, columns_regular, [](std::ostream& out, const column_def* column) {
-			const auto quoted_col = column->quoted();
-			out << quoted_col << " = excluded." << quoted_col;
+		sql.join(quoted_regular, ", ", [](SqlBuilder& out, const quoted_column& col) {
+			out << col.name << " = excluded." << col.name;
 		});
 	}
 
-	auto query = sql.str();
+	return sql.str();
+}
+
+void MdSqlGenerator::upsert(duckdb::Connection& con, const table_def& table, const std::string& staging_table_name,
+                            const std::vector<const column_def*>& columns_pk,
+                            const std::vector<const column_def*>& columns_regular,
+                            const std::vector<const column_def*>& order_by) {
+	const auto query = upsert_query(table, staging_table_name, columns_pk, columns_regular, order_by);
 	logger.info("upsert: " + query);
 	auto result = con.Query(query);
 	if (result->HasError()) {
-		throw std::runtime_error("Could not upsert table <" + absolute_table_name + ">" + result->GetError());
+		throw std::runtime_error("Could not upsert table <" + table.to_escaped_string() + ">" + result->GetError());
 	}
 }
 
-void MdSqlGenerator::insert(duckdb::Connection& con, const table_def& table, const std::string& staging_table_name,
-                            const std::vector<const column_def*>& columns_pk,
-                            const std::vector<const column_def*>& columns_regular) {
+std::string MdSqlGenerator::insert_query(const table_def& table, const std::string& staging_table_name,
+                                         const std::vector<const column_def*>& columns_pk,
+                                         const std::vector<const column_def*>& columns_regular,
+                                         const std::vector<const column_def*>& order_by) {
+	const auto quoted_pk = quote_columns(columns_pk);
+	const auto quoted_regular = quote_columns(columns_regular);
+
+	SqlBuilder sql;
+	sql << "INSERT INTO " << table << '(';
+	write_full_column_list(sql, quoted_pk, quoted_regular);
+	sql << ") SELECT ";
+	write_full_column_list(sql, quoted_pk, quoted_regular);
+	sql << " FROM " << staging_table_name;
+	write_order_by(sql, order_by);
 
-	auto full_column_list = make_full_column_list(columns_pk, columns_regular);
-	const std::string absolute_table_name = table.to_escaped_string();
-	std::ostringstream sql;
-	sql << "INSERT INTO " << absolute_table_name << "(" << full_column_list << ") SELECT " << full_column_list
-	    << " FROM " << staging_table_name;
+	return sql.str();
+}
 
-	auto query = sql.str();
+void MdSqlGenerator::insert(duckdb::Connection& con, const table_def& table, const std::string& staging_table_name,
+                            const std::vector<const column_def*>& columns_pk,
+                            const std::vector<const column_def*>& columns_regular,
+                            const std::vector<const column_def*>& order_by) {
+	const auto query = insert_query(table, staging_table_name, columns_pk, columns_regular, order_by);
 	logger.info("insert: " + query);
 	auto result = con.Query(query);
 	if (result->HasError()) {
-		throw std::runtime_error("Could not insert into table <" + absolute_table_name + ">" + result->GetError());
+		throw std::runtime_error("Could not insert into table <" + table.to_escaped_string() + ">" +
+		                         result->GetError());
+	}
+	if (active_records) {
+		add_active_records(con, staging_table_name, columns_pk, columns_regular);
 	}
 }
 
-void MdSqlGenerator::update_values(duckdb::Connection& con, const table_def& table,
-                                   const std::string& staging_table_name, std::vector<const column_def*>& columns_pk,
-                                   std::vector<const column_def*>& columns_regular,
-                                   const std::string& unmodified_string) {
-
-	logger.info("MdSqlGenerator::update_values requested");
-	std::ostringstream sql;
-	auto absolute_table_name = table.to_escaped_string();
-
-	sql << "UPDATE " << absolute_table_name << " SET ";
+void MdSqlGenerator::recluster_table(duckdb::Connection& con, const table_def& table,
+                                     const std::vector<const column_def*>& order_by) const {
+	if (order_by.empty()) {
+		return;
+	}
+	TransactionContext transaction_context(con);
 
-	join(sql, columns_regular, [&](std::ostream& out, const column_def* column) {
-		auto quoted_col = KeywordHelper::WriteQuoted(column->name, '"');
-		std::ostringstream staging_col_expr;
+	// Rewriting the rows in place keeps the constraints and defaults of the
+	// table, which a CREATE OR REPLACE TABLE AS would drop. The sorted copy is
+	// a TEMP table like the LAR table.
+	SqlBuilder sorted_table;
+	sorted_table << "temp.main." << ident("__fivetran_recluster_" + duckdb::StringUtil::GenerateRandomName(16));
+	SqlBuilder sql;
+	sql << "CREATE TEMP TABLE " << sorted_table.str() << " AS SELECT * FROM " << table;
+	write_order_by(sql, order_by);
+	sql << "; DELETE FROM " << table << "; INSERT INTO " << table << " SELECT * FROM " << sorted_table.str()
+	    << " ORDER BY rowid; DROP TABLE " << sorted_table.str();
+	run_query(con, "recluster_table", sql.str(), "Could not recluster table <" + table.to_escaped_string() + ">");
 
-		if (column->type == duckdb::LogicalTypeId::BLOB) {
-			staging_col_expr << "from_base64(" << staging_table_name << "." << quoted_col << ")";
-		} else {
-			staging_col_expr << staging_table_name << "." << quoted_col;
-		}
+	transaction_context.Commit();
+}
 
-		out << quoted_col << " = CASE WHEN " << staging_table_name << "." << quoted_col << " = "
-		    << KeywordHelper::WriteQuoted(unmodified_string, '\'') << " THEN " << absolute_table_name << "."
-		    << quoted_col << " ELSE " << staging_col_expr.str() << " END";
+std::string MdSqlGenerator::update_values_query(const table_def& table, const std::string& staging_table_name,
+                                                const std::vector<const column_def*>& columns_pk,
+                                                const std::vector<const column_def*>& columns_regular,
+                                                const std::string& unmodified_string, const std::string& key_filter) {
+	const auto quoted_pk = quote_columns(columns_pk);
+	const auto quoted_regular = quote_columns(columns_regular);
+
+	// Rendered once, every regular column compares against it
+	SqlBuilder quoted_unmodified;
+	quoted_unmodified << literal(unmodified_string);
+	const auto unmodified_literal = quoted_unmodified.str();
+
+	SqlBuilder sql;
+	sql << "UPDATE " << table << " SET ";
+
+	sql.join(quoted_regular, ", ", [&](SqlBuilder& out, const quoted_column& col) {
+		out << col.name << " = CASE WHEN " << staging_table_name << '.' << col.name << " = " << unmodified_literal
+		    << " THEN " << table << '.' << col.name << " ELSE ";
+		write_staging_value(out, col, staging_table_name);
+		out << " END";
 	});
 
 	sql << " FROM " << staging_table_name << " WHERE ";
-	join(sql, columns_pk, " AND ", [&](std::ostream& out, const column_def* column) {
-		const auto quoted_col = column->quoted();
-		out << KeywordHelper::WriteQuoted(table.table_name, '"') << "." << quoted_col << " = " << staging_table_name
-		    << "." << quoted_col;
+	sql.join(quoted_pk, " AND ", [&](SqlBuilder& out, const quoted_column& col) {
+		out << ident(table.table_name) << '.' << col.name << " = " << staging_table_name << '.' << col.name;
 	});
+	if (!key_filter.empty()) {
+		sql << " AND " << key_filter;
+	}
 
-	auto query = sql.str();
+	return sql.str();
+}
+
+void MdSqlGenerator::update_values(duckdb::Connection& con, const table_def& table,
+                                   const std::string& staging_table_name, std::vector<const column_def*>& columns_pk,
+                                   std::vector<const column_def*>& columns_regular,
+                                   const std::string& unmodified_string) {
+
+	logger.info("MdSqlGenerator::update_values requested");
+	SqlBuilder target;
+	target << ident(table.table_name);
+	const auto key_filter = staged_key_filter(con, staging_table_name, columns_pk, target.str());
+	const auto query =
+	    update_values_query(table, staging_table_name, columns_pk, columns_regular, unmodified_string, key_filter);
 	logger.info("update: " + query);
 	auto result = con.Query(query);
 	if (result->HasError()) {
-		throw std::runtime_error("Could not update table <" + absolute_table_name + ">: " + result->GetError());
+		throw std::runtime_error("Could not update table <" + table.to_escaped_string() + ">: " + result->GetError());
 	}
+	changed_rows += affected_rows(*result);
 }
 
 std::string MdSqlGenerator::create_latest_active_records_table(duckdb::Connection& con,
                                                                const table_def& source_table) const {
-	const std::string lar_table_name = generate_temp_table_name(con, "__fivetran_latest_active_records");
-	const auto create_lar_table_res =
-	    con.Query("CREATE TABLE " + lar_table_name + " AS FROM " + source_table.to_escaped_string() + " WITH NO DATA");
+	// TEMP tables live in the connection's local catalog, so creating and
+	// dropping them does not involve the remote catalog. The name only has to
+	// be unique on this connection.
+	SqlBuilder name;
+	name << "temp.main." << ident("__fivetran_latest_active_records_" + duckdb::StringUtil::GenerateRandomName(16));
+	const std::string lar_table_name = name.str();
+	const auto create_lar_table_res = con.Query("CREATE TEMP TABLE " + lar_table_name + " AS FROM " +
+	                                            source_table.to_escaped_string() + " WITH NO DATA");
 	if (create_lar_table_res->HasError()) {
 		create_lar_table_res->ThrowError("Could not create latest_active_records table: ");
 	}
@@ -741,146 +1050,235 @@ void MdSqlGenerator::drop_latest_active_records_table(duckdb::Connection& con,
 	}
 }
 
+std::string MdSqlGenerator::staged_key_filter(duckdb::Connection& con, const std::string& staging_table_name,
+                                              const std::vector<const column_def*>& columns_pk,
+                                              const std::string& target) const {
+	std::vector<quoted_column> filter_columns;
+	for (auto& col : quote_columns(columns_pk)) {
+		if (supports_key_filter(col.def->type)) {
+			filter_columns.push_back(std::move(col));
+		}
+	}
+	if (filter_columns.empty()) {
+		return "";
+	}
+
+	// One round trip for all columns: the row count, and per column the min,
+	// max and (for small batches) the distinct keys. Update files are staged
+	// with all_varchar=true, hence the casts to the target types.
+	SqlBuilder stats;
+	stats << "SELECT COUNT(*)";
+	for (const auto& col : filter_columns) {
+		SqlBuilder cast;
+		cast << "CAST(" << col.name << " AS " << format_type(*col.def) << ')';
+		const auto expr = cast.str();
+		stats << ", MIN(" << expr << "), MAX(" << expr << ')';
+		stats.format(", CASE WHEN COUNT(*) <= {} THEN list_sort(list(DISTINCT {})) END", MAX_KEY_FILTER_IN_LIST, expr);
+	}
+	stats << " FROM " << staging_table_name;
+
+	const auto query = stats.str();
+	logger.info("staged_key_filter: " + query);
+	const auto result = con.Query(query);
+	if (result->HasError()) {
+		// The filter is only an optimization, the join is correct without it
+		logger.warning("Could not compute primary key bounds of staging table <" + staging_table_name +
+		               ">: " + result->GetError());
+		return "";
+	}
+
+	const auto staged_rows = result->GetValue(0, 0).GetValue<int64_t>();
+	if (staged_rows == 0) {
+		return "";
+	}
+
+	SqlBuilder filter;
+	for (idx_t i = 0; i < filter_columns.size(); i++) {
+		const auto& col = filter_columns[i];
+		const auto min_value = result->GetValue(1 + 3 * i, 0);
+		const auto max_value = result->GetValue(2 + 3 * i, 0);
+		const auto keys = result->GetValue(3 + 3 * i, 0);
+		if (min_value.IsNull() || max_value.IsNull()) {
+			continue;
+		}
+
+		if (filter.size() > 0) {
+			filter << " AND ";
+		}
+		filter << target << '.' << col.name;
+		if (!keys.IsNull()) {
+			filter << " IN (";
+			filter.join(duckdb::ListValue::GetChildren(keys), ", ",
+			            [](SqlBuilder& out, const duckdb::Value& key) { out << key.ToSQLString(); });
+			filter << ')';
+		} else {
+			filter << " BETWEEN " << min_value.ToSQLString() << " AND " << max_value.ToSQLString();
+		}
+	}
+
+	logger.info("staged_key_filter: " + std::to_string(staged_rows) + " staged rows, " +
+	            std::to_string(filter.size()) + " bytes of key filter");
+	return filter.str();
+}
+
 void MdSqlGenerator::add_partial_historical_values(duckdb::Connection& con, const table_def& table,
                                                    const std::string& staging_table_name,
                                                    const std::string& lar_table_name,
                                                    std::vector<const column_def*>& columns_pk,
                                                    std::vector<const column_def*>& columns_regular,
                                                    const std::string& unmodified_string) const {
-	std::ostringstream sql;
-	auto absolute_table_name = table.to_escaped_string();
+	const auto quoted_pk = quote_columns(columns_pk);
+	const auto quoted_regular = quote_columns(columns_regular);
 
-	auto full_column_list = make_full_column_list(columns_pk, columns_regular);
-	sql << "INSERT INTO " << absolute_table_name << " (" << full_column_list << ") ( SELECT ";
+	SqlBuilder quoted_unmodified;
+	quoted_unmodified << literal(unmodified_string);
+	const auto unmodified_literal = quoted_unmodified.str();
+
+	SqlBuilder sql;
+	sql << "INSERT INTO " << table << " (";
+	write_full_column_list(sql, quoted_pk, quoted_regular);
+	sql << ") ( SELECT ";
 
 	// use primary keys as is, without checking for unmodified value
-	join(sql, columns_pk, [&staging_table_name](std::ostream& out, const column_def* column) {
-		out << staging_table_name << "." << column->quoted();
+	sql.join(quoted_pk, ", ", [&staging_table_name](SqlBuilder& out, const quoted_column& col) {
+		out << staging_table_name << '.' << col.name;
 	});
 
 	sql << ",  ";
 
-	join(sql, columns_regular, [&](std::ostream& out, const column_def* column) {
-		auto quoted_col = KeywordHelper::WriteQuoted(column->name, '"');
-		std::ostringstream staging_col_expr;
-
-		if (column->type == duckdb::LogicalTypeId::BLOB) {
-			staging_col_expr << "from_base64(" << staging_table_name << "." << quoted_col << ")";
-		} else {
-			staging_col_expr << staging_table_name << "." << quoted_col;
-		}
-
-		out << "CASE WHEN " << staging_table_name << "." << quoted_col << " = "
-		    << KeywordHelper::WriteQuoted(unmodified_string, '\'') << " THEN lar." << quoted_col << " ELSE "
-		    << staging_col_expr.str() << " END as " << quoted_col;
+	sql.join(quoted_regular, ", ", [&](SqlBuilder& out, const quoted_column& col) {
+		out << "CASE WHEN " << staging_table_name << '.' << col.name << " = " << unmodified_literal << " THEN lar."
+		    << col.name << " ELSE ";
+		write_staging_value(out, col, staging_table_name);
+		out << " END as " << col.name;
 	});
 
-	sql << " FROM " << staging_table_name << " LEFT JOIN " << lar_table_name << " AS lar ON "
-	    << primary_key_join(columns_pk, "lar", staging_table_name) << ")";
+	sql << " FROM " << staging_table_name << " LEFT JOIN " << lar_table_name << " AS lar ON ";
+	write_primary_key_join(sql, quoted_pk, "lar", staging_table_name);
+	sql << ')';
 
-	auto query = sql.str();
+	const auto query = sql.str();
 	logger.info("update (add partial historical values): " + query);
 	auto result = con.Query(query);
 	if (result->HasError()) {
-		throw std::runtime_error("Could not update (add partial historical values) table <" + absolute_table_name +
-		                         ">: " + result->GetError());
+		throw std::runtime_error("Could not update (add partial historical values) table <" +
+		                         table.to_escaped_string() + ">: " + result->GetError());
+	}
+	if (active_records) {
+		add_active_records(con, staging_table_name, columns_pk, columns_regular);
 	}
 }
 
-void MdSqlGenerator::delete_rows(duckdb::Connection& con, const table_def& table, const std::string& staging_table_name,
-                                 std::vector<const column_def*>& columns_pk) {
-
-	const std::string absolute_table_name = table.to_escaped_string();
-	std::ostringstream sql;
-	sql << "DELETE FROM " + absolute_table_name << " USING " << staging_table_name << " WHERE ";
+std::string MdSqlGenerator::delete_rows_query(const table_def& table, const std::string& staging_table_name,
+                                              const std::vector<const column_def*>& columns_pk,
+                                              const std::string& key_filter) {
+	SqlBuilder sql;
+	sql << "DELETE FROM " << table << " USING " << staging_table_name << " WHERE ";
 
-	join(sql, columns_pk, " AND ", [&](std::ostream& out, const column_def* column) {
-		const auto quoted_col = column->quoted();
-		out << KeywordHelper::WriteQuoted(table.table_name, '"') << "." << quoted_col << " = " << staging_table_name
-		    << "." << quoted_col;
+	sql.join(quote_columns(columns_pk), " AND ", [&](SqlBuilder& out, const quoted_column& col) {
+		out << ident(table.table_name) << '.' << col.name << " = " << staging_table_name << '.' << col.name;
 	});
+	if (!key_filter.empty()) {
+		sql << " AND " << key_filter;
+	}
 
-	auto query = sql.str();
+	return sql.str();
+}
+
+void MdSqlGenerator::delete_rows(duckdb::Connection& con, const table_def& table, const std::string& staging_table_name,
+                                 std::vector<const column_def*>& columns_pk) {
+	SqlBuilder target;
+	target << ident(table.table_name);
+	const auto key_filter = staged_key_filter(con, staging_table_name, columns_pk, target.str());
+	const auto query = delete_rows_query(table, staging_table_name, columns_pk, key_filter);
 	logger.info("delete_rows: " + query);
 	auto result = con.Query(query);
 	if (result->HasError()) {
-		throw std::runtime_error("Error deleting rows from table <" + absolute_table_name + ">: " + result->GetError());
+		throw std::runtime_error("Error deleting rows from table <" + table.to_escaped_string() +
+		                         ">: " + result->GetError());
 	}
+	changed_rows += affected_rows(*result);
 }
 
 void MdSqlGenerator::deactivate_historical_records(duckdb::Connection& con, const table_def& table,
                                                    const std::string& staging_table_name,
                                                    const std::string& lar_table_name,
-                                                   std::vector<const column_def*>& columns_pk) const {
+                                                   std::vector<const column_def*>& columns_pk) {
 
 	const std::string absolute_table_name = table.to_escaped_string();
-
-	// primary keys condition (list of primary keys already excludes
-	// _fivetran_start)
-	std::string primary_key_join_condition = primary_key_join(columns_pk, absolute_table_name, staging_table_name);
-
-	{
-		// delete overlapping records
-		std::ostringstream sql;
-		sql << "DELETE FROM " + absolute_table_name << " USING " << staging_table_name << " WHERE ";
-		sql << primary_key_join_condition;
-		sql << " AND " << absolute_table_name << "._fivetran_start >= " << staging_table_name << "._fivetran_start";
-
-		auto query = sql.str();
-		logger.info("delete_overlapping_records: " + query);
-		auto result = con.Query(query);
-		if (result->HasError()) {
-			throw std::runtime_error("Error deleting overlapping records from table <" + absolute_table_name +
-			                         ">: " + result->GetError());
+	const auto quoted_pk = quote_columns(columns_pk);
+	const auto key_filter = staged_key_filter(con, staging_table_name, columns_pk, absolute_table_name);
+	std::string key_filter_condition = key_filter.empty() ? "" : " AND " + key_filter;
+	if (active_records) {
+		// If every staged key has an active version that starts before the
+		// staged _fivetran_start, no version overlaps with the batch and the
+		// active versions are the latest ones, so older row groups can be skipped.
+		const auto start_bound = active_start_bound(con, staging_table_name, columns_pk, true);
+		if (!start_bound.IsNull()) {
+			key_filter_condition += " AND " + absolute_table_name + "._fivetran_start >= " + start_bound.ToSQLString();
 		}
 	}
 
+	SqlBuilder target;
+	target << ident(table.table_name);
+	const std::string target_name = target.str();
+
+	SqlBuilder overlapping;
+	overlapping << absolute_table_name << "._fivetran_start >= " << staging_table_name << "._fivetran_start";
+	const auto overlapping_condition = overlapping.str();
+
+	// Two statements read the history table per file, without any table in
+	// the remote catalog:
+	//  - the latest version of each staged key that does not overlap with the
+	//    batch is stashed in the (TEMP) LAR table for the update files, even if
+	//    it is no longer active, to prevent null values in a partially
+	//    successful batch,
+	//  - a single MERGE matches the history table against the staged keys,
+	//    deletes the versions that overlap with the batch and deactivates the
+	//    remaining active ones.
+	// The primary keys already exclude _fivetran_start.
+	TransactionContext transaction_context(con);
 	{
-		// store latest versions of records before they get deactivated
-		// per spec, this should be limited to _fivetran_active = TRUE, but it's
-		// safer to get all latest versions even if deactivated to prevent null
-		// values in a partially successful batch.
-		std::ostringstream sql;
-		const std::string short_table_name = KeywordHelper::WriteQuoted(table.table_name, '"');
-		sql << "WITH ranked_records AS (SELECT " << short_table_name << ".*,";
-		sql << " row_number() OVER (PARTITION BY ";
-		join(sql, columns_pk, [absolute_table_name](std::ostream& out, const column_def* column) {
-			out << absolute_table_name << "." << column->quoted();
+		SqlBuilder sql;
+		sql << "INSERT INTO " << lar_table_name << " SELECT " << target_name << ".* FROM " << absolute_table_name
+		    << " INNER JOIN " << staging_table_name << " ON ";
+		write_primary_key_join(sql, quoted_pk, absolute_table_name, staging_table_name);
+		sql << " AND NOT (" << overlapping_condition << ")" << key_filter_condition;
+		sql << " QUALIFY row_number() OVER (PARTITION BY ";
+		sql.join(quoted_pk, ", ", [&absolute_table_name](SqlBuilder& out, const quoted_column& col) {
+			out << absolute_table_name << '.' << col.name;
 		});
-		sql << " ORDER BY " << absolute_table_name << "._fivetran_start DESC) as row_num FROM " << absolute_table_name;
-		// inner join to earliest table to only select rows that are in this batch
-		sql << " INNER JOIN " << staging_table_name << " ON " << primary_key_join_condition << ")\n";
-
-		sql << "INSERT INTO " << lar_table_name
-		    << " SELECT * EXCLUDE (row_num) FROM "
-		       "ranked_records WHERE row_num = 1";
-		auto query = sql.str();
-		logger.info("stash latest records: " + query);
-		auto result = con.Query(query);
-		if (result->HasError()) {
-			throw std::runtime_error("Error stashing latest records from table <" + absolute_table_name +
-			                         ">: " + result->GetError());
-		}
+		sql << " ORDER BY " << absolute_table_name << "._fivetran_start DESC) = 1";
+		run_query(con, "stash latest records", sql.str(),
+		          "Error stashing latest records from table <" + absolute_table_name + ">");
 	}
 
 	{
-		// mark existing records inactive
-		std::ostringstream sql;
-		sql << "UPDATE " + absolute_table_name << " SET _fivetran_active = FALSE, ";
+		SqlBuilder sql;
+		sql << "MERGE INTO " << absolute_table_name << " USING " << staging_table_name << " ON ";
+		write_primary_key_join(sql, quoted_pk, absolute_table_name, staging_table_name);
+		sql << key_filter_condition;
+		sql << " WHEN MATCHED AND " << overlapping_condition << " THEN DELETE";
+		sql << " WHEN MATCHED AND " << absolute_table_name << "._fivetran_active THEN UPDATE SET "
+		    << "_fivetran_active = FALSE, ";
 		// converting to TIMESTAMP with no timezone because otherwise ICU is
 		// required to do TIMESTAMPZ math. Need to test this well.
-		sql << "_fivetran_end = (" << staging_table_name << "._fivetran_start::TIMESTAMP - (INTERVAL '1 millisecond'))";
-		sql << " FROM " << staging_table_name;
-		sql << " WHERE " << absolute_table_name << "._fivetran_active = TRUE AND ";
-		sql << primary_key_join_condition;
-
-		auto query = sql.str();
-		logger.info("deactivate records: " + query);
+		sql << "_fivetran_end = (" << staging_table_name
+		    << "._fivetran_start::TIMESTAMP - (INTERVAL '1 millisecond'))";
+		const auto query = sql.str();
+		logger.info("delete overlapping and deactivate records: " + query);
 		auto result = con.Query(query);
 		if (result->HasError()) {
-			throw std::runtime_error("Error deactivating records <" + absolute_table_name + ">: " + result->GetError());
+			throw std::runtime_error("Error deactivating records <" + absolute_table_name +
+			                         ">: " + result->GetError());
 		}
+		changed_rows += affected_rows(*result);
+	}
+
+	if (active_records) {
+		remove_active_records(con, staging_table_name, columns_pk);
 	}
+	transaction_context.Commit();
 }
 
 void MdSqlGenerator::delete_historical_rows(duckdb::Connection& con, const table_def& table,
@@ -888,65 +1286,227 @@ void MdSqlGenerator::delete_historical_rows(duckdb::Connection& con, const table
                                             std::vector<const column_def*>& columns_pk) {
 
 	const std::string absolute_table_name = table.to_escaped_string();
+	const auto quoted_pk = quote_columns(columns_pk);
+	const auto key_filter = staged_key_filter(con, staging_table_name, columns_pk, absolute_table_name);
+
+	duckdb::Value start_bound;
+	if (active_records) {
+		start_bound = active_start_bound(con, staging_table_name, columns_pk, false);
+		if (start_bound.IsNull()) {
+			logger.info("delete historical records: no active versions of the staged keys");
+			return;
+		}
+	}
 
-	std::string primary_key_join_condition = primary_key_join(columns_pk, absolute_table_name, staging_table_name);
-
-	std::ostringstream sql;
+	SqlBuilder sql;
 
-	sql << "UPDATE " + absolute_table_name << " SET _fivetran_active = FALSE, ";
+	sql << "UPDATE " << absolute_table_name << " SET _fivetran_active = FALSE, ";
 	sql << "_fivetran_end = " << staging_table_name << "._fivetran_end";
 	sql << " FROM " << staging_table_name;
+	if (active_records) {
+		// Only the versions listed in the active records table can match
+		sql << " INNER JOIN " << *active_records << " AS active ON ";
+		write_primary_key_join(sql, quoted_pk, "active", staging_table_name);
+	}
 	sql << " WHERE " << absolute_table_name << "._fivetran_active = TRUE AND ";
-	sql << primary_key_join_condition;
+	write_primary_key_join(sql, quoted_pk, absolute_table_name, staging_table_name);
+	if (active_records) {
+		sql << " AND " << absolute_table_name << "._fivetran_start = active._fivetran_start AND "
+		    << absolute_table_name << "._fivetran_start >= " << start_bound.ToSQLString();
+	}
+	if (!key_filter.empty()) {
+		sql << " AND " << key_filter;
+	}
 
-	auto query = sql.str();
+	const auto query = sql.str();
 	logger.info("delete historical records: " + query);
 	auto result = con.Query(query);
 	if (result->HasError()) {
 		throw std::runtime_error("Error deleting historical records <" + absolute_table_name +
 		                         ">: " + result->GetError());
 	}
+	changed_rows += affected_rows(*result);
+	if (active_records) {
+		remove_active_records(con, staging_table_name, columns_pk);
+	}
+}
+
+table_def MdSqlGenerator::active_records_table(const table_def& table) {
+	return table_def {table.db_name, table.schema_name, "__fivetran_active_" + table.table_name};
+}
+
+void MdSqlGenerator::maintain_active_records_table(duckdb::Connection& con, const table_def& table,
+                                                   const std::vector<const column_def*>& columns_pk) {
+	active_records = active_records_table(table);
+
+	SqlBuilder sql;
+	sql << "CREATE TABLE IF NOT EXISTS " << *active_records << " AS SELECT ";
+	sql.join_names(quote_columns(columns_pk));
+	sql << ", _fivetran_start FROM " << table << " WHERE _fivetran_active";
+	run_query(con, "create active records table", sql.str(),
+	          "Could not create active records table for <" + table.to_escaped_string() + ">");
+}
+
+void MdSqlGenerator::drop_active_records_table(duckdb::Connection& con, const table_def& table) const {
+	const auto side_table = active_records_table(table).to_escaped_string();
+	run_query(con, "drop active records table", "DROP TABLE IF EXISTS " + side_table,
+	          "Could not drop active records table for <" + table.to_escaped_string() + ">");
+}
+
+duckdb::Value MdSqlGenerator::active_start_bound(duckdb::Connection& con, const std::string& staging_table_name,
+                                                 const std::vector<const column_def*>& columns_pk,
+                                                 const bool before_staged_start) const {
+	SqlBuilder sql;
+	sql << "SELECT ";
+	if (before_staged_start) {
+		// Keys without an active version compare as NULL, which bool_and would ignore
+		sql << "CASE WHEN bool_and(coalesce(active._fivetran_start < " << staging_table_name
+		    << "._fivetran_start, false)) THEN min(active._fivetran_start) END FROM " << staging_table_name
+		    << " LEFT JOIN ";
+	} else {
+		sql << "min(active._fivetran_start) FROM " << staging_table_name << " INNER JOIN ";
+	}
+	sql << *active_records << " AS active ON ";
+	write_primary_key_join(sql, quote_columns(columns_pk), "active", staging_table_name);
+
+	const auto query = sql.str();
+	logger.info("active_start_bound: " + query);
+	auto result = con.Query(query);
+	if (result->HasError()) {
+		throw std::runtime_error("Could not read active records of staging table <" + staging_table_name +
+		                         ">: " + result->GetError());
+	}
+	return result->GetValue(0, 0);
+}
+
+void MdSqlGenerator::add_active_records(duckdb::Connection& con, const std::string& staging_table_name,
+                                        const std::vector<const column_def*>& columns_pk,
+                                        const std::vector<const column_def*>& columns_regular) const {
+	const auto quoted_pk = quote_columns(columns_pk);
+	const quoted_column start {&find_history_column(columns_regular, "_fivetran_start"), "_fivetran_start"};
+	const quoted_column active {&find_history_column(columns_regular, "_fivetran_active"), "_fivetran_active"};
+
+	SqlBuilder active_condition;
+	write_typed_column(active_condition, active, staging_table_name);
+	const auto staged_active = active_condition.str();
+
+	{
+		SqlBuilder sql;
+		sql << "DELETE FROM " << *active_records << " AS active USING " << staging_table_name << " WHERE ";
+		sql.join(quoted_pk, " AND ", [&staging_table_name](SqlBuilder& out, const quoted_column& col) {
+			out << "active." << col.name << " = ";
+			write_typed_column(out, col, staging_table_name);
+		});
+		sql << " AND " << staged_active;
+		run_query(con, "replace active records", sql.str(), "Could not replace active records");
+	}
+	{
+		SqlBuilder sql;
+		sql << "INSERT INTO " << *active_records << " SELECT ";
+		sql.join(quoted_pk, ", ", [&staging_table_name](SqlBuilder& out, const quoted_column& col) {
+			write_typed_column(out, col, staging_table_name);
+		});
+		sql << ", ";
+		write_typed_column(sql, start, staging_table_name);
+		sql << " FROM " << staging_table_name << " WHERE " << staged_active;
+		run_query(con, "add active records", sql.str(), "Could not add active records");
+	}
+}
+
+void MdSqlGenerator::remove_active_records(duckdb::Connection& con, const std::string& staging_table_name,
+                                           const std::vector<const column_def*>& columns_pk) const {
+	SqlBuilder sql;
+	sql << "DELETE FROM " << *active_records << " AS active USING " << staging_table_name << " WHERE ";
+	write_primary_key_join(sql, quote_columns(columns_pk), "active", staging_table_name);
+	run_query(con, "remove active records", sql.str(), "Could not remove active records");
 }
 
 void MdSqlGenerator::truncate_table(duckdb::Connection& con, const table_def& table, const std::string& synced_column,
                                     std::chrono::nanoseconds& cutoff_ns, const std::string& deleted_column) {
 	const std::string absolute_table_name = table.to_escaped_string();
-	std::ostringstream sql;
+	const std::string err = "Error truncating table <" + absolute_table_name + ">";
+	drop_active_records_table(con, table);
 
 	logger.info("truncate_table request: deleted column = " + deleted_column);
-	if (deleted_column.empty()) {
-		// hard delete
-		sql << "DELETE FROM " << absolute_table_name;
-	} else {
-		// soft delete
-		sql << "UPDATE " << absolute_table_name << " SET " << KeywordHelper::WriteQuoted(deleted_column, '"')
-		    << " = true";
-	}
 	logger.info("truncate_table request: synced column = " + synced_column);
-	sql << " WHERE " << KeywordHelper::WriteQuoted(synced_column, '"') << " < make_timestamp(?)";
-	auto query = sql.str();
-	const std::string err = "Error truncating table at bind step <" + absolute_table_name + ">";
-	logger.info("truncate_table: " + query);
-	auto statement = con.Prepare(query);
-	if (statement->HasError()) {
-		throw std::runtime_error(err + " (at bind step):" + statement->GetError());
-	}
 
 	// DuckDB make_timestamp takes microseconds; Fivetran sends millisecond
 	// precision -- safe to divide with truncation
 	int64_t cutoff_microseconds = cutoff_ns.count() / 1000;
 	duckdb::vector<duckdb::Value> params = {duckdb::Value(cutoff_microseconds)};
-
 	logger.info("truncate_table: cutoff_microseconds = <" + std::to_string(cutoff_microseconds) + ">");
-	auto result = statement->Execute(params, false);
-	if (result->HasError()) {
-		throw std::runtime_error(err + ": " + result->GetError());
+
+	const auto execute = [&](const std::string& query) {
+		logger.info("truncate_table: " + query);
+		auto statement = con.Prepare(query);
+		if (statement->HasError()) {
+			throw std::runtime_error(err + " (at bind step): " + statement->GetError());
+		}
+		auto result = statement->Execute(params, false);
+		if (result->HasError()) {
+			throw std::runtime_error(err + ": " + result->GetError());
+		}
+		return result;
+	};
+
+	// A single scan of the synced (and deleted) column decides how much work
+	// there is. Rows without a synced timestamp never match the cutoff.
+	SqlBuilder stats;
+	stats << "SELECT COUNT(*) FILTER (" << ident(synced_column) << " < make_timestamp($1))";
+	stats << ", COUNT(*) FILTER (" << ident(synced_column) << " IS NULL OR " << ident(synced_column)
+	      << " >= make_timestamp($1))";
+	if (!deleted_column.empty()) {
+		stats << ", COUNT(*) FILTER (" << ident(synced_column) << " < make_timestamp($1) AND "
+		      << ident(deleted_column) << " IS DISTINCT FROM true)";
+	}
+	stats << " FROM " << absolute_table_name;
+	const auto stats_result = execute(stats.str());
+	auto& counts = stats_result->Cast<duckdb::MaterializedQueryResult>();
+	const auto rows_before_cutoff = counts.GetValue(0, 0).GetValue<int64_t>();
+	const auto rows_to_keep = counts.GetValue(1, 0).GetValue<int64_t>();
+
+	const auto log_strategy = [&](const std::string& strategy) {
+		logger.info("truncate_table strategy for <" + absolute_table_name + ">: " + strategy);
+	};
+
+	if (deleted_column.empty()) {
+		if (rows_before_cutoff == 0) {
+			log_strategy("no-op, no rows before the cutoff");
+		} else if (rows_to_keep == 0) {
+			// Every row goes: drop the row groups instead of deleting rows one by one
+			log_strategy("TRUNCATE, all " + std::to_string(rows_before_cutoff) + " rows are before the cutoff");
+			run_query(con, "truncate_table", "TRUNCATE " + absolute_table_name, err);
+		} else {
+			log_strategy("DELETE of " + std::to_string(rows_before_cutoff) + " rows");
+			SqlBuilder sql;
+			sql << "DELETE FROM " << absolute_table_name << " WHERE " << ident(synced_column)
+			    << " < make_timestamp($1)";
+			execute(sql.str());
+		}
+		return;
 	}
+
+	const auto rows_to_soft_delete = counts.GetValue(2, 0).GetValue<int64_t>();
+	if (rows_to_soft_delete == 0) {
+		log_strategy("no-op, all " + std::to_string(rows_before_cutoff) +
+		             " rows before the cutoff are already marked as deleted");
+		return;
+	}
+	// Rows that are already marked as deleted are not rewritten
+	log_strategy("soft delete of " + std::to_string(rows_to_soft_delete) + " of " +
+	             std::to_string(rows_before_cutoff) + " rows before the cutoff");
+	SqlBuilder sql;
+	sql << "UPDATE " << absolute_table_name << " SET " << ident(deleted_column) << " = true";
+	sql << " WHERE " << ident(synced_column) << " < make_timestamp($1) AND " << ident(deleted_column)
+	    << " IS DISTINCT FROM true";
+	execute(sql.str());
 }
 
 // Migration operations
 
 void MdSqlGenerator::drop_table(duckdb::Connection& con, const table_def& table, const std::string& log_prefix) {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
+	drop_active_records_table(con, table);
 	const std::string absolute_table_name = table.to_escaped_string();
 
 	run_query(con, log_prefix, "DROP TABLE " + absolute_table_name,
@@ -955,6 +1515,7 @@ void MdSqlGenerator::drop_table(duckdb::Connection& con, const table_def& table,
 
 void MdSqlGenerator::drop_column_in_history_mode(duckdb::Connection& con, const table_def& table,
                                                  const std::string& column, const std::string& operation_timestamp) {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
 	const std::string absolute_table_name = table.to_escaped_string();
 	const std::string quoted_column = KeywordHelper::WriteQuoted(column, '"');
 	const std::string quoted_timestamp = KeywordHelper::WriteQuoted(operation_timestamp, '\'') + "::TIMESTAMPTZ";
@@ -968,10 +1529,12 @@ void MdSqlGenerator::drop_column_in_history_mode(duckdb::Connection& con, const
 	// We execute 3 queries as described in the spec if the table is not empty.
 
 	TransactionContext transaction_context(con);
+	// The new versions have new _fivetran_start values
+	drop_active_records_table(con, table);
 
 	{
 		// Query 1: Insert new rows for active records where column is not null
-		std::ostringstream sql;
+		SqlBuilder sql;
 		sql << "INSERT INTO " << absolute_table_name << " SELECT * REPLACE"
 		    << " (NULL as " << quoted_column << ", " << quoted_timestamp << " as \"_fivetran_start\""
 		    << ")"
@@ -997,7 +1560,7 @@ void MdSqlGenerator::drop_column_in_history_mode(duckdb::Connection& con, const
 		// \"_fivetran_start\" < quoted_timestamp clause. Query 2 assures we also
 		// set B to NULL for the rows inserted while handling column A.
 
-		std::ostringstream sql;
+		SqlBuilder sql;
 		sql << "UPDATE " << absolute_table_name << " SET " << quoted_column
 		    << " = NULL WHERE \"_fivetran_start\" = " << quoted_timestamp;
 
@@ -1006,7 +1569,7 @@ void MdSqlGenerator::drop_column_in_history_mode(duckdb::Connection& con, const
 	}
 	{
 		// Query 3: Update previous active records to mark them inactive
-		std::ostringstream sql;
+		SqlBuilder sql;
 		sql << "UPDATE " << absolute_table_name << " SET \"_fivetran_active\" = FALSE,"
 		    << " \"_fivetran_end\" = (" << quoted_timestamp << "::TIMESTAMP - (INTERVAL '1 millisecond'))"
 		    << " WHERE \"_fivetran_active\" = TRUE"
@@ -1022,10 +1585,11 @@ void MdSqlGenerator::drop_column_in_history_mode(duckdb::Connection& con, const
 
 void MdSqlGenerator::copy_table(duckdb::Connection& con, const table_def& from_table, const table_def& to_table,
                                 const std::string& log_prefix, const std::vector<const column_def*>& additional_pks) {
+	const SchemaChange schema_change(schema_cache, instance_key, to_table);
 	TransactionContext transaction_context(con);
 
 	{
-		std::ostringstream sql;
+		SqlBuilder sql;
 		sql << "CREATE TABLE " << to_table.to_escaped_string() << " AS FROM " << from_table.to_escaped_string();
 
 		run_query(con, log_prefix, sql.str(),
@@ -1052,6 +1616,7 @@ void MdSqlGenerator::copy_table(duckdb::Connection& con, const table_def& from_t
 
 void MdSqlGenerator::add_defaults(duckdb::Connection& con, const std::vector<column_def>& columns,
                                   const table_def& table, const std::string& log_prefix) {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
 	// Copies the default of every column that has a default defined to the destination table_name. This assumes all
 	// columns are present in the destination table.
 	for (const auto& col : columns) {
@@ -1060,15 +1625,14 @@ void MdSqlGenerator::add_defaults(duckdb::Connection& con, const std::vector<col
 			continue;
 		}
 
-		std::ostringstream sql;
+		SqlBuilder sql;
 
 		// The default in col.column_default can already contain a CAST-statement, because the columns passed to
 		// this method were generated with describe_table(). This results in e.g. "CAST(CAST(\'42\' as int) as int)"
 		// being generated. We decided that we are find with this edge-case for now since this is still a valid default
 		// and makes this method more usable.
-		sql << "ALTER TABLE " << table.to_escaped_string() << " ALTER COLUMN "
-		    << KeywordHelper::WriteQuoted(col.name, '"') << " SET DEFAULT CAST("
-		    << KeywordHelper::WriteQuoted(col.column_default.value(), '\'') << " AS " << format_type(col) << ");";
+		sql << "ALTER TABLE " << table.to_escaped_string() << " ALTER COLUMN " << ident(col.name)
+		    << " SET DEFAULT CAST(" << literal(col.column_default.value()) << " AS " << format_type(col) << ");";
 
 		run_query(con, log_prefix, sql.str(), "Could not add default to column " + col.name);
 	}
@@ -1076,6 +1640,7 @@ void MdSqlGenerator::add_defaults(duckdb::Connection& con, const std::vector<col
 
 void MdSqlGenerator::add_pks(duckdb::Connection& con, const std::vector<const column_def*>& columns_pk,
                              const table_def& table, const std::string& log_prefix) const {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
 	if (columns_pk.empty()) {
 		// All modes require a primary key to be present, because we cannot switch
 		// to history mode without a primary key. Fivetran has confirmed that the
@@ -1086,28 +1651,27 @@ void MdSqlGenerator::add_pks(duckdb::Connection& con, const std::vector<const co
 
 	// Add the right primary key. Note that "CREATE TABLE AS SELECT" does not
 	// add any primary key constraints.
-	std::ostringstream sql;
+	SqlBuilder sql;
 
 	sql << "ALTER TABLE " << table.to_escaped_string() << " ADD PRIMARY KEY (";
-	join(sql, columns_pk, to_name);
+	sql.join_names(quote_columns(columns_pk));
 	sql << ");";
 	run_query(con, log_prefix, sql.str(), "Could not add pks to table " + table.to_escaped_string());
 }
 
 void MdSqlGenerator::copy_column(duckdb::Connection& con, const table_def& table, const std::string& from_column_name,
                                  const std::string& to_column_name) {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
 	const std::string quoted_from = KeywordHelper::WriteQuoted(from_column_name, '"');
-	const std::string quoted_to = KeywordHelper::WriteQuoted(to_column_name, '"');
 
 	// Get the column type from the source column
-	auto query = "SELECT data_type_id, column_default, numeric_precision, numeric_scale "
-	             "from duckdb_columns() WHERE "
-	             "database_name = " +
-	             KeywordHelper::WriteQuoted(table.db_name, '\'') +
-	             " AND schema_name = " + KeywordHelper::WriteQuoted(table.schema_name, '\'') +
-	             " AND table_name = " + KeywordHelper::WriteQuoted(table.table_name, '\'') +
-	             " AND column_name = " + KeywordHelper::WriteQuoted(from_column_name, '\'');
-	auto result = con.Query(query);
+	SqlBuilder query;
+	query << "SELECT data_type_id, column_default, numeric_precision, numeric_scale "
+	         "from duckdb_columns() WHERE "
+	         "database_name = "
+	      << literal(table.db_name) << " AND schema_name = " << literal(table.schema_name)
+	      << " AND table_name = " << literal(table.table_name) << " AND column_name = " << literal(from_column_name);
+	auto result = con.Query(query.str());
 
 	if (result->HasError()) {
 		throw std::runtime_error("copy_column get_type: " + result->GetError());
@@ -1132,16 +1696,16 @@ void MdSqlGenerator::copy_column(duckdb::Connection& con, const table_def& table
 	TransactionContext transaction_context(con);
 
 	add_column(con, table, to_column, "copy_column add");
-	run_query(con, "copy_column update",
-	          "UPDATE " + table.to_escaped_string() + " SET " + KeywordHelper::WriteQuoted(to_column_name, '"') +
-	              " = " + quoted_from,
-	          "Could not copy column values");
+	SqlBuilder update;
+	update << "UPDATE " << table << " SET " << ident(to_column_name) << " = " << quoted_from;
+	run_query(con, "copy_column update", update.str(), "Could not copy column values");
 
 	transaction_context.Commit();
 }
 
 void MdSqlGenerator::copy_table_to_history_mode(duckdb::Connection& con, const table_def& from_table,
                                                 const table_def& to_table, const std::string& soft_deleted_column) {
+	const SchemaChange schema_change(schema_cache, instance_key, to_table);
 	const std::string from_table_name = from_table.to_escaped_string();
 	const std::string to_table_name = to_table.to_escaped_string();
 
@@ -1159,20 +1723,23 @@ void MdSqlGenerator::copy_table_to_history_mode(duckdb::Connection& con, const t
 
 void MdSqlGenerator::rename_table(duckdb::Connection& con, const table_def& from_table,
                                   const std::string& to_table_name, const std::string& log_prefix) {
-	std::ostringstream sql;
-	sql << "ALTER TABLE " << from_table.to_escaped_string() << " RENAME TO "
-	    << KeywordHelper::WriteQuoted(to_table_name, '"');
+	const SchemaChange schema_change(schema_cache, instance_key, from_table);
+	drop_active_records_table(con, from_table);
+	SqlBuilder sql;
+	sql << "ALTER TABLE " << from_table.to_escaped_string() << " RENAME TO " << ident(to_table_name);
 
 	run_query(con, log_prefix, sql.str(), "Could not rename table <" + from_table.to_escaped_string() + ">");
 }
 
 void MdSqlGenerator::rename_column(duckdb::Connection& con, const table_def& table, const std::string& from_column_name,
                                    const std::string& to_column_name) {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
 	const std::string absolute_table_name = table.to_escaped_string();
-	std::ostringstream sql;
-	sql << "ALTER TABLE " << absolute_table_name << " RENAME COLUMN "
-	    << KeywordHelper::WriteQuoted(from_column_name, '"') << " TO "
-	    << KeywordHelper::WriteQuoted(to_column_name, '"');
+	// It has columns of the same names as the primary key
+	drop_active_records_table(con, table);
+	SqlBuilder sql;
+	sql << "ALTER TABLE " << absolute_table_name << " RENAME COLUMN " << ident(from_column_name) << " TO "
+	    << ident(to_column_name);
 
 	run_query(con, "rename_column", sql.str(),
 	          "Could not rename column <" + from_column_name + "> to <" + to_column_name + "> in table <" +
@@ -1220,11 +1787,14 @@ bool MdSqlGenerator::history_table_is_valid(duckdb::Connection& con, const table
 void MdSqlGenerator::add_column_in_history_mode(duckdb::Connection& con, const table_def& table,
                                                 const column_def& column, const std::string& operation_timestamp,
                                                 const std::string& default_value) {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
 	const std::string absolute_table_name = table.to_escaped_string();
 
 	const std::string quoted_timestamp = KeywordHelper::WriteQuoted(operation_timestamp, '\'') + "::TIMESTAMPTZ";
 
 	TransactionContext transaction_context(con);
+	// The new versions have new _fivetran_start values
+	drop_active_records_table(con, table);
 	add_column(con, table, column, "add_column_in_history_mode create");
 
 	if (!history_table_is_valid(con, table, quoted_timestamp)) {
@@ -1240,7 +1810,7 @@ void MdSqlGenerator::add_column_in_history_mode(duckdb::Connection& con, const t
 
 	{
 		// Insert new rows with the default value, capturing the DDL change
-		std::ostringstream sql;
+		SqlBuilder sql;
 		sql << "INSERT INTO " << absolute_table_name << " SELECT * REPLACE (" << casted_default_value << " AS "
 		    << quoted_column << ", " << quoted_timestamp << " AS \"_fivetran_start\")"
 		    << " FROM " << absolute_table_name << " WHERE \"_fivetran_active\" = TRUE AND _fivetran_start < "
@@ -1259,7 +1829,7 @@ void MdSqlGenerator::add_column_in_history_mode(duckdb::Connection& con, const t
 		// Also see drop_column_in_history_mode(): this ensures that if we already
 		// inserted records for the current operation_timestamp, we set the right
 		// default value for the column we're currently processing.
-		std::ostringstream sql;
+		SqlBuilder sql;
 		sql << "UPDATE " << absolute_table_name << " SET " << quoted_column << " = " << casted_default_value
 		    << " WHERE \"_fivetran_start\" = " << quoted_timestamp;
 
@@ -1269,7 +1839,7 @@ void MdSqlGenerator::add_column_in_history_mode(duckdb::Connection& con, const t
 
 	{
 		// Update previous active records
-		std::ostringstream sql;
+		SqlBuilder sql;
 		sql << "UPDATE " << absolute_table_name << " SET \"_fivetran_active\" = FALSE,"
 		    << " \"_fivetran_end\" = (" << quoted_timestamp << "::TIMESTAMP - (INTERVAL '1 millisecond'))"
 		    << " WHERE \"_fivetran_active\" = TRUE"
@@ -1286,8 +1856,10 @@ void MdSqlGenerator::update_column_value(duckdb::Connection& con, const table_de
                                          const std::string& value) {
 	const std::string absolute_table_name = table.to_escaped_string();
 	const std::string quoted_column = KeywordHelper::WriteQuoted(column, '"');
+	// The column may be part of the primary key
+	drop_active_records_table(con, table);
 
-	std::ostringstream sql;
+	SqlBuilder sql;
 
 	if (value == "NULL") {
 		// As per a discussion with Fivetran, if value == "NULL" we should interpret
@@ -1295,8 +1867,7 @@ void MdSqlGenerator::update_column_value(duckdb::Connection& con, const table_de
 		// string 'NULL' here.
 		sql << "UPDATE " << absolute_table_name << " SET " << quoted_column << " = NULL";
 	} else {
-		sql << "UPDATE " << absolute_table_name << " SET " << quoted_column << " = "
-		    << KeywordHelper::WriteQuoted(value, '\'');
+		sql << "UPDATE " << absolute_table_name << " SET " << quoted_column << " = " << literal(value);
 	}
 
 	run_query(con, "update_column_value", sql.str(),
@@ -1305,6 +1876,7 @@ void MdSqlGenerator::update_column_value(duckdb::Connection& con, const table_de
 
 void MdSqlGenerator::migrate_soft_delete_to_live(duckdb::Connection& con, const table_def& table,
                                                  const std::string& soft_deleted_column) {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
 	const std::string absolute_table_name = table.to_escaped_string();
 	const std::string quoted_deleted_col = KeywordHelper::WriteQuoted(soft_deleted_column, '"');
 
@@ -1313,7 +1885,7 @@ void MdSqlGenerator::migrate_soft_delete_to_live(duckdb::Connection& con, const
 
 	// Delete rows where soft_deleted_column = TRUE
 	{
-		std::ostringstream sql;
+		SqlBuilder sql;
 		sql << "DELETE FROM " << absolute_table_name << " WHERE " << quoted_deleted_col << " = TRUE";
 		run_query(con, "migrate_soft_delete_to_live delete", sql.str(), "Could not delete soft-deleted rows");
 	}
@@ -1324,6 +1896,7 @@ void MdSqlGenerator::migrate_soft_delete_to_live(duckdb::Connection& con, const
 
 void MdSqlGenerator::migrate_soft_delete_to_history(duckdb::Connection& con, const table_def& original_table,
                                                     const std::string& soft_deleted_column) {
+	const SchemaChange schema_change(schema_cache, instance_key, original_table);
 	const std::string absolute_table_name = original_table.to_escaped_string();
 	const std::string quoted_deleted_col = KeywordHelper::WriteQuoted(soft_deleted_column, '"');
 
@@ -1392,6 +1965,7 @@ void MdSqlGenerator::migrate_soft_delete_to_history(duckdb::Connection& con, con
 
 void MdSqlGenerator::migrate_history_to_soft_delete(duckdb::Connection& con, const table_def& table,
                                                     const std::string& soft_deleted_column) {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
 	const std::string quoted_deleted_col = KeywordHelper::WriteQuoted(soft_deleted_column, '"');
 
 	TransactionContext transaction_context(con);
@@ -1415,7 +1989,7 @@ void MdSqlGenerator::migrate_history_to_soft_delete(duckdb::Connection& con, con
 	}
 
 	if (soft_deleted_column == "_fivetran_deleted") {
-		std::ostringstream sql;
+		SqlBuilder sql;
 		sql << "CREATE TABLE " << temp_table_name
 		    << " AS SELECT * EXCLUDE (\"_fivetran_start\", \"_fivetran_end\", \"_fivetran_active\"), "
 		       "NOT \"_fivetran_active\" AS \"_fivetran_deleted\" FROM "
@@ -1423,19 +1997,19 @@ void MdSqlGenerator::migrate_history_to_soft_delete(duckdb::Connection& con, con
 
 		// Keep only the latest record for a primary key based on the highest _fivetran_start, using QUALIFY
 		sql << " QUALIFY row_number() OVER (partition by ";
-		join(sql, columns_pk, to_name);
+		sql.join_names(quote_columns(columns_pk));
 		sql << " ORDER BY \"_fivetran_start\" DESC) = 1";
 
 		run_query(con, "migrate_history_to_soft_delete create", sql.str(), "Could not create soft_deleted table");
 	} else {
-		std::ostringstream sql;
+		SqlBuilder sql;
 		sql << "CREATE TABLE " << temp_table_name
 		    << " AS SELECT * EXCLUDE (\"_fivetran_start\", \"_fivetran_end\", \"_fivetran_active\") "
 		       " REPLACE (NOT \"_fivetran_active\" AS "
 		    << quoted_deleted_col << "), false as \"_fivetran_deleted\" FROM " << table.to_escaped_string();
 
 		sql << " QUALIFY row_number() OVER (partition by ";
-		join(sql, columns_pk, to_name);
+		sql.join_names(quote_columns(columns_pk));
 		sql << " ORDER BY \"_fivetran_start\" DESC) = 1";
 
 		run_query(con, "migrate_history_to_soft_delete create", sql.str(), "Could not create soft_deleted table");
@@ -1469,6 +2043,7 @@ void MdSqlGenerator::migrate_history_to_soft_delete(duckdb::Connection& con, con
 }
 
 void MdSqlGenerator::migrate_history_to_live(duckdb::Connection& con, const table_def& table, bool keep_deleted_rows) {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
 	const std::string absolute_table_name = table.to_escaped_string();
 
 	TransactionContext transaction_context(con);
@@ -1489,7 +2064,7 @@ void MdSqlGenerator::migrate_history_to_live(duckdb::Connection& con, const tabl
 
 	{
 		// Combine steps 1 and 3
-		std::ostringstream sql;
+		SqlBuilder sql;
 		sql << "CREATE TABLE " << temp_table_name
 		    << " AS SELECT * EXCLUDE (\"_fivetran_start\", \"_fivetran_end\", "
 		       "\"_fivetran_active\") "
@@ -1525,6 +2100,7 @@ void MdSqlGenerator::migrate_history_to_live(duckdb::Connection& con, const tabl
 
 void MdSqlGenerator::migrate_live_to_soft_delete(duckdb::Connection& con, const table_def& table,
                                                  const std::string& soft_deleted_column) {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
 	const std::string absolute_table_name = table.to_escaped_string();
 	const std::string quoted_deleted_col = KeywordHelper::WriteQuoted(soft_deleted_column, '"');
 
@@ -1547,6 +2123,7 @@ void MdSqlGenerator::migrate_live_to_soft_delete(duckdb::Connection& con, const
 }
 
 void MdSqlGenerator::migrate_live_to_history(duckdb::Connection& con, const table_def& table) {
+	const SchemaChange schema_change(schema_cache, instance_key, table);
 	const std::string absolute_table_name = table.to_escaped_string();
 	table_def temp_table {table.db_name, table.schema_name, table.table_name + "_temp"};
 	const std::string temp_absolute_table_name = temp_table.to_escaped_string();
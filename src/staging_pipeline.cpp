@@ -0,0 +1,109 @@
+#include "staging_pipeline.hpp"
+
+#include "connection_pool.hpp"
+#include "csv_processor.hpp"
+#include "duckdb.hpp"
+#include "ingest_properties.hpp"
+#include "md_logging.hpp"
+#include "request_context.hpp"
+#include "retry_policy.hpp"
+#include "staging_tables.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <optional>
+#include <string>
+#include <utility>
+
+namespace {
+using steady_clock = std::chrono::steady_clock;
+
+struct converted_file {
+	csv_processor::ConvertedFile file;
+	steady_clock::duration elapsed;
+};
+
+std::int64_t to_ms(const steady_clock::duration duration) {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+}
+} // namespace
+
+StagingPipeline::StagingPipeline(duckdb::Connection& con_, mdlog::Logger& logger_, RetryPolicy* retry_policy_)
+    : con(con_), logger(logger_), retry_policy(retry_policy_), staging_tables(con_, logger_) {
+}
+
+void StagingPipeline::Add(IngestProperties props, apply_function apply) {
+	files.push_back(queued_file {std::move(props), std::move(apply)});
+}
+
+void StagingPipeline::Run(RequestContext& ctx) {
+	if (files.empty()) {
+		return;
+	}
+	auto staging = files.size() > 1 ? ctx.TryAcquireConnection() : std::nullopt;
+	if (files.size() > 1 && !staging) {
+		logger.info("StagingPipeline: no connection to spare, processing " + std::to_string(files.size()) +
+		            " files one after the other");
+	}
+	if (!staging) {
+		// A single file has nothing to overlap with and skips the conversion
+		for (const auto& file : files) {
+			csv_processor::ProcessFile(con, file.props, logger, file.apply, &staging_tables, retry_policy);
+		}
+		staging_tables.DropAll();
+		return;
+	}
+
+	const RequestContext::WatchedConnection watched(ctx, *staging);
+	auto staging_logger = RequestContext::CreateLogger(*staging);
+	Run(staging->Connection(), staging_logger);
+}
+
+void StagingPipeline::Run(duckdb::Connection& staging_con, mdlog::Logger& staging_logger) {
+	if (files.empty()) {
+		return;
+	}
+
+	const auto convert_async = [&staging_con, &staging_logger](const queued_file& queued) {
+		return std::async(std::launch::async, [&staging_con, &staging_logger, &queued]() {
+			const auto start = steady_clock::now();
+			auto file = csv_processor::ConvertFile(staging_con, queued.props, staging_logger);
+			return converted_file {std::move(file), steady_clock::now() - start};
+		});
+	};
+
+	const auto start = steady_clock::now();
+	steady_clock::duration convert_time {0};
+	steady_clock::duration apply_time {0};
+
+	// If applying a file throws, the destructor of `next` waits for the running
+	// conversion to finish and removes its output
+	auto next = convert_async(files.front());
+	for (std::size_t i = 0; i < files.size(); i++) {
+		const auto current = next.get();
+		convert_time += current.elapsed;
+		if (i + 1 < files.size()) {
+			next = convert_async(files[i + 1]);
+		}
+
+		const auto apply_start = steady_clock::now();
+		csv_processor::ProcessConvertedFile(con, current.file, files[i].props, logger, files[i].apply,
+		                                    &staging_tables, retry_policy);
+		apply_time += steady_clock::now() - apply_start;
+	}
+
+	staging_tables.DropAll();
+
+	// How much of the shorter of the two phases was hidden behind the longer
+	// one: 100% means the batch took as long as its slower phase alone.
+	const auto wall_time = steady_clock::now() - start;
+	const auto overlap = std::max(steady_clock::duration {0}, convert_time + apply_time - wall_time);
+	const auto shorter_phase = std::min(convert_time, apply_time);
+	const auto efficiency = shorter_phase.count() > 0 ? 100 * overlap.count() / shorter_phase.count() : 0;
+	logger.info("StagingPipeline: " + std::to_string(files.size()) + " files, converting took " +
+	            std::to_string(to_ms(convert_time)) + " ms, applying took " + std::to_string(to_ms(apply_time)) +
+	            " ms, total " + std::to_string(to_ms(wall_time)) + " ms, overlap efficiency " +
+	            std::to_string(efficiency) + "%");
+}
@@ -0,0 +1,94 @@
+#include "staging_tables.hpp"
+
+#include "duckdb.hpp"
+#include "ingest_properties.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+#include "sql_generator.hpp"
+
+#include <optional>
+#include <string>
+#include <utility>
+
+namespace {
+/// Identifies the columns of the staging table that the CSV reader produces
+/// for `props`. Columns without a type are auto-detected per file, so their
+/// tables cannot be reused.
+std::optional<std::string> get_schema_key(const IngestProperties& props) {
+	std::string key = props.allow_unmodified_string ? "all_varchar" : "typed";
+	for (const auto& col : props.columns) {
+		if (!props.allow_unmodified_string && col.type == duckdb::LogicalTypeId::INVALID) {
+			return std::nullopt;
+		}
+		key += '\0' + col.name + '\0';
+		if (!props.allow_unmodified_string) {
+			key += format_type(col);
+		}
+	}
+	return key;
+}
+} // namespace
+
+StagingTables::StagingTables(duckdb::Connection& con_, mdlog::Logger& logger_) : con(con_), logger(logger_) {
+}
+
+StagingTables::~StagingTables() {
+	if (!con.HasActiveTransaction()) {
+		DropAll();
+	}
+}
+
+const std::string& StagingTables::current_database() {
+	if (!db_name) {
+		const auto result = con.Query("SELECT current_database()");
+		if (result->HasError()) {
+			result->ThrowError("Could not get current database to generate staging table name: ");
+		}
+		db_name = result->GetValue(0, 0).ToString();
+	}
+	return *db_name;
+}
+
+StagingTables::staging_table StagingTables::Acquire(const IngestProperties& props) {
+	auto schema_key = get_schema_key(props);
+	if (schema_key) {
+		const auto it = idle.find(*schema_key);
+		if (it != idle.end()) {
+			staging_table table {std::move(it->second), true, std::move(schema_key)};
+			idle.erase(it);
+			reuse_count++;
+			return table;
+		}
+	}
+
+	auto name = MdSqlGenerator::generate_temp_table_name(current_database(), "__fivetran_ingest_staging");
+	created.push_back(name);
+	return staging_table {std::move(name), false, std::move(schema_key)};
+}
+
+void StagingTables::Release(staging_table table) {
+	if (table.schema_key) {
+		idle[*table.schema_key] = std::move(table.name);
+	}
+}
+
+void StagingTables::DropAll() {
+	if (created.empty()) {
+		return;
+	}
+
+	std::string query;
+	for (const auto& name : created) {
+		query += "DROP TABLE IF EXISTS " + name + ";";
+	}
+	logger.info("StagingTables: dropping " + std::to_string(created.size()) + " staging tables, reused them " +
+	            std::to_string(reuse_count) + " times");
+	const auto result = con.Query(query);
+	if (result->HasError()) {
+		// Log error, but do not throw. drop_leaked_temp_tables cleans up
+		// eventually.
+		logger.severe("Could not drop staging tables: " + result->GetError());
+	}
+	created.clear();
+	idle.clear();
+}
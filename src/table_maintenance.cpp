@@ -0,0 +1,195 @@
+#include "table_maintenance.hpp"
+
+#include "config.hpp"
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+#include "sql_builder.hpp"
+#include "sql_generator.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+TableMaintenance::options TableMaintenance::options::FromEnvironment() {
+	options opts;
+	opts.enabled = config::env_bool("MD_TABLE_MAINTENANCE", true);
+	const auto min_changed_rows = config::env_int("MD_TABLE_MAINTENANCE_MIN_CHANGED_ROWS", opts.min_changed_rows);
+	opts.min_changed_rows = std::max<std::int64_t>(1, min_changed_rows);
+	const auto max_concurrent = config::env_int("MD_TABLE_MAINTENANCE_CONCURRENCY", 1);
+	opts.max_concurrent = static_cast<std::size_t>(std::max<std::int64_t>(1, max_concurrent));
+	return opts;
+}
+
+TableMaintenance::TableMaintenance(options opts_, connect_fn connect_, run_fn run_)
+    : opts(std::move(opts_)), connect(std::move(connect_)), run(std::move(run_)) {
+	if (!opts.enabled) {
+		return;
+	}
+	for (std::size_t i = 0; i < opts.max_concurrent; i++) {
+		workers.emplace_back([this]() { work(); });
+	}
+}
+
+TableMaintenance::~TableMaintenance() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		for (auto& [name, state] : tables) {
+			if (state.connection) {
+				state.connection->Interrupt();
+			}
+		}
+	}
+	changed.notify_all();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+
+std::string TableMaintenance::state_key(const std::string& instance_key, const table_def& table) {
+	return instance_key + '\0' + table.to_escaped_string();
+}
+
+TableMaintenance::Write::Write(TableMaintenance& maintenance_, const std::string& instance_key,
+                               const table_def& table)
+    : maintenance(maintenance_), key(state_key(instance_key, table)) {
+	std::unique_lock<std::mutex> lock(maintenance.mutex);
+	auto& state = maintenance.tables[key];
+	state.table = table;
+	state.writes++;
+	if (state.running && state.connection) {
+		state.connection->Interrupt();
+	}
+	maintenance.changed.wait(lock, [&state]() { return !state.running; });
+}
+
+TableMaintenance::Write::~Write() {
+	{
+		std::lock_guard<std::mutex> lock(maintenance.mutex);
+		maintenance.tables[key].writes--;
+	}
+	maintenance.changed.notify_all();
+}
+
+void TableMaintenance::RecordChanges(const std::string& instance_key, const table_def& table,
+                                     const std::string& md_token, const std::vector<const column_def*>& order_by,
+                                     const std::int64_t changed_rows) {
+	if (!opts.enabled || changed_rows <= 0) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	auto& state = tables[state_key(instance_key, table)];
+	state.table = table;
+	state.md_token = md_token;
+	state.order_by.clear();
+	for (const auto* col : order_by) {
+		state.order_by.push_back(*col);
+	}
+	state.changed_rows += changed_rows;
+}
+
+TableMaintenance::table_state* TableMaintenance::find_due() {
+	table_state* due = nullptr;
+	for (auto& [name, state] : tables) {
+		if (state.running || state.writes > 0 ||
+		    state.changed_rows < std::max(opts.min_changed_rows, state.changed_rows_needed)) {
+			continue;
+		}
+		if (!due || state.changed_rows > due->changed_rows) {
+			due = &state;
+		}
+	}
+	return due;
+}
+
+void TableMaintenance::work() {
+	auto logger = mdlog::Logger::CreateStdoutLogger();
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!stopping) {
+		auto* state = find_due();
+		if (!state) {
+			changed.wait_for(lock, opts.interval);
+			continue;
+		}
+		state->running = true;
+		const maintenance_job job {state->table, state->md_token, state->order_by, state->changed_rows};
+		lock.unlock();
+
+		maintenance_result result {false};
+		try {
+			auto con = connect(job);
+			lock.lock();
+			// A write may have started while connecting
+			const bool idle = state->writes == 0 && !stopping;
+			if (idle) {
+				state->connection = &con;
+			}
+			lock.unlock();
+			if (idle) {
+				logger.info("TableMaintenance: maintaining " + job.table.to_escaped_string() + " after " +
+				            std::to_string(job.changed_rows) + " changed rows");
+				result = run(con, job, opts);
+			}
+		} catch (const std::exception& ex) {
+			// Interrupted by a write, or failed. Either way, it is retried later.
+			logger.warning("TableMaintenance: maintenance of " + job.table.to_escaped_string() +
+			               " did not complete: " + ex.what());
+		}
+
+		lock.lock();
+		state->connection = nullptr;
+		state->running = false;
+		if (result.maintained) {
+			state->changed_rows -= job.changed_rows;
+			state->changed_rows_needed = 0;
+		} else if (result.changed_rows_needed > 0) {
+			state->changed_rows_needed = result.changed_rows_needed;
+		}
+		changed.notify_all();
+	}
+}
+
+TableMaintenance::maintenance_result TableMaintenance::Rebuild(duckdb::Connection& con, const maintenance_job& job,
+                                                               const options& opts) {
+	auto logger = mdlog::Logger::CreateStdoutLogger();
+
+	SqlBuilder sql;
+	sql << "SELECT estimated_size FROM duckdb_tables() WHERE database_name = " << literal(job.table.db_name)
+	    << " AND schema_name = " << literal(job.table.schema_name)
+	    << " AND table_name = " << literal(job.table.table_name);
+	const auto size_result = con.Query(sql.str());
+	if (size_result->HasError()) {
+		size_result->ThrowError("Could not get the size of table <" + job.table.to_escaped_string() + ">: ");
+	}
+	if (size_result->RowCount() == 0) {
+		// Dropped since. Maintained as far as the counts are concerned.
+		return {true};
+	}
+	const auto estimated_size = size_result->GetValue(0, 0).GetValue<int64_t>();
+	const auto changed_rows_needed =
+	    static_cast<std::int64_t>(static_cast<double>(estimated_size) * opts.min_changed_ratio);
+	if (job.changed_rows < changed_rows_needed) {
+		logger.info("TableMaintenance: " + std::to_string(job.changed_rows) + " changed rows of " +
+		            std::to_string(estimated_size) + " are not worth a rebuild of " +
+		            job.table.to_escaped_string());
+		return {false, changed_rows_needed};
+	}
+
+	MdSqlGenerator generator(logger);
+	std::vector<column_def> columns = job.order_by;
+	if (columns.empty()) {
+		columns = generator.describe_table(con, job.table);
+		std::erase_if(columns, [](const column_def& col) { return !col.primary_key; });
+	}
+	std::vector<const column_def*> order_by;
+	for (const auto& col : columns) {
+		order_by.push_back(&col);
+	}
+	generator.recluster_table(con, job.table, order_by);
+	return {true};
+}
@@ -0,0 +1,121 @@
+#include "write_locks.hpp"
+
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+// Identifiers are case insensitive in DuckDB
+std::string schema_key(const std::string& instance_key, const std::string& db_name, const std::string& schema_name) {
+	return "schema" + ('\0' + instance_key) + '\0' + duckdb::StringUtil::Lower(db_name) + '\0' +
+	       duckdb::StringUtil::Lower(schema_name);
+}
+
+std::string table_key(const std::string& instance_key, const table_def& table) {
+	return "table" + ('\0' + instance_key) + '\0' + duckdb::StringUtil::Lower(table.db_name) + '\0' +
+	       duckdb::StringUtil::Lower(table.schema_name) + '\0' + duckdb::StringUtil::Lower(table.table_name);
+}
+
+std::string schema_creation_key(const std::string& instance_key, const std::string& db_name,
+                                const std::string& schema_name) {
+	return "create schema" + ('\0' + instance_key) + '\0' + duckdb::StringUtil::Lower(db_name) + '\0' +
+	       duckdb::StringUtil::Lower(schema_name);
+}
+
+std::int64_t to_ms(const std::chrono::steady_clock::duration duration) {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+}
+} // namespace
+
+WriteLocks::stats WriteLocks::Stats() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return totals;
+}
+
+bool WriteLocks::can_hold(const std::list<lock_request>& queue, const lock_request& request) {
+	for (const auto& ahead : queue) {
+		if (&ahead == &request) {
+			return true;
+		}
+		if (request.exclusive || ahead.exclusive) {
+			return false;
+		}
+	}
+	return false;
+}
+
+WriteLocks::Guard::Guard(WriteLocks& write_locks_, const std::vector<std::pair<std::string, bool>>& locks,
+                         const std::string& description, mdlog::Logger& logger)
+    : write_locks(write_locks_) {
+	const auto start = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(write_locks.mutex);
+	for (const auto& [key, exclusive] : locks) {
+		auto& queue = write_locks.queues[key];
+		const auto request = queue.insert(queue.end(), lock_request {exclusive});
+		held.emplace_back(key, request);
+		write_locks.released.wait(lock, [&queue, &request]() { return can_hold(queue, *request); });
+	}
+	wait_time = std::chrono::steady_clock::now() - start;
+
+	auto& totals = write_locks.totals;
+	totals.acquired++;
+	// Ignore the time it takes to take the mutex
+	if (wait_time < std::chrono::milliseconds(1)) {
+		return;
+	}
+	totals.waited++;
+	totals.wait_time += wait_time;
+	totals.max_wait_time = std::max(totals.max_wait_time, wait_time);
+	const auto waits = totals.waited;
+	const auto acquired = totals.acquired;
+	const auto total_wait_time = totals.wait_time;
+	lock.unlock();
+
+	logger.info("WriteLocks: waited " + std::to_string(to_ms(wait_time)) + " ms for the lock on " + description +
+	            ", " + std::to_string(waits) + " of " + std::to_string(acquired) + " locks waited for " +
+	            std::to_string(to_ms(total_wait_time)) + " ms in total");
+}
+
+WriteLocks::Guard::~Guard() {
+	{
+		std::lock_guard<std::mutex> lock(write_locks.mutex);
+		for (auto it = held.rbegin(); it != held.rend(); ++it) {
+			auto& queue = write_locks.queues[it->first];
+			queue.erase(it->second);
+			if (queue.empty()) {
+				write_locks.queues.erase(it->first);
+			}
+		}
+	}
+	write_locks.released.notify_all();
+}
+
+WriteLocks::Table::Table(WriteLocks& write_locks_, const std::string& instance_key, const table_def& table,
+                         mdlog::Logger& logger)
+    : Guard(write_locks_,
+            {{schema_key(instance_key, table.db_name, table.schema_name), false},
+             {table_key(instance_key, table), true}},
+            "table " + table.to_escaped_string(), logger) {
+}
+
+WriteLocks::Schema::Schema(WriteLocks& write_locks_, const std::string& instance_key, const std::string& db_name,
+                           const std::string& schema_name, mdlog::Logger& logger)
+    : Guard(write_locks_, {{schema_key(instance_key, db_name, schema_name), true}}, "schema <" + schema_name + ">",
+            logger) {
+}
+
+WriteLocks::SchemaCreation::SchemaCreation(WriteLocks& write_locks_, const std::string& instance_key,
+                                           const std::string& db_name, const std::string& schema_name,
+                                           mdlog::Logger& logger)
+    : Guard(write_locks_, {{schema_creation_key(instance_key, db_name, schema_name), true}},
+            "the creation of schema <" + schema_name + ">", logger) {
+}
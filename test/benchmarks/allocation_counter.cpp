@@ -0,0 +1,44 @@
+#include "allocation_counter.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace {
+std::atomic<std::uint64_t> allocations {0};
+}
+
+namespace bench {
+std::uint64_t allocation_count() {
+	return allocations.load(std::memory_order_relaxed);
+}
+} // namespace bench
+
+void* operator new(const std::size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+		return ptr;
+	}
+	throw std::bad_alloc();
+}
+
+void* operator new[](const std::size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+	std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+	std::free(ptr);
+}
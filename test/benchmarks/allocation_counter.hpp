@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+namespace bench {
+/// Number of calls to the global operator new since the process started. The
+/// benchmark binary replaces operator new to count them.
+std::uint64_t allocation_count();
+
+/// Counts the allocations made while running `fn`
+template <typename F>
+std::uint64_t count_allocations(F&& fn) {
+	const auto before = allocation_count();
+	fn();
+	return allocation_count() - before;
+}
+} // namespace bench
@@ -0,0 +1,80 @@
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+#include "sql_generator.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+constexpr std::int64_t HISTORY_KEYS = 200000;
+constexpr std::int64_t VERSIONS_PER_KEY = 5;
+// Every 100th key is part of the batch
+constexpr std::int64_t STAGED_KEY_STRIDE = 100;
+
+void require_no_error(duckdb::unique_ptr<duckdb::MaterializedQueryResult> result) {
+	INFO(result->GetError());
+	REQUIRE_FALSE(result->HasError());
+}
+
+/// Number of logged statements, and how many of them mention `table_name`.
+/// Each statement that mentions the table scans it at least once.
+std::pair<std::int64_t, std::int64_t> logged_statements(duckdb::Connection& con, const std::string& table_name) {
+	auto res = con.Query("SELECT COUNT(*), COUNT(*) FILTER (contains(message, " +
+	                     duckdb::KeywordHelper::WriteQuoted(table_name, '\'') +
+	                     ")) FROM duckdb_logs WHERE type = 'QueryLog' AND NOT contains(message, 'duckdb_logs')");
+	REQUIRE_FALSE(res->HasError());
+	return {res->GetValue(0, 0).GetValue<int64_t>(), res->GetValue(1, 0).GetValue<int64_t>()};
+}
+} // namespace
+
+TEST_CASE("History mode apply of an earliest start file", "[!benchmark][history]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	MdSqlGenerator generator(logger);
+
+	const table_def table {"memory", "main", "versions"};
+	require_no_error(con.Query("CREATE TABLE versions (id BIGINT, _fivetran_start TIMESTAMP, _fivetran_end TIMESTAMP, "
+	                           "_fivetran_active BOOLEAN, payload VARCHAR, PRIMARY KEY (id, _fivetran_start))"));
+	require_no_error(con.Query(
+	    "INSERT INTO versions SELECT k, TIMESTAMP '2024-01-01' + to_days(CAST(v AS INTEGER)), "
+	    "CASE WHEN v = " +
+	    std::to_string(VERSIONS_PER_KEY - 1) +
+	    " THEN TIMESTAMP '9999-12-31' ELSE TIMESTAMP '2024-01-01' + to_days(CAST(v AS INTEGER) + 1) END, v = " +
+	    std::to_string(VERSIONS_PER_KEY - 1) + ", 'payload ' || k || ' ' || v FROM range(" +
+	    std::to_string(HISTORY_KEYS) + ") keys(k), range(" + std::to_string(VERSIONS_PER_KEY) + ") versions(v)"));
+	require_no_error(con.Query("CREATE TABLE earliest AS SELECT k AS id, TIMESTAMP '2024-02-01' AS _fivetran_start "
+	                           "FROM range(0, " +
+	                           std::to_string(HISTORY_KEYS) + ", " + std::to_string(STAGED_KEY_STRIDE) + ") keys(k)"));
+
+	const std::vector<column_def> columns {
+	    column_def {.name = "id", .type = duckdb::LogicalTypeId::BIGINT, .primary_key = true},
+	    column_def {.name = "_fivetran_start", .type = duckdb::LogicalTypeId::TIMESTAMP, .primary_key = true}};
+	std::vector<const column_def*> columns_pk;
+	find_primary_keys(columns, columns_pk, nullptr, "_fivetran_start");
+
+	const auto apply = [&]() {
+		con.BeginTransaction();
+		const auto lar_table_name = generator.create_latest_active_records_table(con, table);
+		generator.deactivate_historical_records(con, table, "earliest", lar_table_name, columns_pk);
+		con.Rollback();
+	};
+
+	require_no_error(con.Query("CALL enable_logging('QueryLog')"));
+	apply();
+	const auto [statements, scans] = logged_statements(con, table.to_escaped_string());
+	require_no_error(con.Query("CALL disable_logging()"));
+	std::cout << "deactivate_historical_records: " << scans << " scans of the history table ("
+	          << HISTORY_KEYS * VERSIONS_PER_KEY << " rows) in " << statements << " statements per earliest file"
+	          << std::endl;
+
+	BENCHMARK("deactivate_historical_records") {
+		apply();
+	};
+}
@@ -0,0 +1,83 @@
+#include "csv_processor.hpp"
+#include "duckdb.hpp"
+#include "ingest_properties.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+// Rows of test/files/csv/large.csv
+constexpr std::int64_t LARGE_CSV_ROWS = 1000;
+
+void require_no_error(duckdb::unique_ptr<duckdb::MaterializedQueryResult> result) {
+	INFO(result->GetError());
+	REQUIRE_FALSE(result->HasError());
+}
+
+/// Writes a file with the columns of large.csv and `scale` times its rows
+fs::path write_large_csv(duckdb::Connection& con, const fs::path& dir, const std::int64_t scale) {
+	const auto path = dir / ("large_x" + std::to_string(scale) + ".csv");
+	require_no_error(con.Query(
+	    "COPY (SELECT i AS transaction_id, i * 7919 % 500 AS user_id, ['Speaker', 'Laptop', 'Camera'][i % 3 + 1] AS "
+	    "product_name, ['Video', 'Electronics', 'Audio', 'Books'][i % 4 + 1] AS category, (i * 7919 % 5000000) / 100 "
+	    "AS amount, i % 10 + 1 AS quantity, (i % 3000) / 100 AS discount, (i * 31 % 100000) / 100 AS tax, (i % 5000) "
+	    "/ 100 AS shipping_cost, ['Cash', 'PayPal', 'Credit Card'][i % 3 + 1] AS payment_method, ['Cancelled', "
+	    "'Pending', 'Completed'][i % 3 + 1] AS status, DATE '2024-01-01' + (i % 366)::INTEGER AS order_date FROM "
+	    "range(1, " +
+	    std::to_string(scale * LARGE_CSV_ROWS + 1) + ") t(i)) TO " +
+	    duckdb::KeywordHelper::WriteQuoted(path.string(), '\'') + " (HEADER)"));
+	return path;
+}
+} // namespace
+
+TEST_CASE("Staging large CSV files", "[!benchmark][ingest]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+
+	const auto dir = fs::temp_directory_path() / "bench_ingest";
+	fs::create_directories(dir);
+
+	const std::vector<column_def> columns {
+	    column_def {.name = "transaction_id", .type = duckdb::LogicalTypeId::BIGINT, .primary_key = true},
+	    column_def {.name = "user_id", .type = duckdb::LogicalTypeId::INTEGER},
+	    column_def {.name = "product_name", .type = duckdb::LogicalTypeId::VARCHAR},
+	    column_def {.name = "category", .type = duckdb::LogicalTypeId::VARCHAR},
+	    column_def {.name = "amount", .type = duckdb::LogicalTypeId::DOUBLE},
+	    column_def {.name = "quantity", .type = duckdb::LogicalTypeId::INTEGER},
+	    column_def {.name = "discount", .type = duckdb::LogicalTypeId::DOUBLE},
+	    column_def {.name = "tax", .type = duckdb::LogicalTypeId::DOUBLE},
+	    column_def {.name = "shipping_cost", .type = duckdb::LogicalTypeId::DOUBLE},
+	    column_def {.name = "payment_method", .type = duckdb::LogicalTypeId::VARCHAR},
+	    column_def {.name = "status", .type = duckdb::LogicalTypeId::VARCHAR},
+	    column_def {.name = "order_date", .type = duckdb::LogicalTypeId::DATE}};
+
+	for (const std::int64_t scale : {1, 10, 100}) {
+		const auto file = write_large_csv(con, dir, scale);
+		const IngestProperties props {.filename = file.string(), .columns = columns};
+		const auto check_rows = [&con, scale](const std::string& staging_table_name) {
+			const auto result = con.Query("SELECT COUNT(*) FROM " + staging_table_name);
+			REQUIRE(result->GetValue(0, 0).GetValue<int64_t>() == scale * LARGE_CSV_ROWS);
+		};
+
+		// Each run creates the staging table in a transaction of its own and
+		// drops it again
+		for (const bool preserve_insertion_order : {true, false}) {
+			require_no_error(con.Query(std::string("SET preserve_insertion_order = ") +
+			                           (preserve_insertion_order ? "true" : "false")));
+			BENCHMARK(std::to_string(scale) + "x large.csv, preserve_insertion_order=" +
+			          (preserve_insertion_order ? "true" : "false")) {
+				csv_processor::ProcessFile(con, props, logger, check_rows);
+			};
+		}
+	}
+	fs::remove_all(dir);
+}
@@ -0,0 +1,75 @@
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+#include "sql_generator.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace {
+constexpr std::int64_t INITIAL_SYNC_ROWS = 2000000;
+// The replace files of an initial sync, each one staged separately
+constexpr std::int64_t INITIAL_SYNC_FILES = 4;
+
+void require_no_error(duckdb::unique_ptr<duckdb::MaterializedQueryResult> result) {
+	INFO(result->GetError());
+	REQUIRE_FALSE(result->HasError());
+}
+} // namespace
+
+TEST_CASE("Initial sync of an empty table", "[!benchmark][initial_load]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	MdSqlGenerator generator(logger);
+
+	const table_def table {"memory", "main", "initial"};
+	const std::vector<column_def> columns {
+	    column_def {.name = "id", .type = duckdb::LogicalTypeId::BIGINT, .primary_key = true},
+	    column_def {.name = "name", .type = duckdb::LogicalTypeId::VARCHAR},
+	    column_def {.name = "amount", .type = duckdb::LogicalTypeId::DOUBLE}};
+	std::vector<const column_def*> columns_pk;
+	std::vector<const column_def*> columns_regular;
+	find_primary_keys(columns, columns_pk, &columns_regular);
+
+	// Unique keys in shuffled order, as the source does not send them sorted.
+	// 7919 is coprime to INITIAL_SYNC_ROWS, so that the keys are a permutation.
+	std::vector<std::string> staging_tables;
+	const auto rows_per_file = INITIAL_SYNC_ROWS / INITIAL_SYNC_FILES;
+	for (std::int64_t file = 0; file < INITIAL_SYNC_FILES; file++) {
+		staging_tables.push_back("staging_" + std::to_string(file));
+		require_no_error(con.Query("CREATE TABLE " + staging_tables.back() + " AS SELECT i * 7919 % " +
+		                           std::to_string(INITIAL_SYNC_ROWS) +
+		                           " AS id, 'name ' || i AS name, i / 7 AS amount FROM range(" +
+		                           std::to_string(file * rows_per_file) + ", " +
+		                           std::to_string((file + 1) * rows_per_file) + ") t(i)"));
+	}
+
+	// Every run loads the table in a transaction that is rolled back
+	BENCHMARK("upsert into a table with PRIMARY KEY") {
+		con.BeginTransaction();
+		generator.create_table(con, table, columns, {});
+		for (const auto& staging_table : staging_tables) {
+			generator.upsert(con, table, staging_table, columns_pk, columns_regular);
+		}
+		con.Rollback();
+	};
+
+	BENCHMARK("insert, then add PRIMARY KEY") {
+		con.BeginTransaction();
+		generator.create_table(con, table, columns, {}, false);
+		bool table_empty = true;
+		for (const auto& staging_table : staging_tables) {
+			if (!table_empty) {
+				generator.delete_rows(con, table, staging_table, columns_pk);
+			}
+			generator.insert(con, table, staging_table, columns_pk, columns_regular, columns_pk);
+			table_empty = false;
+		}
+		generator.add_deferred_primary_key(con, table, columns_pk);
+		con.Rollback();
+	};
+}
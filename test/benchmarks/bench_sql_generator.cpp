@@ -0,0 +1,71 @@
+#include "allocation_counter.hpp"
+#include "duckdb.hpp"
+#include "schema_types.hpp"
+#include "sql_generator.hpp"
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+constexpr std::size_t WIDE_TABLE_COLUMNS = 1000;
+
+std::vector<column_def> make_wide_table() {
+	std::vector<column_def> columns;
+	columns.reserve(WIDE_TABLE_COLUMNS);
+	columns.push_back(column_def {.name = "id", .type = duckdb::LogicalTypeId::BIGINT, .primary_key = true});
+	for (std::size_t i = 1; i < WIDE_TABLE_COLUMNS; i++) {
+		// Mix in a few BLOB columns and quotes that need escaping
+		const auto type = i % 10 == 0 ? duckdb::LogicalTypeId::BLOB : duckdb::LogicalTypeId::VARCHAR;
+		columns.push_back(column_def {.name = "column \"" + std::to_string(i) + "\"", .type = type});
+	}
+	return columns;
+}
+
+void report_allocations(const std::string& name, const std::uint64_t allocations) {
+	std::cout << name << ": " << allocations << " allocations per statement (" << WIDE_TABLE_COLUMNS
+	          << " columns)" << std::endl;
+}
+} // namespace
+
+TEST_CASE("SQL generation for a 1000-column table", "[!benchmark][sql_generator]") {
+	const auto columns = make_wide_table();
+	std::vector<const column_def*> columns_pk;
+	std::vector<const column_def*> columns_regular;
+	find_primary_keys(columns, columns_pk, &columns_regular);
+
+	const table_def table {"my_db", "my_schema", "wide_table"};
+	const std::string staging_table = "\"my_db\".\"main\".\"__fivetran_ingest_staging_abc\"";
+	const std::string unmodified_string = "unmod-NcK9NIjPUutCsz4mjOQQztbnwnE1sY3";
+
+	report_allocations("upsert", bench::count_allocations([&]() {
+		                   MdSqlGenerator::upsert_query(table, staging_table, columns_pk, columns_regular);
+	                   }));
+	report_allocations("update_values", bench::count_allocations([&]() {
+		                   MdSqlGenerator::update_values_query(table, staging_table, columns_pk, columns_regular,
+		                                                       unmodified_string);
+	                   }));
+	report_allocations("delete_rows", bench::count_allocations([&]() {
+		                   MdSqlGenerator::delete_rows_query(table, staging_table, columns_pk);
+	                   }));
+
+	BENCHMARK("upsert") {
+		return MdSqlGenerator::upsert_query(table, staging_table, columns_pk, columns_regular);
+	};
+
+	BENCHMARK("insert") {
+		return MdSqlGenerator::insert_query(table, staging_table, columns_pk, columns_regular);
+	};
+
+	BENCHMARK("update_values") {
+		return MdSqlGenerator::update_values_query(table, staging_table, columns_pk, columns_regular,
+		                                           unmodified_string);
+	};
+
+	BENCHMARK("delete_rows") {
+		return MdSqlGenerator::delete_rows_query(table, staging_table, columns_pk);
+	};
+}
@@ -1,13 +1,20 @@
 #include "../constants.hpp"
 #include "common.hpp"
 #include "config_tester.hpp"
+#include "destination_callback_service.hpp"
 #include "duckdb.hpp"
 #include "motherduck_destination_server.hpp"
 
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/internal/catch_run_context.hpp>
 #include <catch2/matchers/catch_matchers_string.hpp>
+#include <chrono>
+#include <filesystem>
 #include <fstream>
+#include <grpcpp/grpcpp.h>
+#include <memory>
+#include <string>
+#include <vector>
 
 using namespace test::constants;
 
@@ -19,11 +26,14 @@ TEST_CASE("ConfigurationForm", "[integration][config]") {
 	auto status = service.ConfigurationForm(nullptr, &request, &response);
 	REQUIRE_NO_FAIL(status);
 
-	REQUIRE(response.fields_size() == 4);
+	REQUIRE(response.fields_size() == 7);
 	REQUIRE(response.fields(0).name() == "motherduck_token");
 	REQUIRE(response.fields(1).name() == "motherduck_database");
 	REQUIRE(response.fields(2).name() == "max_record_size");
 	REQUIRE(response.fields(3).name() == "strict_primary_keys");
+	REQUIRE(response.fields(4).name() == "active_records_table");
+	REQUIRE(response.fields(5).name() == "cluster_by");
+	REQUIRE(response.fields(6).name() == "apply_chunk_rows");
 
 	REQUIRE(response.tests_size() == 4);
 }
@@ -616,6 +626,157 @@ TEST_CASE("WriteBatch succeeds with empty max_record_size", "[integration][write
 	}
 }
 
+TEST_CASE("WriteBatch skips files that an earlier attempt of the batch committed", "[integration][write-batch]") {
+	DestinationSdkImpl service;
+
+	const std::string table_name = "books" + std::to_string(randint());
+	create_table(service, table_name, TEST_COLUMNS);
+	auto con = get_test_connection(MD_TOKEN);
+	const auto qualified_table = TEST_SCHEMA_NAME + "." + table_name;
+
+	// Fails to stage until it is fixed, after books_upsert.csv has been applied
+	const auto second_file =
+	    (std::filesystem::temp_directory_path() / ("books_retry_" + std::to_string(randint()) + ".csv")).string();
+	const auto write_second_file = [&second_file](const std::string& id) {
+		std::ofstream(second_file) << "id,title,magic_number,_fivetran_deleted,_fivetran_synced\n"
+		                           << id << ",\"The Silmarillion\",7,false,\"2024-01-09T04:10:19.156057706Z\"\n";
+	};
+
+	const auto write_batch = [&](const std::vector<std::string>& files, const std::string& apply_chunk_rows) {
+		::fivetran_sdk::v2::WriteBatchRequest request;
+		add_config(request, MD_TOKEN, TEST_DATABASE_NAME);
+		if (!apply_chunk_rows.empty()) {
+			(*request.mutable_configuration())["apply_chunk_rows"] = apply_chunk_rows;
+		}
+		define_table(request, table_name, TEST_COLUMNS);
+		request.mutable_file_params()->set_null_string("magic-nullvalue");
+		for (const auto& file : files) {
+			request.add_replace_files(file);
+		}
+		::fivetran_sdk::v2::WriteBatchResponse response;
+		return service.WriteBatch(nullptr, &request, &response);
+	};
+	const auto title_of_book_2 = [&]() {
+		auto res = con->Query("SELECT title FROM " + qualified_table + " WHERE id = 2");
+		REQUIRE_NO_FAIL(res);
+		REQUIRE(res->RowCount() == 1);
+		return res->GetValue(0, 0).ToString();
+	};
+	const auto row_count = [&]() {
+		auto res = con->Query("SELECT COUNT(*) FROM " + qualified_table);
+		REQUIRE_NO_FAIL(res);
+		return res->GetValue(0, 0).GetValue<int64_t>();
+	};
+	const auto upsert_file = TEST_RESOURCES_DIR + "books_upsert.csv";
+
+	SECTION("a batch whose response got lost is skipped as a whole") {
+		REQUIRE_NO_FAIL(write_batch({upsert_file}, ""));
+		// Changed after the commit, a retry that applied the file again would
+		// undo this
+		REQUIRE_NO_FAIL(con->Query("UPDATE " + qualified_table + " SET title = 'changed' WHERE id = 2"));
+
+		REQUIRE_NO_FAIL(write_batch({upsert_file}, ""));
+		REQUIRE(title_of_book_2() == "changed");
+	}
+
+	SECTION("without chunked mode, a failed batch is retried from its first file") {
+		write_second_file("not a number");
+		REQUIRE_FALSE(write_batch({upsert_file, second_file}, "").ok());
+		REQUIRE(row_count() == 0);
+	}
+
+	SECTION("in chunked mode, a failed batch continues after the files it committed") {
+		write_second_file("not a number");
+		REQUIRE_FALSE(write_batch({upsert_file, second_file}, "2").ok());
+		REQUIRE(row_count() == 3);
+		REQUIRE_NO_FAIL(con->Query("UPDATE " + qualified_table + " SET title = 'changed' WHERE id = 2"));
+
+		write_second_file("4");
+		REQUIRE_NO_FAIL(write_batch({upsert_file, second_file}, "2"));
+		REQUIRE(title_of_book_2() == "changed");
+		REQUIRE(row_count() == 4);
+	}
+
+	std::filesystem::remove(second_file);
+}
+
+TEST_CASE("WriteBatch that exceeds its deadline leaves no tables behind and discards its connection",
+          "[integration][write-batch]") {
+	DestinationSdkImpl service;
+
+	const std::string table_name = "books" + std::to_string(randint());
+	create_table(service, table_name, TEST_COLUMNS);
+	auto con = get_test_connection(MD_TOKEN);
+
+	// Enough rows that staging and applying them take longer than the deadline
+	const auto file =
+	    (std::filesystem::temp_directory_path() / ("books_cancelled_" + std::to_string(randint()) + ".csv")).string();
+	{
+		duckdb::DuckDB local(nullptr);
+		duckdb::Connection local_con(local);
+		REQUIRE_NO_FAIL(local_con.Query(
+		    "COPY (SELECT i::INTEGER AS id, 'title ' || i AS title, (i % 100)::INTEGER AS magic_number, false AS "
+		    "_fivetran_deleted, TIMESTAMPTZ '2024-01-09 04:10:19+00' AS _fivetran_synced FROM range(2000000) t(i)) "
+		    "TO " +
+		    duckdb::KeywordHelper::WriteQuoted(file, '\'') + " (HEADER)"));
+	}
+
+	// Staging tables of this and of other tests; the LAR tables are TEMP tables
+	// of the request's connection and go away with it
+	const auto leftover_tables = [&con]() {
+		auto res = con->Query("SELECT table_name FROM duckdb_tables() WHERE database_name = " +
+		                      duckdb::KeywordHelper::WriteQuoted(TEST_DATABASE_NAME, '\'') +
+		                      " AND (starts_with(table_name, '__fivetran_ingest_staging') OR "
+		                      "starts_with(table_name, '__fivetran_latest_active_records')) ORDER BY ALL");
+		REQUIRE_NO_FAIL(res);
+		std::vector<std::string> names;
+		for (idx_t row = 0; row < res->RowCount(); row++) {
+			names.push_back(res->GetValue(0, row).ToString());
+		}
+		return names;
+	};
+	const auto tables_before = leftover_tables();
+	// The request reuses the idle connection that CreateTable returned
+	const auto pool_before = service.PoolStats(MD_TOKEN, TEST_DATABASE_NAME);
+	REQUIRE(pool_before.idle > 0);
+
+	{
+		// Served like in production, so that the request has a context that
+		// reports its deadline
+		DestinationCallbackService callback_service(service, DestinationCallbackService::options());
+		grpc::ServerBuilder builder;
+		builder.RegisterService(&callback_service);
+		const std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
+		REQUIRE(server);
+		const auto stub = fivetran_sdk::v2::DestinationConnector::NewStub(server->InProcessChannel({}));
+
+		::fivetran_sdk::v2::WriteBatchRequest request;
+		add_config(request, MD_TOKEN, TEST_DATABASE_NAME);
+		define_table(request, table_name, TEST_COLUMNS);
+		request.add_replace_files(file);
+
+		grpc::ClientContext client_context;
+		client_context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(500));
+		::fivetran_sdk::v2::WriteBatchResponse response;
+		const auto status = stub->WriteBatch(&client_context, request, &response);
+		REQUIRE(status.error_code() == grpc::StatusCode::DEADLINE_EXCEEDED);
+
+		// Waits for the request to unwind
+		server->Shutdown();
+	}
+
+	auto res = con->Query("SELECT COUNT(*) FROM " + TEST_SCHEMA_NAME + "." + table_name);
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->GetValue(0, 0).GetValue<int64_t>() == 0);
+	REQUIRE(leftover_tables() == tables_before);
+
+	const auto pool_after = service.PoolStats(MD_TOKEN, TEST_DATABASE_NAME);
+	REQUIRE(pool_after.created == pool_before.created);
+	REQUIRE(pool_after.open == pool_before.open - 1);
+
+	std::filesystem::remove(file);
+}
+
 TEST_CASE("Test all types with create and describe table") {
 
 	DestinationSdkImpl service;
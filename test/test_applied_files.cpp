@@ -0,0 +1,78 @@
+#include "applied_files.hpp"
+#include "constants.hpp"
+#include "decryption.hpp"
+#include "duckdb.hpp"
+#include "integration/common.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+using namespace test::constants;
+
+TEST_CASE("File fingerprints identify file contents", "[applied_files]") {
+	const auto simple = (fs::path(TEST_RESOURCES_DIR) / "csv" / "small_simple.csv").string();
+	const auto other = (fs::path(TEST_RESOURCES_DIR) / "csv" / "escaped_string.csv").string();
+	REQUIRE(fs::exists(simple));
+	REQUIRE(fs::exists(other));
+
+	const auto fingerprint = file_fingerprint(simple, "");
+	REQUIRE(fingerprint.size() == 64);
+	REQUIRE(file_fingerprint(simple, "") == fingerprint);
+	REQUIRE(file_fingerprint(other, "") != fingerprint);
+	// Encrypted files are identified by their key and IV
+	REQUIRE(file_fingerprint(simple, "key-1") != file_fingerprint(simple, "key-2"));
+}
+
+TEST_CASE("AppliedFiles only remembers committed batches", "[applied_files]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	AppliedFiles::Initialize(con, logger, std::chrono::hours(1));
+
+	const table_def table {"memory", "my_schema", "t"};
+	const std::vector<std::string> fingerprints {"aaa", "bbb"};
+
+	SECTION("rolled back batches are applied again") {
+		AppliedFiles batch(con, logger, table);
+		batch.Load(fingerprints);
+		con.BeginTransaction();
+		batch.Add("aaa", "replace");
+		batch.Record();
+		con.Rollback();
+
+		AppliedFiles retry(con, logger, table);
+		retry.Load(fingerprints);
+		REQUIRE_FALSE(retry.Contains("aaa"));
+	}
+
+	SECTION("committed batches are skipped, for the same table only") {
+		AppliedFiles batch(con, logger, table);
+		batch.Load(fingerprints);
+		con.BeginTransaction();
+		batch.Add("aaa", "replace");
+		batch.Add("bbb", "delete");
+		batch.Record();
+		con.Commit();
+
+		AppliedFiles retry(con, logger, table);
+		retry.Load(fingerprints);
+		REQUIRE(retry.Contains("aaa"));
+		REQUIRE(retry.Contains("bbb"));
+
+		AppliedFiles other_table(con, logger, {"memory", "my_schema", "u"});
+		other_table.Load(fingerprints);
+		REQUIRE_FALSE(other_table.Contains("aaa"));
+
+		// Old records are removed on startup
+		REQUIRE_NO_FAIL(con.Query("UPDATE __fivetran_applied_files SET applied_at = applied_at - 7200"));
+		AppliedFiles::Initialize(con, logger, std::chrono::hours(1));
+		AppliedFiles after_cleanup(con, logger, table);
+		after_cleanup.Load(fingerprints);
+		REQUIRE_FALSE(after_cleanup.Contains("aaa"));
+	}
+}
@@ -0,0 +1,84 @@
+#include "cancellation_watchdog.hpp"
+#include "duckdb.hpp"
+
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <string>
+
+namespace {
+// Runs for hours unless interrupted
+constexpr const char* LONG_QUERY = "SELECT sum(hash(i)) FROM range(1000000000000) t(i)";
+
+CancellationWatchdog::options fast_polling() {
+	CancellationWatchdog::options opts;
+	opts.interval = std::chrono::milliseconds(20);
+	return opts;
+}
+} // namespace
+
+TEST_CASE("CancellationWatchdog interrupts the queries of a cancelled request", "[cancellation]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	CancellationWatchdog watchdog(fast_polling());
+
+	std::atomic<int> checks {0};
+	CancellationWatchdog::Watch watch(
+	    watchdog, "WriteBatch", [&checks]() { return ++checks > 3; }, CancellationWatchdog::clock::time_point::max());
+	watch.AddConnection(con);
+
+	const auto result = con.Query(LONG_QUERY);
+	REQUIRE(result->HasError());
+	CHECK(result->GetError().find("Interrupt") != std::string::npos);
+	CHECK(watch.Cancelled());
+	CHECK(watch.Reason() == "cancelled by the client");
+
+	// Cleanup queries run once the request stops the watch
+	watch.Stop();
+	const auto cleanup = con.Query("SELECT 42");
+	REQUIRE_FALSE(cleanup->HasError());
+	CHECK(watch.Cancelled());
+}
+
+TEST_CASE("CancellationWatchdog interrupts the queries of a request past its deadline", "[cancellation]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	CancellationWatchdog watchdog(fast_polling());
+
+	CancellationWatchdog::Watch watch(watchdog, "Migrate", nullptr,
+	                                  CancellationWatchdog::clock::now() + std::chrono::milliseconds(100));
+	watch.AddConnection(con);
+
+	const auto start = std::chrono::steady_clock::now();
+	const auto result = con.Query(LONG_QUERY);
+	REQUIRE(result->HasError());
+	CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(30));
+	CHECK(watch.Reason() == "past its deadline");
+}
+
+TEST_CASE("CancellationWatchdog leaves other requests and removed connections alone", "[cancellation]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection cancelled_con(db);
+	duckdb::Connection removed_con(db);
+	duckdb::Connection other_con(db);
+	CancellationWatchdog watchdog(fast_polling());
+
+	CancellationWatchdog::Watch cancelled(
+	    watchdog, "Truncate", []() { return true; }, CancellationWatchdog::clock::time_point::max());
+	cancelled.AddConnection(cancelled_con);
+	cancelled.AddConnection(removed_con);
+	cancelled.RemoveConnection(removed_con);
+	CancellationWatchdog::Watch other(
+	    watchdog, "WriteBatch", []() { return false; }, CancellationWatchdog::clock::time_point::max());
+	other.AddConnection(other_con);
+
+	REQUIRE(cancelled_con.Query(LONG_QUERY)->HasError());
+	REQUIRE(cancelled.Cancelled());
+
+	// Long enough for several polls
+	const auto query = "SELECT count(*) FROM range(100000000) t(i) WHERE hash(i) % 7 = 0";
+	REQUIRE_FALSE(removed_con.Query(query)->HasError());
+	REQUIRE_FALSE(other_con.Query(query)->HasError());
+	CHECK_FALSE(other.Cancelled());
+	CHECK(other.Reason().empty());
+}
@@ -0,0 +1,170 @@
+#include "applied_files.hpp"
+#include "chunked_apply.hpp"
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+
+#include <algorithm>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+std::int64_t count_rows(duckdb::Connection& con, const std::string& table) {
+	const auto result = con.Query("SELECT COUNT(*) FROM " + table);
+	REQUIRE_FALSE(result->HasError());
+	return result->GetValue(0, 0).GetValue<int64_t>();
+}
+} // namespace
+
+TEST_CASE("ChunkedApply commits chunks and resumes after the last committed one", "[chunked_apply]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	AppliedFiles::Initialize(con, logger, std::chrono::hours(1));
+	REQUIRE_FALSE(con.Query("CREATE TABLE target (id INT PRIMARY KEY, v VARCHAR)")->HasError());
+	REQUIRE_FALSE(con.Query("CREATE TABLE staging AS SELECT i::INT AS id, 'v' || i AS v FROM range(10) t(i)")
+	                  ->HasError());
+
+	const table_def table {"memory", "main", "target"};
+	std::int64_t applied_chunks = 0;
+	const auto upsert = [&](const std::string& chunk_table) {
+		const auto result = con.Query("INSERT OR REPLACE INTO target SELECT * FROM " + chunk_table);
+		REQUIRE_FALSE(result->HasError());
+		applied_chunks++;
+	};
+
+	SECTION("all chunks are applied in separate transactions") {
+		AppliedFiles applied_files(con, logger, table);
+		applied_files.Load({"file"});
+		ChunkedApply chunked(con, logger, applied_files, 4);
+
+		chunked.Run("staging", "file", "replace", upsert);
+		REQUIRE_FALSE(con.HasActiveTransaction());
+
+		REQUIRE(applied_chunks == 3);
+		REQUIRE(count_rows(con, "target") == 10);
+		REQUIRE(applied_files.CommittedChunks("file#4#") == 3);
+		// The chunk view has been dropped
+		const auto views =
+		    con.Query("SELECT COUNT(*) FROM duckdb_views() WHERE starts_with(view_name, '__fivetran_ingest')");
+		REQUIRE(views->GetValue(0, 0).GetValue<int64_t>() == 0);
+	}
+
+	SECTION("a retry skips the committed chunks") {
+		AppliedFiles applied_files(con, logger, table);
+		applied_files.Load({"file"});
+		ChunkedApply chunked(con, logger, applied_files, 4);
+
+		const auto fail_second = [&](const std::string& chunk_table) {
+			if (applied_chunks == 1) {
+				throw std::runtime_error("connection lost");
+			}
+			upsert(chunk_table);
+		};
+		REQUIRE_THROWS(chunked.Run("staging", "file", "replace", fail_second));
+		// The failed chunk has been rolled back, and its view dropped
+		REQUIRE_FALSE(con.HasActiveTransaction());
+		REQUIRE(count_rows(con, "target") == 4);
+		const auto views =
+		    con.Query("SELECT COUNT(*) FROM duckdb_views() WHERE starts_with(view_name, '__fivetran_ingest')");
+		REQUIRE(views->GetValue(0, 0).GetValue<int64_t>() == 0);
+
+		applied_chunks = 0;
+		AppliedFiles retry_files(con, logger, table);
+		retry_files.Load({"file"});
+		ChunkedApply retry(con, logger, retry_files, 4);
+		retry.Run("staging", "file", "replace", upsert);
+
+		REQUIRE(applied_chunks == 2);
+		REQUIRE(count_rows(con, "target") == 10);
+		REQUIRE(retry_files.CommittedChunks("file#4#") == 3);
+
+		// Chunks of another size start over
+		applied_chunks = 0;
+		retry_files.Load({"file"});
+		ChunkedApply resized(con, logger, retry_files, 5);
+		resized.Run("staging", "file", "replace", upsert);
+		REQUIRE(applied_chunks == 2);
+	}
+
+	SECTION("a retry that stages the file again applies each row once") {
+		std::vector<std::int32_t> applied_ids;
+		const auto record_ids = [&](const std::string& chunk_table) {
+			const auto result = con.Query("SELECT id FROM " + chunk_table);
+			REQUIRE_FALSE(result->HasError());
+			for (idx_t row = 0; row < result->RowCount(); row++) {
+				applied_ids.push_back(result->GetValue(0, row).GetValue<std::int32_t>());
+			}
+			upsert(chunk_table);
+		};
+		const auto fail_second = [&](const std::string& chunk_table) {
+			if (applied_chunks == 1) {
+				throw std::runtime_error("connection lost");
+			}
+			record_ids(chunk_table);
+		};
+
+		AppliedFiles applied_files(con, logger, table);
+		applied_files.Load({"file"});
+		ChunkedApply chunked(con, logger, applied_files, 4);
+		REQUIRE_THROWS(chunked.Run("staging", "file", "replace", fail_second));
+		REQUIRE(applied_ids.size() == 4);
+
+		// The reused staging table is filled in the same order, after the rowids
+		// of the first attempt
+		REQUIRE_FALSE(con.Query("TRUNCATE staging; INSERT INTO staging SELECT i::INT, 'v' || i FROM range(10) t(i)")
+		                  ->HasError());
+		AppliedFiles retry_files(con, logger, table);
+		retry_files.Load({"file"});
+		ChunkedApply retry(con, logger, retry_files, 4);
+		retry.Run("staging", "file", "replace", record_ids);
+
+		std::sort(applied_ids.begin(), applied_ids.end());
+		std::vector<std::int32_t> all_ids(10);
+		std::iota(all_ids.begin(), all_ids.end(), 0);
+		REQUIRE(applied_ids == all_ids);
+		REQUIRE(count_rows(con, "target") == 10);
+	}
+
+	SECTION("the caller's transaction is not committed") {
+		AppliedFiles applied_files(con, logger, table);
+		applied_files.Load({"file"});
+		ChunkedApply chunked(con, logger, applied_files, 4);
+
+		con.BeginTransaction();
+		REQUIRE_THROWS_AS(chunked.Run("staging", "file", "replace", upsert), std::runtime_error);
+		REQUIRE(con.HasActiveTransaction());
+		con.Rollback();
+		REQUIRE(applied_chunks == 0);
+	}
+
+	SECTION("gaps in the rowids leave chunks smaller") {
+		// Leaves 1, 2, 4, 5, 7 and 8, with gaps in their rowids
+		REQUIRE_FALSE(con.Query("DELETE FROM staging WHERE id % 3 = 0")->HasError());
+		AppliedFiles applied_files(con, logger, table);
+		applied_files.Load({"file"});
+		ChunkedApply chunked(con, logger, applied_files, 4);
+		chunked.Run("staging", "file", "replace", upsert);
+
+		REQUIRE(applied_chunks == 2);
+		REQUIRE(count_rows(con, "target") == 6);
+	}
+
+	SECTION("reused staging tables are chunked from their first row") {
+		REQUIRE_FALSE(con.Query("TRUNCATE staging; INSERT INTO staging SELECT i::INT, 'w' || i FROM range(20, 25) "
+		                        "t(i)")
+		                  ->HasError());
+		AppliedFiles applied_files(con, logger, table);
+		applied_files.Load({"other"});
+		ChunkedApply chunked(con, logger, applied_files, 2);
+		chunked.Run("staging", "other", "replace", upsert);
+
+		REQUIRE(applied_chunks == 3);
+		REQUIRE(count_rows(con, "target") == 5);
+	}
+}
@@ -0,0 +1,76 @@
+#include "cluster_key.hpp"
+#include "duckdb.hpp"
+#include "integration/common.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+#include "sql_generator.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <vector>
+
+TEST_CASE("find_cluster_columns", "[cluster]") {
+	auto logger = mdlog::Logger::CreateNopLogger();
+	const std::vector<column_def> columns {
+	    column_def {.name = "id", .type = duckdb::LogicalTypeId::INTEGER, .primary_key = true},
+	    column_def {.name = "region", .type = duckdb::LogicalTypeId::VARCHAR, .primary_key = true},
+	    column_def {.name = "ordered_at", .type = duckdb::LogicalTypeId::TIMESTAMP},
+	    column_def {.name = "_fivetran_synced", .type = duckdb::LogicalTypeId::TIMESTAMP_TZ}};
+
+	REQUIRE(find_cluster_columns("", "orders", columns, logger).empty());
+
+	// Table entries win over the entry for all tables
+	const auto by_table = find_cluster_columns(" _fivetran_synced, orders = ordered_at ", "orders", columns, logger);
+	REQUIRE(by_table.size() == 1);
+	REQUIRE(by_table[0]->name == "ordered_at");
+	const auto by_default = find_cluster_columns("_fivetran_synced, orders=ordered_at", "items", columns, logger);
+	REQUIRE(by_default.size() == 1);
+	REQUIRE(by_default[0]->name == "_fivetran_synced");
+
+	const auto by_pk = find_cluster_columns("orders=primary_key", "orders", columns, logger);
+	REQUIRE(by_pk.size() == 2);
+	REQUIRE(by_pk[0]->name == "id");
+	REQUIRE(by_pk[1]->name == "region");
+
+	// Unknown columns are ignored
+	REQUIRE(find_cluster_columns("orders=shipped_at", "orders", columns, logger).empty());
+	REQUIRE(find_cluster_columns("items=ordered_at", "orders", columns, logger).empty());
+}
+
+TEST_CASE("Upserts and inserts write staged rows in cluster order", "[cluster]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	MdSqlGenerator generator(logger);
+
+	const table_def table {"memory", "main", "t"};
+	const std::vector<column_def> columns {
+	    column_def {.name = "id", .type = duckdb::LogicalTypeId::INTEGER, .primary_key = true},
+	    column_def {.name = "v", .type = duckdb::LogicalTypeId::INTEGER}};
+	std::vector<const column_def*> columns_pk;
+	std::vector<const column_def*> columns_regular;
+	find_primary_keys(columns, columns_pk, &columns_regular);
+	const std::vector<const column_def*> order_by {columns_regular[0]};
+
+	generator.create_table(con, table, columns, {});
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE staging AS SELECT * FROM (VALUES (1, 30), (2, 10), (3, 20)) s(id, v)"));
+
+	SECTION("upsert") {
+		generator.upsert(con, table, "staging", columns_pk, columns_regular, order_by);
+	}
+	SECTION("insert") {
+		generator.insert(con, table, "staging", columns_pk, columns_regular, order_by);
+	}
+	SECTION("recluster") {
+		generator.insert(con, table, "staging", columns_pk, columns_regular);
+		generator.recluster_table(con, table, order_by);
+		// The constraint survives the rewrite
+		REQUIRE(con.Query("INSERT INTO t VALUES (1, 0)")->HasError());
+	}
+
+	auto res = con.Query("SELECT id FROM t ORDER BY rowid");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->RowCount() == 3);
+	check_row(res, 0, {duckdb::Value::INTEGER(2)});
+	check_row(res, 1, {duckdb::Value::INTEGER(3)});
+	check_row(res, 2, {duckdb::Value::INTEGER(1)});
+}
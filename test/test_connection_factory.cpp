@@ -0,0 +1,138 @@
+#include "connection_factory.hpp"
+#include "connection_pool.hpp"
+#include "duckdb.hpp"
+#include "integration/common.hpp"
+#include "resource_governor.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace {
+struct created_instance {
+	std::string md_auth_token;
+	std::string db_name;
+	ConnectionFactory::instance_settings settings;
+};
+
+ConnectionFactory::create_instance_fn in_memory_instances(std::vector<created_instance>& created) {
+	return [&created](const std::string& md_auth_token, const std::string& db_name,
+	                  const ConnectionFactory::instance_settings& settings) {
+		created.push_back({md_auth_token, db_name, settings});
+		duckdb::DBConfig config;
+		config.SetOptionByName("memory_limit", settings.memory_limit);
+		return std::make_shared<duckdb::DuckDB>(nullptr, &config);
+	};
+}
+} // namespace
+
+TEST_CASE("ConnectionFactory keeps an instance per token and database", "[connection_factory]") {
+	std::vector<created_instance> created;
+	ConnectionFactory::options opts;
+	opts.max_instances = 2;
+	opts.instance_memory_limit = "100MB";
+	opts.pool.fetch_client_ids = false;
+	ConnectionFactory factory(opts, in_memory_instances(created));
+
+	{
+		auto lease = factory.AcquireConnection("token-a", "db1");
+		REQUIRE_NO_FAIL(lease.Connection().Query("CREATE TABLE t AS SELECT 1 AS i"));
+	}
+	{
+		// Same instance, so the table is there
+		auto con = factory.CreateConnection("token-a", "db1");
+		REQUIRE_NO_FAIL(con.Query("SELECT * FROM t"));
+	}
+	REQUIRE(created.size() == 1);
+	REQUIRE(created[0].settings.memory_limit == "100MB");
+
+	SECTION("other tokens and databases get instances of their own") {
+		auto other_db = factory.AcquireConnection("token-a", "db2");
+		auto other_token = factory.AcquireConnection("token-b", "db1");
+		REQUIRE(created.size() == 3);
+		REQUIRE(created[1].db_name == "db2");
+		REQUIRE(created[2].md_auth_token == "token-b");
+		REQUIRE_FALSE(other_token.Connection().Query("SELECT * FROM t")->GetError().empty());
+
+		// Two of them are in use and the third one, the least recently used, is
+		// closed
+		REQUIRE(factory.InstanceCount() == 2);
+		auto again = factory.AcquireConnection("token-a", "db1");
+		REQUIRE(created.size() == 4);
+	}
+
+	SECTION("instances in use are not closed") {
+		auto a = factory.AcquireConnection("token-a", "db1");
+		auto b = factory.AcquireConnection("token-b", "db1");
+		auto c = factory.AcquireConnection("token-c", "db1");
+		REQUIRE(factory.InstanceCount() == 3);
+		REQUIRE_NO_FAIL(a.Connection().Query("SELECT * FROM t"));
+	}
+}
+
+TEST_CASE("ConnectionFactory switches to a rotated token", "[connection_factory]") {
+	std::vector<created_instance> created;
+	ConnectionFactory::options opts;
+	opts.max_idle_time = std::chrono::seconds(0);
+	opts.pool.fetch_client_ids = false;
+	ConnectionFactory factory(opts, in_memory_instances(created));
+
+	std::optional<ConnectionPool::Lease> in_flight;
+	in_flight.emplace(factory.AcquireConnection("old-token", "db1"));
+	{
+		auto lease = factory.AcquireConnection("new-token", "db1");
+		REQUIRE(created.size() == 2);
+		// The new token may belong to another account with a database of the
+		// same name, so its instance cleans up too
+		REQUIRE(created[0].settings.clean_up);
+		REQUIRE(created[1].settings.clean_up);
+	}
+
+	// The request with the old token finishes on its instance...
+	REQUIRE_NO_FAIL(in_flight->Connection().Query("SELECT 1"));
+	REQUIRE(factory.InstanceCount() == 2);
+
+	// ... which is closed once it is no longer used
+	in_flight.reset();
+	auto lease = factory.AcquireConnection("new-token", "db1");
+	REQUIRE(factory.InstanceCount() == 1);
+	REQUIRE(created.size() == 2);
+}
+
+TEST_CASE("ConnectionFactory cleans up once per token and database", "[connection_factory]") {
+	std::vector<created_instance> created;
+	ConnectionFactory::options opts;
+	opts.max_instances = 1;
+	opts.pool.fetch_client_ids = false;
+	ConnectionFactory factory(opts, in_memory_instances(created));
+
+	factory.AcquireConnection("token-a", "db1");
+	// Evicts the instance of token-a
+	factory.AcquireConnection("token-b", "db1");
+	factory.AcquireConnection("token-a", "db1");
+	REQUIRE(created.size() == 3);
+	REQUIRE(created[0].settings.clean_up);
+	REQUIRE(created[1].settings.clean_up);
+	// The evicted instance already cleaned up
+	REQUIRE_FALSE(created[2].settings.clean_up);
+}
+
+TEST_CASE("ConnectionFactory divides the memory only if MD_MAX_INSTANCES is set", "[connection_factory]") {
+	unsetenv("MD_INSTANCE_MEMORY_LIMIT");
+	const auto limits = resource_governor::ReadCgroupLimits();
+
+	unsetenv("MD_MAX_INSTANCES");
+	const auto single = ConnectionFactory::options::FromEnvironment();
+	REQUIRE(single.max_instances == 4);
+	REQUIRE(single.instance_memory_limit == resource_governor::Budget(limits, 1).memory_limit);
+
+	setenv("MD_MAX_INSTANCES", "4", 1);
+	const auto multiple = ConnectionFactory::options::FromEnvironment();
+	REQUIRE(multiple.max_instances == 4);
+	REQUIRE(multiple.instance_memory_limit == resource_governor::Budget(limits, 4).memory_limit);
+	unsetenv("MD_MAX_INSTANCES");
+}
@@ -0,0 +1,123 @@
+#include "connection_pool.hpp"
+#include "duckdb.hpp"
+#include "integration/common.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <future>
+#include <memory>
+
+namespace {
+std::shared_ptr<ConnectionPool> create_pool(const std::size_t max_idle, const std::size_t max_open) {
+	return ConnectionPool::Create(std::make_shared<duckdb::DuckDB>(nullptr),
+	                              {.max_idle = max_idle, .max_open = max_open, .fetch_client_ids = false});
+}
+} // namespace
+
+TEST_CASE("ConnectionPool reuses connections", "[connection_pool]") {
+	auto pool_ptr = create_pool(2, 4);
+	auto& pool = *pool_ptr;
+
+	duckdb::Connection* first = nullptr;
+	{
+		auto lease = pool.Acquire();
+		first = &lease.Connection();
+		REQUIRE_NO_FAIL(lease.Connection().Query("SELECT 1"));
+	}
+	{
+		auto lease = pool.Acquire();
+		REQUIRE(&lease.Connection() == first);
+	}
+	const auto stats = pool.Stats();
+	REQUIRE(stats.created == 1);
+	REQUIRE(stats.reused == 1);
+	REQUIRE(stats.open == 1);
+	REQUIRE(stats.idle == 1);
+
+	SECTION("keeps at most max_idle connections") {
+		{
+			auto a = pool.Acquire();
+			auto b = pool.Acquire();
+			auto c = pool.Acquire();
+			REQUIRE(pool.Stats().open == 3);
+		}
+		REQUIRE(pool.Stats().open == 2);
+		REQUIRE(pool.Stats().idle == 2);
+	}
+
+	SECTION("discarded connections are closed") {
+		{
+			auto lease = pool.Acquire();
+			lease.Discard();
+		}
+		REQUIRE(pool.Stats().open == 0);
+	}
+
+	SECTION("checked out connections keep the pool alive") {
+		auto lease = pool.Acquire();
+		std::weak_ptr<ConnectionPool> weak_pool = pool_ptr;
+		pool_ptr.reset();
+		REQUIRE_FALSE(weak_pool.expired());
+		REQUIRE_NO_FAIL(lease.Connection().Query("SELECT 42"));
+	}
+
+	SECTION("prefills idle connections") {
+		pool.Prefill(5);
+		REQUIRE(pool.Stats().idle == 2);
+		REQUIRE(pool.Stats().created == 2);
+	}
+}
+
+TEST_CASE("ConnectionPool resets connections on return", "[connection_pool]") {
+	auto pool_ptr = create_pool(1, 1);
+	auto& pool = *pool_ptr;
+	{
+		auto lease = pool.Acquire();
+		auto& con = lease.Connection();
+		REQUIRE_NO_FAIL(con.Query("CREATE TABLE t (i INTEGER)"));
+		REQUIRE_NO_FAIL(con.Query("SET errors_as_json = true"));
+		lease.ResetOnReturn("errors_as_json");
+		con.BeginTransaction();
+		REQUIRE_NO_FAIL(con.Query("INSERT INTO t VALUES (1)"));
+	}
+
+	auto lease = pool.Acquire();
+	auto& con = lease.Connection();
+	REQUIRE_FALSE(con.HasActiveTransaction());
+	auto res = con.Query("SELECT COUNT(*) FROM t");
+	REQUIRE_NO_FAIL(res);
+	check_row(res, 0, {duckdb::Value::BIGINT(0)});
+	res = con.Query("SELECT current_setting('errors_as_json')");
+	REQUIRE_NO_FAIL(res);
+	check_row(res, 0, {duckdb::Value::BOOLEAN(false)});
+}
+
+TEST_CASE("ConnectionPool waits for a connection when max_open are checked out", "[connection_pool]") {
+	auto pool_ptr = create_pool(1, 1);
+	auto& pool = *pool_ptr;
+
+	auto lease = std::make_unique<ConnectionPool::Lease>(pool.Acquire());
+	auto waiting = std::async(std::launch::async, [&pool]() { return pool.Acquire().WaitTime(); });
+	REQUIRE(waiting.wait_for(std::chrono::milliseconds(100)) == std::future_status::timeout);
+
+	lease.reset();
+	REQUIRE(waiting.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+	REQUIRE(waiting.get() >= std::chrono::milliseconds(100));
+	REQUIRE(pool.Stats().waits == 1);
+	REQUIRE(pool.Stats().created == 1);
+}
+
+TEST_CASE("ConnectionPool::TryAcquire does not wait when max_open are checked out", "[connection_pool]") {
+	auto pool_ptr = create_pool(1, 1);
+	auto& pool = *pool_ptr;
+
+	{
+		auto lease = pool.Acquire();
+		REQUIRE_FALSE(pool.TryAcquire().has_value());
+		REQUIRE(pool.Stats().waits == 0);
+	}
+	auto lease = pool.TryAcquire();
+	REQUIRE(lease.has_value());
+	REQUIRE(lease->WaitTime() == std::chrono::steady_clock::duration {0});
+	REQUIRE(pool.Stats().reused == 1);
+}
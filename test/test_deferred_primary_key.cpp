@@ -0,0 +1,107 @@
+#include "duckdb.hpp"
+#include "integration/common.hpp"
+#include "md_error.hpp"
+#include "md_logging.hpp"
+#include "schema_cache.hpp"
+#include "schema_types.hpp"
+#include "sql_generator.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <vector>
+
+TEST_CASE("Tables created without PRIMARY KEY constraint get it after the load", "[initial_load]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	MdSqlGenerator generator(logger);
+
+	const table_def table {"memory", "main", "t"};
+	const std::vector<column_def> columns {
+	    column_def {.name = "id", .type = duckdb::LogicalTypeId::INTEGER, .primary_key = true},
+	    column_def {.name = "v", .type = duckdb::LogicalTypeId::VARCHAR}};
+	std::vector<const column_def*> columns_pk;
+	std::vector<const column_def*> columns_regular;
+	find_primary_keys(columns, columns_pk, &columns_regular);
+
+	generator.create_table(con, table, columns, {}, false);
+	REQUIRE_FALSE(generator.has_primary_key_constraint(con, table));
+	REQUIRE(generator.table_is_empty(con, table));
+	// The primary key columns still show up as such
+	const auto described = generator.describe_table(con, table);
+	REQUIRE(described.size() == 2);
+	REQUIRE(described[0].primary_key);
+	REQUIRE_FALSE(described[1].primary_key);
+
+	SECTION("unique keys") {
+		REQUIRE_NO_FAIL(
+		    con.Query("CREATE TABLE staging AS SELECT * FROM (VALUES (3, 'c'), (1, 'a'), (2, 'b')) v(id, v)"));
+		generator.insert(con, table, "staging", columns_pk, columns_regular, columns_pk);
+		REQUIRE_FALSE(generator.table_is_empty(con, table));
+
+		generator.add_deferred_primary_key(con, table, columns_pk);
+		REQUIRE(generator.has_primary_key_constraint(con, table));
+
+		auto res = con.Query("SELECT id, v FROM t ORDER BY id");
+		REQUIRE_NO_FAIL(res);
+		REQUIRE(res->RowCount() == 3);
+		check_row(res, 0, {duckdb::Value::INTEGER(1), "a"});
+		check_row(res, 2, {duckdb::Value::INTEGER(3), "c"});
+		REQUIRE(con.Query("INSERT INTO t VALUES (1, 'duplicate')")->HasError());
+	}
+
+	SECTION("duplicate keys") {
+		REQUIRE_NO_FAIL(
+		    con.Query("CREATE TABLE staging AS SELECT * FROM (VALUES (1, 'a'), (2, 'b'), (1, 'c')) v(id, v)"));
+		generator.insert(con, table, "staging", columns_pk, columns_regular, columns_pk);
+
+		REQUIRE_THROWS_AS(generator.add_deferred_primary_key(con, table, columns_pk), md_error::RecoverableError);
+		REQUIRE_FALSE(generator.has_primary_key_constraint(con, table));
+	}
+}
+
+TEST_CASE("The deferred PRIMARY KEY constraint is added in the batch transaction", "[initial_load]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	SchemaCache cache(std::chrono::hours(1));
+	MdSqlGenerator generator(logger, &cache);
+
+	const table_def table {"memory", "main", "t"};
+	const std::vector<column_def> columns {
+	    column_def {.name = "id", .type = duckdb::LogicalTypeId::INTEGER, .primary_key = true},
+	    column_def {.name = "v", .type = duckdb::LogicalTypeId::VARCHAR}};
+	std::vector<const column_def*> columns_pk;
+	std::vector<const column_def*> columns_regular;
+	find_primary_keys(columns, columns_pk, &columns_regular);
+
+	generator.create_table(con, table, columns, {}, false);
+	REQUIRE_FALSE(generator.has_primary_key_constraint(con, table));
+
+	SECTION("commit") {
+		REQUIRE_NO_FAIL(con.Query("CREATE TABLE staging AS SELECT * FROM (VALUES (2, 'b'), (1, 'a')) v(id, v)"));
+		con.BeginTransaction();
+		generator.insert(con, table, "staging", columns_pk, columns_regular, columns_pk);
+		generator.add_deferred_primary_key(con, table, columns_pk);
+		REQUIRE(generator.has_primary_key_constraint(con, table));
+		con.Commit();
+
+		REQUIRE(generator.has_primary_key_constraint(con, table));
+		// Later batches find the constraint in the schema cache
+		const auto cached = cache.Get("", table.db_name, table.schema_name);
+		REQUIRE(cached);
+		REQUIRE(cached->at("t").primary_key);
+		REQUIRE(con.Query("INSERT INTO t VALUES (2, 'duplicate')")->HasError());
+	}
+
+	SECTION("rollback") {
+		REQUIRE_NO_FAIL(con.Query("CREATE TABLE staging AS SELECT * FROM (VALUES (1, 'a'), (1, 'b')) v(id, v)"));
+		con.BeginTransaction();
+		generator.insert(con, table, "staging", columns_pk, columns_regular, columns_pk);
+		REQUIRE_THROWS_AS(generator.add_deferred_primary_key(con, table, columns_pk), md_error::RecoverableError);
+		con.Rollback();
+
+		REQUIRE(generator.table_is_empty(con, table));
+		REQUIRE_FALSE(generator.has_primary_key_constraint(con, table));
+	}
+}
@@ -1,4 +1,5 @@
 #include "catch2/matchers/catch_matchers_string.hpp"
+#include "config.hpp"
 #include "constants.hpp"
 #include "csv_processor.hpp"
 #include "duckdb.hpp"
@@ -10,6 +11,7 @@
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/generators/catch_generators.hpp>
 #include <catch2/matchers/catch_matchers.hpp>
+#include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <string>
@@ -41,3 +43,28 @@ TEST_CASE("Test join strings", "[helpers]") {
 		REQUIRE(os.str() == "\"id\"-del-\"title\"-del-\"magic_number\"");
 	}
 }
+
+TEST_CASE("Environment variables resolve to their defaults unless they parse", "[helpers]") {
+	const char* name = "MD_TEST_ENV_HELPER";
+	unsetenv(name);
+	REQUIRE_FALSE(config::env_string(name));
+	REQUIRE(config::env_int(name, 7) == 7);
+	REQUIRE(config::env_bool(name, true));
+
+	setenv(name, "", 1);
+	REQUIRE(config::env_string(name) == "");
+	REQUIRE(config::env_int(name, 7) == 7);
+	REQUIRE_FALSE(config::env_bool(name, false));
+
+	setenv(name, "42", 1);
+	REQUIRE(config::env_int(name, 7) == 42);
+	setenv(name, "many", 1);
+	REQUIRE(config::env_int(name, 7) == 7);
+	REQUIRE(config::env_bool(name, true));
+
+	setenv(name, "TRUE", 1);
+	REQUIRE(config::env_bool(name, false));
+	setenv(name, "0", 1);
+	REQUIRE_FALSE(config::env_bool(name, true));
+	unsetenv(name);
+}
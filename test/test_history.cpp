@@ -0,0 +1,168 @@
+#include "duckdb.hpp"
+#include "integration/common.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+#include "sql_generator.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <string>
+#include <vector>
+
+TEST_CASE("deactivate_historical_records stashes, then deletes and deactivates in one MERGE", "[history]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	MdSqlGenerator generator(logger);
+
+	const table_def table {"memory", "main", "h"};
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE h (id INTEGER, _fivetran_start TIMESTAMP, _fivetran_end TIMESTAMP, "
+	                          "_fivetran_active BOOLEAN, v VARCHAR, PRIMARY KEY (id, _fivetran_start))"));
+	REQUIRE_NO_FAIL(con.Query("INSERT INTO h VALUES "
+	                          "(1, '2024-01-01', '2024-01-31', false, 'a1'), "
+	                          "(1, '2024-02-01', '9999-12-31', true, 'a2'), "
+	                          "(2, '2024-01-01', '2024-02-29', false, 'b1'), "
+	                          "(2, '2024-03-01', '9999-12-31', true, 'b2'), "
+	                          "(3, '2024-01-01', '9999-12-31', true, 'c1')"));
+	// The earliest _fivetran_start of every key in the batch
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE earliest (id INTEGER, _fivetran_start TIMESTAMP)"));
+	REQUIRE_NO_FAIL(con.Query("INSERT INTO earliest VALUES (1, '2024-03-01'), (2, '2024-02-15')"));
+
+	const std::vector<column_def> columns {
+	    column_def {.name = "id", .type = duckdb::LogicalTypeId::INTEGER, .primary_key = true},
+	    column_def {.name = "_fivetran_start", .type = duckdb::LogicalTypeId::TIMESTAMP, .primary_key = true}};
+	std::vector<const column_def*> columns_pk;
+	find_primary_keys(columns, columns_pk, nullptr, "_fivetran_start");
+
+	const auto lar_table_name = generator.create_latest_active_records_table(con, table);
+	generator.deactivate_historical_records(con, table, "earliest", lar_table_name, columns_pk);
+
+	// id 1: the active version is deactivated right before the batch starts
+	// id 2: the version that overlaps with the batch is deleted
+	// id 3: not part of the batch
+	auto res = con.Query("SELECT id, _fivetran_start::VARCHAR, _fivetran_end::VARCHAR, _fivetran_active, v FROM h "
+	                     "ORDER BY id, _fivetran_start");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->RowCount() == 4);
+	check_row(res, 0, {1, "2024-01-01 00:00:00", "2024-01-31 00:00:00", duckdb::Value::BOOLEAN(false), "a1"});
+	check_row(res, 1, {1, "2024-02-01 00:00:00", "2024-02-29 23:59:59.999", duckdb::Value::BOOLEAN(false), "a2"});
+	check_row(res, 2, {2, "2024-01-01 00:00:00", "2024-02-29 00:00:00", duckdb::Value::BOOLEAN(false), "b1"});
+	check_row(res, 3, {3, "2024-01-01 00:00:00", "9999-12-31 00:00:00", duckdb::Value::BOOLEAN(true), "c1"});
+
+	// The LAR table has the latest remaining version of each staged key
+	res = con.Query("SELECT id, v FROM " + lar_table_name + " ORDER BY id");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->RowCount() == 2);
+	check_row(res, 0, {1, "a2"});
+	check_row(res, 1, {2, "b1"});
+
+	// No tables besides the LAR table, which is a TEMP table
+	res = con.Query("SELECT COUNT(*) FROM duckdb_tables() WHERE NOT temporary AND table_name NOT IN ('h', 'earliest')");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->GetValue(0, 0) == duckdb::Value::BIGINT(0));
+
+	generator.drop_latest_active_records_table(con, lar_table_name);
+}
+
+TEST_CASE("The active records table follows the active versions of a history table", "[history]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	MdSqlGenerator generator(logger);
+
+	const table_def table {"memory", "main", "h"};
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE h (id INTEGER, _fivetran_start TIMESTAMP, _fivetran_end TIMESTAMP, "
+	                          "_fivetran_active BOOLEAN, v VARCHAR, PRIMARY KEY (id, _fivetran_start))"));
+	REQUIRE_NO_FAIL(con.Query("INSERT INTO h VALUES "
+	                          "(1, '2024-01-01', '2024-01-31', false, 'a1'), "
+	                          "(1, '2024-02-01', '9999-12-31', true, 'a2'), "
+	                          "(2, '2024-01-01', '9999-12-31', true, 'b1'), "
+	                          "(3, '2024-01-01', '9999-12-31', true, 'c1')"));
+
+	const std::vector<column_def> columns {
+	    column_def {.name = "id", .type = duckdb::LogicalTypeId::INTEGER, .primary_key = true},
+	    column_def {.name = "_fivetran_start", .type = duckdb::LogicalTypeId::TIMESTAMP, .primary_key = true},
+	    column_def {.name = "_fivetran_end", .type = duckdb::LogicalTypeId::TIMESTAMP},
+	    column_def {.name = "_fivetran_active", .type = duckdb::LogicalTypeId::BOOLEAN},
+	    column_def {.name = "v", .type = duckdb::LogicalTypeId::VARCHAR}};
+	std::vector<const column_def*> columns_pk;
+	std::vector<const column_def*> columns_regular;
+	find_primary_keys(columns, columns_pk, &columns_regular, "_fivetran_start");
+
+	const auto active_records = MdSqlGenerator::active_records_table(table).to_escaped_string();
+	generator.maintain_active_records_table(con, table, columns_pk);
+
+	// A new version of id 1 and the deletion of id 3
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE earliest (id INTEGER, _fivetran_start TIMESTAMP)"));
+	REQUIRE_NO_FAIL(con.Query("INSERT INTO earliest VALUES (1, '2024-03-01')"));
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE replaced AS FROM h WITH NO DATA"));
+	REQUIRE_NO_FAIL(con.Query("INSERT INTO replaced VALUES (1, '2024-03-01', '9999-12-31', true, 'a3')"));
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE deletes (id INTEGER, _fivetran_end TIMESTAMP)"));
+	REQUIRE_NO_FAIL(con.Query("INSERT INTO deletes VALUES (3, '2024-04-01')"));
+
+	const auto lar_table_name = generator.create_latest_active_records_table(con, table);
+	generator.deactivate_historical_records(con, table, "earliest", lar_table_name, columns_pk);
+	generator.drop_latest_active_records_table(con, lar_table_name);
+	generator.insert(con, table, "replaced", columns_pk, columns_regular);
+	generator.delete_historical_rows(con, table, "deletes", columns_pk);
+
+	auto res = con.Query("SELECT id, _fivetran_start::VARCHAR FROM " + active_records + " ORDER BY id");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->RowCount() == 2);
+	check_row(res, 0, {1, "2024-03-01 00:00:00"});
+	check_row(res, 1, {2, "2024-01-01 00:00:00"});
+
+	// Same contents as the active versions of the history table
+	res = con.Query("SELECT COUNT(*) FROM " + active_records +
+	                " AS a FULL OUTER JOIN (SELECT id, _fivetran_start FROM h WHERE _fivetran_active) h "
+	                "ON a.id = h.id AND a._fivetran_start = h._fivetran_start WHERE a.id IS NULL OR h.id IS NULL");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->GetValue(0, 0) == duckdb::Value::BIGINT(0));
+
+	res = con.Query("SELECT _fivetran_end::VARCHAR, _fivetran_active FROM h WHERE id = 3");
+	REQUIRE_NO_FAIL(res);
+	check_row(res, 0, {"2024-04-01 00:00:00", duckdb::Value::BOOLEAN(false)});
+
+	generator.drop_active_records_table(con, table);
+	res = con.Query("SELECT COUNT(*) FROM duckdb_tables() WHERE table_name = '__fivetran_active_h'");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->GetValue(0, 0) == duckdb::Value::BIGINT(0));
+}
+
+TEST_CASE("History mode migrations drop the active records table", "[history]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+
+	const table_def table {"memory", "main", "h"};
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE h (id INTEGER, _fivetran_start TIMESTAMPTZ, _fivetran_end TIMESTAMPTZ, "
+	                          "_fivetran_active BOOLEAN, v VARCHAR, PRIMARY KEY (id, _fivetran_start))"));
+	REQUIRE_NO_FAIL(con.Query("INSERT INTO h VALUES "
+	                          "(1, '2024-01-01 00:00:00+00', '9999-12-31 00:00:00+00', true, 'a1'), "
+	                          "(2, '2024-01-01 00:00:00+00', '9999-12-31 00:00:00+00', true, 'b1')"));
+
+	const std::vector<column_def> columns {
+	    column_def {.name = "id", .type = duckdb::LogicalTypeId::INTEGER, .primary_key = true},
+	    column_def {.name = "_fivetran_start", .type = duckdb::LogicalTypeId::TIMESTAMP_TZ, .primary_key = true}};
+	std::vector<const column_def*> columns_pk;
+	find_primary_keys(columns, columns_pk, nullptr, "_fivetran_start");
+
+	// A batch creates the table, then a migration adds new versions
+	MdSqlGenerator(logger).maintain_active_records_table(con, table, columns_pk);
+	MdSqlGenerator(logger).drop_column_in_history_mode(con, table, "v", "2024-02-01T00:00:00Z");
+	auto res = con.Query("SELECT COUNT(*) FROM duckdb_tables() WHERE table_name = '__fivetran_active_h'");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->GetValue(0, 0) == duckdb::Value::BIGINT(0));
+
+	// The next batch rebuilds it, and finds the new active version to delete
+	MdSqlGenerator generator(logger);
+	generator.maintain_active_records_table(con, table, columns_pk);
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE deletes (id INTEGER, _fivetran_end TIMESTAMPTZ)"));
+	REQUIRE_NO_FAIL(con.Query("INSERT INTO deletes VALUES (2, '2024-03-01 00:00:00+00')"));
+	generator.delete_historical_rows(con, table, "deletes", columns_pk);
+
+	res = con.Query("SELECT id, _fivetran_active FROM h WHERE _fivetran_start = '2024-02-01 00:00:00+00' ORDER BY id");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->RowCount() == 2);
+	check_row(res, 0, {1, duckdb::Value::BOOLEAN(true)});
+	check_row(res, 1, {2, duckdb::Value::BOOLEAN(false)});
+}
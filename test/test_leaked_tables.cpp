@@ -0,0 +1,57 @@
+#include "duckdb.hpp"
+#include "integration/common.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+#include "sql_generator.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <string>
+
+TEST_CASE("drop_leaked_temp_tables only drops old staging and bookkeeping tables", "[leaked_tables]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	MdSqlGenerator generator(logger);
+
+	const auto fresh_name = generator.generate_temp_table_name(con, "__fivetran_ingest_staging");
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE " + fresh_name + " (i INTEGER)"));
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE __fivetran_ingest_staging_1000_abcdef (i INTEGER)"));
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE __fivetran_latest_active_recordsabcdef (i INTEGER)"));
+	REQUIRE_NO_FAIL(con.Query("CREATE SCHEMA other"));
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE other.__fivetran_history_matches_1000_abcdef (i INTEGER)"));
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE my_table (i INTEGER)"));
+	REQUIRE_NO_FAIL(con.Query("CREATE TEMP TABLE __fivetran_ingest_staging_1000_temp (i INTEGER)"));
+
+	generator.drop_leaked_temp_tables(con, std::chrono::hours(1));
+
+	auto res = con.Query("SELECT schema_name, table_name, temporary FROM duckdb_tables() ORDER BY table_name");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->RowCount() == 3);
+	check_row(res, 0, {"main", "__fivetran_ingest_staging_1000_temp", duckdb::Value::BOOLEAN(true)});
+	REQUIRE(fresh_name.ends_with("\"" + res->GetValue(1, 1).ToString() + "\""));
+	check_row(res, 2, {"main", "my_table", duckdb::Value::BOOLEAN(false)});
+}
+
+TEST_CASE("The latest_active_records table is a TEMP table", "[leaked_tables]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	MdSqlGenerator generator(logger);
+
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE t (id INTEGER, v VARCHAR)"));
+	const auto lar_table_name = generator.create_latest_active_records_table(con, table_def {"memory", "main", "t"});
+
+	auto res = con.Query("SELECT database_name, temporary FROM duckdb_tables() WHERE starts_with(table_name, "
+	                     "'__fivetran_latest_active_records')");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->RowCount() == 1);
+	check_row(res, 0, {"temp", duckdb::Value::BOOLEAN(true)});
+
+	// Other connections do not see it
+	duckdb::Connection other(db);
+	REQUIRE(other.Query("FROM " + lar_table_name)->HasError());
+
+	generator.drop_latest_active_records_table(con, lar_table_name);
+	REQUIRE(con.Query("FROM " + lar_table_name)->HasError());
+}
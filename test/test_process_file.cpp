@@ -5,6 +5,7 @@
 #include "integration/common.hpp"
 #include "md_error.hpp"
 #include "schema_types.hpp"
+#include "staging_tables.hpp"
 
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/generators/catch_generators.hpp>
@@ -718,3 +719,48 @@ TEST_CASE("Test reading a CSV file with a huge VARCHAR column", "[csv_processor]
 		});
 	}
 }
+
+TEST_CASE("Files with the same columns share a staging table", "[csv_processor]") {
+	const fs::path test_file = fs::path(TEST_RESOURCES_DIR) / "csv" / "small_simple.csv";
+	REQUIRE(fs::exists(test_file));
+
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+
+	const std::vector<column_def> columns {column_def {.name = "id", .type = duckdb::LogicalType::INTEGER},
+	                                       column_def {.name = "name", .type = duckdb::LogicalType::VARCHAR},
+	                                       column_def {.name = "age", .type = duckdb::LogicalType::SMALLINT}};
+	const IngestProperties typed {.filename = test_file.string(), .columns = columns};
+	const IngestProperties all_varchar {
+	    .filename = test_file.string(), .columns = columns, .allow_unmodified_string = true};
+
+	std::vector<std::string> names;
+	const auto collect = [&con, &names](const std::string& staging_table_name) {
+		names.push_back(staging_table_name);
+		// Rows of earlier files are gone
+		const auto res = con.Query("SELECT COUNT(*) FROM " + staging_table_name);
+		REQUIRE_NO_FAIL(res);
+		REQUIRE(res->GetValue(0, 0) == duckdb::Value::BIGINT(3));
+	};
+
+	con.BeginTransaction();
+	StagingTables staging_tables(con, logger);
+	csv_processor::ProcessFile(con, typed, logger, collect, &staging_tables);
+	csv_processor::ProcessFile(con, all_varchar, logger, collect, &staging_tables);
+	csv_processor::ProcessFile(con, typed, logger, collect, &staging_tables);
+	csv_processor::ProcessFile(con, all_varchar, logger, collect, &staging_tables);
+	staging_tables.DropAll();
+	con.Commit();
+
+	REQUIRE(names.size() == 4);
+	REQUIRE(names[0] == names[2]);
+	REQUIRE(names[1] == names[3]);
+	REQUIRE(names[0] != names[1]);
+	REQUIRE(staging_tables.ReuseCount() == 2);
+
+	const auto res =
+	    con.Query("SELECT COUNT(*) FROM duckdb_tables() WHERE starts_with(table_name, '__fivetran_ingest_staging')");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->GetValue(0, 0) == duckdb::Value::BIGINT(0));
+}
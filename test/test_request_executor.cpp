@@ -0,0 +1,79 @@
+#include "request_executor.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+TEST_CASE("RequestExecutor limits the tasks of a key without holding up others", "[request_executor]") {
+	std::mutex mutex;
+	std::condition_variable changed;
+	bool release = false;
+	std::vector<std::string> started;
+	std::atomic<int> max_running_writes {0};
+	std::atomic<int> running_writes {0};
+
+	const auto blocking_task = [&](const std::string& name) {
+		return [&, name]() {
+			const auto running = ++running_writes;
+			max_running_writes = std::max(max_running_writes.load(), running);
+			std::unique_lock<std::mutex> lock(mutex);
+			started.push_back(name);
+			changed.notify_all();
+			changed.wait(lock, [&]() { return release; });
+			running_writes--;
+		};
+	};
+	const auto quick_task = [&](const std::string& name) {
+		return [&, name]() {
+			std::lock_guard<std::mutex> lock(mutex);
+			started.push_back(name);
+			changed.notify_all();
+		};
+	};
+	const auto wait_for_started = [&](const std::size_t count) {
+		std::unique_lock<std::mutex> lock(mutex);
+		return changed.wait_for(lock, std::chrono::seconds(10), [&]() { return started.size() >= count; });
+	};
+
+	{
+		RequestExecutor executor("test", 3, {{"WriteBatch", 1}});
+		executor.Submit("WriteBatch", blocking_task("write 1"));
+		executor.Submit("WriteBatch", blocking_task("write 2"));
+		executor.Submit("DescribeTable", quick_task("describe"));
+
+		// The second write waits for the first, the describe runs right away
+		REQUIRE(wait_for_started(2));
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			REQUIRE(std::find(started.begin(), started.end(), "write 1") != started.end());
+			REQUIRE(std::find(started.begin(), started.end(), "describe") != started.end());
+		}
+		REQUIRE(executor.Stats().queued == 1);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			release = true;
+		}
+		changed.notify_all();
+		REQUIRE(wait_for_started(3));
+	}
+
+	REQUIRE(started.back() == "write 2");
+	REQUIRE(max_running_writes == 1);
+}
+
+TEST_CASE("RequestExecutor runs queued tasks before it is destroyed", "[request_executor]") {
+	std::atomic<int> ran {0};
+	{
+		RequestExecutor executor("test", 1);
+		for (int i = 0; i < 10; i++) {
+			executor.Submit("Task", [&ran]() { ran++; });
+		}
+	}
+	REQUIRE(ran == 10);
+}
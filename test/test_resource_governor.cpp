@@ -0,0 +1,94 @@
+#include "resource_governor.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <thread>
+
+namespace {
+constexpr std::int64_t MIB = 1024 * 1024;
+
+/// A directory that looks like /sys/fs/cgroup
+class FakeCgroup {
+public:
+	FakeCgroup() : root(std::filesystem::temp_directory_path() / "test_resource_governor") {
+		std::filesystem::remove_all(root);
+		std::filesystem::create_directories(root);
+	}
+	~FakeCgroup() {
+		std::filesystem::remove_all(root);
+	}
+
+	void Write(const std::string& file, const std::string& content) const {
+		const auto path = root / file;
+		std::filesystem::create_directories(path.parent_path());
+		std::ofstream(path) << content << "\n";
+	}
+
+	std::string Root() const {
+		return root.string();
+	}
+
+private:
+	const std::filesystem::path root;
+};
+} // namespace
+
+TEST_CASE("ReadCgroupLimits reads cgroup v2 limits", "[resource_governor]") {
+	const FakeCgroup cgroup;
+
+	SECTION("limited") {
+		cgroup.Write("cpu.max", "150000 100000");
+		cgroup.Write("memory.max", std::to_string(2048 * MIB));
+		const auto limits = resource_governor::ReadCgroupLimits(cgroup.Root());
+		REQUIRE(limits.cpus == 2);
+		REQUIRE(limits.memory_bytes == 2048 * MIB);
+	}
+
+	SECTION("unlimited") {
+		cgroup.Write("cpu.max", "max 100000");
+		cgroup.Write("memory.max", "max");
+		const auto limits = resource_governor::ReadCgroupLimits(cgroup.Root());
+		REQUIRE_FALSE(limits.cpus);
+		REQUIRE_FALSE(limits.memory_bytes);
+	}
+}
+
+TEST_CASE("ReadCgroupLimits falls back to cgroup v1", "[resource_governor]") {
+	const FakeCgroup cgroup;
+	cgroup.Write("cpu/cpu.cfs_quota_us", "400000");
+	cgroup.Write("cpu/cpu.cfs_period_us", "100000");
+	cgroup.Write("memory/memory.limit_in_bytes", "9223372036854771712");
+	const auto limits = resource_governor::ReadCgroupLimits(cgroup.Root());
+	REQUIRE(limits.cpus == 4);
+	REQUIRE_FALSE(limits.memory_bytes);
+
+	// Without any files, there is no limit
+	const auto none = resource_governor::ReadCgroupLimits(cgroup.Root() + "/missing");
+	REQUIRE_FALSE(none.cpus);
+	REQUIRE_FALSE(none.memory_bytes);
+}
+
+TEST_CASE("Budget splits memory across instances", "[resource_governor]") {
+	const auto budget = resource_governor::Budget({1, 2048 * MIB}, 4);
+	REQUIRE(budget.threads == 1);
+	REQUIRE(budget.memory_limit == "384MiB");
+
+	// Never below the minimum, however many instances there are
+	REQUIRE(resource_governor::Budget({std::nullopt, 256 * MIB}, 8).memory_limit == "64MiB");
+
+	// Without limits, DuckDB's defaults apply
+	const auto unlimited = resource_governor::Budget({}, 4);
+	REQUIRE(unlimited.threads == 0);
+	REQUIRE(unlimited.memory_limit.empty());
+
+	// Threads are capped by the cores the process can use
+	const auto cores = static_cast<std::size_t>(std::thread::hardware_concurrency());
+	if (cores > 0) {
+		REQUIRE(resource_governor::Budget({cores + 8, std::nullopt}, 1).threads == cores);
+	}
+}
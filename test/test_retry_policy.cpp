@@ -0,0 +1,122 @@
+#include "duckdb.hpp"
+#include "md_logging.hpp"
+#include "retry_policy.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+namespace {
+constexpr const char* CONFLICT = "TransactionContext Error: Catalog write-write conflict on create with \"s\"";
+constexpr const char* CONNECTION = "Connection Error: connection reset by peer";
+
+RetryPolicy::options fast_retries() {
+	RetryPolicy::options opts;
+	opts.base_delay = std::chrono::milliseconds(1);
+	opts.max_delay = std::chrono::milliseconds(5);
+	return opts;
+}
+} // namespace
+
+TEST_CASE("RetryPolicy classifies errors", "[retry_policy]") {
+	CHECK(RetryPolicy::Classify(CONFLICT) == RetryPolicy::error_kind::conflict);
+	CHECK(RetryPolicy::Classify("TransactionContext Error: Conflict on tuple deletion!") ==
+	      RetryPolicy::error_kind::conflict);
+	CHECK(RetryPolicy::Classify(CONNECTION) == RetryPolicy::error_kind::transient);
+	CHECK(RetryPolicy::Classify("HTTP Error: 503 Service Unavailable") == RetryPolicy::error_kind::transient);
+	CHECK(RetryPolicy::Classify("Constraint Error: Duplicate key \"id: 1\" violates primary key constraint") ==
+	      RetryPolicy::error_kind::permanent);
+	CHECK(RetryPolicy::Classify("INTERRUPT Error: Interrupted!") == RetryPolicy::error_kind::permanent);
+}
+
+TEST_CASE("RetryPolicy retries conflicts of any step, connection errors of idempotent steps", "[retry_policy]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	RetryPolicy policy(fast_retries(), logger);
+
+	const auto failing = [](int& attempts, const int failures, const char* error) {
+		return [&attempts, failures, error]() {
+			if (++attempts <= failures) {
+				throw std::runtime_error(error);
+			}
+		};
+	};
+
+	int attempts = 0;
+	policy.Run(con, "conflict", RetryPolicy::idempotency::not_idempotent, failing(attempts, 2, CONFLICT));
+	CHECK(attempts == 3);
+
+	attempts = 0;
+	policy.Run(con, "idempotent", RetryPolicy::idempotency::idempotent, failing(attempts, 1, CONNECTION));
+	CHECK(attempts == 2);
+
+	attempts = 0;
+	CHECK_THROWS(
+	    policy.Run(con, "not idempotent", RetryPolicy::idempotency::not_idempotent, failing(attempts, 1, CONNECTION)));
+	CHECK(attempts == 1);
+
+	attempts = 0;
+	CHECK_THROWS(policy.Run(con, "permanent", RetryPolicy::idempotency::idempotent,
+	                        failing(attempts, 1, "Binder Error: column does not exist")));
+	CHECK(attempts == 1);
+
+	// Attempts of a step are limited
+	attempts = 0;
+	CHECK_THROWS(policy.Run(con, "always", RetryPolicy::idempotency::idempotent, failing(attempts, 100, CONFLICT)));
+	CHECK(attempts == 5);
+
+	CHECK(policy.Retries() == 2 + 1 + 4);
+}
+
+TEST_CASE("RetryPolicy stops when the budget of the request is used up", "[retry_policy]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	auto opts = fast_retries();
+	opts.budget = 3;
+	RetryPolicy policy(opts, logger);
+
+	int attempts = 0;
+	const auto always_conflicts = [&attempts]() {
+		attempts++;
+		throw std::runtime_error(CONFLICT);
+	};
+	CHECK_THROWS(policy.Run(con, "first", RetryPolicy::idempotency::idempotent, always_conflicts));
+	CHECK(attempts == 4);
+	CHECK_THROWS(policy.Run(con, "second", RetryPolicy::idempotency::idempotent, always_conflicts));
+	CHECK(attempts == 5);
+	CHECK(policy.Retries() == 3);
+}
+
+TEST_CASE("RetryPolicy retries steps that run their own transactions only", "[retry_policy]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	RetryPolicy policy(fast_retries(), logger);
+	REQUIRE_FALSE(con.Query("CREATE TABLE t (i INTEGER)")->HasError());
+
+	// A failed attempt's transaction is rolled back before the next attempt
+	int attempts = 0;
+	policy.Run(con, "own transaction", RetryPolicy::idempotency::not_idempotent, [&]() {
+		con.BeginTransaction();
+		REQUIRE_FALSE(con.Query("INSERT INTO t VALUES (1)")->HasError());
+		if (++attempts == 1) {
+			throw std::runtime_error(CONFLICT);
+		}
+		con.Commit();
+	});
+	CHECK(attempts == 2);
+	CHECK(con.Query("SELECT COUNT(*) FROM t")->GetValue(0, 0).GetValue<int64_t>() == 1);
+
+	// The caller's transaction would have been aborted by the failure
+	con.BeginTransaction();
+	attempts = 0;
+	CHECK_THROWS(policy.Run(con, "caller transaction", RetryPolicy::idempotency::idempotent, [&]() {
+		attempts++;
+		throw std::runtime_error(CONFLICT);
+	}));
+	CHECK(attempts == 1);
+	con.Rollback();
+}
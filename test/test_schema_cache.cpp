@@ -0,0 +1,108 @@
+#include "connection_factory.hpp"
+#include "duckdb.hpp"
+#include "integration/common.hpp"
+#include "md_logging.hpp"
+#include "schema_cache.hpp"
+#include "schema_types.hpp"
+#include "sql_generator.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+TEST_CASE("The schema cache answers table_exists and describe_table", "[schema_cache]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	SchemaCache cache(std::chrono::hours(1));
+	MdSqlGenerator generator(logger, &cache);
+
+	const table_def table {"memory", "main", "t"};
+	const table_def missing {"memory", "main", "missing"};
+	const std::vector<column_def> columns {
+	    column_def {.name = "id", .type = duckdb::LogicalTypeId::INTEGER, .primary_key = true},
+	    column_def {.name = "amount", .type = duckdb::LogicalTypeId::DECIMAL, .width = 10, .scale = 2}};
+	generator.create_table(con, table, columns, {});
+	REQUIRE_NO_FAIL(con.Query("CREATE VIEW v AS SELECT 1 AS i"));
+
+	REQUIRE(generator.table_exists(con, table));
+	REQUIRE_FALSE(generator.table_exists(con, missing));
+	REQUIRE_FALSE(generator.table_exists(con, {"memory", "main", "v"}));
+	REQUIRE(generator.describe_table(con, {"memory", "main", "v"}).size() == 1);
+	REQUIRE(generator.describe_table(con, missing).empty());
+
+	auto described = generator.describe_table(con, table);
+	REQUIRE(described.size() == 2);
+	REQUIRE(described[0].name == "id");
+	REQUIRE(described[0].primary_key);
+	REQUIRE(described[1].type == duckdb::LogicalTypeId::DECIMAL);
+	REQUIRE(described[1].width == 10);
+	REQUIRE(described[1].scale == 2);
+	// Cached along with the columns
+	REQUIRE(generator.has_primary_key_constraint(con, table));
+	REQUIRE(cache.Get("", "memory", "main")->at("t").primary_key);
+	REQUIRE_FALSE(cache.Get("", "memory", "main")->at("v").primary_key);
+
+	SECTION("changes made elsewhere are not seen until the entry expires") {
+		REQUIRE_NO_FAIL(con.Query("CREATE TABLE missing (i INTEGER)"));
+		REQUIRE_FALSE(generator.table_exists(con, missing));
+
+		// Transactions bypass the cache
+		REQUIRE_NO_FAIL(con.Query("BEGIN"));
+		REQUIRE(generator.table_exists(con, missing));
+		REQUIRE_NO_FAIL(con.Query("COMMIT"));
+	}
+
+	SECTION("DDL through the generator invalidates the schema") {
+		generator.add_column(con, table, column_def {.name = "note", .type = duckdb::LogicalTypeId::VARCHAR},
+		                     "add_column");
+		described = generator.describe_table(con, table);
+		REQUIRE(described.size() == 3);
+		REQUIRE(described[2].name == "note");
+
+		generator.drop_table(con, table, "drop_table");
+		REQUIRE_FALSE(generator.table_exists(con, table));
+	}
+}
+
+TEST_CASE("Schema cache loads that race with an invalidation are discarded", "[schema_cache]") {
+	SchemaCache cache(std::chrono::hours(1));
+	auto tables = std::make_shared<SchemaCache::schema_tables>();
+	(*tables)["t"] = SchemaCache::cached_table {.is_table = true, .columns = {}};
+
+	const auto generation = cache.Generation();
+	cache.Invalidate("instance", "db", "other_schema");
+	cache.Put("instance", "db", "main", tables, generation);
+	REQUIRE(cache.Get("instance", "db", "main") == nullptr);
+
+	cache.Put("instance", "db", "main", tables, cache.Generation());
+	REQUIRE(cache.Get("instance", "db", "main") == tables);
+	REQUIRE(cache.Get("instance", "db", "other_schema") == nullptr);
+}
+
+TEST_CASE("The schema cache keeps the databases of different tokens apart", "[schema_cache]") {
+	// Two accounts with a database of the same name
+	duckdb::DuckDB db_a(nullptr);
+	duckdb::DuckDB db_b(nullptr);
+	duckdb::Connection con_a(db_a);
+	duckdb::Connection con_b(db_b);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	SchemaCache cache(std::chrono::hours(1));
+	MdSqlGenerator generator_a(logger, &cache, nullptr, ConnectionFactory::InstanceKey("token a", "memory"));
+	MdSqlGenerator generator_b(logger, &cache, nullptr, ConnectionFactory::InstanceKey("token b", "memory"));
+
+	const table_def table {"memory", "main", "t"};
+	const std::vector<column_def> columns {
+	    column_def {.name = "id", .type = duckdb::LogicalTypeId::INTEGER, .primary_key = true}};
+	generator_a.create_table(con_a, table, columns, {});
+	REQUIRE(generator_a.table_exists(con_a, table));
+	REQUIRE_FALSE(generator_b.table_exists(con_b, table));
+
+	generator_b.create_table(con_b, table, columns, {});
+	REQUIRE(generator_b.table_exists(con_b, table));
+	generator_a.drop_table(con_a, table, "drop_table");
+	REQUIRE_FALSE(generator_a.table_exists(con_a, table));
+	REQUIRE(generator_b.table_exists(con_b, table));
+}
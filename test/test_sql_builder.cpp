@@ -0,0 +1,110 @@
+#include "duckdb.hpp"
+#include "integration/common.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+#include "sql_builder.hpp"
+#include "sql_generator.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/generators/catch_generators.hpp>
+#include <string>
+#include <vector>
+
+TEST_CASE("append_quoted matches KeywordHelper::WriteQuoted", "[sql_builder]") {
+	const std::string text = GENERATE("", "plain", "with space", "a\"b", "\"\"", "it's", "''", "\"mixed'\"");
+
+	fmt::memory_buffer double_quoted;
+	append_quoted(double_quoted, text, '"');
+	REQUIRE(fmt::to_string(double_quoted) == duckdb::KeywordHelper::WriteQuoted(text, '"'));
+
+	fmt::memory_buffer single_quoted;
+	append_quoted(single_quoted, text, '\'');
+	REQUIRE(fmt::to_string(single_quoted) == duckdb::KeywordHelper::WriteQuoted(text, '\''));
+}
+
+TEST_CASE("SqlBuilder writes identifiers, literals and tables", "[sql_builder]") {
+	const table_def table {"my \"db\"", "main", "t"};
+	const std::vector<column_def> columns {column_def {.name = "id", .primary_key = true},
+	                                       column_def {.name = "na\"me"}};
+	std::vector<const column_def*> column_ptrs {&columns[0], &columns[1]};
+
+	SqlBuilder sql;
+	sql << "SELECT ";
+	sql.join_names(quote_columns(column_ptrs));
+	sql << " FROM " << table << " WHERE " << ident("na\"me") << " = " << literal("it's");
+	sql.format(" LIMIT {}", 10);
+
+	REQUIRE(sql.str() == "SELECT \"id\", \"na\"\"me\" FROM \"my \"\"db\"\"\".\"main\".\"t\" WHERE \"na\"\"me\" = "
+	                     "'it''s' LIMIT 10");
+	REQUIRE(table.to_escaped_string() == "\"my \"\"db\"\"\".\"main\".\"t\"");
+}
+
+TEST_CASE("Generated upsert and update statements run against DuckDB", "[sql_builder]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	MdSqlGenerator generator(logger);
+
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE \"odd \"\"name\"\"\" (id INTEGER PRIMARY KEY, \"va'l\" VARCHAR, b BLOB)"));
+	REQUIRE_NO_FAIL(con.Query("INSERT INTO \"odd \"\"name\"\"\" VALUES (1, 'a', 'x'::BLOB), (2, 'b', 'y'::BLOB)"));
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE staging (id INTEGER, \"va'l\" VARCHAR, b VARCHAR)"));
+	REQUIRE_NO_FAIL(con.Query("INSERT INTO staging VALUES (1, 'unmodified', 'eg=='), (2, 'c', 'unmodified')"));
+
+	const table_def table {"memory", "main", "odd \"name\""};
+	const std::vector<column_def> columns {
+	    column_def {.name = "id", .type = duckdb::LogicalTypeId::INTEGER, .primary_key = true},
+	    column_def {.name = "va'l", .type = duckdb::LogicalTypeId::VARCHAR},
+	    column_def {.name = "b", .type = duckdb::LogicalTypeId::BLOB}};
+	std::vector<const column_def*> columns_pk;
+	std::vector<const column_def*> columns_regular;
+	find_primary_keys(columns, columns_pk, &columns_regular);
+
+	generator.update_values(con, table, "staging", columns_pk, columns_regular, "unmodified");
+
+	auto res = con.Query("SELECT id, \"va'l\", b::VARCHAR FROM \"odd \"\"name\"\"\" ORDER BY id");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->RowCount() == 2);
+	check_row(res, 0, {duckdb::Value::INTEGER(1), "a", "z"});
+	check_row(res, 1, {duckdb::Value::INTEGER(2), "c", "y"});
+}
+
+TEST_CASE("Staged key filter restricts deletes to the staged keys", "[sql_builder]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	MdSqlGenerator generator(logger);
+
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE t (id INTEGER, name VARCHAR, b BLOB, PRIMARY KEY (id, name, b))"));
+	REQUIRE_NO_FAIL(con.Query("INSERT INTO t SELECT i, 'n' || i, 'x'::BLOB FROM range(100) r(i)"));
+	// Staged like an update file, all columns as VARCHAR
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE staging (id VARCHAR, name VARCHAR, b VARCHAR)"));
+	REQUIRE_NO_FAIL(con.Query("INSERT INTO staging VALUES ('3', 'n3', 'eA=='), ('42', 'n42', 'eA==')"));
+
+	const table_def table {"memory", "main", "t"};
+	const std::vector<column_def> columns {
+	    column_def {.name = "id", .type = duckdb::LogicalTypeId::INTEGER, .primary_key = true},
+	    column_def {.name = "name", .type = duckdb::LogicalTypeId::VARCHAR, .primary_key = true},
+	    column_def {.name = "b", .type = duckdb::LogicalTypeId::BLOB, .primary_key = true}};
+	std::vector<const column_def*> columns_pk;
+	find_primary_keys(columns, columns_pk);
+
+	SECTION("small batches get an IN list, BLOB keys are skipped") {
+		const auto filter = generator.staged_key_filter(con, "staging", columns_pk, "\"t\"");
+		REQUIRE(filter == "\"t\".\"id\" IN (3, 42) AND \"t\".\"name\" IN ('n3', 'n42')");
+	}
+
+	SECTION("empty staging tables get no filter") {
+		REQUIRE_NO_FAIL(con.Query("DELETE FROM staging"));
+		REQUIRE(generator.staged_key_filter(con, "staging", columns_pk, "\"t\"").empty());
+	}
+
+	SECTION("delete_rows only removes the staged keys") {
+		REQUIRE_NO_FAIL(con.Query("ALTER TABLE staging ALTER id TYPE INTEGER"));
+		REQUIRE_NO_FAIL(con.Query("ALTER TABLE staging ALTER b TYPE BLOB USING from_base64(b)"));
+		generator.delete_rows(con, table, "staging", columns_pk);
+
+		auto res = con.Query("SELECT count(*), count(*) FILTER (id IN (3, 42)) FROM t");
+		REQUIRE_NO_FAIL(res);
+		check_row(res, 0, {duckdb::Value::BIGINT(98), duckdb::Value::BIGINT(0)});
+	}
+}
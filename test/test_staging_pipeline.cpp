@@ -0,0 +1,88 @@
+#include "constants.hpp"
+#include "csv_processor.hpp"
+#include "duckdb.hpp"
+#include "ingest_properties.hpp"
+#include "integration/common.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+#include "staging_pipeline.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+using namespace test::constants;
+
+TEST_CASE("StagingPipeline applies files in order inside the caller's transaction", "[staging_pipeline]") {
+	const fs::path test_file = fs::path(TEST_RESOURCES_DIR) / "csv" / "small_simple.csv";
+	REQUIRE(fs::exists(test_file));
+
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	duckdb::Connection staging_con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	auto staging_logger = mdlog::Logger::CreateNopLogger();
+
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE applied (file INTEGER, id INTEGER, name VARCHAR, age SMALLINT)"));
+
+	const std::vector<column_def> columns {column_def {.name = "id", .type = duckdb::LogicalTypeId::INTEGER},
+	                                       column_def {.name = "name", .type = duckdb::LogicalTypeId::VARCHAR},
+	                                       column_def {.name = "age", .type = duckdb::LogicalTypeId::SMALLINT}};
+
+	con.BeginTransaction();
+	StagingPipeline pipeline(con, logger);
+	std::vector<int> order;
+	for (int file = 0; file < 4; file++) {
+		IngestProperties props {.filename = test_file.string(), .columns = columns};
+		pipeline.Add(props, [&con, &order, file](const std::string& staging_table_name) {
+			order.push_back(file);
+			REQUIRE_NO_FAIL(con.Query("INSERT INTO applied SELECT " + std::to_string(file) + ", * FROM " +
+			                          staging_table_name));
+		});
+	}
+	REQUIRE(pipeline.Size() == 4);
+	pipeline.Run(staging_con, staging_logger);
+
+	// Nothing is visible outside of the transaction before the commit
+	auto res = staging_con.Query("SELECT COUNT(*) FROM applied");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->GetValue(0, 0) == duckdb::Value::BIGINT(0));
+	con.Commit();
+
+	REQUIRE(order == std::vector<int> {0, 1, 2, 3});
+	res = con.Query("SELECT file, COUNT(*), SUM(age)::BIGINT FROM applied GROUP BY file ORDER BY file");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->RowCount() == 4);
+	for (idx_t row = 0; row < 4; row++) {
+		check_row(res, row,
+		          {duckdb::Value::INTEGER(static_cast<int32_t>(row)), duckdb::Value::BIGINT(3),
+		           duckdb::Value::BIGINT(90)});
+	}
+
+	// Staging tables are dropped again
+	res = con.Query("SELECT COUNT(*) FROM duckdb_tables() WHERE starts_with(table_name, '__fivetran_ingest_staging')");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->GetValue(0, 0) == duckdb::Value::BIGINT(0));
+}
+
+TEST_CASE("ConvertFile keeps the converted file in memory", "[staging_pipeline]") {
+	const fs::path test_file = fs::path(TEST_RESOURCES_DIR) / "csv" / "small_simple.csv";
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+
+	const std::vector<column_def> columns {column_def {.name = "id", .type = duckdb::LogicalTypeId::INTEGER},
+	                                       column_def {.name = "name", .type = duckdb::LogicalTypeId::VARCHAR},
+	                                       column_def {.name = "age", .type = duckdb::LogicalTypeId::SMALLINT}};
+	const IngestProperties props {.filename = test_file.string(), .columns = columns};
+	const auto converted = csv_processor::ConvertFile(con, props, logger);
+	// Not a path on disk, but the descriptor of a memory-backed file
+	REQUIRE(converted.Path().starts_with("/dev/fd/"));
+
+	auto res = con.Query("SELECT COUNT(*), SUM(age)::BIGINT FROM read_parquet(" +
+	                     duckdb::KeywordHelper::WriteQuoted(converted.Path(), '\'') + ")");
+	REQUIRE_NO_FAIL(res);
+	check_row(res, 0, {duckdb::Value::BIGINT(3), duckdb::Value::BIGINT(90)});
+}
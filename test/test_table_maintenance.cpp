@@ -0,0 +1,59 @@
+#include "duckdb.hpp"
+#include "integration/common.hpp"
+#include "schema_types.hpp"
+#include "table_maintenance.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+TEST_CASE("TableMaintenance rebuilds tables with many changed rows", "[maintenance]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE t (id INTEGER PRIMARY KEY, v VARCHAR)"));
+	REQUIRE_NO_FAIL(con.Query("INSERT INTO t SELECT i, 'v' || i FROM range(100, 0, -1) r(i)"));
+	const table_def table {"memory", "main", "t"};
+
+	std::mutex mutex;
+	std::condition_variable ran;
+	std::vector<TableMaintenance::maintenance_result> results;
+	const auto run = [&](duckdb::Connection& maintenance_con, const TableMaintenance::maintenance_job& job,
+	                     const TableMaintenance::options& opts) {
+		const auto result = TableMaintenance::Rebuild(maintenance_con, job, opts);
+		std::lock_guard<std::mutex> lock(mutex);
+		results.push_back(result);
+		ran.notify_all();
+		return result;
+	};
+	const auto connect = [&db](const TableMaintenance::maintenance_job&) { return duckdb::Connection(db); };
+	const auto wait_for_runs = [&](const std::size_t count) {
+		std::unique_lock<std::mutex> lock(mutex);
+		return ran.wait_for(lock, std::chrono::seconds(10), [&]() { return results.size() >= count; });
+	};
+
+	TableMaintenance maintenance({.min_changed_rows = 10, .min_changed_ratio = 0.2}, connect, run);
+
+	{
+		// 15 of 100 rows is not worth a rebuild yet
+		const TableMaintenance::Write write(maintenance, "instance", table);
+		maintenance.RecordChanges("instance", table, "", {}, 15);
+	}
+	REQUIRE(wait_for_runs(1));
+	REQUIRE_FALSE(results[0].maintained);
+	REQUIRE(results[0].changed_rows_needed == 20);
+
+	{
+		const TableMaintenance::Write write(maintenance, "instance", table);
+		maintenance.RecordChanges("instance", table, "", {}, 10);
+	}
+	REQUIRE(wait_for_runs(2));
+	REQUIRE(results[1].maintained);
+
+	// Rewritten in primary key order
+	auto res = con.Query("SELECT id FROM t ORDER BY rowid LIMIT 2");
+	REQUIRE_NO_FAIL(res);
+	check_row(res, 0, {duckdb::Value::INTEGER(1)});
+	check_row(res, 1, {duckdb::Value::INTEGER(2)});
+}
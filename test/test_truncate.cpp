@@ -0,0 +1,88 @@
+#include "duckdb.hpp"
+#include "integration/common.hpp"
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+#include "sql_generator.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <string>
+
+namespace {
+// 2024-02-09 00:00:00 UTC
+constexpr std::chrono::nanoseconds CUTOFF = std::chrono::seconds(1707436800);
+} // namespace
+
+TEST_CASE("truncate_table hard deletes rows before the cutoff", "[truncate]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	MdSqlGenerator generator(logger);
+
+	const table_def table {"memory", "main", "t"};
+	REQUIRE_NO_FAIL(con.Query("CREATE TABLE t (id INTEGER PRIMARY KEY, _fivetran_synced TIMESTAMP)"));
+	auto cutoff = CUTOFF;
+
+	SECTION("some rows are newer") {
+		REQUIRE_NO_FAIL(con.Query("INSERT INTO t VALUES (1, '2024-02-08 23:59:59'), (2, '2024-02-09 00:00:00'), "
+		                          "(3, NULL)"));
+		generator.truncate_table(con, table, "_fivetran_synced", cutoff, "");
+
+		auto res = con.Query("SELECT id FROM t ORDER BY id");
+		REQUIRE_NO_FAIL(res);
+		REQUIRE(res->RowCount() == 2);
+		check_row(res, 0, {2});
+		check_row(res, 1, {3});
+	}
+
+	SECTION("all rows are older") {
+		REQUIRE_NO_FAIL(con.Query("INSERT INTO t VALUES (1, '2024-01-01'), (2, '2024-02-08 23:59:59')"));
+		generator.truncate_table(con, table, "_fivetran_synced", cutoff, "");
+
+		auto res = con.Query("SELECT COUNT(*) FROM t");
+		REQUIRE_NO_FAIL(res);
+		REQUIRE(res->GetValue(0, 0) == duckdb::Value::BIGINT(0));
+
+		// The table is still usable, including its primary key
+		REQUIRE_NO_FAIL(con.Query("INSERT INTO t VALUES (1, '2024-03-01')"));
+		REQUIRE(con.Query("INSERT INTO t VALUES (1, '2024-03-01')")->HasError());
+	}
+
+	SECTION("empty table") {
+		generator.truncate_table(con, table, "_fivetran_synced", cutoff, "");
+
+		auto res = con.Query("SELECT COUNT(*) FROM t");
+		REQUIRE_NO_FAIL(res);
+		REQUIRE(res->GetValue(0, 0) == duckdb::Value::BIGINT(0));
+	}
+}
+
+TEST_CASE("truncate_table soft deletes only rows that are not deleted yet", "[truncate]") {
+	duckdb::DuckDB db(nullptr);
+	duckdb::Connection con(db);
+	auto logger = mdlog::Logger::CreateNopLogger();
+	MdSqlGenerator generator(logger);
+
+	const table_def table {"memory", "main", "t"};
+	REQUIRE_NO_FAIL(
+	    con.Query("CREATE TABLE t (id INTEGER PRIMARY KEY, _fivetran_synced TIMESTAMP, _fivetran_deleted BOOLEAN)"));
+	REQUIRE_NO_FAIL(con.Query("INSERT INTO t VALUES (1, '2024-01-01', true), (2, '2024-01-01', false), "
+	                          "(3, '2024-01-01', NULL), (4, '2024-03-01', false)"));
+	auto cutoff = CUTOFF;
+
+	generator.truncate_table(con, table, "_fivetran_synced", cutoff, "_fivetran_deleted");
+
+	auto res = con.Query("SELECT id, _fivetran_deleted FROM t ORDER BY id");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->RowCount() == 4);
+	check_row(res, 0, {1, duckdb::Value::BOOLEAN(true)});
+	check_row(res, 1, {2, duckdb::Value::BOOLEAN(true)});
+	check_row(res, 2, {3, duckdb::Value::BOOLEAN(true)});
+	check_row(res, 3, {4, duckdb::Value::BOOLEAN(false)});
+
+	// Running it again has nothing left to do
+	generator.truncate_table(con, table, "_fivetran_synced", cutoff, "_fivetran_deleted");
+	res = con.Query("SELECT COUNT(*) FILTER (_fivetran_deleted) FROM t");
+	REQUIRE_NO_FAIL(res);
+	REQUIRE(res->GetValue(0, 0) == duckdb::Value::BIGINT(3));
+}
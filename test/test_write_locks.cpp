@@ -0,0 +1,131 @@
+#include "md_logging.hpp"
+#include "schema_types.hpp"
+#include "write_locks.hpp"
+
+#include <catch2/catch_test_macros.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+/// Records the order in which threads got their locks
+class Events {
+public:
+	void Add(const std::string& event) {
+		std::lock_guard<std::mutex> lock(mutex);
+		events.push_back(event);
+		changed.notify_all();
+	}
+
+	bool WaitFor(const std::size_t count) {
+		std::unique_lock<std::mutex> lock(mutex);
+		return changed.wait_for(lock, std::chrono::seconds(10), [&]() { return events.size() >= count; });
+	}
+
+	std::vector<std::string> Get() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return events;
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::vector<std::string> events;
+};
+
+/// Gives threads that were just started time to queue up for their locks
+void let_queue() {
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+}
+} // namespace
+
+TEST_CASE("WriteLocks serializes writes to a table in request order", "[write_locks]") {
+	WriteLocks locks;
+	auto logger = mdlog::Logger::CreateNopLogger();
+	const table_def table {"db", "main", "t"};
+	Events events;
+
+	std::optional<WriteLocks::Table> first(std::in_place, locks, "instance", table, logger);
+	std::vector<std::thread> threads;
+	for (const auto* name : {"second", "third"}) {
+		threads.emplace_back([&, name]() {
+			const WriteLocks::Table lock(locks, "instance", table, logger);
+			events.Add(name);
+		});
+		let_queue();
+	}
+	CHECK(events.Get().empty());
+
+	first.reset();
+	REQUIRE(events.WaitFor(2));
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	CHECK(events.Get() == std::vector<std::string> {"second", "third"});
+
+	const auto stats = locks.Stats();
+	CHECK(stats.acquired == 3);
+	CHECK(stats.waited == 2);
+	CHECK(stats.max_wait_time >= std::chrono::milliseconds(100));
+	CHECK(stats.wait_time >= stats.max_wait_time);
+}
+
+TEST_CASE("WriteLocks lets writes to different tables run at once", "[write_locks]") {
+	WriteLocks locks;
+	auto logger = mdlog::Logger::CreateNopLogger();
+
+	std::optional<WriteLocks::Table> t1(std::in_place, locks, "instance", table_def {"db", "main", "t1"}, logger);
+	const WriteLocks::Table t2(locks, "instance", {"db", "main", "t2"}, logger);
+	const WriteLocks::Table t1_elsewhere(locks, "instance", {"other_db", "main", "t1"}, logger);
+	const WriteLocks::SchemaCreation creation(locks, "instance", "db", "main", logger);
+	// The database of another token with the same name
+	const WriteLocks::Table t1_other_account(locks, "other instance", {"db", "main", "t1"}, logger);
+	const WriteLocks::Schema schema_other_account(locks, "other instance", "db", "s", logger);
+
+	CHECK(locks.Stats().acquired == 6);
+	CHECK(locks.Stats().waited == 0);
+
+	// Identifiers are case insensitive
+	Events events;
+	std::thread same_table([&]() {
+		const WriteLocks::Table lock(locks, "instance", {"DB", "Main", "T1"}, logger);
+		events.Add("T1");
+	});
+	let_queue();
+	CHECK(events.Get().empty());
+
+	t1.reset();
+	REQUIRE(events.WaitFor(1));
+	same_table.join();
+}
+
+TEST_CASE("WriteLocks makes schema changes wait for table writes and vice versa", "[write_locks]") {
+	WriteLocks locks;
+	auto logger = mdlog::Logger::CreateNopLogger();
+	Events events;
+
+	std::optional<WriteLocks::Table> write(std::in_place, locks, "instance", table_def {"db", "s", "t1"}, logger);
+	std::thread migrate([&]() {
+		const WriteLocks::Schema lock(locks, "instance", "db", "s", logger);
+		events.Add("migrate");
+	});
+	let_queue();
+	// Queued behind the migration, although it could share the schema with the
+	// running write
+	std::thread later_write([&]() {
+		const WriteLocks::Table lock(locks, "instance", table_def {"db", "s", "t2"}, logger);
+		events.Add("write t2");
+	});
+	let_queue();
+	CHECK(events.Get().empty());
+
+	write.reset();
+	REQUIRE(events.WaitFor(2));
+	migrate.join();
+	later_write.join();
+	CHECK(events.Get() == std::vector<std::string> {"migrate", "write t2"});
+}